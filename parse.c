@@ -1,139 +1,149 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <sys/mman.h>
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-#define DATA_VERSION_TYPE       'D'
-#define APP_VERSION_TYPE        'A'
-#define REGION_TYPE             'R'
-
-/* Version identification record */
-struct vir {
-        unsigned int file_id;
-        unsigned short version;
-} __attribute__ ((__packed__));
-
-/* Data record */
-struct data_record {
-        unsigned int size;
-        unsigned char type;
-} __attribute__ ((__packed__));
-
-/* Application data version record */
-struct advr {
-        unsigned short version;
-} __attribute__ ((__packed__));
-
-/* Application version record */
-struct avr {
-        unsigned short version;
-        char *builder;
-        char *build_date;
-        char *build_time;
-} __attribute__ ((__packed__));
-
-/* Region record */
-struct region {
-        unsigned short id;
-        unsigned int delay;
-        unsigned int size;
-} __attribute__ ((__packed__));
-
-unsigned char *ptr;
-
-void parse_vir_header()
+
+#include "rgn.h"
+
+void parse_vir_header(const struct rgn_file *file)
 {
-        struct vir *vir_header = (struct vir*)ptr;
-        printf("file_id: 0x%x\n", vir_header->file_id);
-        printf("version: %d\n", vir_header->version);
-        ptr += sizeof(struct vir);
+        struct vir vir_header;
+
+        if (rgn_read_vir(file, &vir_header)) {
+                printf("Error on parsing header\n");
+                return;
+        }
+        printf("file_id: 0x%x\n", vir_header.file_id);
+        printf("version: %d\n", vir_header.version);
 }
-void parse_advr(unsigned int size)
+void parse_advr(const struct rgn_record *rec)
 {
-	struct advr *advr = (struct advr*)ptr;
-	printf("Application version: %u.%02u\n", advr->version / 100, advr->version % 100);
-	ptr += sizeof(struct advr);
+	struct advr advr;
+
+	if (rgn_decode_advr(rec, &advr)) {
+		printf("Error on parsing data\n");
+		return;
+	}
+	printf("Application version: %u.%02u\n", advr.version / 100, advr.version % 100);
 }
 
-void parse_avr(unsigned int size)
+void parse_avr(const struct rgn_record *rec)
 {
-	struct avr *avr = (struct avr*)ptr;
-	printf("Version: %d\n", avr->version);
-	printf("builder: %s\n", &avr->builder);
-	printf("date: %s\n", &avr->build_date);
-	printf("time: %s\n", &avr->build_time);
+	struct avr avr;
+
+	if (rgn_decode_avr(rec, &avr) < 0) {
+		printf("Error on parsing data\n");
+		return;
+	}
+	printf("Version: %d\n", avr.version);
+	printf("builder: %.*s\n", avr.builder_len, avr.builder);
+	printf("date: %.*s\n", avr.build_date_len, avr.build_date);
+	printf("time: %.*s\n", avr.build_time_len, avr.build_time);
 }
 
-void parse_region(unsigned int size)
+/* Only the region header is read; the payload pages are never touched */
+void parse_region(const struct rgn_record *rec)
 {
+	struct rgn_region region;
+
+	if (rgn_decode_region(rec, &region)) {
+		printf("Error on parsing data\n");
+		return;
+	}
+	printf("id: %d, delay: %u, size: %llu, offset: %lld\n", region.id,
+	       region.delay, region.size, (long long)region.offset);
 }
 
-void parse_data_record()
+int parse_data_record(struct rgn_iter *iter)
 {
-	struct data_record *data = (struct data_record*)ptr;
-	printf("size: %d, type: %c ", data->size, data->type);
-	ptr += sizeof(struct data_record);
-	switch (data->type) {
-		case DATA_VERSION_TYPE:
+	struct rgn_record rec;
+	int ret;
+
+	ret = rgn_iter_next(iter, &rec);
+	if (ret <= 0) {
+		if (ret < 0)
+			printf("Error on parsing data: record is truncated\n");
+		return 0;
+	}
+	printf("size: %llu, type: %c ", rec.size, rec.type);
+	switch (rec.type) {
+		case DATA_VERSION_REC_CHAR:
 			printf("DATA_VERSION_TYPE\n");
-			parse_advr(data->size);
+			parse_advr(&rec);
 			break;
-		case APP_VERSION_TYPE:
+		case APP_VERSION_REC_CHAR:
 			printf("APP_VERSION_TYPE\n");
-			parse_avr(data->size);
+			parse_avr(&rec);
 			break;
-		case REGION_TYPE:
+		case REGION_REC_CHAR:
 			printf("REGION_TYPE\n");
-			parse_region(data->size);
+			parse_region(&rec);
+			break;
+		case REGION_TOC_REC_CHAR:
+			printf("REGION_TOC_TYPE\n");
+			break;
+		case REGION_CRC_REC_CHAR:
+			printf("REGION_CRC_TYPE\n");
+			break;
+		case REGION_DELTA_REC_CHAR:
+			printf("REGION_DELTA_TYPE\n");
+			parse_region(&rec);
+			break;
+		case REGION_COMPRESSED_REC_CHAR:
+			printf("REGION_COMPRESSED_TYPE\n");
+			parse_region(&rec);
+			break;
+		case REGION_SPARSE_REC_CHAR:
+			printf("REGION_SPARSE_TYPE\n");
+			parse_region(&rec);
 			break;
 		default:
 			printf("Error on parsing data\n");
 			break;
 	}
+
+	return 1;
 }
 
-void parse_rgn()
+void parse_rgn(const struct rgn_file *file)
 {
-	parse_vir_header();
-	parse_data_record();
-	parse_data_record();
-	parse_data_record();
+	struct rgn_iter iter;
+
+	parse_vir_header(file);
+	rgn_iter_init(&iter, file);
+	while (parse_data_record(&iter))
+		;
 }
 
 int main(int argc, char **argv)
 {
-#if 0
-	if (argc != 3) {
-		printf("Usage: %s [rgn file] [file size]\n", argv[0]);
-		exit(1);
-	}
+	int i, ret = 0;
 
-	int fd = open(argv[1], O_RDONLY);
-#endif
-	int fd = open("a.rgn", O_RDONLY);
-	if (fd == -1) {
-		perror("open");
+	if (argc < 2) {
+		printf("Usage: %s [rgn file]...\n", argv[0]);
 		exit(1);
 	}
 
-//	int length = atoi(argv[2]);
-	int length = 67;
+	for (i = 1; i < argc; i++) {
+		struct rgn_file file;
 
-	unsigned char *buf = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
-	if ((void*)buf == MAP_FAILED) {
-		perror("mmap");
-		close(fd);
-		exit(1);
-	}
+		/* The mapping is sized from fstat() by rgn_open() */
+		if (rgn_open(&file, argv[i])) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			ret = 1;
+			continue;
+		}
 
-	ptr = buf;
-	parse_rgn();
+		/* Only headers are read, so keep readahead off the payloads */
+		rgn_advise(&file, MADV_RANDOM);
 
-	munmap(buf, length);
-	close(fd);
+		if (argc > 2)
+			printf("%s%s:\n", i > 1 ? "\n" : "", argv[i]);
+		parse_rgn(&file);
+
+		rgn_close(&file);
+	}
 
-	return 0;
+	return ret;
 }
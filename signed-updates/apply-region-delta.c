@@ -0,0 +1,403 @@
+/*
+ * apply-region-delta.c
+ *
+ * Rebuild a full region file from a delta region file made with
+ * build-region --delta-from and the region file it was made against.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+
+#include "rgn.h"
+
+/* A record of the delta file and where its rebuilt form goes */
+struct out_record {
+	struct rgn_record rec;
+	ULONGLONG size;		/* Size of the rebuilt record body */
+	off_t offset;		/* Output offset of a region's payload */
+};
+
+static struct rgn_file old;
+static struct rgn_file delta;
+static int out_fd = STDOUT_FILENO;
+static int large;		/* The files have version 200 records */
+
+/* The first full region with each ID in OLD; type 0 where there is none */
+static struct rgn_region *bases;
+
+/*
+ * Print usage and exit with status.  Misuse goes to stderr, since stdout
+ * is the rebuilt file.
+ */
+static void __attribute__ ((noreturn))
+usage (const char *name, int status)
+{
+	FILE *f = status ? stderr : stdout;
+
+	fprintf (f, "Usage: %s [-o FILE] OLD DELTA\n", name);
+	fprintf (f, "Rebuild the full region file from the delta region file DELTA\n");
+	fprintf (f, "and the region file OLD it was made against.\n");
+	fprintf (f, "\n");
+	fprintf (f, "  -o FILE   Write to FILE instead of stdout\n");
+	fprintf (f, "  --stats[=FORMAT]\n");
+	fprintf (f, "            Print the bytes, time, system calls and peak RSS of\n");
+	fprintf (f, "            each phase to stderr, as text or json\n");
+	fprintf (f, "  -h        Display this help message\n");
+	exit (status);
+}
+
+static void *
+xrealloc (void *ptr, size_t size)
+{
+	ptr = realloc (ptr, size);
+	if (!ptr) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	return ptr;
+}
+
+static void
+writeall (const void *buf, size_t count)
+{
+	if (rgn_write_full (out_fd, buf, count) < 0) {
+		fprintf (stderr, "Error writing: %s\n", strerror (errno));
+		exit (1);
+	}
+}
+
+static void
+write_record_header (ULONGLONG size, BYTE type)
+{
+	BYTE buf[RGN_HEADERS_MAX];
+
+	writeall (buf, rgn_encode_record_header (buf, large, size, type));
+}
+
+static void
+decode_region (const struct rgn_record *rec, struct rgn_region *region)
+{
+	if (rgn_decode_region (rec, region)) {
+		fprintf (stderr, "Invalid region record\n");
+		exit (1);
+	}
+}
+
+static void
+decode_delta (const struct rgn_region *region, struct region_delta *hdr)
+{
+	if (rgn_delta_header (region->data, region->size, hdr)) {
+		fprintf (stderr, "Invalid delta region %d\n", region->id);
+		exit (1);
+	}
+}
+
+/*
+ * Index the full regions of OLD by ID, so that each delta record finds
+ * its base without walking OLD again.
+ */
+static void
+index_bases (void)
+{
+	struct rgn_iter it;
+	struct rgn_record rec;
+	struct rgn_region region;
+
+	bases = calloc (65536, sizeof(*bases));
+	if (!bases) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	rgn_iter_init (&it, &old);
+	while (rgn_iter_next (&it, &rec) > 0) {
+		if (rec.type != REGION_REC_CHAR)
+			continue;
+		decode_region (&rec, &region);
+		if (!bases[region.id].type)
+			bases[region.id] = region;
+	}
+}
+
+/* The payload of the first full region with the given ID in OLD */
+static void
+find_base (USHORT id, struct rgn_region *base)
+{
+	if (!bases)
+		index_bases ();
+	if (!bases[id].type) {
+		fprintf (stderr, "Region %d is not in the old region file\n",
+			 id);
+		exit (1);
+	}
+	*base = bases[id];
+}
+
+/*
+ * Walk the delta file once to size every rebuilt record, so that a TOC
+ * can be written before the regions it points to.
+ */
+static struct out_record *
+plan (int *count)
+{
+	struct out_record *recs = NULL;
+	struct rgn_record rec;
+	struct rgn_iter it;
+	off_t pos = sizeof(struct vir);
+	size_t region_hdr = rgn_region_header_size (large);
+	int n = 0, ret;
+
+	rgn_iter_init (&it, &delta);
+	while ((ret = rgn_iter_next (&it, &rec)) > 0) {
+		struct out_record *out;
+
+		recs = xrealloc (recs, (n + 1) * sizeof(*recs));
+		out = &recs[n++];
+		out->rec = rec;
+		out->size = rec.size;
+		out->offset = 0;
+
+		if (rec.type == REGION_DELTA_REC_CHAR) {
+			struct rgn_region region;
+			struct region_delta hdr;
+
+			decode_region (&rec, &region);
+			decode_delta (&region, &hdr);
+			out->size = region_hdr + hdr.size;
+		}
+		pos += rgn_record_header_size (large);
+		if (rec.type == REGION_DELTA_REC_CHAR ||
+		    rec.type == REGION_REC_CHAR ||
+		    rec.type == REGION_COMPRESSED_REC_CHAR ||
+		    rec.type == REGION_SPARSE_REC_CHAR)
+			out->offset = pos + region_hdr;
+		pos += out->size;
+	}
+	if (ret < 0) {
+		fprintf (stderr, "Delta region file is truncated\n");
+		exit (1);
+	}
+
+	*count = n;
+	return recs;
+}
+
+static void
+copy_record (const struct rgn_record *rec)
+{
+	off_t pos = rec->offset;
+	ULONGLONG span;
+	ssize_t copied;
+
+	rgn_stats_enter (RGN_PHASE_COPY);
+	span = rgn_trace_begin ();
+	write_record_header (rec->size, rec->type);
+	copied = rgn_copy (delta.fd, &pos, out_fd, NULL, rec->size);
+	if (copied < 0) {
+		fprintf (stderr, "Error copying: %s\n", strerror (errno));
+		exit (1);
+	}
+	if (copied != rec->size) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
+	rgn_trace_end ("copy_record", span, rec->type);
+	rgn_stats_add (RGN_PHASE_COPY, rec->size);
+	rgn_stats_leave ();
+}
+
+/* The TOC again, with the sizes and offsets of the rebuilt regions */
+static void
+write_toc (const struct out_record *recs, int count)
+{
+	struct region_toc_entry entry;
+	UINT entries = 0;
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (recs[i].offset)
+			entries++;
+
+	write_record_header (sizeof(UINT) + entries * sizeof(entry),
+			     REGION_TOC_REC_CHAR);
+	writeall (&entries, sizeof(entries));
+	rgn_stats_add (RGN_PHASE_OUTPUT, sizeof(entries) +
+		       entries * sizeof(entry));
+	for (i = 0; i < count; i++) {
+		struct rgn_region region;
+
+		if (!recs[i].offset)
+			continue;
+		decode_region (&recs[i].rec, &region);
+		entry.id = region.id;
+		entry.delay = region.delay;
+		entry.size = recs[i].size - rgn_region_header_size (large);
+		entry.offset = recs[i].offset;
+		writeall (&entry, sizeof(entry));
+	}
+}
+
+static void
+apply_delta (const struct rgn_record *rec, ULONGLONG size)
+{
+	BYTE hdr[RGN_HEADERS_MAX];
+	struct rgn_region region, base;
+	ULONGLONG span;
+
+	rgn_stats_enter (RGN_PHASE_PARSE);
+	decode_region (rec, &region);
+	find_base (region.id, &base);
+	rgn_stats_leave ();
+
+	rgn_stats_enter (RGN_PHASE_ENCODE);
+	span = rgn_trace_begin ();
+	write_record_header (size, REGION_REC_CHAR);
+	writeall (hdr, rgn_encode_region_header (hdr, large, region.id,
+			region.delay, size - rgn_region_header_size (large)));
+
+	if (rgn_delta_apply (old.fd, base.offset, base.data, base.size,
+			     region.data, region.size, out_fd)) {
+		if (errno == ESTALE)
+			fprintf (stderr, "Region %d of the old region file is "
+				 "not the one the delta was made against\n",
+				 region.id);
+		else
+			fprintf (stderr, "Could not apply delta to region %d: "
+				 "%s\n", region.id, strerror (errno));
+		exit (1);
+	}
+	rgn_trace_end ("apply_delta", span, region.id);
+	rgn_stats_add (RGN_PHASE_ENCODE, size);
+	rgn_stats_leave ();
+}
+
+int
+main (int argc, char **argv)
+{
+	struct out_record *recs;
+	struct region_delta hdr;
+	struct vir vir;
+	static const struct option long_options[] = {
+		{ "stats",	optional_argument,	NULL, 'S' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	enum rgn_stats_format stats = RGN_STATS_OFF;
+	int count, i, opt;
+
+	while ((opt = getopt_long (argc, argv, "ho:", long_options,
+				   NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			out_fd = open (optarg, O_WRONLY | O_CREAT | O_TRUNC,
+				       S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (out_fd < 0) {
+				fprintf (stderr, "Could not open %s: %s\n",
+					 optarg, strerror (errno));
+				exit (1);
+			}
+			break;
+		case 'S':
+			if (rgn_stats_parse (optarg, &stats)) {
+				fprintf (stderr, "Unknown statistics format: "
+					 "%s\n", optarg);
+				exit (1);
+			}
+			break;
+		case 'h':
+			usage (argv[0], 0);
+		default:
+			usage (argv[0], 1);
+		}
+	}
+	if (argc - optind != 2)
+		usage (argv[0], 1);
+	rgn_stats_start ("apply-region-delta", stats);
+	rgn_trace_start ("apply-region-delta");
+
+	rgn_stats_enter (RGN_PHASE_PARSE);
+	if (rgn_open (&old, argv[optind])) {
+		fprintf (stderr, "Could not open %s: %s\n", argv[optind],
+			 strerror (errno));
+		exit (1);
+	}
+	if (rgn_open (&delta, argv[optind + 1])) {
+		fprintf (stderr, "Could not open %s: %s\n", argv[optind + 1],
+			 strerror (errno));
+		exit (1);
+	}
+	if (rgn_read_vir (&delta, &vir) || vir.file_id != FILE_ID) {
+		fprintf (stderr, "%s is not a region file\n", argv[optind + 1]);
+		exit (1);
+	}
+	rgn_advise (&delta, MADV_SEQUENTIAL);
+	large = vir.version == RGN_VERSION_LARGE;
+
+	recs = plan (&count);
+	rgn_stats_add (RGN_PHASE_PARSE, delta.size);
+	rgn_stats_leave ();
+
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	writeall (&vir, sizeof(vir));
+	rgn_stats_add (RGN_PHASE_OUTPUT, sizeof(vir));
+	rgn_stats_leave ();
+
+	for (i = 0; i < count; i++) {
+		const struct rgn_record *rec = &recs[i].rec;
+
+		switch (rec->type) {
+		case REGION_TOC_REC_CHAR:
+			rgn_stats_enter (RGN_PHASE_OUTPUT);
+			write_toc (recs, count);
+			rgn_stats_leave ();
+			break;
+		case REGION_DELTA_REC_CHAR:
+			apply_delta (rec, recs[i].size);
+			break;
+		case REGION_CRC_REC_CHAR:
+			/* A CRC of a delta now covers the rebuilt payload */
+			if (i > 0 && recs[i - 1].rec.type == REGION_DELTA_REC_CHAR) {
+				struct region_crc crc;
+				struct rgn_region region;
+
+				rgn_stats_enter (RGN_PHASE_OUTPUT);
+				decode_region (&recs[i - 1].rec, &region);
+				decode_delta (&region, &hdr);
+				crc.id = region.id;
+				crc.crc = hdr.crc;
+				write_record_header (sizeof(crc),
+						     REGION_CRC_REC_CHAR);
+				writeall (&crc, sizeof(crc));
+				rgn_stats_add (RGN_PHASE_OUTPUT, sizeof(crc));
+				rgn_stats_leave ();
+				break;
+			}
+			copy_record (rec);
+			break;
+		default:
+			copy_record (rec);
+			break;
+		}
+	}
+
+	free (recs);
+	free (bases);
+	rgn_close (&delta);
+	rgn_close (&old);
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	if (close (out_fd)) {
+		fprintf (stderr, "Error writing: %s\n", strerror (errno));
+		exit (1);
+	}
+	rgn_stats_leave ();
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+#! /bin/bash
+
+# Throughput benchmark for the region tools, run by "make bench".
+#
+# A synthetic corpus is generated with rgn-gen and every tool is run over
+# it through rgn-bench, which prints the wall time, MB/s, system calls and
+# peak RSS of each run.  The corpus is read from the page cache; the first
+# run of each input pays for nothing but the generation.
+#
+# Environment:
+#   BENCH_MB       Total payload size in MiB (default 256)
+#   BENCH_REGIONS  Number of regions in the region files (default 8)
+#   BENCH_JOBS     Thread count for the -j runs (default: online CPUs)
+#   BENCH_DIR      Directory for the corpus (default: a temporary one,
+#                  removed afterwards)
+#   BENCH_NOSYSCALLS  Set to skip the ptrace'd syscall count runs
+
+set -e
+
+_dir=$(cd "$(dirname "${0}")" && pwd)
+MB=${BENCH_MB:-256}
+REGIONS=${BENCH_REGIONS:-8}
+JOBS=${BENCH_JOBS:-$(getconf _NPROCESSORS_ONLN)}
+
+if [ -n "${BENCH_DIR}" ]; then
+	DIR=${BENCH_DIR}
+	mkdir -p "${DIR}"
+else
+	DIR=$(mktemp -d "${TMPDIR:-/tmp}/rgn-bench.XXXXXX")
+	trap 'rm -rf "${DIR}"' EXIT
+fi
+
+GEN=${_dir}/rgn-gen
+BENCH=${_dir}/rgn-bench
+BENCH_OPTS=
+[ -n "${BENCH_NOSYSCALLS}" ] && BENCH_OPTS=-S
+
+size () {
+	stat -c %s "${1}"
+}
+
+run () {
+	"${BENCH}" ${BENCH_OPTS} "$@"
+}
+
+echo "Generating a ${MB} MiB corpus in ${DIR}"
+
+# A throwaway unprotected signing key, if gpg is around to make one
+KEY_OPTS=
+if command -v gpg >/dev/null 2>&1; then
+	export GNUPGHOME=${DIR}/gnupg
+	mkdir -p -m 0700 "${GNUPGHOME}"
+	if gpg --batch -q --pinentry-mode loopback --passphrase '' \
+	       --quick-gen-key "rgn bench <bench@localhost>" rsa2048 sign never \
+	       2>/dev/null; then
+		gpg --batch -q --pinentry-mode loopback --passphrase '' \
+		    --export-secret-keys > "${DIR}/secret.gpg"
+		gpg --batch -q --export > "${DIR}/public.gpg"
+		KEY_OPTS="-k ${DIR}/secret.gpg"
+	fi
+fi
+
+PER_REGION=$((MB * 1024 * 1024 / REGIONS))
+INPUTS=
+for i in $(seq 1 "${REGIONS}"); do
+	"${GEN}" -r -s "${PER_REGION}" --seed "${i}" -o "${DIR}/payload-${i}.bin"
+	INPUTS="${INPUTS} ${DIR}/payload-${i}.bin,${i},0"
+done
+"${GEN}" -r -s "${MB}M" -o "${DIR}/payload.bin"
+"${GEN}" -r -z -s "${MB}M" -o "${DIR}/zero.bin"
+"${GEN}" -r -S -s "${MB}M" ${KEY_OPTS} -o "${DIR}/signed.bin"
+"${GEN}" -S -n "${REGIONS}" -s "${PER_REGION}" ${KEY_OPTS} -o "${DIR}/signed.rgn"
+
+BYTES=$((MB * 1024 * 1024))
+
+echo
+run -H
+run -l "build-region" -b "${BYTES}" -- \
+	"${_dir}/build-region" -o "${DIR}/plain.rgn" ${INPUTS}
+run -l "build-region -j ${JOBS}" -b "${BYTES}" -- \
+	"${_dir}/build-region" -j "${JOBS}" -o "${DIR}/plain.rgn" ${INPUTS}
+run -l "build-region --toc" -b "${BYTES}" -- \
+	"${_dir}/build-region" --toc -o "${DIR}/toc.rgn" ${INPUTS}
+run -l "build-region --crc" -b "${BYTES}" -- \
+	"${_dir}/build-region" --crc -o "${DIR}/crc.rgn" ${INPUTS}
+run -l "build-region --delta-from (unchanged)" -b "${BYTES}" -- \
+	"${_dir}/build-region" --delta-from "${DIR}/plain.rgn" \
+	-o "${DIR}/delta.rgn" ${INPUTS}
+run -l "apply-region-delta" -b "${BYTES}" -- \
+	"${_dir}/apply-region-delta" -o "${DIR}/rebuilt.rgn" "${DIR}/plain.rgn" \
+	"${DIR}/delta.rgn"
+rm -f "${DIR}/delta.rgn" "${DIR}/rebuilt.rgn"
+run -l "build-region -z -j ${JOBS} (random)" -b "${BYTES}" -- \
+	"${_dir}/build-region" -z -j "${JOBS}" -o "${DIR}/random-z.rgn" ${INPUTS}
+run -l "build-region -z (zeros)" -b "${BYTES}" -- \
+	"${_dir}/build-region" -z -o "${DIR}/zero-z.rgn" "${DIR}/zero.bin,1,0"
+run -l "build-region -z -j ${JOBS} (zeros)" -b "${BYTES}" -- \
+	"${_dir}/build-region" -z -j "${JOBS}" -o "${DIR}/zero-z.rgn" \
+	"${DIR}/zero.bin,1,0"
+rm -f "${DIR}/random-z.rgn"
+run -l "build-region -s (zeros)" -b "${BYTES}" -- \
+	"${_dir}/build-region" -s -o "${DIR}/zero-s.rgn" "${DIR}/zero.bin,1,0"
+
+for io in buffered mmap direct uring; do
+	run -l "parse-region -p --io ${io}" -b "$(size "${DIR}/plain.rgn")" \
+		-i "${DIR}/plain.rgn" -- "${_dir}/parse-region" -p --io "${io}"
+done
+run -l "parse-region --check" -b "${BYTES}" -i "${DIR}/crc.rgn" -- \
+	"${_dir}/parse-region" --check
+rm -f "${DIR}/crc.rgn"
+mkdir -p "${DIR}/out"
+run -l "parse-region --extract-all" -b "${BYTES}" -i "${DIR}/plain.rgn" -- \
+	"${_dir}/parse-region" --extract-all -O "${DIR}/out"
+run -l "parse-region --extract-all (TOC)" -b "${BYTES}" -i "${DIR}/toc.rgn" -- \
+	"${_dir}/parse-region" --extract-all -O "${DIR}/out"
+run -l "parse-region --extract-all (zlib)" -b "${BYTES}" \
+	-i "${DIR}/zero-z.rgn" -- "${_dir}/parse-region" --extract-all -O "${DIR}/out"
+run -l "parse-region --extract-all -j ${JOBS} (zlib)" -b "${BYTES}" \
+	-i "${DIR}/zero-z.rgn" -- \
+	"${_dir}/parse-region" --extract-all -j "${JOBS}" -O "${DIR}/out"
+rm -f "${DIR}/zero-z.rgn"
+run -l "parse-region --extract-all (sparse)" -b "${BYTES}" \
+	-i "${DIR}/zero-s.rgn" -- "${_dir}/parse-region" --extract-all -O "${DIR}/out"
+rm -f "${DIR}/zero-s.rgn"
+rm -rf "${DIR}/out"
+
+run -l "extract-signed-update" -b "$(size "${DIR}/signed.bin")" \
+	-i "${DIR}/signed.bin" -o "${DIR}/stripped.bin" -- \
+	"${_dir}/extract-signed-update"
+run -l "extract-signed-update -j ${JOBS}" -b "$(size "${DIR}/signed.bin")" \
+	-i "${DIR}/signed.bin" -o "${DIR}/stripped.bin" -- \
+	"${_dir}/extract-signed-update" -j "${JOBS}"
+for io in buffered mmap direct uring; do
+	run -l "extract-signed-update --io ${io}" \
+		-b "$(size "${DIR}/signed.bin")" \
+		-i "${DIR}/signed.bin" -o "${DIR}/stripped.bin" -- \
+		"${_dir}/extract-signed-update" --io "${io}"
+done
+rm -f "${DIR}/stripped.bin"
+
+if [ -n "${KEY_OPTS}" ]; then
+	run -l "region-file-data-extractor -v" -b "$(size "${DIR}/signed.rgn")" -- \
+		"${_dir}/region-file-data-extractor" -v -k "${DIR}/public.gpg" \
+		"${DIR}/signed.rgn"
+	run -l "region-file-data-extractor -v -j ${JOBS}" \
+		-b "$(size "${DIR}/signed.rgn")" -- \
+		"${_dir}/region-file-data-extractor" -v -k "${DIR}/public.gpg" \
+		-j "${JOBS}" "${DIR}/signed.rgn"
+	run -l "build-signed-update" -b "${BYTES}" -- \
+		"${_dir}/build-signed-update" -k "${DIR}/secret.gpg" \
+		-i "${DIR}/payload.bin" -o "${DIR}/resigned.bin"
+	run -l "build-signed-update -j ${JOBS}" -b "${BYTES}" -- \
+		"${_dir}/build-signed-update" -k "${DIR}/secret.gpg" \
+		-j "${JOBS}" -i "${DIR}/payload.bin" -o "${DIR}/resigned.bin"
+	# signed.rgn has rgn-gen's v2 headers; this is the default v1 one
+	"${_dir}/build-region" -o "${DIR}/resigned.rgn" "${DIR}/resigned.bin,1,0"
+	run -l "region-file-data-extractor -v (v1)" \
+		-b "$(size "${DIR}/resigned.rgn")" -- \
+		"${_dir}/region-file-data-extractor" -v -k "${DIR}/public.gpg" \
+		"${DIR}/resigned.rgn"
+	rm -f "${DIR}/resigned.bin" "${DIR}/resigned.rgn"
+else
+	mkdir -p "${DIR}/dump"
+	run -l "region-file-data-extractor" -b "$(size "${DIR}/signed.rgn")" -- \
+		"${_dir}/region-file-data-extractor" -o "${DIR}/dump/chunk" \
+		"${DIR}/signed.rgn"
+	rm -rf "${DIR}/dump"
+	echo "(gpg not found; signing and verification were skipped)"
+fi
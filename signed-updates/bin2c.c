@@ -1,44 +1,600 @@
 /*
  * bin2c.c
  *
- * [Short description of file]
+ * Formats binary data for embedding in a program: as a C array (the
+ * default), as a C string literal, as an assembler stub that pulls the
+ * file in with .incbin, or as an ELF relocatable object holding the data.
  *
  * Copyright 2007-2008 by Garmin Ltd. or its subsidiaries
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <elf.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
-void usage(void)
+/* Input is read and output gathered in blocks of this size */
+#define BLOCK_SIZE	(1024 * 1024)
+
+/* Bytes per line of the array form, and output columns of a string line */
+#define ARRAY_LINE	10
+#define STRING_LINE	76
+
+/* Alignment of the data in the assembler and ELF forms */
+#define DATA_ALIGN	16
+
+enum format {
+	FORMAT_ARRAY,
+	FORMAT_STRING,
+	FORMAT_INCBIN,
+	FORMAT_ELF,
+};
+
+/* Text of each byte value in the array and string forms */
+static char array_text[256][6];
+static char string_text[256][4];
+static unsigned char string_len[256];
+
+static unsigned char *out_buf;
+static size_t out_len;
+static int out_fd = STDOUT_FILENO;
+
+void usage(int status)
 {
-	fprintf(stderr, "Formats binary data into an array for use in C.\n");
-	fprintf(stderr, "Reads from stdin; writes to stdout.\n");
+	fprintf(stderr, "Usage: bin2c [-f FORMAT] [-n NAME] [-o FILE] [FILE]\n");
+	fprintf(stderr, "Formats binary data for use in C.\n");
+	fprintf(stderr, "Reads FILE or stdin; writes to FILE or stdout.\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -f FORMAT  array (default): a C array initializer\n");
+	fprintf(stderr, "             string: a C string literal, which compiles much\n");
+	fprintf(stderr, "               faster\n");
+	fprintf(stderr, "             incbin: an assembler file that includes FILE\n");
+	fprintf(stderr, "               with .incbin; FILE must be given\n");
+	fprintf(stderr, "             elf: an ELF relocatable object for this host\n");
+	fprintf(stderr, "  -n NAME    Name of the array (default data).  The incbin and\n");
+	fprintf(stderr, "             elf forms define NAME_start, NAME_end and the\n");
+	fprintf(stderr, "             absolute symbol NAME_size\n");
+	fprintf(stderr, "  -o FILE    Write to FILE instead of stdout\n");
 
-	exit(0);
+	exit(status);
 }
 
-int main(int argc, char **argv)
+void fail(const char *what)
+{
+	fprintf(stderr, "bin2c: %s: %s\n", what, strerror(errno));
+	exit(1);
+}
+
+void write_all(const unsigned char *data, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = write(out_fd, data + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("write");
+		}
+		done += ret;
+	}
+}
+
+void flush_output(void)
+{
+	write_all(out_buf, out_len);
+	out_len = 0;
+}
+
+/* Make room for len more bytes of output */
+static inline unsigned char *output_space(size_t len)
+{
+	if (out_len + len > BLOCK_SIZE)
+		flush_output();
+	return out_buf + out_len;
+}
+
+void output(const void *data, size_t len)
+{
+	if (len > BLOCK_SIZE) {
+		flush_output();
+		write_all(data, len);
+		return;
+	}
+	memcpy(output_space(len), data, len);
+	out_len += len;
+}
+
+void output_string(const char *s)
+{
+	output(s, strlen(s));
+}
+
+/* Read up to len bytes, fewer only at the end of the input */
+size_t read_block(int fd, unsigned char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = read(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fail("read");
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+void build_tables(void)
+{
+	static const char hex[] = "0123456789abcdef";
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		memcpy(array_text[c], "0x00, ", 6);
+		array_text[c][2] = hex[c >> 4];
+		array_text[c][3] = hex[c & 15];
+
+		/* Octal escapes are always three digits, so never run on */
+		if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+			string_text[c][0] = c;
+			string_len[c] = 1;
+		}
+		else if (c == '"' || c == '\\' || c == '?') {
+			string_text[c][0] = '\\';
+			string_text[c][1] = c;
+			string_len[c] = 2;
+		}
+		else {
+			string_text[c][0] = '\\';
+			string_text[c][1] = '0' + (c >> 6);
+			string_text[c][2] = '0' + ((c >> 3) & 7);
+			string_text[c][3] = '0' + (c & 7);
+			string_len[c] = 4;
+		}
+	}
+}
+
+/*
+ * The array form, ten bytes to a line.  The last line is the one with
+ * fewer than ten bytes, even if that is none.
+ */
+void write_array(int fd, const char *name)
+{
+	unsigned char *buf;
+	size_t len, i, line = 0;
+
+	buf = malloc(BLOCK_SIZE);
+	if (!buf)
+		fail("malloc");
+
+	output_string("static unsigned char ");
+	output_string(name);
+	output_string("[] = {\n");
+	do {
+		len = read_block(fd, buf, BLOCK_SIZE);
+		for (i = 0; i < len; i++) {
+			unsigned char *p = output_space(1 + 6 + 1);
+
+			if (line == 0)
+				*p++ = '\t';
+			memcpy(p, array_text[buf[i]], 6);
+			p += 6;
+			if (++line == ARRAY_LINE) {
+				*p++ = '\n';
+				line = 0;
+			}
+			out_len = p - out_buf;
+		}
+	} while (len == BLOCK_SIZE);
+	if (line == 0)
+		output_string("\t");
+	output_string("\n};\n");
+
+	free(buf);
+}
+
+/*
+ * The string form.  When the input size is known the array is given that
+ * exact size, so the terminating NUL of the literal is dropped and the
+ * result matches the array form; input from a pipe keeps the NUL.
+ */
+void write_string(int fd, const char *name, off_t size)
 {
-	int fd = 0, chars;
-	unsigned char buf[10];
+	unsigned char *buf, *p;
+	size_t len, i, col = 0;
+	char num[32];
 
-	if (argc > 1)
-		usage();
+	buf = malloc(BLOCK_SIZE);
+	if (!buf)
+		fail("malloc");
 
-	printf("static unsigned char data[] = {\n");
+	output_string("static const unsigned char ");
+	output_string(name);
+	if (size >= 0) {
+		snprintf(num, sizeof(num), "[%lld]", (long long)size);
+		output_string(num);
+	}
+	else {
+		output_string("[]");
+	}
+	output_string(" =\n\t\"");
 	do {
-		int i;
-		chars = read(fd, buf, 10);
-		printf("\t");
-		for (i=0; i<chars; i++)
-			printf("0x%02x, ", buf[i]);
-		printf("\n");
-	} while (chars == 10);
-	printf("};\n");
+		len = read_block(fd, buf, BLOCK_SIZE);
+		for (i = 0; i < len; i++) {
+			int c = buf[i];
+
+			p = output_space(8);
+			if (col >= STRING_LINE) {
+				memcpy(p, "\"\n\t\"", 4);
+				p += 4;
+				out_len += 4;
+				col = 0;
+			}
+			memcpy(p, string_text[c], 4);
+			out_len += string_len[c];
+			col += string_len[c];
+		}
+	} while (len == BLOCK_SIZE);
+	output_string("\";\n");
+
+	free(buf);
+}
+
+/* An assembler stub; the data stays in the file until it is assembled */
+void write_incbin(const char *name, const char *file)
+{
+	char *text;
+	const char *c;
+
+	output_string("\t.section .rodata\n");
+	if (asprintf(&text, "\t.balign %d\n"
+			"\t.global %s_start\n"
+			"\t.type %s_start, @object\n"
+			"%s_start:\n"
+			"\t.incbin \"", DATA_ALIGN, name, name, name) < 0)
+		fail("asprintf");
+	output_string(text);
+	free(text);
+
+	for (c = file; *c; c++) {
+		if (*c == '"' || *c == '\\')
+			output_string("\\");
+		output(c, 1);
+	}
+
+	if (asprintf(&text, "\"\n"
+			"\t.global %s_end\n"
+			"%s_end:\n"
+			"\t.size %s_start, %s_end - %s_start\n"
+			"\t.global %s_size\n"
+			"\t.set %s_size, %s_end - %s_start\n"
+			"\t.section .note.GNU-stack,\"\",@progbits\n",
+			name, name, name, name, name, name, name, name,
+			name) < 0)
+		fail("asprintf");
+	output_string(text);
+	free(text);
+}
+
+/*
+ * Pull the whole of a non-regular input into memory, as the ELF form
+ * needs the size before the data.
+ */
+unsigned char *slurp(int fd, size_t *size)
+{
+	unsigned char *buf = NULL;
+	size_t len = 0, alloc = 0, got;
+
+	do {
+		if (alloc - len < BLOCK_SIZE) {
+			alloc = alloc ? alloc * 2 : BLOCK_SIZE;
+			buf = realloc(buf, alloc);
+			if (!buf)
+				fail("realloc");
+		}
+		got = read_block(fd, buf + len, BLOCK_SIZE);
+		len += got;
+	} while (got == BLOCK_SIZE);
+
+	*size = len;
+	return buf;
+}
+
+#if defined(__x86_64__)
+#define ELF_CLASS	ELFCLASS64
+#define ELF_MACHINE	EM_X86_64
+#elif defined(__aarch64__)
+#define ELF_CLASS	ELFCLASS64
+#define ELF_MACHINE	EM_AARCH64
+#elif defined(__riscv) && __riscv_xlen == 64
+#define ELF_CLASS	ELFCLASS64
+#define ELF_MACHINE	EM_RISCV
+#elif defined(__powerpc64__)
+#define ELF_CLASS	ELFCLASS64
+#define ELF_MACHINE	EM_PPC64
+#elif defined(__i386__)
+#define ELF_CLASS	ELFCLASS32
+#define ELF_MACHINE	EM_386
+#elif defined(__arm__)
+#define ELF_CLASS	ELFCLASS32
+#define ELF_MACHINE	EM_ARM
+#endif
+
+#ifdef ELF_MACHINE
+#if ELF_CLASS == ELFCLASS64
+typedef Elf64_Ehdr Elf_Ehdr;
+typedef Elf64_Shdr Elf_Shdr;
+typedef Elf64_Sym Elf_Sym;
+#else
+typedef Elf32_Ehdr Elf_Ehdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym Elf_Sym;
+#endif
+
+/* Sections of the object, in order */
+enum {
+	SEC_NULL,
+	SEC_RODATA,
+	SEC_NOTE,
+	SEC_SYMTAB,
+	SEC_STRTAB,
+	SEC_SHSTRTAB,
+	SECTIONS,
+};
+
+static const char shstrtab[] =
+	"\0.rodata\0.note.GNU-stack\0.symtab\0.strtab\0.shstrtab";
+
+/*
+ * An ELF relocatable object for the host with the data in .rodata and
+ * the symbols NAME_start, NAME_end and NAME_size, laid out as
+ *
+ *	ELF header, data, symbols, strings, section headers
+ *
+ * so it is written front to back.  A regular input is copied across in
+ * blocks; anything else is read into memory first to learn its size.
+ */
+void write_elf(int fd, const char *name)
+{
+	static const unsigned char zeros[DATA_ALIGN];
+	unsigned char *data = NULL, *buf;
+	Elf_Shdr sh[SECTIONS];
+	Elf_Sym sym[5];
+	Elf_Ehdr eh;
+	struct stat st;
+	size_t size, len, copied, strtab_len, pad;
+	char *strtab;
+	off_t pos;
+	int n;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size = st.st_size;
+	}
+	else {
+		data = slurp(fd, &size);
+	}
+
+	/* Symbol names */
+	n = strlen(name);
+	strtab_len = 1 + 3 * (n + 7);
+	strtab = calloc(1, strtab_len);
+	if (!strtab)
+		fail("calloc");
+	sprintf(strtab + 1, "%s_start", name);
+	sprintf(strtab + 1 + n + 7, "%s_end", name);
+	sprintf(strtab + 1 + 2 * (n + 7), "%s_size", name);
+
+	memset(sym, 0, sizeof(sym));
+	sym[1].st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+	sym[1].st_shndx = SEC_RODATA;
+	sym[2].st_name = 1;
+	sym[2].st_value = 0;
+	sym[2].st_size = size;
+	sym[2].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_OBJECT);
+	sym[2].st_shndx = SEC_RODATA;
+	sym[3].st_name = 1 + n + 7;
+	sym[3].st_value = size;
+	sym[3].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+	sym[3].st_shndx = SEC_RODATA;
+	sym[4].st_name = 1 + 2 * (n + 7);
+	sym[4].st_value = size;
+	sym[4].st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE);
+	sym[4].st_shndx = SHN_ABS;
+
+	/* Layout */
+	memset(sh, 0, sizeof(sh));
+	pos = sizeof(eh);
+	pos = (pos + DATA_ALIGN - 1) & ~(off_t)(DATA_ALIGN - 1);
+	sh[SEC_RODATA].sh_name = 1;
+	sh[SEC_RODATA].sh_type = SHT_PROGBITS;
+	sh[SEC_RODATA].sh_flags = SHF_ALLOC;
+	sh[SEC_RODATA].sh_offset = pos;
+	sh[SEC_RODATA].sh_size = size;
+	sh[SEC_RODATA].sh_addralign = DATA_ALIGN;
+	pos += size;
+
+	sh[SEC_NOTE].sh_name = 9;
+	sh[SEC_NOTE].sh_type = SHT_PROGBITS;
+	sh[SEC_NOTE].sh_offset = pos;
+	sh[SEC_NOTE].sh_addralign = 1;
+
+	pos = (pos + 7) & ~(off_t)7;
+	sh[SEC_SYMTAB].sh_name = 25;
+	sh[SEC_SYMTAB].sh_type = SHT_SYMTAB;
+	sh[SEC_SYMTAB].sh_offset = pos;
+	sh[SEC_SYMTAB].sh_size = sizeof(sym);
+	sh[SEC_SYMTAB].sh_link = SEC_STRTAB;
+	sh[SEC_SYMTAB].sh_info = 2;	/* First global symbol */
+	sh[SEC_SYMTAB].sh_addralign = 8;
+	sh[SEC_SYMTAB].sh_entsize = sizeof(Elf_Sym);
+	pos += sizeof(sym);
+
+	sh[SEC_STRTAB].sh_name = 33;
+	sh[SEC_STRTAB].sh_type = SHT_STRTAB;
+	sh[SEC_STRTAB].sh_offset = pos;
+	sh[SEC_STRTAB].sh_size = strtab_len;
+	sh[SEC_STRTAB].sh_addralign = 1;
+	pos += strtab_len;
+
+	sh[SEC_SHSTRTAB].sh_name = 41;
+	sh[SEC_SHSTRTAB].sh_type = SHT_STRTAB;
+	sh[SEC_SHSTRTAB].sh_offset = pos;
+	sh[SEC_SHSTRTAB].sh_size = sizeof(shstrtab);
+	sh[SEC_SHSTRTAB].sh_addralign = 1;
+	pos += sizeof(shstrtab);
+
+	pos = (pos + 7) & ~(off_t)7;
+
+	memset(&eh, 0, sizeof(eh));
+	memcpy(eh.e_ident, ELFMAG, SELFMAG);
+	eh.e_ident[EI_CLASS] = ELF_CLASS;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	eh.e_ident[EI_DATA] = ELFDATA2MSB;
+#else
+	eh.e_ident[EI_DATA] = ELFDATA2LSB;
+#endif
+	eh.e_ident[EI_VERSION] = EV_CURRENT;
+	eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+	eh.e_type = ET_REL;
+	eh.e_machine = ELF_MACHINE;
+	eh.e_version = EV_CURRENT;
+	eh.e_shoff = pos;
+	eh.e_ehsize = sizeof(eh);
+	eh.e_shentsize = sizeof(Elf_Shdr);
+	eh.e_shnum = SECTIONS;
+	eh.e_shstrndx = SEC_SHSTRTAB;
+
+	output(&eh, sizeof(eh));
+	output(zeros, sh[SEC_RODATA].sh_offset - sizeof(eh));
+	if (data) {
+		output(data, size);
+		free(data);
+	}
+	else {
+		buf = malloc(BLOCK_SIZE);
+		if (!buf)
+			fail("malloc");
+		for (copied = 0; copied < size; copied += len) {
+			len = read_block(fd, buf, size - copied < BLOCK_SIZE ?
+					size - copied : BLOCK_SIZE);
+			if (len == 0) {
+				fprintf(stderr, "bin2c: input changed size\n");
+				exit(1);
+			}
+			output(buf, len);
+		}
+		free(buf);
+	}
+	pad = sh[SEC_SYMTAB].sh_offset - sh[SEC_NOTE].sh_offset;
+	output(zeros, pad);
+	output(sym, sizeof(sym));
+	output(strtab, strtab_len);
+	output(shstrtab, sizeof(shstrtab));
+	output(zeros, eh.e_shoff - (sh[SEC_SHSTRTAB].sh_offset +
+				sizeof(shstrtab)));
+	output(sh, sizeof(sh));
+
+	free(strtab);
+}
+#else
+void write_elf(int fd, const char *name)
+{
+	fprintf(stderr, "bin2c: ELF output is not supported on this host\n");
+	exit(1);
+}
+#endif
+
+int main(int argc, char **argv)
+{
+	enum format format = FORMAT_ARRAY;
+	const char *name = "data";
+	const char *in_name = NULL;
+	struct stat st;
+	off_t size = -1;
+	int fd = STDIN_FILENO, opt;
+
+	while ((opt = getopt(argc, argv, "hf:n:o:")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg, "array"))
+				format = FORMAT_ARRAY;
+			else if (!strcmp(optarg, "string"))
+				format = FORMAT_STRING;
+			else if (!strcmp(optarg, "incbin"))
+				format = FORMAT_INCBIN;
+			else if (!strcmp(optarg, "elf"))
+				format = FORMAT_ELF;
+			else
+				usage(1);
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'o':
+			out_fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC,
+					S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+			if (out_fd < 0)
+				fail(optarg);
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+	if (argc - optind > 1)
+		usage(1);
+	if (optind < argc) {
+		in_name = argv[optind];
+		fd = open(in_name, O_RDONLY);
+		if (fd < 0)
+			fail(in_name);
+	}
+	if (format == FORMAT_INCBIN && !in_name) {
+		fprintf(stderr, "bin2c: the incbin format needs an input file\n");
+		exit(1);
+	}
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		size = st.st_size;
+
+	out_buf = malloc(BLOCK_SIZE);
+	if (!out_buf)
+		fail("malloc");
+	build_tables();
+
+	switch (format) {
+	case FORMAT_ARRAY:
+		write_array(fd, name);
+		break;
+	case FORMAT_STRING:
+		write_string(fd, name, size);
+		break;
+	case FORMAT_INCBIN:
+		write_incbin(name, in_name);
+		break;
+	case FORMAT_ELF:
+		write_elf(fd, name);
+		break;
+	}
+	flush_output();
 
+	if (out_fd != STDOUT_FILENO && close(out_fd))
+		fail("close");
 	return 0;
 }
-	
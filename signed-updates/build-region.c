@@ -6,23 +6,24 @@
  * Copyright 2007-2008 by Garmin Ltd. or its subsidiaries
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
-/* Region file header information */
-#define FILE_ID			0x7247704B
-#define DATA_VERSION_REC_CHAR	'D'
-#define APP_VERSION_REC_CHAR	'A'
-#define REGION_REC_CHAR		'R'
+#include "rgn.h"
 
 #define PRODUCT_VERSION_MAJOR	(2)
 #define PRODUCT_VERSION_MINOR	(0)
-#define LOW_LEVEL_VERSION	100
+#define LOW_LEVEL_VERSION	RGN_VERSION
 #define DATA_VERSION		100
 #define APP_VERSION 		((PRODUCT_VERSION_MAJOR * 100) \
 					+ PRODUCT_VERSION_MINOR )
@@ -38,25 +39,48 @@
 #endif
 
 /* Memory parameters */
-#define FILE_BUF_SIZE (4096)
-#define REGION_ALLOC_NUM 10
+#define REGION_ALLOC_NUM 1024
+#define MANIFEST_READ_SIZE (1024 * 1024)
 #define RECORD_BUFFER_SIZE 256
 #define ERROR_SIZE (70)
 
+/* zlib level of compressed regions */
+#define COMPRESS_LEVEL 6
+
 /* Structure for holding region information */
 struct region {
 	char * file;
 	unsigned int delay;
-	unsigned int size;
+	unsigned long long size;
 	unsigned short id;
+	off_t offset;		/* Offset of the payload in the output */
+	struct timespec mtime;	/* Of the region file */
+	char type;		/* Region, delta or compressed record */
+	int payload_fd;		/* Delta or compressed payload, or -1 */
+	off_t payload_off;	/* Offset of the payload in payload_fd */
 };
 
-/* Format of region data in region header */
-struct region_header {
-	unsigned short id;
-	unsigned int delay;
-	unsigned int size;
-} __attribute__ ((__packed__));
+/* Regions shared out between parallel copy threads */
+struct build_job {
+	int out_fd;
+	off_t base;		/* Output position of the file header */
+	struct region *regions;
+	int region_count;
+	int crc;		/* Follow each region with a CRC record */
+	int next;		/* Next region to copy, taken atomically */
+};
+
+/*
+ * Whether the output has version 200 records with 64-bit sizes.  Set
+ * before anything is laid out or written.
+ */
+static int large_records;
+
+/*
+ * --trust-mtime: with --update, take an input older than the region file
+ * to be unchanged without comparing it.
+ */
+static int trust_mtime;
 
 /* Macro to build a buffer of null-terminated strings */
 #define ADD_STRING(buf, str, max, size) \
@@ -104,15 +128,50 @@ usage_and_quit(void)
 {
 	printf("Usage: build_region [OPTION] "
 			"<input_file>,<region_id>,<delay_ms>...\n");
+	printf("   or: build_region [OPTION] -m MANIFEST\n");
 	printf("Build a region file for use with Garmin updater.exe\n");
 	printf("\n");
 	printf("  -o FILE      Specify a file to write to (default stdout)\n");
+	printf("  -m, --manifest FILE\n");
+	printf("               Read regions from FILE (- for stdin), one\n");
+	printf("               input_file,region_id,delay_ms per line; blank\n");
+	printf("               lines and lines starting with # are skipped\n");
+	printf("  -t, --toc    Add a region table of contents for random access\n");
+	printf("  -c, --crc    Add a CRC32C record after each region\n");
+	printf("  --delta-from OLD\n");
+	printf("               Write regions that also appear in the region\n");
+	printf("               file OLD as deltas against it, where smaller\n");
+	printf("               (see apply-region-delta)\n");
+	printf("  --update FILE\n");
+	printf("               Rewrite the region file FILE in place, leaving\n");
+	printf("               regions whose input is unchanged where they are\n");
+	printf("               and moving only what follows a resized region\n");
+	printf("  --trust-mtime\n");
+	printf("               With --update, take inputs older than FILE to be\n");
+	printf("               unchanged instead of comparing them\n");
+	printf("  -s, --sparse Store runs of one fill byte (erased flash, zero\n");
+	printf("               padding) as fill descriptors, where that makes\n");
+	printf("               regions smaller\n");
+	printf("  -L, --large  Write version 200 records with 64-bit sizes; the\n");
+	printf("               default when a region is over 4 GiB\n");
+	printf("  -z, --compress\n");
+	printf("               Compress regions in independent blocks, where\n");
+	printf("               that makes them smaller\n");
+	printf("  -j N         Copy up to N regions in parallel (output must be\n");
+	printf("               a regular file), encode up to N deltas and\n");
+	printf("               compress with N threads\n");
+	printf("  --stats[=FORMAT]\n");
+	printf("               Print the bytes, time, system calls and peak\n");
+	printf("               RSS of each phase to stderr, as text or json\n");
 	printf("  -h, --help   Display this help message\n");
 	printf("\n");
 	printf("  input_file - File containing binary region data\n");
 	printf("  region_id - Enumerated region type\n");
 	printf("  delay_ms - Delay after applying this region\n");
 	printf("\n");
+	printf("The region ID and delay are the last two fields, so the file\n");
+	printf("name may itself contain commas.\n");
+	printf("\n");
 	printf("Example:\n");
 	printf("  build_region -o foo.rgn region1.bin,25,3000 "
 							"23,region2.bin,0\n");
@@ -134,11 +193,13 @@ argument_error(const char *error)
 static void
 writeall (int fd, const void *buf, size_t count)
 {
-	size_t bytes_written;
+	ssize_t bytes_written;
 
 	do {
 		bytes_written = write(fd, buf, count);
 		if (bytes_written < 0) {
+			if (errno == EINTR)
+				continue;
 			fprintf(stderr, "Error writing output file: %s\n",
 					strerror(errno));
 			exit(1);
@@ -161,88 +222,1253 @@ write_header (int fd, unsigned int fid, unsigned short ll_version)
 /*
  * Write a region file record to open file descriptor fd.
  *
- * A record is: (uint)  Record size
+ * A record is: (uint)  Record size (ulonglong in large files)
  *              (char)  Record type
  *                      Record data
  */
 static void
-write_record (int fd, unsigned int size, char type, const void *buf,
+write_record (int fd, unsigned long long size, char type, const void *buf,
 							unsigned int buf_len)
 {
-	writeall(fd, &size, sizeof(size));
-	writeall(fd, &type, sizeof(type));
+	BYTE hdr[RGN_HEADERS_MAX];
+
+	writeall(fd, hdr, rgn_encode_record_header(hdr, large_records, size,
+									type));
 	writeall(fd, buf, buf_len);
 }
 
 /*
- * Region files are given on the command line as triplets in the form:
+ * Size of the record and region headers in front of a payload.
+ */
+static off_t
+region_headers_size (void)
+{
+	return rgn_record_header_size(large_records) +
+				rgn_region_header_size(large_records);
+}
+
+/*
+ * Size of a CRC record.
+ */
+static off_t
+crc_record_size (void)
+{
+	return rgn_record_header_size(large_records) +
+						sizeof(struct region_crc);
+}
+
+/*
+ * Write entire buffer to fd at offset.  Exit if write errors occur.
+ */
+static void
+pwriteall (int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t bytes_written;
+
+	do {
+		bytes_written = pwrite(fd, buf, count, offset);
+		if (bytes_written < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error writing output file: %s\n",
+					strerror(errno));
+			exit(1);
+		}
+		buf += bytes_written;
+		count -= bytes_written;
+		offset += bytes_written;
+	} while (count);
+}
+
+/*
+ * Size of the body of a table of contents record.
+ */
+static UINT
+toc_size (int region_count)
+{
+	return sizeof(UINT) + region_count * sizeof(struct region_toc_entry);
+}
+
+/*
+ * Work out where the payload of every region goes, given that the first
+ * region record starts at pos.  Returns the size of the whole output.
+ */
+static off_t
+compute_layout (struct region *regions, int region_count, off_t pos,
+								int crc)
+{
+	int i;
+
+	for (i = 0; i < region_count; i++) {
+		pos += region_headers_size();
+		regions[i].offset = pos;
+		pos += regions[i].size;
+		if (crc)
+			pos += crc_record_size();
+	}
+
+	return pos;
+}
+
+/*
+ * Write a table of contents record listing each region and the absolute
+ * offset of its payload.  The layout must already be computed.
+ */
+static void
+write_toc (int fd, struct region *regions, int region_count)
+{
+	struct region_toc_entry *entries;
+	UINT count = region_count;
+	UINT size;
+	int i;
+
+	size = toc_size(region_count);
+	entries = xmalloc(region_count * sizeof(struct region_toc_entry) + 1);
+
+	for (i = 0; i < region_count; i++) {
+		entries[i].id = regions[i].id;
+		entries[i].delay = regions[i].delay;
+		entries[i].size = regions[i].size;
+		entries[i].offset = regions[i].offset;
+	}
+
+	write_record(fd, size, REGION_TOC_REC_CHAR, &count, sizeof(count));
+	writeall(fd, entries, region_count * sizeof(struct region_toc_entry));
+
+	free(entries);
+}
+
+/*
+ * CRC32C of the size bytes of in_fd at in_pos.  The file is mapped and
+ * read once here; the copy that follows then comes from the page cache
+ * and still stays in the kernel.
+ */
+static UINT
+region_crc (int in_fd, off_t in_pos, const struct region *region)
+{
+	struct stat st;
+	off_t skew = in_pos % sysconf(_SC_PAGESIZE);
+	void *map;
+	UINT crc;
+
+	if (region->size == 0)
+		return 0;
+
+	/* A mapping past the end of a shrunk file would fault */
+	if (fstat(in_fd, &st) == 0 && st.st_size < in_pos + region->size) {
+		fprintf(stderr, "Region file %s changed size while building\n",
+							region->file);
+		exit(1);
+	}
+
+	map = mmap(NULL, region->size + skew, PROT_READ, MAP_SHARED, in_fd,
+								in_pos - skew);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Could not map region file %s: %s\n",
+						region->file, strerror(errno));
+		exit(1);
+	}
+	madvise(map, region->size + skew, MADV_SEQUENTIAL);
+	crc = rgn_crc32c(0, (BYTE *)map + skew, region->size);
+	munmap(map, region->size + skew);
+
+	return crc;
+}
+
+/*
+ * Write the record for one region: the record header, the region header
+ * and the contents of the region file, then the CRC record if crc is set.
+ * If base is given the records go to their precomputed offset
+ * base + region->offset and the file position of out_fd is not used, so
+ * several regions can be written at once.
+ */
+static void
+write_region (int out_fd, const struct region *region, const off_t *base,
+								int crc)
+{
+	BYTE hdr[RGN_HEADERS_MAX];
+	BYTE crc_rec[sizeof(struct data_record_large) +
+						sizeof(struct region_crc)];
+	size_t hdr_len, crc_len = crc_record_size();
+	off_t pos, in_pos = 0;
+	ULONGLONG span;
+	ssize_t copied;
+	int in_fd;
+
+	if (region->payload_fd >= 0) {
+		in_fd = dup(region->payload_fd);
+		in_pos = region->payload_off;
+	}
+	else {
+		in_fd = open(region->file, O_RDONLY);
+	}
+	if (in_fd < 0) {
+		fprintf(stderr, "Could not open region file %s: %s\n",
+						region->file, strerror(errno));
+		exit(1);
+	}
+	rgn_stats_enter(RGN_PHASE_COPY);
+	span = rgn_trace_begin();
+
+	hdr_len = rgn_encode_record_header(hdr, large_records,
+			rgn_region_header_size(large_records) + region->size,
+			region->type);
+	hdr_len += rgn_encode_region_header(hdr + hdr_len, large_records,
+				region->id, region->delay, region->size);
+
+	if (crc) {
+		struct region_crc body;
+
+		body.id = region->id;
+		body.crc = region_crc(in_fd, in_pos, region);
+		memcpy(crc_rec + rgn_encode_record_header(crc_rec,
+				large_records, sizeof(body),
+				REGION_CRC_REC_CHAR), &body, sizeof(body));
+	}
+
+	/*
+	 * Copy exactly the size recorded in the headers.  The data stays in
+	 * the kernel unless neither end supports that.
+	 */
+	if (base) {
+		pos = *base + region->offset;
+		pwriteall(out_fd, hdr, hdr_len, pos - hdr_len);
+		copied = rgn_copy(in_fd, &in_pos, out_fd, &pos, region->size);
+		if (crc && copied == region->size)
+			pwriteall(out_fd, crc_rec, crc_len, pos);
+	}
+	else {
+		writeall(out_fd, hdr, hdr_len);
+		copied = rgn_copy(in_fd, &in_pos, out_fd, NULL, region->size);
+		if (crc && copied == region->size)
+			writeall(out_fd, crc_rec, crc_len);
+	}
+	if (copied < 0) {
+		fprintf(stderr, "Error copying %s: %s\n", region->file,
+							strerror(errno));
+		exit(1);
+	}
+	if (copied != region->size) {
+		fprintf(stderr, "Region file %s changed size while building\n",
+							region->file);
+		exit(1);
+	}
+
+	close(in_fd);
+	rgn_trace_end("write_region", span, region->id);
+	rgn_stats_add(RGN_PHASE_COPY, region->size);
+	rgn_stats_leave();
+}
+
+static void *
+copy_worker (void *arg)
+{
+	struct build_job *job = arg;
+	int i;
+
+	rgn_trace_thread_name("copy");
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+							job->region_count)
+		write_region(job->out_fd, &job->regions[i], &job->base,
+								job->crc);
+
+	return NULL;
+}
+
+/*
+ * Copy all regions into a preallocated output with up to jobs threads,
+ * each writing whole regions at their fixed offsets.  The output is
+ * positioned where the first region record goes, start bytes into the
+ * region file, and the whole file is end bytes long.  Returns 0 if the
+ * output cannot be written by offset.
+ */
+static int
+write_regions_parallel (int out_fd, struct region *regions,
+			int region_count, off_t start, off_t end, int jobs,
+			int crc)
+{
+	struct build_job job;
+	pthread_t *threads;
+	struct stat st;
+	int i, err;
+
+	if (fstat(out_fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	job.out_fd = out_fd;
+	job.base = lseek(out_fd, 0, SEEK_CUR);
+	if (job.base < 0)
+		return 0;
+	job.base -= start;
+	job.regions = regions;
+	job.region_count = region_count;
+	job.crc = crc;
+	job.next = 0;
+
+	/* Reserve the whole file so the threads do not fight over extents */
+	if (fallocate(out_fd, 0, job.base, end) && ftruncate(out_fd,
+							job.base + end)) {
+		fprintf(stderr, "Could not size output file: %s\n",
+							strerror(errno));
+		exit(1);
+	}
+
+	if (jobs > region_count)
+		jobs = region_count;
+	threads = xmalloc(jobs * sizeof(pthread_t) + 1);
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&threads[i], NULL, copy_worker, &job);
+		if (err) {
+			fprintf(stderr, "Could not start copy thread: %s\n",
+							strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	lseek(out_fd, job.base + end, SEEK_SET);
+	return 1;
+}
+
+/*
+ * Stat every region file so the size of each region is known before any
+ * output is written.  The requests go to the kernel in batches rather
+ * than one system call per file.
+ */
+static void
+stat_regions (struct region *regions, int region_count)
+{
+	struct rgn_statx *reqs;
+	int i;
+
+	reqs = xmalloc(region_count * sizeof(struct rgn_statx) + 1);
+	for (i = 0; i < region_count; i++)
+		reqs[i].path = regions[i].file;
+	if (rgn_statx_batch(reqs, region_count, STATX_SIZE | STATX_MTIME)) {
+		fprintf(stderr, "Could not stat region files: %s\n",
+							strerror(errno));
+		exit(1);
+	}
+
+	for (i = 0; i < region_count; i++) {
+		if (reqs[i].error) {
+			fprintf(stderr, "Could not stat region file %s: %s\n",
+							regions[i].file,
+							strerror(reqs[i].error));
+			exit(1);
+		}
+		regions[i].size = reqs[i].stx.stx_size;
+		regions[i].mtime.tv_sec = reqs[i].stx.stx_mtime.tv_sec;
+		regions[i].mtime.tv_nsec = reqs[i].stx.stx_mtime.tv_nsec;
+	}
+	free(reqs);
+}
+
+/*
+ * Index the first full region with each ID in a region file.  An ID
+ * without one has type 0 in the index.
+ */
+static struct rgn_region *
+index_old_regions (const struct rgn_file *old)
+{
+	struct rgn_region *index, region;
+	struct rgn_iter it;
+	struct rgn_record rec;
+
+	index = xmalloc(65536 * sizeof(struct rgn_region));
+	memset(index, 0, 65536 * sizeof(struct rgn_region));
+
+	rgn_iter_init(&it, old);
+	while (rgn_iter_next(&it, &rec) > 0) {
+		if (rec.type != REGION_REC_CHAR)
+			continue;
+		if (rgn_decode_region(&rec, &region) == 0 &&
+						!index[region.id].type)
+			index[region.id] = region;
+	}
+
+	return index;
+}
+
+/*
+ * Directory for unlinked temporary payload files.
+ */
+static const char *
+temp_dir (void)
+{
+	const char *tmpdir = getenv("TMPDIR");
+
+	return tmpdir ? tmpdir : "/tmp";
+}
+
+static int
+open_temp (const char *tmpdir)
+{
+	int fd;
+
+	fd = open(tmpdir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		fprintf(stderr, "Could not create temporary file in %s: %s\n",
+						tmpdir, strerror(errno));
+		exit(1);
+	}
+	return fd;
+}
+
+/* Unlinked temporary files holding the delta and compressed payloads */
+static int *payload_fds;
+static int payload_fd_count;
+static pthread_mutex_t payload_fd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Open a temporary file for payloads.  Many regions share one such file,
+ * each at its own offset, so the number of open files does not grow with
+ * the number of regions.
+ */
+static int
+open_payload_temp (const char *tmpdir)
+{
+	int fd = open_temp(tmpdir);
+
+	pthread_mutex_lock(&payload_fd_lock);
+	payload_fds = xrealloc(payload_fds,
+			(payload_fd_count + 1) * sizeof(int));
+	payload_fds[payload_fd_count++] = fd;
+	pthread_mutex_unlock(&payload_fd_lock);
+
+	return fd;
+}
+
+static void
+close_payload_temps (void)
+{
+	int i;
+
+	for (i = 0; i < payload_fd_count; i++)
+		close(payload_fds[i]);
+	free(payload_fds);
+	payload_fds = NULL;
+	payload_fd_count = 0;
+}
+
+/*
+ * Position of the end of a payload file, where the next payload goes.
+ */
+static off_t
+payload_end (int fd)
+{
+	off_t pos = lseek(fd, 0, SEEK_END);
+
+	if (pos < 0) {
+		fprintf(stderr, "Could not seek temporary file: %s\n",
+							strerror(errno));
+		exit(1);
+	}
+	return pos;
+}
+
+/*
+ * Drop a payload that was not used from the end of its file.
+ */
+static void
+discard_payload (int fd, off_t start)
+{
+	if (ftruncate(fd, start) || lseek(fd, start, SEEK_SET) < 0) {
+		fprintf(stderr, "Could not truncate temporary file: %s\n",
+							strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+ * Map the contents of a region file, or return NULL if it is empty.
+ */
+static void *
+map_region (const struct region *region)
+{
+	void *map = NULL;
+	int in_fd;
+
+	in_fd = open(region->file, O_RDONLY);
+	if (in_fd < 0) {
+		fprintf(stderr, "Could not open region file %s: %s\n",
+						region->file, strerror(errno));
+		exit(1);
+	}
+	if (region->size) {
+		map = mmap(NULL, region->size, PROT_READ, MAP_SHARED, in_fd, 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Could not map region file %s: %s\n",
+						region->file, strerror(errno));
+			exit(1);
+		}
+	}
+	close(in_fd);
+
+	return map;
+}
+
+/* Regions shared out between delta encoding threads */
+struct delta_job {
+	const struct rgn_region *index;	/* Old regions by ID */
+	const char *tmpdir;
+	struct region *regions;
+	int region_count;
+	int next;		/* Next region to encode, taken atomically */
+};
+
+/*
+ * Encode a region that has a namesake in the old region file as a delta
+ * against it, at the end of the payload file fd.  A region whose delta
+ * would not be smaller than the region itself is left alone.
+ */
+static void
+encode_delta (const struct rgn_region *index, int fd, struct region *region)
+{
+	const struct rgn_region *base = &index[region->id];
+	unsigned long long full_size = region->size;
+	ULONGLONG span;
+	void *map;
+	ssize_t size;
+	off_t start;
+
+	/* Delta payloads describe regions of up to 4 GiB */
+	if (!base->type || full_size > UINT_MAX)
+		return;
+
+	rgn_stats_enter(RGN_PHASE_ENCODE);
+	span = rgn_trace_begin();
+	map = map_region(region);
+	start = payload_end(fd);
+
+	size = rgn_delta_encode(base->data, base->size, map, full_size, fd,
+								full_size);
+	if (size < 0) {
+		fprintf(stderr, "Could not encode delta for %s: %s\n",
+						region->file, strerror(errno));
+		exit(1);
+	}
+	if (size > 0) {
+		region->type = REGION_DELTA_REC_CHAR;
+		region->payload_fd = fd;
+		region->payload_off = start;
+		region->size = size;
+	}
+	else {
+		discard_payload(fd, start);
+	}
+
+	if (map)
+		munmap(map, full_size);
+	rgn_trace_end("encode_delta", span, region->id);
+	rgn_stats_add(RGN_PHASE_ENCODE, full_size);
+	rgn_stats_leave();
+}
+
+static void *
+delta_worker (void *arg)
+{
+	struct delta_job *job = arg;
+	int i, fd = -1;
+
+	rgn_trace_thread_name("delta");
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) <
+							job->region_count) {
+		/* Each thread appends to a payload file of its own */
+		if (fd < 0)
+			fd = open_payload_temp(job->tmpdir);
+		encode_delta(job->index, fd, &job->regions[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Replace regions by deltas against the old region file where that makes
+ * them smaller, encoding up to jobs regions at once.
+ */
+static void
+encode_deltas (const char *old_file_name, struct region *regions,
+					int region_count, int jobs)
+{
+	struct rgn_file old;
+	struct delta_job job;
+	pthread_t *threads;
+	int i, err;
+
+	rgn_stats_enter(RGN_PHASE_PARSE);
+	if (rgn_open(&old, old_file_name)) {
+		fprintf(stderr, "Could not open %s: %s\n", old_file_name,
+							strerror(errno));
+		exit(1);
+	}
+
+	job.index = index_old_regions(&old);
+	rgn_stats_add(RGN_PHASE_PARSE, old.size);
+	rgn_stats_leave();
+	job.tmpdir = temp_dir();
+	job.regions = regions;
+	job.region_count = region_count;
+	job.next = 0;
+
+	if (jobs > region_count)
+		jobs = region_count;
+	if (jobs < 2) {
+		delta_worker(&job);
+		free((void *)job.index);
+		rgn_close(&old);
+		return;
+	}
+
+	threads = xmalloc(jobs * sizeof(pthread_t));
+	for (i = 0; i < jobs; i++) {
+		err = pthread_create(&threads[i], NULL, delta_worker, &job);
+		if (err) {
+			fprintf(stderr, "Could not start delta thread: %s\n",
+							strerror(err));
+			exit(1);
+		}
+	}
+	for (i = 0; i < jobs; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	free((void *)job.index);
+	rgn_close(&old);
+}
+
+/*
+ * Compress every region that is still written in full, one after the
+ * other with jobs threads on the blocks of each.  A region that does not
+ * get smaller is left alone.
+ */
+static void
+compress_regions (struct region *regions, int region_count, int jobs)
+{
+	int i, fd = -1;
+
+	for (i = 0; i < region_count; i++) {
+		struct region *region = &regions[i];
+		ULONGLONG span;
+		void *map;
+		ssize_t size;
+		off_t start;
+
+		if (region->type != REGION_REC_CHAR || region->size == 0 ||
+						region->size > UINT_MAX)
+			continue;
+
+		rgn_stats_enter(RGN_PHASE_ENCODE);
+		span = rgn_trace_begin();
+		map = map_region(region);
+		madvise(map, region->size, MADV_SEQUENTIAL);
+		if (fd < 0)
+			fd = open_payload_temp(temp_dir());
+		start = payload_end(fd);
+		size = rgn_compress(map, region->size, fd, RGN_COMPRESS_BLOCK,
+						COMPRESS_LEVEL, jobs);
+		if (size < 0) {
+			fprintf(stderr, "Could not compress %s: %s\n",
+						region->file, strerror(errno));
+			exit(1);
+		}
+		munmap(map, region->size);
+		rgn_trace_end("compress", span, region->id);
+		rgn_stats_add(RGN_PHASE_ENCODE, region->size);
+		rgn_stats_leave();
+
+		if (size < region->size) {
+			region->type = REGION_COMPRESSED_REC_CHAR;
+			region->payload_fd = fd;
+			region->payload_off = start;
+			region->size = size;
+		}
+		else {
+			discard_payload(fd, start);
+		}
+	}
+}
+
+/*
+ * Store every region that is still written in full and has long runs of
+ * one byte as a sparse region.  A region that does not get smaller is
+ * left alone.
+ */
+static void
+sparse_regions (struct region *regions, int region_count)
+{
+	int i, fd = -1;
+
+	for (i = 0; i < region_count; i++) {
+		struct region *region = &regions[i];
+		ULONGLONG span;
+		void *map;
+		ssize_t size;
+		off_t start;
+
+		if (region->type != REGION_REC_CHAR || region->size == 0 ||
+						region->size > UINT_MAX)
+			continue;
+
+		rgn_stats_enter(RGN_PHASE_ENCODE);
+		span = rgn_trace_begin();
+		map = map_region(region);
+		madvise(map, region->size, MADV_SEQUENTIAL);
+		if (fd < 0)
+			fd = open_payload_temp(temp_dir());
+		start = payload_end(fd);
+		size = rgn_sparse_encode(map, region->size, fd, RGN_FILL_MIN);
+		if (size < 0) {
+			fprintf(stderr, "Could not encode %s: %s\n",
+						region->file, strerror(errno));
+			exit(1);
+		}
+		munmap(map, region->size);
+		rgn_trace_end("sparse", span, region->id);
+		rgn_stats_add(RGN_PHASE_ENCODE, region->size);
+		rgn_stats_leave();
+
+		if (size > 0) {
+			region->type = REGION_SPARSE_REC_CHAR;
+			region->payload_fd = fd;
+			region->payload_off = start;
+			region->size = size;
+		}
+	}
+}
+
+/* What --update does with a region of the existing file */
+enum update_action {
+	UPDATE_KEEP,		/* Unchanged */
+	UPDATE_HEADER,		/* Only the delay changed */
+	UPDATE_REWRITE,		/* Written again from its input file */
+};
+
+/* A region group (region record and its CRC record) of an existing file */
+struct old_region {
+	unsigned short id;
+	unsigned int delay;
+	unsigned long long size;
+	char type;
+	int has_crc;
+	off_t start;		/* Offset of the region record */
+	off_t end;		/* End of the group */
+	const BYTE *data;	/* Payload, while the file is mapped */
+};
+
+/* The layout of the file being updated and what to do with each region */
+struct update {
+	int fd;
+	off_t head;		/* Records before the first region */
+	off_t end;
+	off_t shift;		/* Move of the regions for the new head */
+	int large;		/* The file has 64-bit records */
+	struct old_region *old;
+	int old_count;
+	int old_alloc;
+	enum update_action *action;
+};
+
+/*
+ * Size of the record group of a new region.
+ */
+static off_t
+group_size (const struct region *region, int crc)
+{
+	off_t size = region_headers_size() + region->size;
+
+	if (crc)
+		size += crc_record_size();
+	return size;
+}
+
+/*
+ * Read the layout of a region file written by build-region: the VIR, the
+ * version records and TOC, then regions each optionally followed by a CRC
+ * record.
+ */
+static void
+read_old_layout (const struct rgn_file *file, const char *name,
+						struct update *update)
+{
+	struct rgn_iter it;
+	struct rgn_record rec;
+	struct rgn_region region;
+	struct old_region *old;
+	struct vir vir;
+	int ret;
+
+	if (rgn_read_vir(file, &vir) || vir.file_id != FILE_ID) {
+		fprintf(stderr, "%s is not a region file\n", name);
+		exit(1);
+	}
+
+	update->head = file->size;
+	update->end = file->size;
+	rgn_iter_init(&it, file);
+	update->large = it.large;
+	while ((ret = rgn_iter_next(&it, &rec)) > 0) {
+		off_t start = rec.offset - rgn_record_header_size(it.large);
+
+		switch (rec.type) {
+		case DATA_VERSION_REC_CHAR:
+		case APP_VERSION_REC_CHAR:
+		case REGION_TOC_REC_CHAR:
+			if (update->old_count)
+				goto bad;
+			continue;
+		case REGION_CRC_REC_CHAR:
+			if (!update->old_count)
+				goto bad;
+			old = &update->old[update->old_count - 1];
+			if (old->has_crc || old->end != start)
+				goto bad;
+			old->has_crc = 1;
+			old->end = rec.offset + rec.size;
+			continue;
+		case REGION_REC_CHAR:
+		case REGION_DELTA_REC_CHAR:
+		case REGION_COMPRESSED_REC_CHAR:
+		case REGION_SPARSE_REC_CHAR:
+			break;
+		default:
+			goto bad;
+		}
+
+		if (rgn_decode_region(&rec, &region))
+			goto bad;
+		if (!update->old_count)
+			update->head = start;
+		if (update->old_count == update->old_alloc) {
+			update->old_alloc = update->old_alloc ?
+					2 * update->old_alloc : REGION_ALLOC_NUM;
+			update->old = xrealloc(update->old, update->old_alloc *
+						sizeof(struct old_region));
+		}
+		old = &update->old[update->old_count++];
+		old->id = region.id;
+		old->delay = region.delay;
+		old->size = region.size;
+		old->type = rec.type;
+		old->has_crc = 0;
+		old->start = start;
+		old->end = rec.offset + rec.size;
+		old->data = region.data;
+	}
+	if (ret == 0)
+		return;
+
+bad:
+	fprintf(stderr, "%s was not written by build-region; rebuild it "
+					"without --update\n", name);
+	exit(1);
+}
+
+/*
+ * Whether the input of a region still holds the payload in the existing
+ * file.  The two are compared, unless --trust-mtime lets an input older
+ * than the file be taken to be unchanged without reading it, as make
+ * would.  Inputs restored with cp -p or tar keep an old time, so that is
+ * not the default.
+ */
+static int
+region_unchanged (const struct region *region, const struct old_region *old,
+					const struct stat *file_st)
+{
+	void *map;
+	int same;
+
+	if (old->type != REGION_REC_CHAR || old->id != region->id ||
+						old->size != region->size)
+		return 0;
+
+	if (trust_mtime &&
+	    (region->mtime.tv_sec < file_st->st_mtim.tv_sec ||
+	     (region->mtime.tv_sec == file_st->st_mtim.tv_sec &&
+	      region->mtime.tv_nsec < file_st->st_mtim.tv_nsec)))
+		return 1;
+
+	if (region->size == 0)
+		return 1;
+	map = map_region(region);
+	madvise(map, region->size, MADV_SEQUENTIAL);
+	same = !memcmp(map, old->data, region->size);
+	munmap(map, region->size);
+
+	return same;
+}
+
+/*
+ * Open the region file to update and decide what happens to each region.
+ * Regions are matched by position; those past the end of the new list
+ * are dropped.
+ */
+static void
+plan_update (const char *name, struct region *regions, int region_count,
+					int crc, struct update *update)
+{
+	struct rgn_file file;
+	struct stat st;
+	int i;
+
+	memset(update, 0, sizeof(*update));
+	update->fd = open(name, O_RDWR);
+	if (update->fd < 0 || fstat(update->fd, &st)) {
+		fprintf(stderr, "Could not open %s: %s\n", name,
+							strerror(errno));
+		exit(1);
+	}
+	if (rgn_open(&file, name)) {
+		fprintf(stderr, "Could not read %s: %s\n", name,
+							strerror(errno));
+		exit(1);
+	}
+
+	read_old_layout(&file, name, update);
+	rgn_stats_add(RGN_PHASE_PARSE, file.size);
+	if (large_records && !update->large) {
+		fprintf(stderr, "%s needs 64-bit records; rebuild it without "
+						"--update\n", name);
+		exit(1);
+	}
+	large_records = update->large;
+
+	update->action = xmalloc(region_count * sizeof(enum update_action) + 1);
+	for (i = 0; i < region_count; i++) {
+		const struct old_region *old = &update->old[i];
+
+		if (i >= update->old_count || old->has_crc != crc ||
+				!region_unchanged(&regions[i], old, &st))
+			update->action[i] = UPDATE_REWRITE;
+		else if (old->delay != regions[i].delay)
+			update->action[i] = UPDATE_HEADER;
+		else
+			update->action[i] = UPDATE_KEEP;
+	}
+
+	/* Nothing else will read the mapping, which is about to change */
+	for (i = 0; i < update->old_count; i++)
+		update->old[i].data = NULL;
+	rgn_close(&file);
+}
+
+/*
+ * Move the bytes from..end of fd by diff.  When diff is a multiple of the
+ * file system block size the extents themselves are moved with
+ * FALLOC_FL_INSERT_RANGE or FALLOC_FL_COLLAPSE_RANGE and only the partial
+ * block at from is copied.  Otherwise the tail goes through an unlinked
+ * temporary file with copy_file_range(), which a reflinking file system
+ * turns into extent sharing.  Bytes uncovered by a move are left as they
+ * are, to be overwritten by the caller.
+ */
+static void
+shift_tail (int fd, off_t from, off_t end, off_t diff)
+{
+	struct stat st;
+	off_t len = end - from, pos, tmp_pos;
+	ssize_t copied;
+	int tmp_fd;
+
+	if (len <= 0 || diff == 0)
+		return;
+
+	if (fstat(fd, &st) == 0 && st.st_blksize > 0 &&
+				(diff < 0 ? -diff : diff) % st.st_blksize == 0) {
+		off_t bs = st.st_blksize, at, keep_len;
+		char *keep;
+		int ok;
+
+		/*
+		 * Extents move at a block boundary; the bytes between from and
+		 * that boundary are saved and written back by hand.
+		 */
+		if (diff > 0)
+			at = (from + bs - 1) / bs * bs;
+		else
+			at = (from + diff + bs - 1) / bs * bs;
+		keep_len = diff > 0 ? at - from : at - diff - from;
+		if (keep_len < 0)
+			keep_len = 0;
+		if (keep_len > len)
+			keep_len = len;
+
+		keep = xmalloc(keep_len + 1);
+		if (pread(fd, keep, keep_len, from) != keep_len) {
+			fprintf(stderr, "Error reading output file: %s\n",
+							strerror(errno));
+			exit(1);
+		}
+		if (diff > 0)
+			ok = at < end && !fallocate(fd, FALLOC_FL_INSERT_RANGE,
+								at, diff);
+		else
+			ok = at - diff < end && !fallocate(fd,
+					FALLOC_FL_COLLAPSE_RANGE, at, -diff);
+		if (ok)
+			pwriteall(fd, keep, keep_len, from + diff);
+		free(keep);
+		if (ok)
+			return;
+	}
+
+	tmp_fd = open_temp(temp_dir());
+	pos = from;
+	tmp_pos = 0;
+	copied = rgn_copy(fd, &pos, tmp_fd, &tmp_pos, len);
+	if (copied == len) {
+		pos = from + diff;
+		tmp_pos = 0;
+		copied = rgn_copy(tmp_fd, &tmp_pos, fd, &pos, len);
+	}
+	if (copied != len) {
+		fprintf(stderr, "Error moving regions in output file: %s\n",
+				copied < 0 ? strerror(errno) : "short copy");
+		exit(1);
+	}
+	close(tmp_fd);
+}
+
+/*
+ * Write the region records of an updated file.  The records before the
+ * first region have already been moved to fit the new head, so old
+ * region i now starts at its old offset plus shift.  When a region
+ * changes size only the records after it move; regions past the end of
+ * the old file are simply written there.
+ */
+static void
+update_regions (struct update *update, struct region *regions,
+				int region_count, off_t out_end, int crc)
+{
+	off_t shift = update->shift, zero = 0;
+	int i;
+
+	for (i = 0; i < region_count; i++) {
+		struct region *region = &regions[i];
+		off_t start, old_size, new_size;
+
+		if (i < update->old_count) {
+			start = update->old[i].start + shift;
+			old_size = update->old[i].end - update->old[i].start;
+			new_size = group_size(region, crc);
+			if (new_size != old_size) {
+				shift_tail(update->fd, start + old_size,
+					update->end, new_size - old_size);
+				update->end += new_size - old_size;
+				shift += new_size - old_size;
+			}
+		}
+
+		switch (update->action[i]) {
+		case UPDATE_KEEP:
+			break;
+		case UPDATE_HEADER: {
+			BYTE hdr[RGN_HEADERS_MAX];
+			size_t len;
+
+			len = rgn_encode_region_header(hdr, large_records,
+					region->id, region->delay, region->size);
+			pwriteall(update->fd, hdr, len, region->offset - len);
+			break;
+		}
+		case UPDATE_REWRITE:
+			write_region(update->fd, region, &zero, crc);
+			break;
+		}
+	}
+
+	if (ftruncate(update->fd, out_end)) {
+		fprintf(stderr, "Could not size output file: %s\n",
+							strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+ * Make room for the new head of the file (version records and TOC), so
+ * that it can be written over the old one.  Regions dropped from the end
+ * are cut off first so they are not moved.
+ */
+static void
+prepare_update (struct update *update, int region_count, off_t head)
+{
+	if (update->old_count > region_count) {
+		update->end = region_count ? update->old[region_count].start :
+								update->head;
+		update->old_count = region_count;
+		if (ftruncate(update->fd, update->end)) {
+			fprintf(stderr, "Could not size output file: %s\n",
+							strerror(errno));
+			exit(1);
+		}
+	}
+
+	update->shift = head - update->head;
+	if (update->shift && update->old_count) {
+		shift_tail(update->fd, update->head, update->end,
+							update->shift);
+		update->end += update->shift;
+	}
+	if (lseek(update->fd, 0, SEEK_SET) < 0) {
+		fprintf(stderr, "Could not seek output file: %s\n",
+							strerror(errno));
+		exit(1);
+	}
+}
+
+/* The regions to build, in one array */
+struct region_table {
+	struct region *regions;
+	int count;
+	int alloc;
+};
+
+/*
+ * Regions are given on the command line or in a manifest as triplets in
+ * the form:
  *     input_file,region_id,delay_ms
- * This function parses this string and stores the data in the struct region
- * array pointed to by regions.
+ * This function parses this string and adds the region to table.  The ID
+ * and delay are taken from the end, so the file name may hold commas; it
+ * is cut off in place and used where it is, so triplet must outlive the
+ * table.
  */
 static void
-parse_region_triplet(	const char *triplet,
-			struct region ***regions,
-			int *region_count)
+parse_region_triplet(	char *triplet,
+			struct region_table *table)
 {
 	struct region *region;
-	const char *pos;
-	char *tmp;
+	char *delay, *id = NULL, *end;
 	char error[ERROR_SIZE];
 
-	/* Expand list if necessary */
-	if (*region_count % REGION_ALLOC_NUM == 0) {
-                size_t new_size = (*region_count + REGION_ALLOC_NUM) *
-                                                sizeof(struct region *);
-		*regions = xrealloc(*regions, new_size);
+	delay = strrchr(triplet, ',');
+	if (delay) {
+		*delay = 0;
+		id = strrchr(triplet, ',');
+		*delay++ = ',';
+	}
+	if (!delay || !id || id == triplet) {
+		snprintf(error, ERROR_SIZE, "Invalid region specification: %s",
+				triplet);
+		argument_error(error);
 	}
 
-	/* Get space for new region */
-	region = xmalloc( sizeof(struct region) );
-
-	/* Read file name */
-	pos = triplet;
-	while (*pos != ',') {
-		if (*pos == 0) {
-			snprintf(error, ERROR_SIZE, "Invalid region "
-					"specification: %s", triplet);
-			argument_error(error);
-		}
-		pos++;
+	/* Expand the table if necessary */
+	if (table->count == table->alloc) {
+		table->alloc = table->alloc ? 2 * table->alloc :
+							REGION_ALLOC_NUM;
+		table->regions = xrealloc(table->regions,
+				table->alloc * sizeof(struct region));
 	}
-	region->file = xmalloc(pos - triplet + 1);
-	memcpy(region->file, triplet, pos - triplet);
-        region->file[pos - triplet] = 0;
-	pos++;
+	region = &table->regions[table->count];
+	memset(region, 0, sizeof(*region));
+	region->type = REGION_REC_CHAR;
+	region->payload_fd = -1;
 
 	/* Read region id */
-	region->id = strtol(pos, &tmp, 10);
-	pos = tmp;
-	if (*pos != ',') {
+	region->id = strtol(id + 1, &end, 10);
+	if (end != delay - 1) {
 		snprintf(error, ERROR_SIZE, "Invalid region specification: %s",
 				triplet);
 		argument_error(error);
 	}
-	pos++;
-	
+
 	/* Read delay */
-	region->delay = strtol(pos, NULL, 10);
+	region->delay = strtol(delay, NULL, 10);
+
+	/* Read file name */
+	*id = 0;
+	region->file = triplet;
 
-	/* Add region */
-	(*regions)[*region_count] = region;
-	*region_count += 1;
-}	
+	table->count++;
+}
+
+/*
+ * Read a manifest of regions, one triplet per line, from the named file
+ * or from stdin for "-".  The whole manifest is kept in memory; the file
+ * names point into it.
+ */
+static char *
+read_manifest (const char *name, struct region_table *table)
+{
+	size_t size = 0, alloc = 0;
+	char *buf = NULL, *line, *next;
+	ssize_t bytes_read;
+	int fd;
+
+	if (!strcmp(name, "-"))
+		fd = STDIN_FILENO;
+	else
+		fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open manifest %s: %s\n", name,
+							strerror(errno));
+		exit(1);
+	}
+
+	do {
+		if (alloc - size < MANIFEST_READ_SIZE) {
+			alloc = alloc ? 2 * alloc : 2 * MANIFEST_READ_SIZE;
+			buf = xrealloc(buf, alloc + 1);
+		}
+		bytes_read = read(fd, buf + size, alloc - size);
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Error reading manifest %s: %s\n",
+						name, strerror(errno));
+			exit(1);
+		}
+		size += bytes_read;
+	} while (bytes_read);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	buf[size] = 0;
+
+	for (line = buf; line < buf + size; line = next) {
+		char *end;
+
+		end = memchr(line, '\n', buf + size - line);
+		if (!end)
+			end = buf + size;
+		next = end + 1;
+		*end = 0;
+		if (end > line && end[-1] == '\r')
+			*--end = 0;
+
+		while (*line == ' ' || *line == '\t')
+			line++;
+		if (*line == 0 || *line == '#')
+			continue;
+		parse_region_triplet(line, table);
+	}
+
+	return buf;
+}
 
 /*
  * Parse command line arguments and create output file.
  */
 int main(int argc, char **argv)
 {
-	struct region **regions = NULL;
-	int region_count = 0;
+	struct region_table table = { NULL, 0, 0 };
+	struct region *regions;
+	int region_count;
+	char **manifests = NULL;
+	int manifest_count = 0;
 	const char *out_file_name = NULL;
+	const char *delta_from = NULL;
+	const char *update_file = NULL;
+	struct update update;
 	char buf[RECORD_BUFFER_SIZE];
 	int i, out_fd, buf_size;
+	int toc = 0;
+	int crc = 0;
+	int compress = 0;
+	int sparse = 0;
+	int jobs = 1;
+	enum rgn_stats_format stats = RGN_STATS_OFF;
+	off_t out_pos, out_end;
 
 	for (i = 1; i < argc; i++) {
 		if (argv[i][0] == '-') {
@@ -251,6 +1477,66 @@ int main(int argc, char **argv)
 			case '-':
 				if (!strcmp(argv[i]+2, "help"))
 					usage_and_quit();
+				if (!strcmp(argv[i]+2, "toc")) {
+					toc = 1;
+					break;
+				}
+				if (!strcmp(argv[i]+2, "crc")) {
+					crc = 1;
+					break;
+				}
+				if (!strcmp(argv[i]+2, "update")) {
+					i++;
+					if (i >= argc)
+						argument_error("Missing region "
+							"file for --update");
+					update_file = argv[i];
+					break;
+				}
+				if (!strcmp(argv[i]+2, "trust-mtime")) {
+					trust_mtime = 1;
+					break;
+				}
+				if (!strcmp(argv[i]+2, "manifest")) {
+					i++;
+					if (i >= argc)
+						argument_error("Missing file "
+							"for --manifest");
+					manifests = xrealloc(manifests,
+						(manifest_count + 1) *
+						sizeof(char *));
+					manifests[manifest_count++] =
+						read_manifest(argv[i], &table);
+					break;
+				}
+				if (!strcmp(argv[i]+2, "sparse")) {
+					sparse = 1;
+					break;
+				}
+				if (!strcmp(argv[i]+2, "large")) {
+					large_records = 1;
+					break;
+				}
+				if (!strncmp(argv[i]+2, "stats", 5) &&
+				    (!argv[i][7] || argv[i][7] == '=')) {
+					if (rgn_stats_parse(argv[i][7] ?
+						argv[i] + 8 : NULL, &stats))
+						argument_error("Unknown "
+							"--stats format");
+					break;
+				}
+				if (!strcmp(argv[i]+2, "compress")) {
+					compress = 1;
+					break;
+				}
+				if (!strcmp(argv[i]+2, "delta-from")) {
+					i++;
+					if (i >= argc)
+						argument_error("Missing region "
+							"file for --delta-from");
+					delta_from = argv[i];
+					break;
+				}
 				snprintf(error, ERROR_SIZE, "Unrecognized "
 						"option: %s", argv[i]+2);
 				argument_error(error);
@@ -262,6 +1548,35 @@ int main(int argc, char **argv)
 			case 'h':
 				usage_and_quit();
 				break;
+			case 'm':
+				i++;
+				if (i >= argc)
+					argument_error("Missing file for -m");
+				manifests = xrealloc(manifests,
+					(manifest_count + 1) * sizeof(char *));
+				manifests[manifest_count++] =
+					read_manifest(argv[i], &table);
+				break;
+			case 't':
+				toc = 1;
+				break;
+			case 'c':
+				crc = 1;
+				break;
+			case 's':
+				sparse = 1;
+				break;
+			case 'L':
+				large_records = 1;
+				break;
+			case 'z':
+				compress = 1;
+				break;
+			case 'j':
+				i++;
+				if (i >= argc || (jobs = atoi(argv[i])) < 1)
+					argument_error("Invalid number of jobs");
+				break;
 			default:
 				snprintf(error, ERROR_SIZE, "Unrecognized "
 						"option: %c", argv[i][1]);
@@ -271,11 +1586,25 @@ int main(int argc, char **argv)
 		}
 		else {
 			/* All non-switch options are region file triplets */
-			parse_region_triplet(argv[i], &regions, &region_count);
+			parse_region_triplet(argv[i], &table);
 		}
 	}
+	regions = table.regions;
+	region_count = table.count;
+
+	rgn_stats_start("build-region", stats);
+	rgn_trace_start("build-region");
 
-	if (out_file_name) {
+	if (update_file && (out_file_name || delta_from || compress || sparse))
+		argument_error("--update cannot be combined with -o, "
+				"--delta-from, --sparse or --compress");
+	if (trust_mtime && !update_file)
+		argument_error("--trust-mtime only applies to --update");
+
+	if (update_file) {
+		out_fd = -1;
+	}
+	else if (out_file_name) {
 		out_fd = open(out_file_name, O_WRONLY | O_CREAT | O_TRUNC, 
 				S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
 		if (out_fd < 0) {
@@ -288,89 +1617,107 @@ int main(int argc, char **argv)
 		out_fd = STDOUT_FILENO;
 	}
 
-	/* Write file header */
-	write_header(out_fd, FILE_ID, LOW_LEVEL_VERSION);
-
-	/* Write data version record */
-	buf[0] = DATA_VERSION;
-	buf[1] = 0;
-	buf_size = 2;
-	write_record(out_fd, buf_size, DATA_VERSION_REC_CHAR, buf, buf_size);
+	/* Get the size of every region so the layout is known up front */
+	rgn_stats_enter(RGN_PHASE_PARSE);
+	stat_regions(regions, region_count);
+	for (i = 0; i < region_count; i++)
+		if (regions[i].size > UINT_MAX - sizeof(struct region_header))
+			large_records = 1;
+	rgn_stats_leave();
+	if (delta_from)
+		encode_deltas(delta_from, regions, region_count, jobs);
+	if (sparse)
+		sparse_regions(regions, region_count);
+	if (compress)
+		compress_regions(regions, region_count, jobs);
 
-	/* Write application version record */
+	/* Application version record */
 	buf[0] = APP_VERSION;
 	buf[1] = 0;
 	buf_size = 2;
 	ADD_STRING(buf, BUILD_UID, RECORD_BUFFER_SIZE, buf_size);
 	ADD_STRING(buf, BUILD_DATE, RECORD_BUFFER_SIZE, buf_size);
 	ADD_STRING(buf, BUILD_TIME, RECORD_BUFFER_SIZE, buf_size);
-	write_record(out_fd, buf_size, APP_VERSION_REC_CHAR, buf, buf_size);
 
-	/* Write a region record for each region.
-	 * The body of the record contains the region header and the region.
-	 */
-	for (i = 0; i < region_count; i++) {
-		int in_fd;
-		int rgn_size;
-#ifdef __USE_LARGEFILE64
-		struct stat64 stat_buf;
-#else
-		struct stat stat_buf;
-#endif
-		struct region_header region_header;
-		unsigned char file_buf[FILE_BUF_SIZE];
-		size_t bytes_read;
-
-		/* Get file size */
-#ifdef __USE_LARGEFILE64
-		if (stat64(regions[i]->file, &stat_buf)) {
-#else
-		if (stat(regions[i]->file, &stat_buf)) {
-#endif
-			fprintf(stderr, "Could not stat region file %s: %s\n",
-							regions[i]->file,
-							strerror(errno));
-			exit(1);
-		}
-		regions[i]->size = stat_buf.st_size;
+	/* An update keeps the record width of the file it updates */
+	if (update_file) {
+		rgn_stats_enter(RGN_PHASE_PARSE);
+		plan_update(update_file, regions, region_count, crc, &update);
+		rgn_stats_leave();
+	}
 
-		in_fd = open(regions[i]->file, O_RDONLY);
-		if (in_fd < 0) {
-			fprintf(stderr, "Could not open region file %s: %s\n",
-							regions[i]->file,
-							strerror(errno));
-			exit(1);
-		}
+	out_pos = sizeof(struct vir) +
+			2 * rgn_record_header_size(large_records) + 2 + buf_size;
+	if (toc)
+		out_pos += rgn_record_header_size(large_records) +
+							toc_size(region_count);
+	out_end = compute_layout(regions, region_count, out_pos, crc);
 
-		region_header.id = regions[i]->id;
-		region_header.delay = regions[i]->delay;
-		region_header.size = regions[i]->size;
-		memcpy(buf, &region_header, sizeof(region_header));
+	/* An update makes room for the new head and writes it over the old */
+	if (update_file) {
+		rgn_stats_enter(RGN_PHASE_COPY);
+		prepare_update(&update, region_count, out_pos);
+		rgn_stats_leave();
+		out_fd = update.fd;
+	}
 
-		rgn_size = sizeof(region_header) + regions[i]->size;
+	/* Write file header */
+	rgn_stats_enter(RGN_PHASE_OUTPUT);
+	write_header(out_fd, FILE_ID, large_records ? RGN_VERSION_LARGE :
+							LOW_LEVEL_VERSION);
 
-		/* Write record header and region header */
-		write_record(out_fd, rgn_size, REGION_REC_CHAR, buf,
-							sizeof(region_header));
+	/* Write data version record */
+	{
+		char dvr[2] = { DATA_VERSION, 0 };
 
-		do {
-			bytes_read = read(in_fd, file_buf, FILE_BUF_SIZE);
-			if (bytes_read < 0) {
-				fprintf(stderr, "File read error in %s: %s\n",
-						regions[i]->file,
-						strerror(errno));
-				exit(1);
-			}
-			writeall(out_fd, file_buf, bytes_read);
-		} while (bytes_read);
+		write_record(out_fd, sizeof(dvr), DATA_VERSION_REC_CHAR, dvr,
+								sizeof(dvr));
+	}
+
+	/* Write application version record */
+	write_record(out_fd, buf_size, APP_VERSION_REC_CHAR, buf, buf_size);
+
+	/* Write the table of contents */
+	if (toc)
+		write_toc(out_fd, regions, region_count);
+	rgn_stats_add(RGN_PHASE_OUTPUT, out_pos);
+	rgn_stats_leave();
 
-		close(in_fd);
+	/* Write a region record for each region.
+	 * The body of the record contains the region header and the region.
+	 */
+	if (update_file) {
+		rgn_stats_enter(RGN_PHASE_COPY);
+		update_regions(&update, regions, region_count, out_end, crc);
+		rgn_stats_leave();
+		free(update.old);
+		free(update.action);
 	}
+	else if (jobs < 2 || !write_regions_parallel(out_fd, regions,
+				region_count, out_pos, out_end, jobs, crc)) {
+		struct stat st;
+		off_t base = lseek(out_fd, 0, SEEK_CUR) - out_pos;
+
+		/*
+		 * Reserve the whole file up front, so that many small regions
+		 * do not grow it a little at a time.  Not every file system
+		 * can; the writes then grow it as they go.
+		 */
+		if (base >= 0 && fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode))
+			fallocate(out_fd, 0, base, out_end);
+
+		for (i = 0; i < region_count; i++)
+			write_region(out_fd, &regions[i], NULL, crc);
+	}
+	rgn_stats_enter(RGN_PHASE_OUTPUT);
 	close(out_fd);
+	rgn_stats_leave();
 
-	for (i = 0; i < region_count; i++)
-		free(regions[i]);
+	close_payload_temps();
 	free(regions);
+	for (i = 0; i < manifest_count; i++)
+		free(manifests[i]);
+	free(manifests);
 
 	return 0;
 }
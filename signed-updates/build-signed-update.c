@@ -0,0 +1,696 @@
+/*
+ * build-signed-update.c
+ *
+ * Create a PGP signed virtual region: a virtual region header followed by
+ * the update split into chunks, each chunk followed by its detached
+ * signature padded out to SIGSIZE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "rgn.h"
+#include "signer.h"
+
+/* Space reserved for each chunk's signature */
+#define SIGSIZE			512
+
+#define DEFAULT_CHUNK_SIZE	524288
+
+/* Chunks in flight per signing thread */
+#define SLOTS_PER_JOB		2
+
+struct options {
+	const char *input_file;
+	const char *output_file;
+	const char *signer;
+	struct signer_config cfg;
+	UINT chunk_size;
+	UINT offset;
+	UINT target;
+	int version;
+	int jobs;
+	enum rgn_io_backend io;
+	enum rgn_stats_format stats;
+};
+
+enum slot_state {
+	SLOT_FREE,
+	SLOT_READ,		/* Filled by the reader, waiting for a signer */
+	SLOT_SIGNING,
+	SLOT_SIGNED,		/* Waiting for the writer */
+};
+
+/* One chunk on its way through the signing pipeline */
+struct slot {
+	enum slot_state state;
+	BYTE *data;
+	size_t len;
+	BYTE sig[SIGNER_MAX_SIG];
+};
+
+/*
+ * Chunk i lives in slots[i % nslots].  The reader fills slots in order,
+ * signing threads take them in order but finish in any order, and the
+ * writer empties them in order again, so the output is the same as
+ * signing sequentially.
+ */
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct slot *slots;
+	int nslots;
+	struct rgn_reader *in;
+	int out_fd;
+	size_t chunk_size;
+	struct signer *signer;
+	UINT created;
+	unsigned long long read;	/* Chunks handed to the signers */
+	unsigned long long signing;	/* Next chunk to sign */
+	int read_done;
+};
+
+static void
+usage (const char *name)
+{
+	printf ("Usage: %s [OPTIONS]\n", name);
+	printf ("\n");
+	printf ("        -i <input_file>\n");
+	printf ("                File containing the update to be signed.  (Required)\n");
+	printf ("        -o <output_file>\n");
+	printf ("                File to which to write the signed update data.  (Required)\n");
+	printf ("        -u <gpg_id>\n");
+	printf ("                Name of GPG key to use for signing.\n");
+	printf ("        -k, --key <key_file>\n");
+	printf ("                Sign in-process with an RSA key exported by\n");
+	printf ("                gpg --export-secret-keys, instead of running gpg.\n");
+	printf ("        --pw_file <file>\n");
+	printf ("                File containing GPG password.\n");
+	printf ("        --homedir <dir>\n");
+	printf ("                GnuPG home directory.\n");
+	printf ("        --signer <pgp|gpg>\n");
+	printf ("                Signing backend.  (Default pgp with -k, gpg otherwise)\n");
+	printf ("        -c <chunk_size>\n");
+	printf ("                Size of data (in bytes) to put in each chunk for signing.\n");
+	printf ("                (Default 524288 = 512K)\n");
+	printf ("        -f <offset>\n");
+	printf ("                Offset into flash target to begin writing.\n");
+	printf ("                (Default 0)\n");
+	printf ("        -t <target>\n");
+	printf ("                Product-specific field to determine where in flash to write.\n");
+	printf ("                (Default 0)\n");
+	printf ("        -v <version>\n");
+	printf ("                Specify packet format version number.\n");
+	printf ("                (Default 1)\n");
+	printf ("        -j <jobs>\n");
+	printf ("                Number of chunks to sign in parallel.\n");
+	printf ("                (Default 1)\n");
+	printf ("        --io <buffered|mmap|direct|uring>\n");
+	printf ("                How to read the input.  (Default $RGN_IO or mmap)\n");
+	printf ("        --stats[=<text|json>]\n");
+	printf ("                Print the bytes, time, system calls and peak RSS of\n");
+	printf ("                each phase to stderr.\n");
+	printf ("\n");
+	printf ("The signature time is taken from SOURCE_DATE_EPOCH when it is set.\n");
+	exit (0);
+}
+
+static void
+xwrite (int fd, const void *buf, size_t count)
+{
+	while (count) {
+		ssize_t n = write (fd, buf, count);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "Error writing: %s\n", strerror (errno));
+			exit (1);
+		}
+		buf = (const BYTE *)buf + n;
+		count -= n;
+	}
+}
+
+static void
+xwritev (int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t n = writev (fd, iov, iovcnt);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "Error writing: %s\n", strerror (errno));
+			exit (1);
+		}
+		while (iovcnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (BYTE *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Fill buf with up to count bytes.  Returns less than count only at the
+ * end of the input.
+ */
+static size_t
+xread (struct rgn_reader *in, void *buf, size_t count)
+{
+	ULONGLONG span;
+	ssize_t n;
+
+	rgn_stats_enter (RGN_PHASE_COPY);
+	span = rgn_trace_begin ();
+	n = rgn_reader_read (in, buf, count);
+	if (n < 0) {
+		fprintf (stderr, "Error reading: %s\n", strerror (errno));
+		exit (1);
+	}
+	rgn_trace_end ("read", span, n);
+	rgn_stats_add (RGN_PHASE_COPY, n);
+	rgn_stats_leave ();
+
+	return n;
+}
+
+static UINT
+parse_number (const char *arg, const char *what)
+{
+	unsigned long val;
+	char *end;
+
+	errno = 0;
+	val = strtoul (arg, &end, 0);
+	if (errno || end == arg || *end || val > 0xffffffffUL) {
+		fprintf (stderr, "Invalid %s: %s\n", what, arg);
+		exit (1);
+	}
+
+	return val;
+}
+
+static void
+parse_args (int argc, char **argv, struct options *opts)
+{
+	enum {
+		OPT_PW_FILE = 256,
+		OPT_HOMEDIR,
+		OPT_SIGNER,
+		OPT_IO,
+		OPT_STATS,
+	};
+	static const struct option available_options[] = {
+		{ "key",	required_argument,	NULL, 'k' },
+		{ "pw_file",	required_argument,	NULL, OPT_PW_FILE },
+		{ "homedir",	required_argument,	NULL, OPT_HOMEDIR },
+		{ "signer",	required_argument,	NULL, OPT_SIGNER },
+		{ "io",		required_argument,	NULL, OPT_IO },
+		{ "stats",	optional_argument,	NULL, OPT_STATS },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+
+	memset (opts, 0, sizeof(*opts));
+	opts->chunk_size = DEFAULT_CHUNK_SIZE;
+	opts->version = 1;
+	opts->jobs = 1;
+	opts->io = rgn_io_get_default ();
+
+	while ((opt = getopt_long (argc, argv, "hi:o:u:k:c:f:t:v:j:",
+				   available_options, NULL)) != -1) {
+		switch (opt) {
+		case 'i':
+			opts->input_file = optarg;
+			break;
+		case 'o':
+			opts->output_file = optarg;
+			break;
+		case 'u':
+			opts->cfg.user_id = optarg;
+			break;
+		case 'k':
+			opts->cfg.key_file = optarg;
+			break;
+		case OPT_PW_FILE:
+			opts->cfg.passphrase_file = optarg;
+			break;
+		case OPT_HOMEDIR:
+			opts->cfg.homedir = optarg;
+			break;
+		case OPT_SIGNER:
+			opts->signer = optarg;
+			break;
+		case OPT_IO:
+			if (rgn_io_parse (optarg, &opts->io)) {
+				fprintf (stderr, "Unknown I/O backend: %s\n",
+					 optarg);
+				exit (1);
+			}
+			break;
+		case OPT_STATS:
+			if (rgn_stats_parse (optarg, &opts->stats)) {
+				fprintf (stderr, "Unknown statistics format: "
+					 "%s\n", optarg);
+				exit (1);
+			}
+			break;
+		case 'c':
+			opts->chunk_size = parse_number (optarg, "chunk size");
+			break;
+		case 'f':
+			opts->offset = parse_number (optarg, "offset");
+			break;
+		case 't':
+			opts->target = parse_number (optarg, "target");
+			break;
+		case 'v':
+			opts->version = parse_number (optarg, "version");
+			if (opts->version != 1 && opts->version != 2) {
+				fprintf (stderr, "No such version: %s\n", optarg);
+				exit (1);
+			}
+			break;
+		case 'j':
+			opts->jobs = parse_number (optarg, "number of jobs");
+			if (opts->jobs < 1) {
+				fprintf (stderr, "Invalid number of jobs: %s\n",
+					 optarg);
+				exit (1);
+			}
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	if (optind < argc)
+		usage (argv[0]);
+
+	if (!opts->signer)
+		opts->signer = opts->cfg.key_file ? "pgp" : "gpg";
+
+	if (!opts->input_file) {
+		fprintf (stderr, "Please specify an input file.  (-h for help)\n");
+		exit (1);
+	}
+	if (!opts->output_file) {
+		fprintf (stderr, "Please specify an output file.  (-h for help)\n");
+		exit (1);
+	}
+	if (opts->chunk_size == 0) {
+		fprintf (stderr, "Chunk size must not be 0\n");
+		exit (1);
+	}
+}
+
+/*
+ * The v1 header has no length or target field; v2 is struct vr_header_v2.
+ */
+static void
+write_vr_header (int fd, const struct options *opts)
+{
+	struct vr_header_v2 hdr;
+	UINT v1[4];
+
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	if (opts->version == 1) {
+		v1[0] = PGP_SIGNED_VIRT_RGN;
+		v1[1] = opts->offset;
+		v1[2] = opts->chunk_size;
+		v1[3] = SIGSIZE;
+		xwrite (fd, v1, sizeof(v1));
+		rgn_stats_add (RGN_PHASE_OUTPUT, sizeof(v1));
+	}
+	else {
+		hdr.virtual_region = PGP_SIGNED_VIRT_RGN;
+		hdr.header_len = sizeof(hdr);
+		hdr.target = opts->target;
+		hdr.offset = opts->offset;
+		hdr.chunk_size = opts->chunk_size;
+		hdr.sig_size = SIGSIZE;
+		xwrite (fd, &hdr, sizeof(hdr));
+		rgn_stats_add (RGN_PHASE_OUTPUT, sizeof(hdr));
+	}
+	rgn_stats_leave ();
+}
+
+/*
+ * Sign one chunk into sig and pad the signature out to SIGSIZE.
+ */
+static void
+sign_chunk (struct signer *signer, const BYTE *data, size_t len, UINT created,
+	    BYTE *sig)
+{
+	size_t sig_len = SIGNER_MAX_SIG;
+	ULONGLONG span;
+
+	rgn_stats_enter (RGN_PHASE_SIGN);
+	span = rgn_trace_begin ();
+	if (signer_sign (signer, data, len, created, sig, &sig_len)) {
+		fprintf (stderr, "\nCould not sign chunk\n");
+		exit (1);
+	}
+	if (sig_len > SIGSIZE) {
+		fprintf (stderr, "\nERROR!  Sig larger than max size!\n");
+		exit (1);
+	}
+	memset (sig + sig_len, 0, SIGSIZE - sig_len);
+	rgn_trace_end ("sign", span, len);
+	rgn_stats_add (RGN_PHASE_SIGN, len);
+	rgn_stats_leave ();
+}
+
+/*
+ * Append a chunk and its padded signature to the output.
+ */
+static void
+write_chunk (int fd, BYTE *data, size_t len, BYTE *sig)
+{
+	struct iovec iov[2];
+	ULONGLONG span;
+
+	iov[0].iov_base = data;
+	iov[0].iov_len = len;
+	iov[1].iov_base = sig;
+	iov[1].iov_len = SIGSIZE;
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	span = rgn_trace_begin ();
+	xwritev (fd, iov, 2);
+	rgn_trace_end ("write", span, len);
+	rgn_stats_add (RGN_PHASE_OUTPUT, len + SIGSIZE);
+	rgn_stats_leave ();
+}
+
+/*
+ * chunks is 0 for an input whose size is not known up front.
+ */
+static void
+progress (unsigned long long i, unsigned long long chunks)
+{
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	if (chunks)
+		printf ("%llu / %llu\r", i + 1, chunks);
+	else
+		printf ("%llu\r", i + 1);
+	fflush (stdout);
+	rgn_stats_leave ();
+}
+
+/*
+ * Returns the number of chunks signed.
+ */
+static unsigned long long
+sign_sequential (struct rgn_reader *in, int out_fd, const struct options *opts,
+		 struct signer *signer, UINT created, unsigned long long chunks)
+{
+	unsigned long long i;
+	BYTE *data, *sig;
+
+	data = malloc (opts->chunk_size);
+	sig = malloc (SIGNER_MAX_SIG);
+	if (!data || !sig) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	/* Until the end of the input, which need not be a regular file */
+	for (i = 0; ; i++) {
+		size_t len = xread (in, data, opts->chunk_size);
+
+		if (len == 0)
+			break;
+		progress (i, chunks);
+		sign_chunk (signer, data, len, created, sig);
+		write_chunk (out_fd, data, len, sig);
+	}
+
+	free (data);
+	free (sig);
+	return i;
+}
+
+static void *
+reader_thread (void *arg)
+{
+	struct pipeline *p = arg;
+	unsigned long long i;
+
+	rgn_trace_thread_name ("reader");
+	for (i = 0; ; i++) {
+		struct slot *slot = &p->slots[i % p->nslots];
+		ULONGLONG span = rgn_trace_begin ();
+		size_t len;
+
+		/* Stalled on the writer: every slot is still in use */
+		pthread_mutex_lock (&p->lock);
+		while (slot->state != SLOT_FREE)
+			pthread_cond_wait (&p->cond, &p->lock);
+		pthread_mutex_unlock (&p->lock);
+		rgn_trace_end ("wait_slot", span, i);
+
+		len = xread (p->in, slot->data, p->chunk_size);
+		if (len == 0)
+			break;
+
+		pthread_mutex_lock (&p->lock);
+		slot->len = len;
+		slot->state = SLOT_READ;
+		p->read = i + 1;
+		rgn_trace_counter ("queued", p->read - p->signing);
+		pthread_cond_broadcast (&p->cond);
+		pthread_mutex_unlock (&p->lock);
+	}
+
+	pthread_mutex_lock (&p->lock);
+	p->read_done = 1;
+	pthread_cond_broadcast (&p->cond);
+	pthread_mutex_unlock (&p->lock);
+
+	return NULL;
+}
+
+static void *
+signer_thread (void *arg)
+{
+	struct pipeline *p = arg;
+
+	rgn_trace_thread_name ("signer");
+	pthread_mutex_lock (&p->lock);
+	for (;;) {
+		ULONGLONG span = rgn_trace_begin ();
+		struct slot *slot;
+
+		/* Stalled on the reader: nothing read is left to sign */
+		while (p->signing == p->read && !p->read_done)
+			pthread_cond_wait (&p->cond, &p->lock);
+		rgn_trace_end ("wait_chunk", span, p->signing);
+		if (p->signing == p->read)
+			break;
+
+		slot = &p->slots[p->signing++ % p->nslots];
+		slot->state = SLOT_SIGNING;
+		rgn_trace_counter ("queued", p->read - p->signing);
+		pthread_mutex_unlock (&p->lock);
+
+		sign_chunk (p->signer, slot->data, slot->len, p->created,
+			    slot->sig);
+
+		pthread_mutex_lock (&p->lock);
+		slot->state = SLOT_SIGNED;
+		pthread_cond_broadcast (&p->cond);
+	}
+	pthread_mutex_unlock (&p->lock);
+
+	return NULL;
+}
+
+/*
+ * Sign with a reader, opts->jobs signing threads and this thread writing
+ * the chunks back out in order.  Returns the number of chunks signed.
+ */
+static unsigned long long
+sign_parallel (struct rgn_reader *in, int out_fd, const struct options *opts,
+	       struct signer *signer, UINT created, unsigned long long chunks)
+{
+	struct pipeline p;
+	pthread_t reader, *signers;
+	unsigned long long i, written;
+	int jobs = opts->jobs;
+	int err;
+
+	memset (&p, 0, sizeof(p));
+	pthread_mutex_init (&p.lock, NULL);
+	pthread_cond_init (&p.cond, NULL);
+	p.in = in;
+	p.out_fd = out_fd;
+	p.chunk_size = opts->chunk_size;
+	p.signer = signer;
+	p.created = created;
+
+	if (chunks && (unsigned long long)jobs > chunks)
+		jobs = chunks;
+	p.nslots = jobs * SLOTS_PER_JOB;
+	p.slots = calloc (p.nslots, sizeof(*p.slots));
+	signers = calloc (jobs, sizeof(*signers));
+	if (!p.slots || !signers) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	for (i = 0; i < (unsigned long long)p.nslots; i++) {
+		p.slots[i].data = malloc (p.chunk_size);
+		if (!p.slots[i].data) {
+			fprintf (stderr, "Out of memory\n");
+			exit (1);
+		}
+	}
+
+	err = pthread_create (&reader, NULL, reader_thread, &p);
+	for (i = 0; !err && i < (unsigned long long)jobs; i++)
+		err = pthread_create (&signers[i], NULL, signer_thread, &p);
+	if (err) {
+		fprintf (stderr, "Could not start signing thread: %s\n",
+			 strerror (err));
+		exit (1);
+	}
+
+	/* Chunk i goes to out_fd at header + i * (chunk_size + SIGSIZE) */
+	for (i = 0; ; i++) {
+		struct slot *slot = &p.slots[i % p.nslots];
+		ULONGLONG span = rgn_trace_begin ();
+
+		/* Stalled on the signers: the next chunk in order is not done */
+		pthread_mutex_lock (&p.lock);
+		while (!(i < p.read && slot->state == SLOT_SIGNED) &&
+		       !(p.read_done && i == p.read))
+			pthread_cond_wait (&p.cond, &p.lock);
+		pthread_mutex_unlock (&p.lock);
+		rgn_trace_end ("wait_signed", span, i);
+		if (i == p.read)
+			break;
+
+		progress (i, chunks);
+		write_chunk (out_fd, slot->data, slot->len, slot->sig);
+
+		pthread_mutex_lock (&p.lock);
+		slot->state = SLOT_FREE;
+		pthread_cond_broadcast (&p.cond);
+		pthread_mutex_unlock (&p.lock);
+	}
+
+	written = i;
+
+	pthread_join (reader, NULL);
+	for (i = 0; i < (unsigned long long)jobs; i++)
+		pthread_join (signers[i], NULL);
+
+	for (i = 0; i < (unsigned long long)p.nslots; i++)
+		free (p.slots[i].data);
+	free (p.slots);
+	free (signers);
+	pthread_cond_destroy (&p.cond);
+	pthread_mutex_destroy (&p.lock);
+	return written;
+}
+
+static UINT
+creation_time (void)
+{
+	const char *epoch = getenv ("SOURCE_DATE_EPOCH");
+
+	if (epoch && *epoch)
+		return parse_number (epoch, "SOURCE_DATE_EPOCH");
+	return time (NULL);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct options opts;
+	struct signer signer;
+	struct stat st;
+	unsigned long long chunks;
+	UINT created;
+	struct rgn_reader *in;
+	int in_fd, out_fd;
+
+	parse_args (argc, argv, &opts);
+	rgn_stats_start ("build-signed-update", opts.stats);
+	rgn_trace_start ("build-signed-update");
+
+	in_fd = open (opts.input_file, O_RDONLY);
+	if (in_fd < 0 || fstat (in_fd, &st)) {
+		fprintf (stderr, "Could not read \"%s\"\n", opts.input_file);
+		exit (1);
+	}
+	/* Only for progress; a pipe is read until it ends */
+	chunks = 0;
+	if (S_ISREG (st.st_mode))
+		chunks = ((unsigned long long)st.st_size + opts.chunk_size -
+			  1) / opts.chunk_size;
+
+	rgn_stats_enter (RGN_PHASE_PARSE);
+	if (signer_open (&signer, opts.signer, &opts.cfg))
+		exit (1);
+	rgn_stats_leave ();
+	created = creation_time ();
+
+	out_fd = open (opts.output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0) {
+		fprintf (stderr, "Could not open %s: %s\n", opts.output_file,
+			 strerror (errno));
+		exit (1);
+	}
+
+	in = rgn_reader_open (in_fd, opts.io);
+	if (!in) {
+		fprintf (stderr, "Could not read \"%s\": %s\n",
+			 opts.input_file, strerror (errno));
+		exit (1);
+	}
+	write_vr_header (out_fd, &opts);
+
+	printf ("Signing:\n");
+	if (opts.jobs > 1 && chunks != 1)
+		chunks = sign_parallel (in, out_fd, &opts, &signer, created,
+					chunks);
+	else
+		chunks = sign_sequential (in, out_fd, &opts, &signer, created,
+					  chunks);
+	printf ("\n");
+	if (!chunks) {
+		fprintf (stderr, "\"%s\" is empty; nothing to sign\n",
+			 opts.input_file);
+		unlink (opts.output_file);
+		exit (1);
+	}
+
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	if (close (out_fd)) {
+		fprintf (stderr, "Error writing: %s\n", strerror (errno));
+		exit (1);
+	}
+	rgn_stats_leave ();
+	rgn_reader_close (in);
+	close (in_fd);
+	signer_close (&signer);
+
+	return 0;
+}
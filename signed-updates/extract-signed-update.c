@@ -3,15 +3,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
-static struct vr_header_v2 {
-    unsigned int virtual_region;
-    unsigned int header_len;
-    unsigned int target;
-    unsigned int offset;
-    unsigned int chunk_size;
-    unsigned int sig_size;
-} header;
+#include "rgn.h"
+
+static struct vr_header_v2 header;
 
 
 static void *
@@ -28,84 +26,341 @@ xmalloc (size_t size)
 }
 
 
+/* Streamed input, read through the selected I/O backend */
+static struct rgn_reader *in;
+
+
 static void
-readall (int fd, void *buf, size_t count)
+readall (void *buf, size_t count)
 {
-    size_t bytes_read;
+    ssize_t bytes_read;
 
-    do {
-        bytes_read = read(fd, buf, count);
-        if (bytes_read < 0) {
-            fprintf(stderr, "Error reading: %s\n", strerror(errno));
-            exit(1);
-        }
-        if (bytes_read == 0) {
-            fprintf(stderr, "Unexpected EOF\n");
-            exit(1);
-        }
-        buf += bytes_read;
-        count -= bytes_read;
-    } while (count);
+    bytes_read = rgn_reader_read(in, buf, count);
+    if (bytes_read < 0) {
+        fprintf(stderr, "Error reading: %s\n", strerror(errno));
+        exit(1);
+    }
+    if ((size_t)bytes_read < count) {
+        fprintf(stderr, "Unexpected EOF\n");
+        exit(1);
+    }
 }
 
 
 static int
-readall2 (int fd, void *buf, size_t count)
+readall2 (void *buf, size_t count)
 {
-    size_t bytes_read;
-    size_t total = 0;
+    ssize_t bytes_read;
 
-    do {
-        bytes_read = read(fd, buf, count - total);
-        if (bytes_read < 0) {
-            fprintf(stderr, "Error reading: %s\n", strerror(errno));
-            exit(1);
-        }
-        if (bytes_read == 0) {
-            break;
-        }
-        buf += bytes_read;
-        total += bytes_read;
-    } while (total < count);
+    bytes_read = rgn_reader_read(in, buf, count);
+    if (bytes_read < 0) {
+        fprintf(stderr, "Error reading: %s\n", strerror(errno));
+        exit(1);
+    }
 
-    return total;
+    return bytes_read;
 }
 
 
 static void
 writeall (int fd, const void *buf, size_t count)
 {
-    size_t bytes_written;
+    if (rgn_write_full(fd, buf, count) < 0) {
+        fprintf(stderr, "Error writing: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+
+/*
+ * Chunk i's data sits at header_len + i * (chunk_size + sig_size) in the
+ * input and at i * chunk_size in the output.  Only the last chunk may be
+ * short; its signature still ends the file.
+ */
+static unsigned long long
+count_chunks (off_t size)
+{
+    off_t stride = (off_t)header.chunk_size + header.sig_size;
+    off_t body = size - header.header_len;
+
+    if (body < 0 || (body % stride && body % stride < header.sig_size)) {
+        fprintf (stderr, "File format error\n");
+        exit (1);
+    }
+    return (body + stride - 1) / stride;
+}
+
+static size_t
+chunk_length (off_t size, unsigned long long i)
+{
+    off_t pos = header.header_len +
+                i * ((off_t)header.chunk_size + header.sig_size);
+
+    if (size - pos < (off_t)header.chunk_size + header.sig_size)
+        return size - pos - header.sig_size;
+    return header.chunk_size;
+}
+
+static void
+copy_chunk (int in_fd, int out_fd, off_t size, unsigned long long i,
+            off_t *out_pos)
+{
+    off_t in_pos = header.header_len +
+                   i * ((off_t)header.chunk_size + header.sig_size);
+    size_t len = chunk_length (size, i);
+    ULONGLONG span;
+    ssize_t copied;
+
+    rgn_stats_enter(RGN_PHASE_COPY);
+    span = rgn_trace_begin();
+    copied = rgn_copy (in_fd, &in_pos, out_fd, out_pos, len);
+    if (copied < 0) {
+        fprintf(stderr, "Error copying: %s\n", strerror(errno));
+        exit(1);
+    }
+    if ((size_t)copied < len) {
+        fprintf(stderr, "Unexpected EOF\n");
+        exit(1);
+    }
+    rgn_trace_end("chunk", span, i);
+    rgn_stats_add(RGN_PHASE_COPY, len);
+    rgn_stats_leave();
+}
+
+/*
+ * Seekable input: the layout is known from the file size, so only the
+ * data ranges are copied and the signatures are skipped by offset.  The
+ * data is moved inside the kernel with copy_file_range, splice or
+ * sendfile, whichever suits the output.
+ */
+static void
+strip_seekable (int in_fd, int out_fd, off_t size)
+{
+    unsigned long long i, chunks = count_chunks (size);
+
+    for (i = 0; i < chunks; i++)
+        copy_chunk (in_fd, out_fd, size, i, NULL);
+}
+
+/* A contiguous run of chunks for one thread */
+struct strip_job {
+    pthread_t thread;
+    int in_fd;
+    int out_fd;
+    off_t size;
+    off_t out_base;
+    unsigned long long first;
+    unsigned long long last;
+};
+
+static void *
+strip_worker (void *arg)
+{
+    struct strip_job *job = arg;
+    unsigned long long i;
 
-    do {
-        bytes_written = write(fd, buf, count);
-        if (bytes_written < 0) {
-            fprintf(stderr, "Error writing: %s\n", strerror(errno));
+    rgn_trace_thread_name("strip");
+    for (i = job->first; i < job->last; i++) {
+        off_t out_pos = job->out_base + i * (off_t)header.chunk_size;
+
+        copy_chunk (job->in_fd, job->out_fd, job->size, i, &out_pos);
+    }
+
+    return NULL;
+}
+
+/*
+ * Split the chunks between jobs threads, each copying with positional
+ * reads and writes.  The output has to be a regular file; returns 0 if
+ * it is not and nothing was done.
+ */
+static int
+strip_parallel (int in_fd, int out_fd, off_t size, int jobs)
+{
+    unsigned long long chunks = count_chunks (size);
+    struct strip_job *job;
+    struct stat st;
+    off_t base, out_size;
+    int i, err;
+
+    if (fstat (out_fd, &st) || !S_ISREG (st.st_mode))
+        return 0;
+    base = lseek (out_fd, 0, SEEK_CUR);
+    if (base < 0)
+        return 0;
+
+    out_size = 0;
+    if (chunks)
+        out_size = (chunks - 1) * (off_t)header.chunk_size +
+                   chunk_length (size, chunks - 1);
+    if (ftruncate (out_fd, base + out_size)) {
+        fprintf(stderr, "Could not size output: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    if ((unsigned long long)jobs > chunks)
+        jobs = chunks ? chunks : 1;
+    job = xmalloc (jobs * sizeof (*job));
+    for (i = 0; i < jobs; i++) {
+        job[i].in_fd = in_fd;
+        job[i].out_fd = out_fd;
+        job[i].size = size;
+        job[i].out_base = base;
+        job[i].first = chunks * i / jobs;
+        job[i].last = chunks * (i + 1) / jobs;
+        err = pthread_create (&job[i].thread, NULL, strip_worker, &job[i]);
+        if (err) {
+            fprintf(stderr, "Could not start thread: %s\n", strerror(err));
             exit(1);
         }
-        buf += bytes_written;
-        count -= bytes_written;
-    } while (count);
+    }
+    for (i = 0; i < jobs; i++)
+        pthread_join (job[i].thread, NULL);
+    free (job);
+
+    lseek (out_fd, base + out_size, SEEK_SET);
+    return 1;
+}
+
+
+static void
+usage (const char *name)
+{
+    printf("Usage: %s [-j N] [--io BACKEND] < signed-update > data\n", name);
+    printf("Strip the signatures from a PGP signed virtual region.\n");
+    printf("\n");
+    printf("  -j N    Copy chunks with N threads (output must be a regular\n");
+    printf("          file; a piped input is spooled to $TMPDIR first)\n");
+    printf("  --io BACKEND\n");
+    printf("          Stream the input through buffered, mmap, direct or\n");
+    printf("          uring reads instead of copying it inside the kernel\n");
+    printf("  --stats[=FORMAT]\n");
+    printf("          Print the bytes, time, system calls and peak RSS of\n");
+    printf("          each phase to stderr, as text or json\n");
+    printf("  -h      Display this help message\n");
+    exit(0);
+}
+
+
+static void
+read_header (int fd)
+{
+    rgn_stats_enter(RGN_PHASE_PARSE);
+    if (pread (fd, &header, sizeof (header), 0) != sizeof (header)) {
+        fprintf(stderr, "Unexpected EOF\n");
+        exit(1);
+    }
+    if (header.chunk_size == 0) {
+        fprintf (stderr, "File format error\n");
+        exit (1);
+    }
+    rgn_stats_add(RGN_PHASE_PARSE, sizeof (header));
+    rgn_stats_leave();
 }
 
 
 int main (int argc, char **argv)
 {
+    struct rgn_file file;
+    struct stat st;
     void *data;
     void *sig;
+    static const struct option long_options[] = {
+        { "io", required_argument, NULL, 'I' },
+        { "stats", optional_argument, NULL, 'S' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    enum rgn_io_backend io = rgn_io_get_default();
+    enum rgn_stats_format stats = RGN_STATS_OFF;
+    unsigned long long chunk;
+    int stream = 0;
+    int jobs = 1;
+    int opt;
 
-    readall (0, &header, sizeof (header));
+    while ((opt = getopt_long(argc, argv, "hj:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'I':
+            if (rgn_io_parse(optarg, &io)) {
+                fprintf(stderr, "Unknown I/O backend: %s\n", optarg);
+                exit(1);
+            }
+            stream = 1;
+            break;
+        case 'S':
+            if (rgn_stats_parse(optarg, &stats)) {
+                fprintf(stderr, "Unknown statistics format: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    rgn_stats_start("extract-signed-update", stats);
+    rgn_trace_start("extract-signed-update");
 
-    lseek (0, header.header_len, SEEK_SET);
+    if (jobs > 1 && !stream) {
+        /* Random access needs a file; rgn_open_fd spools a pipe */
+        rgn_stats_enter(RGN_PHASE_PARSE);
+        if (rgn_open_fd (&file, 0)) {
+            fprintf(stderr, "Error reading: %s\n", strerror(errno));
+            exit(1);
+        }
+        rgn_stats_leave();
+        read_header (file.fd);
+        if (!strip_parallel (file.fd, 1, file.size, jobs))
+            strip_seekable (file.fd, 1, file.size);
+        rgn_close (&file);
+        return 0;
+    }
+
+    if (!stream && fstat (0, &st) == 0 && S_ISREG (st.st_mode)) {
+        read_header (0);
+        strip_seekable (0, 1, st.st_size);
+        return 0;
+    }
+
+    in = rgn_reader_open(0, io);
+    if (!in) {
+        fprintf(stderr, "Error reading: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    rgn_stats_enter(RGN_PHASE_PARSE);
+    readall (&header, sizeof (header));
+
+    if (header.chunk_size == 0) {
+        fprintf (stderr, "File format error\n");
+        exit (1);
+    }
+
+    /* Skip the rest of a longer header */
+    if (header.header_len > sizeof (header)) {
+        data = xmalloc (header.header_len - sizeof (header));
+        readall (data, header.header_len - sizeof (header));
+        free (data);
+    }
+    rgn_stats_add(RGN_PHASE_PARSE, header.header_len);
+    rgn_stats_leave();
 
     data = xmalloc (header.chunk_size);
     sig = xmalloc (header.sig_size);
 
-    while (1) {
+    rgn_stats_enter(RGN_PHASE_COPY);
+    for (chunk = 0; ; chunk++) {
+        ULONGLONG span = rgn_trace_begin();
         int bytes;
 
         /* Read data */
-        bytes = readall2 (0, data, header.chunk_size);
+        bytes = readall2 (data, header.chunk_size);
         if (bytes < header.chunk_size) {
             if (bytes == 0)
                 break;
@@ -114,19 +369,31 @@ int main (int argc, char **argv)
                 exit (1);
             }
             writeall (1, data, bytes - header.sig_size);
+            rgn_trace_end("chunk", span, chunk);
+            rgn_stats_add(RGN_PHASE_COPY, bytes - header.sig_size);
             break;
         }
 
         /* Read signature */
-        bytes = readall2 (0, sig, header.sig_size);
+        bytes = readall2 (sig, header.sig_size);
         if (bytes < header.sig_size) {
             writeall (1, data, header.chunk_size + bytes - header.sig_size);
+            rgn_trace_end("chunk", span, chunk);
+            rgn_stats_add(RGN_PHASE_COPY,
+                          header.chunk_size + bytes - header.sig_size);
             break;
         }
 
         /* Write data */
         writeall (1, data, header.chunk_size);
+        rgn_trace_end("chunk", span, chunk);
+        rgn_stats_add(RGN_PHASE_COPY, header.chunk_size);
     }
+    rgn_stats_leave();
+
+    rgn_reader_close(in);
+    free(data);
+    free(sig);
 
     return 0;
 }
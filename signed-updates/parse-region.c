@@ -15,13 +15,10 @@
 #include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/user.h>
+#include <sys/mman.h>
 #include <getopt.h>
 
-#define FILE_ID			0x7247704B
-#define DATA_VERSION_TYPE	'D'
-#define APP_VERSION_TYPE	'A'
-#define REGION_TYPE		'R'
+#include "rgn.h"
 
 #define _stringize(s) #s
 #define stringize(s) _stringize(s)
@@ -31,17 +28,6 @@
 		printf (fmt, ##__VA_ARGS__); \
 	} while (0)
 
-/* Types as defined by "RGNPKG Document File Specification" */
-typedef unsigned char BYTE;
-typedef signed short SHORT;
-typedef unsigned short USHORT;
-typedef signed int INT;
-typedef unsigned int UINT;
-typedef char * STRING;
-typedef BYTE * BSTRING;
-typedef unsigned char BOOL;
-typedef double DOUBLE;
-
 /* Globals */
 static int advr_count;
 static int avr_count;
@@ -49,93 +35,58 @@ static int region_count;
 static int app_record_count;
 static int first_record_is_advr;
 static int valid = 1;
+static struct rgn_file file;
 
-/* Version identification record */
-struct vir {
-	UINT file_id;
-	USHORT version;
-} __attribute__ ((__packed__));
-
-/* Data record */
-struct data_record {
-	UINT size;
-	BYTE type;
-} __attribute__ ((__packed__));
-
-/* Application data version record */
-struct advr {
-	USHORT version;
-} __attribute__ ((__packed__));
-
-/* Application version record */
-struct avr {
-	USHORT version;
-	STRING builder;
-	STRING build_date;
-	STRING build_time;
-} __attribute__ ((__packed__));
-
-/* Region record */
-struct region {
-	USHORT id;
-	UINT delay;
-	UINT size;
-} __attribute__ ((__packed__));
+/* --check state: the last region record, until its CRC record is seen */
+static struct rgn_region crc_pending;
+static int crc_pending_number;
+static int crc_checked;
+static int crc_failed;
+static int crc_missing;
 
+/* --cache: the cache and the key of the input, if it is a regular file */
+static struct rgn_cache *cache;
+static struct rgn_cache_key cache_key;
 
 struct options {
 	int human_readable:1;
 	int print:1;
-	int extract;
+	int extract_all:1;
+	int check:1;
+	int jobs;		/* Threads for decompressing regions */
+	int *extract;		/* Sorted region numbers to extract */
+	int extract_count;
+	int extract_next;	/* Next entry in extract to look for */
+	const char *output_dir;
+	const char *cache;
+	enum rgn_stats_format stats;
 } options;
 
+
 /*
- * Return memory if available or exit with error.
+ * Return reallocated memory if available or exit with error.
  */
 static void *
-xmalloc (size_t size)
+xrealloc (void *ptr, size_t size)
 {
-	void * mem;
-
-	mem = malloc(size);
-	if (!mem) {
-		fprintf(stderr, "Out of memory\n");
-		exit(1);
+	ptr = realloc (ptr, size);
+	if (!ptr) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
 	}
-	return mem;
-}
-
-/*
- * Read entire count from fd.  Exit on errors or EOF.
- */
-static void
-readall (int fd, void *buf, size_t count)
-{
-	size_t bytes_read;
-
-	do {
-		bytes_read = read(fd, buf, count);
-		if (bytes_read < 0) {
-			fprintf(stderr, "Error writing output file: %s\n",
-					strerror(errno));
-			exit(1);
-		}
-                if (bytes_read == 0) {
-			fprintf(stderr, "Unexpected EOF\n");
-			exit(1);
-                }
-		buf += bytes_read;
-		count -= bytes_read;
-	} while (count);
+	return ptr;
 }
 
 
 int
-parse_vir (int fd)
+parse_vir (const struct rgn_file *file)
 {
 	struct vir vir;
 
-	readall (fd, &vir, sizeof(vir));
+	if (rgn_read_vir (file, &vir)) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
 
 	cond_print ("Version Identification Record:\n");
 	cond_print ("  File ID: 0x%08x (\"%c%c%c%c\")\n", vir.file_id,
@@ -154,11 +105,14 @@ parse_vir (int fd)
 }
 
 void
-parse_advr (int fd, UINT size)
+parse_advr (const struct rgn_record *rec)
 {
 	struct advr advr;
 
-	readall (fd, &advr, size);
+	if (rgn_decode_advr (rec, &advr)) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
 
 	cond_print ("Application Data Version Record:\n");
 	cond_print ("  Version: %u.%02u\n", advr.version / 100, advr.version % 100);
@@ -173,45 +127,26 @@ parse_advr (int fd, UINT size)
 }
 
 void
-parse_avr (int fd, UINT size)
+parse_avr (const struct rgn_record *rec)
 {
 	struct avr avr;
-	char *buf;
-	int pos;
-
-	/* Strings are of unknown length, so memory for
-	 * this record must be dynamic */
-	buf = xmalloc (size);
-	readall (fd, buf, size);
-	pos = 0;
+	int ret;
 
-	/* Copy version value into struct */
-	avr.version = *(typeof(avr.version) *)&buf[pos];
-	pos += sizeof (avr.version);
-
-	/* Set string pointers in struct to locations in buf */
-	avr.builder = &buf[pos];
-	pos += strnlen (avr.builder, size - pos - 1) + 1;
-
-	avr.build_date = &buf[pos];
-	pos += strnlen (avr.build_date, size - pos - 1) + 1;
-
-	avr.build_time = &buf[pos];
-	pos += strnlen (avr.build_time, size - pos - 1) + 1;
-
-	if (buf[size - 1] != 0) {
-		buf[size - 1] = 0;
-		valid = 0;
+	/* Strings point straight into the mapped record */
+	ret = rgn_decode_avr (rec, &avr);
+	if (ret < 0) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
 	}
+	if (ret)
+		valid = 0;
 
 	/* print it */
 	cond_print ("Application Version Record:\n");
 	cond_print ("  Version: %u.%02u\n", avr.version / 100, avr.version % 100);
-	cond_print ("  Builder: %s\n", avr.builder);
-	cond_print ("  Build date: %s\n", avr.build_date);
-	cond_print ("  Build time: %s\n", avr.build_time);
-
-	free (buf);
+	cond_print ("  Builder: %.*s\n", avr.builder_len, avr.builder);
+	cond_print ("  Build date: %.*s\n", avr.build_date_len, avr.build_date);
+	cond_print ("  Build time: %.*s\n", avr.build_time_len, avr.build_time);
 
 	avr_count++;
 	app_record_count++;
@@ -247,68 +182,528 @@ print_human_readable (unsigned long long value)
 
 
 void
-fd_copy (int dst, int src, UINT size)
+fd_copy (int dst, int src, off_t offset, ULONGLONG size)
 {
-	char buf[PAGE_SIZE];
+	ULONGLONG span = rgn_trace_begin ();
+	ssize_t copied;
 
-	while (size) {
-		ssize_t bytes_read;
-		size_t req = size > PAGE_SIZE ? PAGE_SIZE : size;
-		char *pos;
+	copied = rgn_copy (src, &offset, dst, NULL, size);
+	if (copied < 0) {
+		fprintf (stderr, "Error copying region: %s\n", strerror (errno));
+		exit (1);
+	}
+	rgn_trace_end ("fd_copy", span, copied);
+	rgn_stats_add (RGN_PHASE_COPY, copied);
+	if (copied != size) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
+}
+
+
+/*
+ * Write the expanded payload of a compressed or sparse region to dst.  A
+ * compressed one goes block by block as they come off the decompression
+ * threads; the zero runs of a sparse one become holes in a regular file.
+ * A region found through the TOC has no data pointer; its payload is
+ * mapped here.
+ */
+void
+expand_region (int dst, int src, const struct rgn_region *region)
+{
+	ULONGLONG span = rgn_trace_begin ();
+	const BYTE *data = region->data;
+	void *map = NULL;
+	size_t map_len = 0;
+	off_t skew = 0;
+
+	if (!data) {
+		skew = region->offset % sysconf (_SC_PAGESIZE);
+		map_len = region->size + skew;
+		map = mmap (NULL, map_len, PROT_READ, MAP_SHARED, src,
+			    region->offset - skew);
+		if (map == MAP_FAILED) {
+			fprintf (stderr, "Could not map region: %s\n",
+				 strerror (errno));
+			exit (1);
+		}
+		madvise (map, map_len, MADV_SEQUENTIAL);
+		data = (const BYTE *)map + skew;
+	}
 
-		bytes_read = read (src, buf, req);
-		if (bytes_read < 0) {
-			fprintf (stderr, "Error reading from input\n");
+	if (region->type == REGION_SPARSE_REC_CHAR) {
+		struct region_sparse hdr;
+
+		if (rgn_sparse_header (data, region->size, &hdr) ||
+		    rgn_sparse_expand (data, region->size, dst)) {
+			if (errno == EBADMSG)
+				fprintf (stderr, "Sparse region %d is corrupt\n",
+					 region->id);
+			else
+				fprintf (stderr, "Error expanding region: %s\n",
+					 strerror (errno));
 			exit (1);
 		}
-		if (bytes_read == 0)
-			return;
-		size -= bytes_read;
-		pos = buf;
-		while (bytes_read) {
-			int bytes_written;
-			
-			bytes_written = write (dst, pos, bytes_read);
-			if (bytes_written < 0) {
-				fprintf (stderr, "Error writing\n");
-				exit (1);
-			}
-			bytes_read -= bytes_written;
-			pos += bytes_written;
+		rgn_stats_add (RGN_PHASE_COPY, hdr.size);
+	}
+	else {
+		struct region_compressed hdr;
+
+		if (rgn_compressed_header (data, region->size, &hdr) ||
+		    rgn_decompress (data, region->size, dst, options.jobs)) {
+			if (errno == EBADMSG)
+				fprintf (stderr, "Compressed region %d is "
+					 "corrupt\n", region->id);
+			else
+				fprintf (stderr, "Error decompressing region: "
+					 "%s\n", strerror (errno));
+			exit (1);
 		}
+		rgn_stats_add (RGN_PHASE_COPY, hdr.size);
+	}
+
+	if (map)
+		munmap (map, map_len);
+	rgn_trace_end ("expand_region", span, region->id);
+}
+
+
+/*
+ * Return 1 if region number (1 based) was asked for.  Regions are seen in
+ * increasing order, so the sorted extract list is consumed from the front.
+ */
+int
+want_region (int number)
+{
+	if (options.extract_all)
+		return 1;
+
+	while (options.extract_next < options.extract_count &&
+	       options.extract[options.extract_next] < number)
+		options.extract_next++;
+
+	if (options.extract_next < options.extract_count &&
+	    options.extract[options.extract_next] == number) {
+		options.extract_next++;
+		return 1;
 	}
+	return 0;
 }
 
 
+/*
+ * Copy the payload of a region out of src, either to stdout or to its own
+ * file in the output directory.  Compressed and sparse regions are
+ * written out expanded.
+ */
 void
-parse_region (int fd, UINT size)
+extract_region (int src, const struct rgn_region *region, int number)
 {
-	struct region region;
+	char *name;
+	int dst;
+
+	/* A delta payload is copy and insert operations, not the region */
+	if (region->type == REGION_DELTA_REC_CHAR) {
+		fprintf (stderr, "Region %d is a delta against an earlier "
+			 "region file; rebuild the full file with "
+			 "apply-region-delta to extract it\n", number);
+		exit (1);
+	}
 
-	readall (fd, &region, sizeof(region));
+	rgn_stats_enter (RGN_PHASE_COPY);
+	if (!options.output_dir) {
+		if (region->type == REGION_COMPRESSED_REC_CHAR ||
+		    region->type == REGION_SPARSE_REC_CHAR)
+			expand_region (1, src, region);
+		else
+			fd_copy (1, src, region->offset, region->size);
+		rgn_stats_leave ();
+		return;
+	}
+
+	if (asprintf (&name, "%s/region-%d.bin", options.output_dir,
+		      number) < 0) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	dst = open (name, O_WRONLY | O_CREAT | O_TRUNC,
+		    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (dst < 0) {
+		fprintf (stderr, "Could not open %s: %s\n", name,
+			 strerror (errno));
+		exit (1);
+	}
+
+	if (region->type == REGION_COMPRESSED_REC_CHAR ||
+	    region->type == REGION_SPARSE_REC_CHAR)
+		expand_region (dst, src, region);
+	else
+		fd_copy (dst, src, region->offset, region->size);
+
+	if (close (dst)) {
+		fprintf (stderr, "Error writing %s: %s\n", name,
+			 strerror (errno));
+		exit (1);
+	}
+	free (name);
+	rgn_stats_leave ();
+}
+
+
+/*
+ * The region waiting for a CRC record did not get one.
+ */
+void
+end_crc_check (void)
+{
+	if (!crc_pending_number)
+		return;
+
+	fprintf (stderr, "Region %d (ID %d) has no CRC record\n",
+		 crc_pending_number, crc_pending.id);
+	crc_missing++;
+	crc_pending_number = 0;
+}
+
+
+void
+parse_region (const struct rgn_record *rec)
+{
+	struct rgn_region region;
+
+	if (rgn_decode_region (rec, &region)) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
 
 	region_count++;
 	app_record_count++;
 
 	if (options.print) {
-		printf ("Region Record %d:\n", region_count);
+		struct region_delta delta;
+		struct region_compressed compressed;
+		struct region_sparse sparse;
+
+		if (rec->type == REGION_DELTA_REC_CHAR)
+			printf ("Delta Region Record %d:\n", region_count);
+		else if (rec->type == REGION_COMPRESSED_REC_CHAR)
+			printf ("Compressed Region Record %d:\n", region_count);
+		else if (rec->type == REGION_SPARSE_REC_CHAR)
+			printf ("Sparse Region Record %d:\n", region_count);
+		else
+			printf ("Region Record %d:\n", region_count);
 		printf ("  ID: %d (0x%04x)\n", region.id, region.id);
 		printf ("  Delay: %u\n", region.delay);
 		printf ("  Size: ");
 		if (options.human_readable)
 			print_human_readable (region.size);
 		else
-			printf("%u", region.size);
+			printf("%llu", region.size);
 		printf("\n");
+
+		if (rec->type == REGION_DELTA_REC_CHAR) {
+			if (rgn_delta_header (region.data, region.size, &delta)) {
+				printf ("Error: Delta region is too short\n");
+				valid = 0;
+			}
+			else {
+				printf ("  Rebuilt size: ");
+				if (options.human_readable)
+					print_human_readable (delta.size);
+				else
+					printf("%u", delta.size);
+				printf ("\n  Rebuilt CRC32C: 0x%08x\n", delta.crc);
+				printf ("  Base size: %u, CRC32C: 0x%08x\n",
+					delta.base_size, delta.base_crc);
+			}
+		}
+
+		if (rec->type == REGION_COMPRESSED_REC_CHAR) {
+			if (rgn_compressed_header (region.data, region.size,
+						   &compressed)) {
+				printf ("Error: Compressed region is invalid\n");
+				valid = 0;
+			}
+			else {
+				printf ("  Uncompressed size: ");
+				if (options.human_readable)
+					print_human_readable (compressed.size);
+				else
+					printf("%u", compressed.size);
+				printf ("\n  Blocks: %u of %u bytes\n",
+					compressed.size ?
+					(compressed.size - 1) /
+					compressed.block_size + 1 : 0,
+					compressed.block_size);
+			}
+		}
+
+		if (rec->type == REGION_SPARSE_REC_CHAR) {
+			if (rgn_sparse_header (region.data, region.size,
+					       &sparse)) {
+				printf ("Error: Sparse region is invalid\n");
+				valid = 0;
+			}
+			else {
+				printf ("  Expanded size: ");
+				if (options.human_readable)
+					print_human_readable (sparse.size);
+				else
+					printf("%u", sparse.size);
+				printf ("\n  Fill runs: %u\n", sparse.count);
+			}
+		}
 	}
 
-	if (options.extract == region_count) {
-		fd_copy (1, fd, region.size);
-		options.extract = -1;
+	if (want_region (region_count))
+		extract_region (file.fd, &region, region_count);
+
+	if (options.check) {
+		end_crc_check ();
+		crc_pending = region;
+		crc_pending_number = region_count;
+	}
+}
+
+
+void
+parse_crc (const struct rgn_record *rec)
+{
+	struct region_crc crc;
+	UINT computed;
+
+	if (rgn_decode_crc (rec, &crc)) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
+
+	cond_print ("Region CRC Record:\n");
+	cond_print ("  ID: %d (0x%04x)\n", crc.id, crc.id);
+	cond_print ("  CRC32C: 0x%08x\n", crc.crc);
+
+	if (!options.check)
+		return;
+
+	if (!crc_pending_number || crc_pending.id != crc.id) {
+		cond_print ("Error: CRC record for ID %d does not follow its "
+			    "region\n", crc.id);
+		fprintf (stderr, "CRC record for ID %d does not follow its "
+			 "region\n", crc.id);
+		end_crc_check ();
+		crc_failed++;
+		valid = 0;
+		return;
+	}
+
+	rgn_stats_enter (RGN_PHASE_VERIFY);
+	computed = rgn_crc32c (0, crc_pending.data, crc_pending.size);
+	rgn_stats_add (RGN_PHASE_VERIFY, crc_pending.size);
+	rgn_stats_leave ();
+	crc_checked++;
+	if (computed == crc.crc) {
+		cond_print ("  Check: OK\n");
 	}
 	else {
-		lseek (fd, region.size, SEEK_CUR);
+		cond_print ("  Check: FAILED (payload CRC32C is 0x%08x)\n",
+			    computed);
+		fprintf (stderr, "Region %d (ID %d): CRC32C mismatch, stored "
+			 "0x%08x, computed 0x%08x\n", crc_pending_number,
+			 crc.id, crc.crc, computed);
+		crc_failed++;
 	}
+	crc_pending_number = 0;
+}
+
+
+/*
+ * Complain about every requested region that was not in the file.
+ */
+void
+report_missing_regions (void)
+{
+	int missing = 0;
+
+	for (; options.extract_next < options.extract_count;
+	     options.extract_next++) {
+		fprintf (stderr, "Region %d not found\n",
+			 options.extract[options.extract_next]);
+		missing = 1;
+	}
+
+	if (missing)
+		exit (1);
+}
+
+
+void
+parse_toc (const struct rgn_record *rec)
+{
+	struct rgn_toc toc;
+	UINT i;
+
+	if (rgn_decode_toc (rec, &toc)) {
+		fprintf (stderr, "Invalid region table of contents\n");
+		exit (1);
+	}
+
+	if (options.print) {
+		printf ("Region Table Of Contents:\n");
+		for (i = 0; i < toc.count; i++)
+			printf ("  Region %u: ID %d, delay %u, size %llu, "
+				"offset %llu\n", i + 1, toc.entries[i].id,
+				toc.entries[i].delay, toc.entries[i].size,
+				toc.entries[i].offset);
+	}
+
+	rgn_toc_free (&toc);
+}
+
+
+/*
+ * Extract the wanted regions through the table of contents toc.
+ */
+void
+extract_toc_regions (int fd, const struct rgn_toc *toc)
+{
+	struct rgn_region region;
+	UINT i;
+
+	for (i = 0; i < toc->count; i++) {
+		if (!want_region (i + 1))
+			continue;
+		if (rgn_toc_region (fd, toc, i, &region)) {
+			fprintf (stderr, "Region table of contents does not "
+					 "match the file\n");
+			exit (1);
+		}
+		extract_region (fd, &region, i + 1);
+	}
+
+	report_missing_regions ();
+}
+
+
+/*
+ * Extract the wanted regions straight from their table of contents
+ * entries.  Returns 0 if the input has no TOC and has to be walked instead.
+ */
+int
+extract_from_toc (int fd)
+{
+	struct rgn_toc toc;
+	int ret;
+
+	ret = rgn_toc_read (fd, &toc);
+	if (ret <= 0)
+		return 0;
+
+	extract_toc_regions (fd, &toc);
+	rgn_toc_free (&toc);
+	return 1;
+}
+
+
+/*
+ * Extract the wanted regions of an input without a TOC through the region
+ * table of its cached summary, which is made and stored if the cache does
+ * not have it yet.  Returns 0 if the input has to be walked instead.
+ */
+int
+extract_from_summary (int fd)
+{
+	struct rgn_summary summary;
+	struct rgn_toc toc;
+	int ret;
+
+	ret = rgn_cache_lookup (cache, &cache_key, &summary, NULL);
+	if (ret < 0)
+		return 0;
+	if (ret == 0) {
+		if (rgn_summarize (fd, cache_key.size, &summary))
+			return 0;
+		rgn_cache_store (cache, fd, &cache_key, &summary, 0);
+	}
+
+	ret = 0;
+	if (!summary.problems && !rgn_summary_toc (&summary, &toc)) {
+		extract_toc_regions (fd, &toc);
+		rgn_toc_free (&toc);
+		ret = 1;
+	}
+	rgn_summary_free (&summary);
+	return ret;
+}
+
+
+/*
+ * Open the --cache file for a regular file on stdin.
+ */
+void
+open_cache (void)
+{
+	struct stat st;
+
+	cache = rgn_cache_open (options.cache);
+	if (!cache) {
+		if (errno) {
+			fprintf (stderr, "Could not open cache: %s\n",
+				 strerror (errno));
+			exit (1);
+		}
+		return;
+	}
+
+	/* Pipes have no identity to cache under */
+	if (fstat (STDIN_FILENO, &st) || !S_ISREG (st.st_mode) ||
+	    rgn_cache_key (cache, STDIN_FILENO, &st, &cache_key)) {
+		rgn_cache_close (cache);
+		cache = NULL;
+	}
+}
+
+
+void
+close_cache (void)
+{
+	if (rgn_cache_close (cache))
+		fprintf (stderr, "Could not write cache: %s\n",
+			 strerror (errno));
+	cache = NULL;
+}
+
+
+/*
+ * Whether the cache has the input as it is now as having passed --check.
+ */
+int
+checked_before (void)
+{
+	struct rgn_summary summary;
+	unsigned int flags;
+	int ret;
+
+	if (rgn_cache_lookup (cache, &cache_key, &summary, &flags) != 1)
+		return 0;
+	ret = (flags & RGN_CACHE_CHECKED) && !summary.problems;
+	rgn_summary_free (&summary);
+	return ret;
+}
+
+
+/*
+ * Record that the input passed --check.  The key was taken before the
+ * check began, so the store is refused if the file changed during it.
+ */
+void
+store_checked (void)
+{
+	struct rgn_summary summary;
+
+	if (rgn_summarize (STDIN_FILENO, cache_key.size, &summary))
+		return;
+	rgn_cache_store (cache, STDIN_FILENO, &cache_key, &summary,
+			 RGN_CACHE_CHECKED);
+	rgn_summary_free (&summary);
 }
 
 
@@ -316,8 +711,59 @@ void
 init_options (struct options *opts)
 {
 	memset (opts, 0, sizeof(struct options));
+	opts->jobs = 1;
+}
+
+
+static int
+compare_int (const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+
+/*
+ * Add a comma separated list of region numbers to the extraction list.
+ */
+void
+add_extract_list (struct options *opts, const char *list)
+{
+	const char *pos = list;
+
+	for (;;) {
+		char *end;
+		long number;
+
+		number = strtol (pos, &end, 10);
+		if (end == pos || number <= 0 || (*end != ',' && *end != 0)) {
+			fprintf (stderr, "Invalid region number: %s\n", list);
+			exit (1);
+		}
+
+		opts->extract = xrealloc (opts->extract,
+				(opts->extract_count + 1) * sizeof(int));
+		opts->extract[opts->extract_count++] = number;
+
+		if (*end == 0)
+			break;
+		pos = end + 1;
+	}
+}
+
+
+/*
+ * Sort the extraction list and drop duplicates.
+ */
+void
+sort_extract_list (struct options *opts)
+{
+	int i, n = 0;
 
-	opts->extract = -1;
+	qsort (opts->extract, opts->extract_count, sizeof(int), compare_int);
+	for (i = 0; i < opts->extract_count; i++)
+		if (n == 0 || opts->extract[n - 1] != opts->extract[i])
+			opts->extract[n++] = opts->extract[i];
+	opts->extract_count = n;
 }
 
 
@@ -329,6 +775,22 @@ show_usage (void)
 	printf("\n");
 	printf("Options:\n");
 	printf("  -h, --human-readable  Print sizes in human-readable format\n");
+	printf("  -p, --print           Print the records of the file\n");
+	printf("  -x, --extract LIST    Extract the regions numbered in the comma\n");
+	printf("                        separated LIST\n");
+	printf("      --extract-all     Extract every region\n");
+	printf("  -O, --output-dir DIR  Write each extracted region to\n");
+	printf("                        DIR/region-N.bin instead of stdout\n");
+	printf("  -c, --check           Verify each region against its CRC record;\n");
+	printf("                        exits non-zero on a mismatch or missing CRC\n");
+	printf("  -j, --jobs N          Decompress compressed regions with N threads\n");
+	printf("      --cache FILE      Remember in FILE which inputs passed --check\n");
+	printf("                        and where the regions of inputs without a\n");
+	printf("                        TOC are (default: $RGN_CACHE)\n");
+	printf("      --io BACKEND      Read the input with buffered, mmap (default),\n");
+	printf("                        direct or uring I/O\n");
+	printf("      --stats[=FORMAT]  Print the bytes, time, system calls and peak\n");
+	printf("                        RSS of each phase to stderr, as text or json\n");
 	printf("      --help            Display this help message\n");
 }
 
@@ -337,13 +799,19 @@ void
 parse_args (int argc, char **argv, struct options *opts)
 {
 	int opt;
-	void *tmp;
 
 	enum {
 		OPTION_HUMAN,
 		OPTION_HELP,
 		OPTION_PRINT,
 		OPTION_EXTRACT,
+		OPTION_EXTRACT_ALL,
+		OPTION_OUTPUT_DIR,
+		OPTION_IO,
+		OPTION_CHECK,
+		OPTION_JOBS,
+		OPTION_STATS,
+		OPTION_CACHE,
 	};
 
 	struct option available_options[] = {
@@ -351,11 +819,18 @@ parse_args (int argc, char **argv, struct options *opts)
 		{"help",		no_argument,		NULL,	OPTION_HELP},
 		{"print",		no_argument,		NULL,	OPTION_PRINT},
 		{"extract",		required_argument,	NULL,	OPTION_EXTRACT},
+		{"extract-all",		no_argument,		NULL,	OPTION_EXTRACT_ALL},
+		{"output-dir",		required_argument,	NULL,	OPTION_OUTPUT_DIR},
+		{"io",			required_argument,	NULL,	OPTION_IO},
+		{"check",		no_argument,		NULL,	OPTION_CHECK},
+		{"jobs",		required_argument,	NULL,	OPTION_JOBS},
+		{"stats",		optional_argument,	NULL,	OPTION_STATS},
+		{"cache",		required_argument,	NULL,	OPTION_CACHE},
 		{0, 0, 0, 0},
 	};
 
 	do {
-		opt = getopt_long (argc, argv, "hpx:", available_options, NULL);
+		opt = getopt_long (argc, argv, "hpx:O:cj:", available_options, NULL);
 
 		switch (opt) {
 			case 'h':
@@ -372,15 +847,45 @@ parse_args (int argc, char **argv, struct options *opts)
 				break;
 			case 'x':
 			case OPTION_EXTRACT:
-				if (opts->extract >= 0) {
-					fprintf (stderr, "Sorry, only one extraction at a time supported.\n");
+				add_extract_list (opts, optarg);
+				break;
+			case OPTION_EXTRACT_ALL:
+				opts->extract_all = 1;
+				break;
+			case 'c':
+			case OPTION_CHECK:
+				opts->check = 1;
+				break;
+			case 'j':
+			case OPTION_JOBS:
+				opts->jobs = atoi (optarg);
+				if (opts->jobs < 1) {
+					fprintf (stderr, "Invalid number of jobs: %s\n", optarg);
 					exit (1);
 				}
-				opts->extract = strtol (optarg, (char **)&tmp, 10);
-				if (tmp == optarg) {
-					fprintf (stderr, "Invalid region number\n");
+				break;
+			case 'O':
+			case OPTION_OUTPUT_DIR:
+				opts->output_dir = optarg;
+				break;
+			case OPTION_IO: {
+				enum rgn_io_backend io;
+
+				if (rgn_io_parse (optarg, &io)) {
+					fprintf (stderr, "Unknown I/O backend: %s\n", optarg);
 					exit (1);
 				}
+				rgn_io_set_default (io);
+				break;
+			}
+			case OPTION_STATS:
+				if (rgn_stats_parse (optarg, &opts->stats)) {
+					fprintf (stderr, "Unknown statistics format: %s\n", optarg);
+					exit (1);
+				}
+				break;
+			case OPTION_CACHE:
+				opts->cache = optarg;
 				break;
 			case -1:
 				break;
@@ -392,7 +897,15 @@ parse_args (int argc, char **argv, struct options *opts)
 		}
 	} while (opt >= 0);
 
-	if (opts->extract >= 0 && opts->print) {
+	sort_extract_list (opts);
+
+	if (!opts->output_dir &&
+	    (opts->extract_all || opts->extract_count > 1)) {
+		fprintf (stderr, "Extracting more than one region needs -O\n");
+		exit (1);
+	}
+
+	if (!opts->output_dir && opts->extract_count && opts->print) {
 		fprintf (stderr, "Can't both print and extract to stdout\n");
 		exit (1);
 	}
@@ -400,32 +913,52 @@ parse_args (int argc, char **argv, struct options *opts)
 
 
 int
-parse_data_record (int fd)
+parse_data_record (struct rgn_iter *it)
 {
-	struct data_record dr;
-	int bytes;
+	ULONGLONG span = rgn_trace_begin ();
+	struct rgn_record rec;
+	int ret;
 
-	bytes = read (fd, &dr, sizeof(dr));
-	if (bytes == 0)
+	ret = rgn_iter_next (it, &rec);
+	if (ret < 0) {
+		fprintf (stderr, "Unexpected EOF\n");
+		exit (1);
+	}
+	if (ret == 0)
 		return 0;
+	rgn_stats_add (RGN_PHASE_PARSE, rgn_record_header_size (it->large) +
+		       rec.size);
 
-	switch (dr.type) {
-		case DATA_VERSION_TYPE:
-			parse_advr (fd, dr.size);
+	if (rec.type != REGION_CRC_REC_CHAR)
+		end_crc_check ();
+
+	switch (rec.type) {
+		case DATA_VERSION_REC_CHAR:
+			parse_advr (&rec);
+			break;
+		case APP_VERSION_REC_CHAR:
+			parse_avr (&rec);
 			break;
-		case APP_VERSION_TYPE:
-			parse_avr (fd, dr.size);
+		case REGION_REC_CHAR:
+		case REGION_DELTA_REC_CHAR:
+		case REGION_COMPRESSED_REC_CHAR:
+		case REGION_SPARSE_REC_CHAR:
+			parse_region (&rec);
 			break;
-		case REGION_TYPE:
-			parse_region (fd, dr.size);
+		case REGION_TOC_REC_CHAR:
+			parse_toc (&rec);
+			break;
+		case REGION_CRC_REC_CHAR:
+			parse_crc (&rec);
 			break;
 		default:
-			fprintf (stderr, "Unknown data record type: '%c'\n", dr.type);
+			fprintf (stderr, "Unknown data record type: '%c'\n", rec.type);
 			valid = 0;
 			return 0;
 			break;
 	}
 
+	rgn_trace_end ("parse_data_record", span, rec.type);
 	return 1;
 }
 
@@ -453,31 +986,72 @@ print_errors (void)
 	if (!valid)
 		cond_print ("File is NOT valid\n");
 
-	if (options.extract >= 0) {
-		fprintf (stderr, "Region %d not found\n", options.extract);
-		exit (1);
+	if (options.check) {
+		end_crc_check ();
+		if (crc_failed || crc_missing || !valid)
+			fprintf (stderr, "Check FAILED: %d regions good, %d bad, "
+				 "%d without a CRC\n", crc_checked - crc_failed,
+				 crc_failed, crc_missing);
+		else
+			cond_print ("Check passed: %d regions good\n",
+				    crc_checked);
 	}
+
+	report_missing_regions ();
 }
 
 int main(int argc, char **argv)
 {
-	int fd = STDIN_FILENO;
-//	int fd = open("rgnpkg/a.rgn", O_RDONLY);
+	struct rgn_iter it;
 
 	init_options (&options);
 	parse_args (argc, argv, &options);
+	rgn_stats_start ("parse-region", options.stats);
+	rgn_trace_start ("parse-region");
+	rgn_stats_enter (RGN_PHASE_PARSE);
+	open_cache ();
+
+	/* An input that passed --check as it is now need not be checked again */
+	if (cache && options.check && !options.print && checked_before ()) {
+		if (!options.extract_all && !options.extract_count) {
+			close_cache ();
+			return 0;
+		}
+		options.check = 0;
+	}
+
+	/* Seekable input with a TOC, or a cached region table, needs no walk */
+	if (!options.print && !options.check &&
+	    (options.extract_all || options.extract_count) &&
+	    (extract_from_toc (STDIN_FILENO) ||
+	     (cache && extract_from_summary (STDIN_FILENO)))) {
+		close_cache ();
+		return 0;
+	}
 
-	if (!parse_vir (fd))
+	if (rgn_open_fd (&file, STDIN_FILENO)) {
+		fprintf (stderr, "Could not map input: %s\n", strerror (errno));
+		exit (1);
+	}
+
+	if (!parse_vir (&file))
 		return 0;
+	if (options.check)
+		rgn_advise (&file, MADV_SEQUENTIAL);
 	cond_print("\n");
 
-	while (parse_data_record(fd)){
+	rgn_iter_init (&it, &file);
+	while (parse_data_record(&it)){
 		cond_print("\n");
 	}
 
 	print_errors ();
+	if (cache && options.check && !crc_failed && !crc_missing && valid)
+		store_checked ();
+	close_cache ();
 
-//	close(fd);
+	rgn_close (&file);
+	if (options.check && (crc_failed || crc_missing || !valid))
+		return 1;
 	return 0;
 }
-
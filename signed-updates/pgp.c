@@ -0,0 +1,1132 @@
+/*
+ * pgp.c
+ *
+ * Minimal OpenPGP support on top of libgcrypt
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <gcrypt.h>
+
+#include "pgp.h"
+
+/* OpenPGP packet tags */
+#define PGP_TAG_SIGNATURE	2
+#define PGP_TAG_SECRET_KEY	5
+#define PGP_TAG_PUBLIC_KEY	6
+#define PGP_TAG_SECRET_SUBKEY	7
+#define PGP_TAG_PUBLIC_SUBKEY	14
+
+/* OpenPGP algorithm numbers */
+#define PGP_PK_RSA		1
+#define PGP_PK_RSA_SIGN		3
+#define PGP_HASH_SHA256		8
+#define PGP_SIG_BINARY		0x00
+
+/* Secret key protection */
+#define PGP_S2K_USAGE_SHA1	254
+#define PGP_S2K_USAGE_SUM	255
+#define PGP_S2K_SIMPLE		0
+#define PGP_S2K_SALTED		1
+#define PGP_S2K_ITERATED	3
+
+/* Largest packet we build ourselves */
+#define PGP_SIG_MAX		1024
+
+/* Bytes hashed per call while stretching a passphrase */
+#define S2K_BUF_SIZE		(64 * 1024)
+
+struct packet {
+	int tag;
+	const BYTE *body;
+	size_t len;
+};
+
+static UINT
+get_be32 (const BYTE *p)
+{
+	return ((UINT)p[0] << 24) | ((UINT)p[1] << 16) | ((UINT)p[2] << 8) |
+		p[3];
+}
+
+static void
+put_be32 (BYTE *p, UINT v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+put_be16 (BYTE *p, UINT v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+int
+pgp_init (void)
+{
+	if (!gcry_check_version (GCRYPT_VERSION)) {
+		fprintf (stderr, "libgcrypt version mismatch\n");
+		return -1;
+	}
+	gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+	gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+
+	return 0;
+}
+
+/*
+ * Read the next packet header at *pos and point pkt at its body.  Partial
+ * body lengths are not used in key blocks or signatures and are refused.
+ * Returns 1 for a packet, 0 at the end and -1 on malformed input.
+ */
+static int
+next_packet (const BYTE **pos, const BYTE *end, struct packet *pkt)
+{
+	const BYTE *p = *pos;
+	size_t len;
+
+	if (p >= end)
+		return 0;
+	if (!(p[0] & 0x80))
+		return -1;
+
+	if (p[0] & 0x40) {
+		/* New format */
+		pkt->tag = p[0] & 0x3f;
+		p++;
+		if (p >= end)
+			return -1;
+		if (p[0] < 192) {
+			len = p[0];
+			p++;
+		}
+		else if (p[0] < 224) {
+			if (end - p < 2)
+				return -1;
+			len = ((p[0] - 192) << 8) + p[1] + 192;
+			p += 2;
+		}
+		else if (p[0] == 255) {
+			if (end - p < 5)
+				return -1;
+			len = get_be32 (p + 1);
+			p += 5;
+		}
+		else
+			return -1;
+	}
+	else {
+		/* Old format */
+		int lentype = p[0] & 3;
+
+		pkt->tag = (p[0] >> 2) & 0xf;
+		p++;
+		switch (lentype) {
+		case 0:
+			if (end - p < 1)
+				return -1;
+			len = p[0];
+			p += 1;
+			break;
+		case 1:
+			if (end - p < 2)
+				return -1;
+			len = (p[0] << 8) | p[1];
+			p += 2;
+			break;
+		case 2:
+			if (end - p < 4)
+				return -1;
+			len = get_be32 (p);
+			p += 4;
+			break;
+		default:
+			len = end - p;
+			break;
+		}
+	}
+
+	if (len > (size_t)(end - p))
+		return -1;
+
+	pkt->body = p;
+	pkt->len = len;
+	*pos = p + len;
+	return 1;
+}
+
+static int
+base64_value (int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+/*
+ * Strip ASCII armor in place.  Returns the length of the binary data or
+ * -1 if the armor is broken.
+ */
+static ssize_t
+dearmor (BYTE *buf, size_t len)
+{
+	char *text = (char *)buf;
+	char *pos, *end = text + len;
+	size_t out = 0;
+	UINT acc = 0;
+	int bits = 0;
+
+	pos = memmem (text, len, "-----BEGIN PGP", 14);
+	if (!pos)
+		return -1;
+
+	/* Skip the armor line and the headers up to the blank line */
+	pos = memchr (pos, '\n', end - pos);
+	while (pos && pos < end) {
+		char *next = memchr (pos + 1, '\n', end - pos - 1);
+
+		if (!next)
+			return -1;
+		if (next - pos == 1 || (next - pos == 2 && pos[1] == '\r')) {
+			pos = next + 1;
+			break;
+		}
+		if (!memchr (pos + 1, ':', next - pos - 1)) {
+			/* No headers at all */
+			pos = pos + 1;
+			break;
+		}
+		pos = next;
+	}
+	if (!pos)
+		return -1;
+
+	for (; pos < end; pos++) {
+		int v;
+
+		/* The checksum line or the end line stop the data */
+		if ((pos == text || pos[-1] == '\n') &&
+		    (*pos == '=' || *pos == '-'))
+			break;
+		v = base64_value (*pos);
+		if (v < 0)
+			continue;
+		acc = (acc << 6) | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			buf[out++] = acc >> bits;
+		}
+	}
+
+	return out;
+}
+
+static BYTE *
+read_file (const char *path, size_t *len)
+{
+	FILE *f;
+	BYTE *buf = NULL;
+	size_t size = 0, used = 0;
+
+	f = fopen (path, "rb");
+	if (!f) {
+		fprintf (stderr, "Could not open %s: %s\n", path,
+			 strerror (errno));
+		return NULL;
+	}
+
+	for (;;) {
+		size_t n;
+
+		if (used == size) {
+			BYTE *tmp;
+
+			size = size ? size * 2 : 4096;
+			tmp = realloc (buf, size);
+			if (!tmp) {
+				fprintf (stderr, "Out of memory\n");
+				goto fail;
+			}
+			buf = tmp;
+		}
+		n = fread (buf + used, 1, size - used, f);
+		used += n;
+		if (n == 0)
+			break;
+	}
+	if (ferror (f)) {
+		fprintf (stderr, "Error reading %s\n", path);
+		goto fail;
+	}
+
+	fclose (f);
+	*len = used;
+	return buf;
+
+fail:
+	fclose (f);
+	free (buf);
+	return NULL;
+}
+
+static int
+hash_algo (int pgp_algo)
+{
+	switch (pgp_algo) {
+	case 1:		return GCRY_MD_MD5;
+	case 2:		return GCRY_MD_SHA1;
+	case 3:		return GCRY_MD_RMD160;
+	case 8:		return GCRY_MD_SHA256;
+	case 9:		return GCRY_MD_SHA384;
+	case 10:	return GCRY_MD_SHA512;
+	case 11:	return GCRY_MD_SHA224;
+	default:	return 0;
+	}
+}
+
+static int
+cipher_algo (int pgp_algo)
+{
+	switch (pgp_algo) {
+	case 2:		return GCRY_CIPHER_3DES;
+	case 3:		return GCRY_CIPHER_CAST5;
+	case 4:		return GCRY_CIPHER_BLOWFISH;
+	case 7:		return GCRY_CIPHER_AES128;
+	case 8:		return GCRY_CIPHER_AES192;
+	case 9:		return GCRY_CIPHER_AES256;
+	case 10:	return GCRY_CIPHER_TWOFISH;
+	default:	return 0;
+	}
+}
+
+/*
+ * Turn a passphrase into a symmetric key with an OpenPGP string-to-key
+ * specifier.
+ */
+static int
+s2k_derive (int type, int md, const BYTE *salt, unsigned long count,
+	    const char *pass, BYTE *key, size_t keylen)
+{
+	size_t plen = strlen (pass);
+	size_t unit = 8 + plen;
+	size_t dlen = gcry_md_get_algo_dlen (md);
+	size_t done = 0;
+	int preload = 0;
+	BYTE *buf = NULL;
+	size_t buf_len = 0;
+
+	if (type == PGP_S2K_ITERATED) {
+		size_t i;
+
+		if (count < unit)
+			count = unit;
+
+		/* Hash many copies of salt and passphrase per call */
+		buf_len = S2K_BUF_SIZE - S2K_BUF_SIZE % unit;
+		if (buf_len < unit)
+			buf_len = unit;
+		buf = malloc (buf_len);
+		if (!buf)
+			return -1;
+		for (i = 0; i < buf_len; i += unit) {
+			memcpy (buf + i, salt, 8);
+			memcpy (buf + i + 8, pass, plen);
+		}
+	}
+
+	while (done < keylen) {
+		gcry_md_hd_t hd;
+		size_t n;
+		int i;
+
+		if (gcry_md_open (&hd, md, 0)) {
+			free (buf);
+			return -1;
+		}
+		for (i = 0; i < preload; i++)
+			gcry_md_putc (hd, 0);
+
+		switch (type) {
+		case PGP_S2K_SIMPLE:
+			gcry_md_write (hd, pass, plen);
+			break;
+		case PGP_S2K_SALTED:
+			gcry_md_write (hd, salt, 8);
+			gcry_md_write (hd, pass, plen);
+			break;
+		default: {
+			unsigned long left = count;
+
+			while (left) {
+				n = left > buf_len ? buf_len : left;
+				gcry_md_write (hd, buf, n);
+				left -= n;
+			}
+			break;
+		}
+		}
+
+		n = keylen - done > dlen ? dlen : keylen - done;
+		memcpy (key + done, gcry_md_read (hd, md), n);
+		gcry_md_close (hd);
+		done += n;
+		preload++;
+	}
+
+	free (buf);
+	return 0;
+}
+
+/*
+ * Read count OpenPGP MPIs from *pos.
+ */
+static int
+scan_mpis (const BYTE **pos, const BYTE *end, gcry_mpi_t *mpis, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		size_t n;
+
+		if (gcry_mpi_scan (&mpis[i], GCRYMPI_FMT_PGP, *pos, end - *pos,
+				   &n)) {
+			while (i--)
+				gcry_mpi_release (mpis[i]);
+			return -1;
+		}
+		*pos += n;
+	}
+
+	return 0;
+}
+
+/*
+ * Decrypt the secret part of a key packet in place if it is protected
+ * and check its checksum.  *pos points at the S2K usage octet on entry
+ * and at the first secret MPI on return; *end is moved before the
+ * checksum.
+ */
+static int
+unprotect (BYTE **pos, BYTE **end, const char *passphrase)
+{
+	BYTE *p = *pos;
+	BYTE *e = *end;
+	int usage;
+
+	if (p >= e)
+		return -1;
+	usage = *p++;
+
+	if (usage == PGP_S2K_USAGE_SHA1 || usage == PGP_S2K_USAGE_SUM) {
+		int algo, type, md;
+		const BYTE *salt = NULL;
+		unsigned long count = 0;
+		size_t keylen, blklen;
+		BYTE key[64];
+		gcry_cipher_hd_t hd;
+
+		if (e - p < 3)
+			return -1;
+		algo = cipher_algo (p[0]);
+		type = p[1];
+		md = hash_algo (p[2]);
+		p += 3;
+		if (!algo || !md) {
+			fprintf (stderr, "Unsupported key protection\n");
+			return -1;
+		}
+		if (type == PGP_S2K_SALTED || type == PGP_S2K_ITERATED) {
+			if (e - p < 8)
+				return -1;
+			salt = p;
+			p += 8;
+		}
+		if (type == PGP_S2K_ITERATED) {
+			if (e - p < 1)
+				return -1;
+			count = (16UL + (*p & 15)) << ((*p >> 4) + 6);
+			p++;
+		}
+		else if (type != PGP_S2K_SIMPLE) {
+			fprintf (stderr, "Unsupported S2K type %d\n", type);
+			return -1;
+		}
+
+		if (!passphrase) {
+			fprintf (stderr, "Secret key is protected; a passphrase "
+					 "is needed\n");
+			return -1;
+		}
+
+		keylen = gcry_cipher_get_algo_keylen (algo);
+		blklen = gcry_cipher_get_algo_blklen (algo);
+		if (keylen > sizeof(key) || (size_t)(e - p) < blklen)
+			return -1;
+		if (s2k_derive (type, md, salt, count, passphrase, key, keylen))
+			return -1;
+
+		if (gcry_cipher_open (&hd, algo, GCRY_CIPHER_MODE_CFB, 0))
+			return -1;
+		if (gcry_cipher_setkey (hd, key, keylen) ||
+		    gcry_cipher_setiv (hd, p, blklen) ||
+		    gcry_cipher_decrypt (hd, p + blklen, e - p - blklen,
+					 NULL, 0)) {
+			gcry_cipher_close (hd);
+			return -1;
+		}
+		gcry_cipher_close (hd);
+		p += blklen;
+	}
+	else if (usage != 0) {
+		fprintf (stderr, "Unsupported key protection\n");
+		return -1;
+	}
+
+	if (usage == PGP_S2K_USAGE_SHA1) {
+		BYTE digest[20];
+
+		if (e - p < 20)
+			return -1;
+		gcry_md_hash_buffer (GCRY_MD_SHA1, digest, p, e - p - 20);
+		if (memcmp (digest, e - 20, 20)) {
+			fprintf (stderr, "Bad passphrase for secret key\n");
+			return -1;
+		}
+		e -= 20;
+	}
+	else {
+		UINT sum = 0;
+		BYTE *q;
+
+		if (e - p < 2)
+			return -1;
+		for (q = p; q < e - 2; q++)
+			sum += *q;
+		if ((sum & 0xffff) != (UINT)((e[-2] << 8) | e[-1])) {
+			fprintf (stderr, "Bad passphrase for secret key\n");
+			return -1;
+		}
+		e -= 2;
+	}
+
+	*pos = p;
+	*end = e;
+	return 0;
+}
+
+static int
+is_key_packet (int tag)
+{
+	return tag == PGP_TAG_SECRET_KEY || tag == PGP_TAG_PUBLIC_KEY ||
+	       tag == PGP_TAG_SECRET_SUBKEY || tag == PGP_TAG_PUBLIC_SUBKEY;
+}
+
+/*
+ * Parse a public or secret key packet; only the public part is taken
+ * unless want_secret is set.  The body is modified when a protected
+ * secret key is decrypted.
+ */
+static int
+parse_key (struct pgp_key *key, int tag, BYTE *body, size_t len,
+	   int want_secret, const char *passphrase)
+{
+	const BYTE *pos;
+	BYTE *secret, *end = body + len;
+	gcry_mpi_t pub[2], sec[4];
+	gcry_md_hd_t hd;
+	BYTE prefix[3];
+	size_t publen;
+	int err, i;
+
+	if (len < 6 || body[0] != 4) {
+		fprintf (stderr, "Only version 4 keys are supported\n");
+		return -1;
+	}
+	if (body[5] != PGP_PK_RSA && body[5] != PGP_PK_RSA_SIGN) {
+		fprintf (stderr, "Only RSA keys are supported\n");
+		return -1;
+	}
+	key->created = get_be32 (body + 1);
+
+	pos = body + 6;
+	if (scan_mpis (&pos, end, pub, 2)) {
+		fprintf (stderr, "Malformed key packet\n");
+		return -1;
+	}
+	publen = pos - body;
+
+	/* v4 fingerprint: SHA-1 over the public key packet */
+	prefix[0] = 0x99;
+	put_be16 (prefix + 1, publen);
+	if (gcry_md_open (&hd, GCRY_MD_SHA1, 0))
+		goto fail_pub;
+	gcry_md_write (hd, prefix, sizeof(prefix));
+	gcry_md_write (hd, body, publen);
+	memcpy (key->fpr, gcry_md_read (hd, GCRY_MD_SHA1), PGP_FPR_LEN);
+	gcry_md_close (hd);
+	memcpy (key->keyid, key->fpr + PGP_FPR_LEN - PGP_KEYID_LEN,
+		PGP_KEYID_LEN);
+
+	if (!want_secret || tag == PGP_TAG_PUBLIC_KEY ||
+	    tag == PGP_TAG_PUBLIC_SUBKEY) {
+		err = gcry_sexp_build (&key->sexp, NULL,
+				       "(public-key(rsa(n%m)(e%m)))",
+				       pub[0], pub[1]);
+		key->secret = 0;
+		goto done;
+	}
+
+	secret = body + publen;
+	if (unprotect (&secret, &end, passphrase))
+		goto fail_pub;
+	pos = secret;
+	if (scan_mpis (&pos, end, sec, 4)) {
+		fprintf (stderr, "Malformed secret key\n");
+		goto fail_pub;
+	}
+
+	err = gcry_sexp_build (&key->sexp, NULL,
+			       "(private-key(rsa(n%m)(e%m)(d%m)(p%m)(q%m)(u%m)))",
+			       pub[0], pub[1], sec[0], sec[1], sec[2], sec[3]);
+	for (i = 0; i < 4; i++)
+		gcry_mpi_release (sec[i]);
+	if (!err && gcry_pk_testkey (key->sexp)) {
+		fprintf (stderr, "Secret key is inconsistent\n");
+		gcry_sexp_release (key->sexp);
+		err = 1;
+	}
+	key->secret = 1;
+
+done:
+	gcry_mpi_release (pub[0]);
+	gcry_mpi_release (pub[1]);
+	return err ? -1 : 0;
+
+fail_pub:
+	gcry_mpi_release (pub[0]);
+	gcry_mpi_release (pub[1]);
+	return -1;
+}
+
+/*
+ * Read a key block, stripping ASCII armor if there is any.
+ */
+static BYTE *
+read_key_block (const char *path, size_t *len)
+{
+	BYTE *buf;
+
+	buf = read_file (path, len);
+	if (!buf)
+		return NULL;
+
+	if (*len && !(buf[0] & 0x80)) {
+		ssize_t n = dearmor (buf, *len);
+
+		if (n < 0) {
+			fprintf (stderr, "%s: not an OpenPGP key\n", path);
+			free (buf);
+			return NULL;
+		}
+		*len = n;
+	}
+
+	return buf;
+}
+
+int
+pgp_key_load (struct pgp_key *key, const char *path, const char *passphrase)
+{
+	const BYTE *pos, *end;
+	struct packet pkt;
+	BYTE *buf;
+	size_t len;
+	int ret = -1;
+
+	memset (key, 0, sizeof(*key));
+
+	buf = read_key_block (path, &len);
+	if (!buf)
+		return -1;
+
+	pos = buf;
+	end = buf + len;
+	for (;;) {
+		int r = next_packet (&pos, end, &pkt);
+
+		if (r <= 0) {
+			fprintf (stderr, "%s: no RSA key found\n", path);
+			goto out;
+		}
+		if (pkt.tag == PGP_TAG_SECRET_KEY ||
+		    pkt.tag == PGP_TAG_PUBLIC_KEY)
+			break;
+	}
+
+	ret = parse_key (key, pkt.tag, (BYTE *)pkt.body, pkt.len, 1,
+			 passphrase);
+
+out:
+	memset (buf, 0, len);
+	free (buf);
+	return ret;
+}
+
+void
+pgp_key_free (struct pgp_key *key)
+{
+	if (key->sexp)
+		gcry_sexp_release (key->sexp);
+	key->sexp = NULL;
+}
+
+int
+pgp_sign (const struct pgp_key *key, const void *data, size_t len,
+	  UINT created, BYTE *sig, size_t *sig_len)
+{
+	BYTE hashed[6 + 23 + 6];
+	BYTE trailer[6];
+	BYTE body[PGP_SIG_MAX];
+	BYTE *pos;
+	BYTE *digest;
+	gcry_md_hd_t hd;
+	gcry_sexp_t s_data, s_sig, s_val;
+	gcry_mpi_t value;
+	size_t mpi_len, body_len;
+	int err;
+
+	if (!key->secret) {
+		fprintf (stderr, "Signing needs a secret key\n");
+		return -1;
+	}
+
+	/* Hashed part: header and subpackets */
+	hashed[0] = 4;
+	hashed[1] = PGP_SIG_BINARY;
+	hashed[2] = PGP_PK_RSA;
+	hashed[3] = PGP_HASH_SHA256;
+	put_be16 (hashed + 4, 23 + 6);
+	pos = hashed + 6;
+	*pos++ = 22;			/* Issuer fingerprint */
+	*pos++ = 33;
+	*pos++ = 4;
+	memcpy (pos, key->fpr, PGP_FPR_LEN);
+	pos += PGP_FPR_LEN;
+	*pos++ = 5;			/* Signature creation time */
+	*pos++ = 2;
+	put_be32 (pos, created);
+
+	trailer[0] = 4;
+	trailer[1] = 0xff;
+	put_be32 (trailer + 2, sizeof(hashed));
+
+	if (gcry_md_open (&hd, GCRY_MD_SHA256, 0))
+		return -1;
+	gcry_md_write (hd, data, len);
+	gcry_md_write (hd, hashed, sizeof(hashed));
+	gcry_md_write (hd, trailer, sizeof(trailer));
+	digest = gcry_md_read (hd, GCRY_MD_SHA256);
+
+	err = gcry_sexp_build (&s_data, NULL,
+			       "(data(flags pkcs1)(hash sha256 %b))", 32,
+			       digest);
+	if (err) {
+		gcry_md_close (hd);
+		return -1;
+	}
+	err = gcry_pk_sign (&s_sig, s_data, key->sexp);
+	gcry_sexp_release (s_data);
+	if (err) {
+		fprintf (stderr, "Signing failed: %s\n", gcry_strerror (err));
+		gcry_md_close (hd);
+		return -1;
+	}
+
+	/* Body: hashed part, unhashed issuer, digest prefix, value */
+	pos = body;
+	memcpy (pos, hashed, sizeof(hashed));
+	pos += sizeof(hashed);
+	put_be16 (pos, 10);
+	pos += 2;
+	*pos++ = 9;			/* Issuer key ID */
+	*pos++ = 16;
+	memcpy (pos, key->keyid, PGP_KEYID_LEN);
+	pos += PGP_KEYID_LEN;
+	*pos++ = digest[0];
+	*pos++ = digest[1];
+	gcry_md_close (hd);
+
+	s_val = gcry_sexp_find_token (s_sig, "s", 0);
+	value = s_val ? gcry_sexp_nth_mpi (s_val, 1, GCRYMPI_FMT_USG) : NULL;
+	err = !value || gcry_mpi_print (GCRYMPI_FMT_PGP, pos,
+					body + sizeof(body) - pos, &mpi_len,
+					value);
+	gcry_mpi_release (value);
+	gcry_sexp_release (s_val);
+	gcry_sexp_release (s_sig);
+	if (err)
+		return -1;
+	body_len = pos + mpi_len - body;
+
+	/* Old format signature packet with a two octet length */
+	if (*sig_len < body_len + 3) {
+		errno = ENOSPC;
+		return -1;
+	}
+	sig[0] = 0x80 | (PGP_TAG_SIGNATURE << 2) | 1;
+	put_be16 (sig + 1, body_len);
+	memcpy (sig + 3, body, body_len);
+	*sig_len = body_len + 3;
+
+	return 0;
+}
+
+int
+pgp_keyring_load (struct pgp_keyring *ring, const char *path)
+{
+	const BYTE *pos, *end;
+	struct packet pkt;
+	BYTE *buf;
+	size_t len;
+	int r;
+
+	memset (ring, 0, sizeof(*ring));
+
+	buf = read_key_block (path, &len);
+	if (!buf)
+		return -1;
+
+	pos = buf;
+	end = buf + len;
+	while ((r = next_packet (&pos, end, &pkt)) > 0) {
+		struct pgp_key *keys;
+
+		/* Keys we cannot use (DSA, ECC) are simply left out */
+		if (!is_key_packet (pkt.tag) || pkt.len < 6 ||
+		    pkt.body[0] != 4 || (pkt.body[5] != PGP_PK_RSA &&
+					 pkt.body[5] != PGP_PK_RSA_SIGN))
+			continue;
+
+		keys = realloc (ring->keys, (ring->count + 1) * sizeof(*keys));
+		if (!keys) {
+			fprintf (stderr, "Out of memory\n");
+			goto fail;
+		}
+		ring->keys = keys;
+		memset (&keys[ring->count], 0, sizeof(*keys));
+		if (parse_key (&keys[ring->count], pkt.tag, (BYTE *)pkt.body,
+			       pkt.len, 0, NULL))
+			goto fail;
+		ring->count++;
+	}
+	if (r < 0) {
+		fprintf (stderr, "%s: malformed key block\n", path);
+		goto fail;
+	}
+	if (ring->count == 0) {
+		fprintf (stderr, "%s: no RSA key found\n", path);
+		goto fail;
+	}
+
+	free (buf);
+	return 0;
+
+fail:
+	free (buf);
+	pgp_keyring_free (ring);
+	return -1;
+}
+
+void
+pgp_keyring_free (struct pgp_keyring *ring)
+{
+	int i;
+
+	for (i = 0; i < ring->count; i++)
+		pgp_key_free (&ring->keys[i]);
+	free (ring->keys);
+	ring->keys = NULL;
+	ring->count = 0;
+}
+
+const char *
+pgp_status_string (enum pgp_status status)
+{
+	switch (status) {
+	case PGP_GOOD:		return "good signature";
+	case PGP_BAD:		return "BAD signature";
+	case PGP_NO_KEY:	return "no public key";
+	case PGP_UNSUPPORTED:	return "unsupported signature";
+	default:		return "malformed signature";
+	}
+}
+
+/*
+ * Look for the issuer in a signature subpacket area.  Returns the key or
+ * NULL if the area names no issuer we know.
+ */
+static const struct pgp_key *
+find_issuer (const struct pgp_keyring *ring, const BYTE *p, size_t len,
+	     int *named)
+{
+	const BYTE *end = p + len;
+	int i;
+
+	while (p < end) {
+		size_t sublen;
+		int type;
+
+		if (p[0] < 192) {
+			sublen = p[0];
+			p++;
+		}
+		else if (p[0] < 255) {
+			if (end - p < 2)
+				return NULL;
+			sublen = ((p[0] - 192) << 8) + p[1] + 192;
+			p += 2;
+		}
+		else {
+			if (end - p < 5)
+				return NULL;
+			sublen = get_be32 (p + 1);
+			p += 5;
+		}
+		if (sublen == 0 || sublen > (size_t)(end - p))
+			return NULL;
+
+		type = p[0] & 0x7f;
+		for (i = 0; i < ring->count; i++) {
+			const struct pgp_key *key = &ring->keys[i];
+
+			if (type == 16 && sublen == 1 + PGP_KEYID_LEN &&
+			    !memcmp (p + 1, key->keyid, PGP_KEYID_LEN))
+				return key;
+			if (type == 33 && sublen == 2 + PGP_FPR_LEN &&
+			    p[1] == 4 && !memcmp (p + 2, key->fpr, PGP_FPR_LEN))
+				return key;
+		}
+		if (type == 16 || type == 33)
+			*named = 1;
+		p += sublen;
+	}
+
+	return NULL;
+}
+
+/*
+ * A hash context kept by each verifying thread and reused from one
+ * signature to the next.
+ */
+struct verify_ctx {
+	gcry_md_hd_t md;
+	int md_algo;
+};
+
+static enum pgp_status
+verify_sig (struct verify_ctx *ctx, const struct pgp_keyring *ring,
+	    const void *data, size_t len, const BYTE *sig, size_t sig_len)
+{
+	const BYTE *pos = sig, *body, *end, *unhashed;
+	const struct pgp_key *key;
+	size_t hashed_len, unhashed_len;
+	struct packet pkt;
+	BYTE trailer[6];
+	BYTE *digest;
+	gcry_sexp_t s_data, s_sig;
+	gcry_mpi_t value;
+	int md, named = 0, err;
+
+	/* The signature may be followed by padding */
+	if (next_packet (&pos, sig + sig_len, &pkt) <= 0 ||
+	    pkt.tag != PGP_TAG_SIGNATURE)
+		return PGP_MALFORMED;
+	body = pkt.body;
+	end = body + pkt.len;
+
+	if (pkt.len < 6)
+		return PGP_MALFORMED;
+	if (body[0] != 4 || body[1] != PGP_SIG_BINARY ||
+	    (body[2] != PGP_PK_RSA && body[2] != PGP_PK_RSA_SIGN))
+		return PGP_UNSUPPORTED;
+	md = hash_algo (body[3]);
+	if (!md || md == GCRY_MD_MD5)
+		return PGP_UNSUPPORTED;
+
+	hashed_len = (body[4] << 8) | body[5];
+	if (hashed_len + 8 > pkt.len)
+		return PGP_MALFORMED;
+	unhashed = body + 6 + hashed_len;
+	unhashed_len = (unhashed[0] << 8) | unhashed[1];
+	unhashed += 2;
+	if (unhashed + unhashed_len + 2 > end)
+		return PGP_MALFORMED;
+
+	key = find_issuer (ring, body + 6, hashed_len, &named);
+	if (!key)
+		key = find_issuer (ring, unhashed, unhashed_len, &named);
+	if (!key) {
+		if (named || ring->count != 1)
+			return PGP_NO_KEY;
+		key = &ring->keys[0];
+	}
+
+	pos = unhashed + unhashed_len + 2;
+	if (gcry_mpi_scan (&value, GCRYMPI_FMT_PGP, pos, end - pos, NULL))
+		return PGP_MALFORMED;
+
+	if (ctx->md && ctx->md_algo != md) {
+		gcry_md_close (ctx->md);
+		ctx->md = NULL;
+	}
+	if (!ctx->md) {
+		if (gcry_md_open (&ctx->md, md, 0)) {
+			gcry_mpi_release (value);
+			return PGP_UNSUPPORTED;
+		}
+		ctx->md_algo = md;
+	}
+	else
+		gcry_md_reset (ctx->md);
+
+	trailer[0] = 4;
+	trailer[1] = 0xff;
+	put_be32 (trailer + 2, 6 + hashed_len);
+	gcry_md_write (ctx->md, data, len);
+	gcry_md_write (ctx->md, body, 6 + hashed_len);
+	gcry_md_write (ctx->md, trailer, sizeof(trailer));
+	digest = gcry_md_read (ctx->md, md);
+
+	/* The quick check saves the public key operation on a mismatch */
+	if (memcmp (digest, pos - 2, 2)) {
+		gcry_mpi_release (value);
+		return PGP_BAD;
+	}
+
+	err = gcry_sexp_build (&s_data, NULL, "(data(flags pkcs1)(hash %s %b))",
+			       gcry_md_algo_name (md),
+			       (int)gcry_md_get_algo_dlen (md), digest);
+	if (!err)
+		err = gcry_sexp_build (&s_sig, NULL, "(sig-val(rsa(s%m)))",
+				       value);
+	gcry_mpi_release (value);
+	if (err)
+		return PGP_UNSUPPORTED;
+
+	err = gcry_pk_verify (s_sig, s_data, key->sexp);
+	gcry_sexp_release (s_sig);
+	gcry_sexp_release (s_data);
+
+	return err ? PGP_BAD : PGP_GOOD;
+}
+
+enum pgp_status
+pgp_verify (const struct pgp_keyring *ring, const void *data, size_t len,
+	    const BYTE *sig, size_t sig_len)
+{
+	struct verify_ctx ctx = { NULL, 0 };
+	enum pgp_status status;
+
+	status = verify_sig (&ctx, ring, data, len, sig, sig_len);
+	if (ctx.md)
+		gcry_md_close (ctx.md);
+
+	return status;
+}
+
+struct verify_pool {
+	const struct pgp_keyring *ring;
+	struct pgp_verify_job *jobs;
+	size_t count;
+	size_t next;		/* Next job to take, taken atomically */
+};
+
+static void *
+verify_worker (void *arg)
+{
+	struct verify_pool *pool = arg;
+	struct verify_ctx ctx = { NULL, 0 };
+	size_t i;
+
+	rgn_stats_enter (RGN_PHASE_VERIFY);
+	while ((i = __atomic_fetch_add (&pool->next, 1, __ATOMIC_RELAXED)) <
+	       pool->count) {
+		struct pgp_verify_job *job = &pool->jobs[i];
+		ULONGLONG span = rgn_trace_begin ();
+
+		job->status = verify_sig (&ctx, pool->ring, job->data,
+					  job->len, job->sig, job->sig_len);
+		rgn_trace_end ("verify", span, i);
+		rgn_stats_add (RGN_PHASE_VERIFY, job->len);
+	}
+	if (ctx.md)
+		gcry_md_close (ctx.md);
+	rgn_stats_leave ();
+
+	return NULL;
+}
+
+static void *
+verify_thread (void *arg)
+{
+	rgn_trace_thread_name ("verify");
+	return verify_worker (arg);
+}
+
+int
+pgp_verify_batch (const struct pgp_keyring *ring,
+		  struct pgp_verify_job *jobs, size_t count, int threads)
+{
+	struct verify_pool pool;
+	pthread_t *tids;
+	int i, started;
+
+	pool.ring = ring;
+	pool.jobs = jobs;
+	pool.count = count;
+	pool.next = 0;
+
+	if ((size_t)threads > count)
+		threads = count;
+	if (threads <= 1) {
+		verify_worker (&pool);
+		return 0;
+	}
+
+	tids = calloc (threads, sizeof(*tids));
+	if (!tids) {
+		fprintf (stderr, "Out of memory\n");
+		return -1;
+	}
+	for (started = 0; started < threads; started++) {
+		if (pthread_create (&tids[started], NULL, verify_thread,
+				    &pool))
+			break;
+	}
+	/* Whatever threads did start finish the whole batch */
+	if (started == 0)
+		verify_worker (&pool);
+	for (i = 0; i < started; i++)
+		pthread_join (tids[i], NULL);
+	free (tids);
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * pgp.h
+ *
+ * Minimal OpenPGP (RFC 4880) support for signing and verifying update
+ * chunks in-process: loading exported RSA keys, creating detached v4
+ * signatures that gpg --verify and the updater accept, and checking them.
+ */
+
+#ifndef PGP_H
+#define PGP_H
+
+#include <stddef.h>
+#include <gcrypt.h>
+
+#include "rgn.h"
+
+#define PGP_FPR_LEN	20
+#define PGP_KEYID_LEN	8
+
+/* An RSA key taken from an exported OpenPGP key block */
+struct pgp_key {
+	int secret;			/* Private parameters are loaded */
+	UINT created;
+	BYTE fpr[PGP_FPR_LEN];		/* v4 fingerprint */
+	BYTE keyid[PGP_KEYID_LEN];
+	gcry_sexp_t sexp;		/* Public or private key */
+};
+
+/* Every RSA key and subkey of an exported key block */
+struct pgp_keyring {
+	struct pgp_key *keys;
+	int count;
+};
+
+enum pgp_status {
+	PGP_GOOD,
+	PGP_BAD,			/* Data or signature was altered */
+	PGP_NO_KEY,			/* Made by a key not in the ring */
+	PGP_UNSUPPORTED,		/* Not a v4 RSA binary signature */
+	PGP_MALFORMED,
+};
+
+/* One detached signature to check, pointing into the caller's memory */
+struct pgp_verify_job {
+	const void *data;
+	size_t len;
+	const BYTE *sig;
+	size_t sig_len;			/* May include padding after the packet */
+	enum pgp_status status;		/* Set by pgp_verify_batch() */
+};
+
+/*
+ * Initialise libgcrypt.  Must be called once before any other function,
+ * before any threads are started.
+ */
+int pgp_init (void);
+
+/*
+ * Load the primary key from an exported key block, binary or ASCII
+ * armored.  If the block holds a secret key it is loaded, decrypting it
+ * with passphrase if it is protected.  Returns 0 or -1 after printing
+ * the reason to stderr.
+ */
+int pgp_key_load (struct pgp_key *key, const char *path,
+		  const char *passphrase);
+void pgp_key_free (struct pgp_key *key);
+
+/*
+ * Create a binary detached signature over data with a secret key.  sig
+ * must hold *sig_len bytes; on return *sig_len is the length of the
+ * signature packet.  created is the signature creation time, so signing
+ * the same data with the same time gives the same signature.  Safe to
+ * call from several threads with the same key.
+ */
+int pgp_sign (const struct pgp_key *key, const void *data, size_t len,
+	      UINT created, BYTE *sig, size_t *sig_len);
+
+/*
+ * Load the public part of every RSA key in a key block exported with
+ * gpg --export (or --export-secret-keys).  Returns 0 or -1 after
+ * printing the reason to stderr.
+ */
+int pgp_keyring_load (struct pgp_keyring *ring, const char *path);
+void pgp_keyring_free (struct pgp_keyring *ring);
+
+/*
+ * Check a detached signature over data.  Thread safe.
+ */
+enum pgp_status pgp_verify (const struct pgp_keyring *ring, const void *data,
+			    size_t len, const BYTE *sig, size_t sig_len);
+
+/*
+ * Check count signatures with up to threads threads.  Each thread keeps
+ * its hash context from one job to the next.  Every job gets a status;
+ * a failure never stops the batch.  Returns -1 only if the batch could
+ * not be run.
+ */
+int pgp_verify_batch (const struct pgp_keyring *ring,
+		      struct pgp_verify_job *jobs, size_t count, int threads);
+const char *pgp_status_string (enum pgp_status status);
+
+#endif /* PGP_H */
@@ -6,6 +6,7 @@
  * Copyright 2009-2010 by Garmin Ltd. or its subsidiaries
  */
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,19 +16,16 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
 
+#include "rgn.h"
+#include "pgp.h"
 
-#define END_OF_TRANSFER 	(0xFFFFFFFF)
-
-#define IO_READ_RETRY_COUNT	1000
-#define IO_WRITE_RETRY_COUNT	1000
 
+#define END_OF_TRANSFER 	(0xFFFFFFFF)
 
-/* Region file header information */
-#define FILE_ID                 0x7247704B
-#define DATA_VERSION_REC_CHAR   'D'
-#define APP_VERSION_REC_CHAR    'A'
-#define REGION_REC_CHAR         'R'
 
 #define PRODUCT_VERSION_MAJOR   (2)
 #define PRODUCT_VERSION_MINOR   (0)
@@ -52,57 +50,10 @@
 #define RECORD_BUFFER_SIZE 256
 #define ERROR_SIZE (70)
 
-#define NUM_DATA_RECS		(7)
-
 #define PARSER_VERSION		"1.0"
 #define PARSER_NAME		"Garmin Region File Parser"
 
 
-/* Structure for holding region information */
-struct region {
-        char * file;
-        unsigned int delay;
-        unsigned int size;
-        unsigned short id;
-};
-
-/* Format of region data in region header */
-struct region_header {
-        unsigned short id;
-        unsigned int delay;
-        unsigned int size;
-} __attribute__ ((__packed__));
-
-struct ll_header{
-	unsigned int fileid;
-	unsigned short version;
-}__attribute__ ((__packed__));
-
-
-struct data_record{
-	unsigned int size;
-	char type;
-	char *data;
-}__attribute__ ((__packed__));
-
-
-struct app_version {
-	unsigned short version;
-	char *str;
-}__attribute__ ((__packed__));
-
-
-struct pgp_region_hdr {
-        unsigned int virt_region_type;   /* Type of virtual region */
-        unsigned int header_len;         /* Length of this header */
-        unsigned int target;             /* Product-specific field to specify different
-                                   areas of flash */
-        unsigned int offset;             /* Offset within this flash target */
-        unsigned int chunk_size;         /* Size of each signed data chunk */
-        unsigned int sig_size;           /* Size each signature is padded to */
-}__attribute__ ((__packed__));
-
-
 /* Macro to build a buffer of null-terminated strings */
 #define ADD_STRING(buf, str, max, size) \
         do {                                            \
@@ -116,29 +67,56 @@ static int parse_cmdline(int argc, char *argv[]);
 static void usage(int exitval);
 static int init_parser();
 static int deinit_parser();
-static int parse_rgn_file(int fd);
-int parse_rgn_chunks(int fd, int rgn_size, struct pgp_region_hdr);
-static int dump_data_sig_to_files(char *data, int data_size, char *sig, 
-                                int sig_size, int rgnid, int chunkid);
-int read_data(int fd, const char *buff, int size, int giveup);
-int write_data(int fd, const char *buff, int size, int giveup);
-int get_ll_header(int fd, char *buf, int bufsize);
-int read_data_record(int fd, char *buf, int bufsize);
-static void dump_bytes(char *data, int num_of_bytes);
+static int parse_rgn_file(const struct rgn_file *file);
+static int parse_rgn_toc(const struct rgn_file *file, const struct rgn_toc *toc);
+static int summary_toc(const struct rgn_file *file, struct rgn_toc *toc);
+int parse_rgn_chunks(const struct rgn_region *rgn, struct vr_header_v2 pgp);
+static int dump_data_sig_to_files(const char *data, int data_size,
+				const char *sig, int sig_size, int rgnid,
+				int chunkid);
+static int process_chunk(const char *data, int data_size,
+			const char *sig, int sig_size, int rgnid,
+			int chunkid);
+static int verify_chunks(void);
+static int region_pgp_header(const struct rgn_region *rgn,
+			struct vr_header_v2 *pgp);
+static int inflate_region(struct rgn_region *rgn);
+int read_data_record(const struct rgn_record *rec);
 
 
 int desired_rgn = -1;
 int desired_chunk = -1;
 int detach_sig = 0;
 int verify = 0;
+int verify_jobs = 1;
+enum rgn_stats_format stats;
+const char *cachefile;
 
 char ofile[512];
 char ifile[512];
+char keyfile[512];
+
+/* Chunks queued for verification once the file has been parsed */
+struct chunk_id {
+	int rgnid;
+	int chunkid;
+};
+static struct pgp_keyring keyring;
+static struct pgp_verify_job *checks;
+static struct chunk_id *check_ids;
+static int check_count;
+static int check_alloc;
 
-static int infd;
+static struct rgn_file rgnfile;
 static int outfd;
 
-static int cur_pos_in_rgn_file = 0;
+/* Decompressed regions, mapped until the queued chunks are verified */
+struct inflated {
+	void *map;
+	size_t len;
+};
+static struct inflated *inflated;
+static int inflated_count;
 
 
 #define logmsg(format, args...) fprintf(stdout, format, ##args); \
@@ -156,27 +134,34 @@ int main(int argc, char *argv[])
 		usage(1);
 	}
 
+	rgn_stats_start("region-file-data-extractor", stats);
+	rgn_trace_start("region-file-data-extractor");
+	rgn_stats_enter(RGN_PHASE_PARSE);
 	ret = init_parser();
 	if(ret < 0) {
 		logmsg("parser init failed\n");
 	}
 
-	ret = parse_rgn_file(infd);
+	ret = parse_rgn_file(&rgnfile);
 	if(ret < 0) {
 		logmsg("%s parse error\n", ifile);
 	}
+	rgn_stats_add(RGN_PHASE_PARSE, rgnfile.size);
+	rgn_stats_leave();
 
 	if(ret < 0) {
 		exit(1);
 	}
 
-	ret = deinit_parser();	
-	if(ret < 0) {
+	if(verify)
+		ret = verify_chunks();
+
+	if(deinit_parser() < 0) {
 		logmsg("parser deinit failed\n");
 	}
 	
 	
-	return 0;
+	return ret ? 1 : 0;
 }
 
 
@@ -188,8 +173,18 @@ static void usage(int exitval)
         printf("     -r, 	filter for desired region (target or partition) number\n");
         printf("     -c, 	filter for desired chunk within region\n");
 	printf("     -d,        detach chunk data and signature\n");
-	printf("     -v,        verify gpg signature as the region file gets parsed\n");
+	printf("     -v,        verify the chunk signatures and report on each chunk\n");
+	printf("     -k,        public key file for -v (exported with gpg --export)\n");
+	printf("     -j,        number of threads verifying signatures and\n");
+	printf("                decompressing compressed regions\n");
 	printf("     -o,	output file name\n");
+	printf("     -b,	read the region file with buffered, mmap, direct or uring I/O\n");
+	printf("     --stats[=FORMAT]\n");
+	printf("                print the bytes, time, system calls and peak RSS of\n");
+	printf("                each phase to stderr, as text or json\n");
+	printf("     --cache FILE\n");
+	printf("                keep the region table of files without a TOC in\n");
+	printf("                FILE for -r (default: $RGN_CACHE)\n");
         printf("\n");
 
         exit(exitval);
@@ -200,8 +195,14 @@ static int parse_cmdline(int argc, char *argv[])
 {
         int option;
 	int ofile_provided = 0;
-
-        while((option = getopt(argc, argv, "hdvr:c:o:")) != -1) {
+	static const struct option long_options[] = {
+		{ "stats", optional_argument, NULL, 'S' },
+		{ "cache", required_argument, NULL, 'C' },
+		{ NULL, 0, NULL, 0 }
+	};
+
+        while((option = getopt_long(argc, argv, "hdvr:c:o:k:j:b:",
+					long_options, NULL)) != -1) {
                 switch(option) {
                         case 'h':
                                 usage(0);
@@ -233,6 +234,44 @@ static int parse_cmdline(int argc, char *argv[])
 				printf("Verify signatures = %d\n", verify);
 			break;
 
+			case 'k':
+				snprintf(keyfile, sizeof(keyfile), "%s", optarg);
+				printf("Public key file = %s\n", keyfile);
+			break;
+
+			case 'b': {
+				enum rgn_io_backend io;
+
+				if(rgn_io_parse(optarg, &io)) {
+					printf("Unknown I/O backend %s\n\n", optarg);
+					usage(1);
+				}
+				rgn_io_set_default(io);
+				printf("I/O backend = %s\n", optarg);
+			}
+			break;
+
+			case 'j':
+				verify_jobs = atoi(optarg);
+				if(verify_jobs < 1) {
+					printf("Invalid number of jobs\n\n");
+					usage(1);
+				}
+			break;
+
+			case 'S':
+				if(rgn_stats_parse(optarg, &stats)) {
+					printf("Unknown statistics format %s\n\n",
+						optarg);
+					usage(1);
+				}
+			break;
+
+			case 'C':
+				cachefile = optarg;
+				printf("Cache file = %s\n", cachefile);
+			break;
+
                         default:
                                 printf("Invalid option\n\n");
                                 usage(1);
@@ -250,6 +289,11 @@ static int parse_cmdline(int argc, char *argv[])
 		snprintf(ofile, sizeof(ofile), "%s.dump", ifile);
 	}
 
+	if(verify && !keyfile[0]) {
+		printf("-v needs a public key file (-k)\n\n");
+		usage(1);
+	}
+
 	//logmsg("SSIZE_MAX = %d\n", SSIZE_MAX);
 	
 	printf("\n");
@@ -261,17 +305,24 @@ static int parse_cmdline(int argc, char *argv[])
 
 static int init_parser()
 {
-	infd = open(ifile, O_RDONLY);
-	if(infd < 0)
+	int ret;
+
+	ret = rgn_open(&rgnfile, ifile);
+	if(ret < 0)
 		logmsg("infd open err\n");
 	outfd = open(ofile, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
         if(outfd < 0)
                 logmsg("outfd open err\n");
 
-	if(infd < 0 || outfd < 0) {
+	if(ret < 0 || outfd < 0) {
 		return -1;
 	}
 
+	if(verify) {
+		if(pgp_init() || pgp_keyring_load(&keyring, keyfile))
+			return -1;
+	}
+
 	return 0;
 }
 
@@ -279,150 +330,209 @@ static int init_parser()
 
 static int deinit_parser()
 {
-	return !(close(infd) && close(outfd));
+	int i;
+
+	if(verify)
+		pgp_keyring_free(&keyring);
+	for(i = 0; i < inflated_count; i++)
+		munmap(inflated[i].map, inflated[i].len);
+	free(inflated);
+	free(checks);
+	free(check_ids);
+	rgn_close(&rgnfile);
+	return close(outfd);
 }
 
 
-static int parse_rgn_file(int fd)
+static int parse_rgn_file(const struct rgn_file *file)
 {
-	int done = 0;
 	int ret = 0;
-	int i = 0;
 
-	char buf[4096];
-	struct ll_header *header1;
+	struct vir header1;
+	struct rgn_iter it;
+	struct rgn_record rec;
+	struct rgn_toc toc;
 
-	if(fd < 0)
+	if(file->fd < 0)
 		return -1;
 
-	while(!done) {
-		ret = get_ll_header(fd, buf, sizeof(buf));
-		if(ret) {
-			logmsg("ll_header err\n");
-			done = 1;
-			continue; 
-		}
+	ret = rgn_read_vir(file, &header1);
+	if(ret) {
+		logmsg("ll_header err\n");
+		ret = -1;
+		goto done;
+	}
+
+	logmsg("\nLL Header: fileid = %x, version = %i\n", header1.file_id, header1.version);
 
-		header1 = (struct ll_header*)buf;
-		logmsg("\nLL Header: fileid = %x, version = %i\n", header1->fileid, header1->version);
-		for(i = 0; i < NUM_DATA_RECS; i++) {
-			ret = read_data_record(fd, buf, sizeof(buf));
-                	if(ret) {
-				if(ret == -2)
-					break;
-                        	logmsg("data_record err\n");
-                        	done = 1;
-                        	continue;
-                	}
+	/* A TOC, or a cached region table, lets us jump straight to the
+	 * desired region */
+	if(desired_rgn != -1 && (rgn_toc_read(file->fd, &toc) > 0 ||
+				 summary_toc(file, &toc))) {
+		ret = parse_rgn_toc(file, &toc);
+		rgn_toc_free(&toc);
+		if(ret < 0) {
+			logmsg("data_record err\n");
 		}
+		goto done;
+	}
 
-		done = 1;
+	/* Every record is a view into the mapped file */
+	rgn_iter_init(&it, file);
+	while((ret = rgn_iter_next(&it, &rec)) > 0) {
+		ret = read_data_record(&rec);
+		if(ret)
+			break;
+	}
+	if(ret == -2)
+		ret = 0;
+	if(ret < 0) {
+		logmsg("data_record err\n");
 	}
 
+done:
 	logmsg("Parsing of all regions complete.\n\n");
 
-	return 0;
+	return ret < 0 ? -1 : 0;
 }
 
 
-int get_ll_header(int fd, char *buf, int bufsize)
+static int parse_rgn_toc(const struct rgn_file *file, const struct rgn_toc *toc)
 {
-        int read_len;
+	struct rgn_region rgn;
+	struct vr_header_v2 pgp_hdr;
+	UINT i;
 	int ret;
 
-	if(fd < 0 || bufsize < sizeof(struct ll_header))
-		return -1;
+	for(i = 0; i < toc->count; i++) {
+		if(rgn_toc_region(file->fd, toc, i, &rgn))
+			return -1;
+		if(rgn.offset + rgn.size > file->size)
+			continue;
 
-	read_len = sizeof(struct ll_header);
-	//logmsg("read_len = %d\n", read_len);
-	ret = read_data(fd, buf, read_len, 1);
-	if(ret != read_len)
-		ret = -1;
-	else
+		rgn.data = file->map + rgn.offset;
+		ret = region_pgp_header(&rgn, &pgp_hdr);
+		if(ret < 0)
+			return -1;
+		if(!ret || pgp_hdr.target != desired_rgn)
+			continue;
+
+		logmsg("\nRegion Header: id = %d, delay = %u, size = %llu\n", 
+			rgn.id, rgn.delay, rgn.size);
+		if(rgn.type != REGION_REC_CHAR && inflate_region(&rgn))
+			return -1;
+		logmsg("\nProcessing region: %u\n", pgp_hdr.target);
+		ret = parse_rgn_chunks(&rgn, pgp_hdr);
+		if(ret < 0) {
+			logmsg("chunk parsing err\n");
+			return -1;
+		}
+		return 0;
+	}
+
+	logmsg("region %d not found\n", desired_rgn);
+	return 0;
+}
+
+
+/*
+ * Fill in toc from the region table the cache keeps for a file without
+ * one, summarizing the file and storing the table on a miss.  Returns 1
+ * if toc was filled in, 0 if the file has to be walked.
+ */
+static int summary_toc(const struct rgn_file *file, struct rgn_toc *toc)
+{
+	struct rgn_cache *cache;
+	struct rgn_cache_key key;
+	struct rgn_summary summary;
+	int ret = 0;
+
+	cache = rgn_cache_open(cachefile);
+	if(!cache) {
+		if(errno) {
+			logmsg("cache open err: %s\n", strerror(errno));
+		}
+		return 0;
+	}
+
+	if(rgn_cache_key(cache, file->fd, NULL, &key))
+		goto done;
+	ret = rgn_cache_lookup(cache, &key, &summary, NULL);
+	if(ret == 0 && rgn_summarize(file->fd, file->size, &summary) == 0) {
+		rgn_cache_store(cache, file->fd, &key, &summary, 0);
+		ret = 1;
+	}
+	if(ret == 1) {
+		ret = !summary.problems && !rgn_summary_toc(&summary, toc);
+		rgn_summary_free(&summary);
+	}
+	else {
 		ret = 0;
+	}
 
+done:
+	if(rgn_cache_close(cache)) {
+		logmsg("cache write err: %s\n", strerror(errno));
+	}
 	return ret;
 }
 
 
-int read_data_record(int fd, char *buf, int bufsize)
+int read_data_record(const struct rgn_record *rec)
 {
-        int read_len;
         int ret;
-	char type;
-        struct data_record *rec;
-	struct region_header *rgn_header;
-	struct pgp_region_hdr *pgp_hdr;
-	int rgn_size;
-	struct pgp_region_hdr cur_rgn_pgp_hdr;
-
-        if(fd < 0 || bufsize < sizeof(struct data_record))
-                return -1;
-
-        read_len = sizeof(struct data_record) - sizeof(char(*));
-        ret = read_data(fd, buf, read_len, 1);
-	//logmsg("read_len = %d\n", read_len);
-        if(ret != read_len)
-                return -1;
+	struct rgn_region rgn;
+	struct vr_header_v2 pgp_hdr;
 
-	rec = (struct data_record*)buf;
+	logmsg("\nData Record: size = %llu, type = %c\n", rec->size, rec->type);
 
-	logmsg("\nData Record: size = %u, type = %c\n", rec->size, rec->type);
-	type = rec->type;
-
-	switch(type) {
+	switch(rec->type) {
 
 		case DATA_VERSION_REC_CHAR:
 		case APP_VERSION_REC_CHAR:
-			read_len = rec->size;
-			//logmsg("read_len = %d\n", read_len);
-			ret = read_data(fd, buf, read_len, 1);
-			if(ret != read_len)
-				return -1;
+		case REGION_TOC_REC_CHAR:
+		case REGION_CRC_REC_CHAR:
+		case REGION_DELTA_REC_CHAR:
 		break;
 
 		case REGION_REC_CHAR:
-			read_len = sizeof(struct region_header);
-			//logmsg("read_len = %d\n", read_len);
-			ret = read_data(fd, buf, read_len, 1);
-			if(ret != read_len)
+		case REGION_COMPRESSED_REC_CHAR:
+		case REGION_SPARSE_REC_CHAR:
+			if(rgn_decode_region(rec, &rgn))
+				return -1;
+			logmsg("\nRegion Header: id = %d, delay = %u, size = %llu\n", 
+				rgn.id, rgn.delay, rgn.size);
+
+			/* Only PGP signed virtual regions carry chunks */
+			ret = region_pgp_header(&rgn, &pgp_hdr);
+			if(ret < 0)
 				return -1;
-			rgn_header = (struct region_header*)buf;
-			rgn_size = rgn_header->size;
-			logmsg("\nRegion Header: id = %d, delay = %u, size = %u\n", 
-				rgn_header->id, rgn_header->delay, 
-				rgn_header->size);
-#if 0
-			read_len = sizeof(struct pgp_region_hdr);
-			//logmsg("read_len = %d\n", read_len);
-			//logmsg("filpos = %d\n", cur_pos_in_rgn_file);
-                        ret = read_data(fd, buf, read_len, 1);
-                        if(ret != read_len)
-                                return -1;
-			pgp_hdr = (struct pgp_region_hdr*)buf;
-			memcpy(&cur_rgn_pgp_hdr, pgp_hdr, sizeof(cur_rgn_pgp_hdr));
+			if(!ret)
+				break;
+
 			logmsg("\nPGP Header: virtual_rgn_type = %u, header_len = %u, "
                                  "target = %u, offset = %u, chunk_size = %u, sig_size = %u\n", 
-                                pgp_hdr->virt_region_type,
-			       	pgp_hdr->header_len, pgp_hdr->target, pgp_hdr->offset,
-				pgp_hdr->chunk_size, pgp_hdr->sig_size);
-			if(pgp_hdr->target == END_OF_TRANSFER) {
+                                pgp_hdr.virtual_region,
+			       	pgp_hdr.header_len, pgp_hdr.target, pgp_hdr.offset,
+				pgp_hdr.chunk_size, pgp_hdr.sig_size);
+			if(pgp_hdr.target == END_OF_TRANSFER) {
 				logmsg("last target, nothing beyond!\n");
 				return -2;
 			}
 			/* process chunks inside a region */
-			if(desired_rgn == -1 || desired_rgn == pgp_hdr->target) {
-				logmsg("\nProcessing region: %u\n", desired_rgn);
-				ret = parse_rgn_chunks(fd, rgn_size, cur_rgn_pgp_hdr);
-				if(ret < 0)
+			if(desired_rgn == -1 || desired_rgn == pgp_hdr.target) {
+				if(rgn.type != REGION_REC_CHAR &&
+				   inflate_region(&rgn))
+					return -1;
+				logmsg("\nProcessing region: %u\n", pgp_hdr.target);
+				ret = parse_rgn_chunks(&rgn, pgp_hdr);
+				if(ret < 0) {
 					logmsg("chunk parsing err\n");
-				return -2;
-
-			} else {
-				lseek(fd, rgn_size - read_len, SEEK_CUR);
-				cur_pos_in_rgn_file += rgn_size - read_len;
+					return -1;
+				}
+				if(desired_rgn != -1)
+					return -2;
 			}
-#endif
 		break;
 
 		default:
@@ -436,134 +546,289 @@ int read_data_record(int fd, char *buf, int bufsize)
 
 
 
-int parse_rgn_chunks(int fd, int rgn_size, struct pgp_region_hdr pgp)
+/*
+ * Decode the first len bytes of a region of size bytes as a PGP header.
+ * A v2 header gives its own length.  The v1 header build-signed-update
+ * writes by default is {virtual_region, offset, chunk_size, sig_size},
+ * with no length or target, so the region ID stands in for the target.
+ * Returns 1 for a PGP signed virtual region and 0 for any other region.
+ */
+static int decode_pgp_header(const struct rgn_region *rgn, const BYTE *raw,
+			size_t len, ULONGLONG size, struct vr_header_v2 *pgp)
 {
-	int chunkid = 0;
-	int skip_bytes = 0;
+	UINT v1[4];
+
+	if(len < sizeof(v1))
+		return 0;
+	memcpy(v1, raw, sizeof(v1));
+	if(v1[0] != PGP_SIGNED_VIRT_RGN)
+		return 0;
+
+	/* Take it as v2 only if its length and sizes are plausible */
+	if(len >= sizeof(*pgp)) {
+		memcpy(pgp, raw, sizeof(*pgp));
+		if(pgp->header_len >= sizeof(*pgp) &&
+		   pgp->chunk_size != 0 && pgp->sig_size != 0 &&
+		   pgp->header_len + (ULONGLONG)pgp->sig_size < size)
+			return 1;
+	}
+
+	pgp->virtual_region = v1[0];
+	pgp->header_len = sizeof(v1);
+	pgp->target = rgn->id;
+	pgp->offset = v1[1];
+	pgp->chunk_size = v1[2];
+	pgp->sig_size = v1[3];
+	return 1;
+}
+
+
+/*
+ * Read the PGP header at the start of a region.  Of a compressed region
+ * only the first block is decompressed for it, and of a sparse one only
+ * the header is expanded.  Returns 1 for a PGP signed virtual region, 0
+ * for any other region and -1 on error.
+ */
+static int region_pgp_header(const struct rgn_region *rgn,
+			struct vr_header_v2 *pgp)
+{
+	struct region_compressed hdr;
+	struct region_sparse sparse;
+	BYTE raw[sizeof(*pgp)];
+	BYTE *block;
+	ssize_t len;
 	int ret;
-	int data_read = 0;
 
-	char data_buf[pgp.chunk_size + 512];
-	char sig_buf[pgp.sig_size + 512];
+	if(rgn->type == REGION_SPARSE_REC_CHAR) {
+		if(rgn_sparse_header(rgn->data, rgn->size, &sparse)) {
+			logmsg("invalid sparse region %d\n", rgn->id);
+			return -1;
+		}
+		len = rgn_sparse_read(rgn->data, rgn->size, 0, raw,
+				sizeof(raw));
+		if(len < 0) {
+			logmsg("invalid sparse region %d\n", rgn->id);
+			return -1;
+		}
+		return decode_pgp_header(rgn, raw, len, sparse.size, pgp);
+	}
+
+	if(rgn->type != REGION_COMPRESSED_REC_CHAR) {
+		len = rgn->size < sizeof(raw) ? rgn->size : sizeof(raw);
+		return decode_pgp_header(rgn, rgn->data, len, rgn->size, pgp);
+	}
+
+	if(rgn_compressed_header(rgn->data, rgn->size, &hdr)) {
+		logmsg("invalid compressed region %d\n", rgn->id);
+		return -1;
+	}
+	if(hdr.size == 0)
+		return 0;
+
+	block = malloc(hdr.block_size);
+	if(!block)
+		return -1;
+	len = rgn_decompress_block(rgn->data, rgn->size, 0, block);
+	if(len <= 0) {
+		logmsg("invalid compressed region %d\n", rgn->id);
+		free(block);
+		return -1;
+	}
+	if(len > (ssize_t)sizeof(raw))
+		len = sizeof(raw);
+	ret = decode_pgp_header(rgn, block, len, hdr.size, pgp);
+	free(block);
+
+	return ret;
+}
+
+
+/*
+ * Expand a compressed or sparse region into an unlinked temporary file,
+ * with the blocks of a compressed one spread over the -j threads and the
+ * zero runs of a sparse one left as holes, and point rgn at a mapping of
+ * it.  Chunks are used in place there, so the mapping is kept until the
+ * parser is torn down.
+ */
+static int inflate_region(struct rgn_region *rgn)
+{
+	struct region_compressed hdr;
+	struct region_sparse sparse;
+	const char *tmpdir;
+	void *map, *tmp;
+	int fd, ret;
+
+	if(rgn->type == REGION_SPARSE_REC_CHAR) {
+		if(rgn_sparse_header(rgn->data, rgn->size, &sparse))
+			return -1;
+		hdr.size = sparse.size;
+	}
+	else if(rgn_compressed_header(rgn->data, rgn->size, &hdr)) {
+		return -1;
+	}
+
+	tmpdir = getenv("TMPDIR");
+	if(!tmpdir)
+		tmpdir = "/tmp";
+	fd = open(tmpdir, O_TMPFILE | O_RDWR, S_IRUSR | S_IWUSR);
+	if(fd < 0) {
+		logmsg("unable to create temporary file in %s: %s\n",
+			tmpdir, strerror(errno));
+		return -1;
+	}
+	rgn_stats_enter(RGN_PHASE_COPY);
+	if(rgn->type == REGION_SPARSE_REC_CHAR)
+		ret = rgn_sparse_expand(rgn->data, rgn->size, fd);
+	else
+		ret = rgn_decompress(rgn->data, rgn->size, fd, verify_jobs);
+	rgn_stats_add(RGN_PHASE_COPY, hdr.size);
+	rgn_stats_leave();
+	if(ret) {
+		logmsg("unable to expand region %d: %s\n", rgn->id,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return -1;
+
+	tmp = realloc(inflated, (inflated_count + 1) * sizeof(*inflated));
+	if(!tmp) {
+		munmap(map, hdr.size);
+		return -1;
+	}
+	inflated = tmp;
+	inflated[inflated_count].map = map;
+	inflated[inflated_count].len = hdr.size;
+	inflated_count++;
+
+	logmsg("expanded region %d: %llu -> %u bytes\n", rgn->id,
+		rgn->size, hdr.size);
+	rgn->data = map;
+	rgn->size = hdr.size;
+	rgn->offset = 0;
+
+	return 0;
+}
+
+
+/*
+ * Dump or queue the chunks of a PGP signed virtual region, or only chunk
+ * desired_chunk.  The chunk and signature sizes come from the file, so
+ * every chunk is checked to lie within the region first.  Returns 0, or
+ * -1 if the header is bad or a chunk could not be processed.
+ */
+int parse_rgn_chunks(const struct rgn_region *rgn, struct vr_header_v2 pgp)
+{
+	int chunkid = 0;
+	int ret = 0;
+	UINT data_read = 0;
+	UINT sig_size = pgp.sig_size;
+	UINT chunk_size = pgp.chunk_size;
+	ULONGLONG skip_bytes = 0;
+	ULONGLONG span = rgn_trace_begin();
+
+	/* Chunks follow the PGP header and are used in place */
+	const char *chunks;
+	const char *data;
+	ULONGLONG rgn_size;
+
+	ULONGLONG rgn_pos = 0;
+
+	if(rgn->size < pgp.header_len) {
+		logmsg("region %d is too short for its PGP header\n", rgn->id);
+		ret = -1;
+		goto cleanup;
+	}
+	if(chunk_size == 0 || sig_size == 0 ||
+	   chunk_size > INT_MAX || sig_size > INT_MAX) {
+		logmsg("invalid chunk size %u or signature size %u\n",
+			chunk_size, sig_size);
+		ret = -1;
+		goto cleanup;
+	}
+	chunks = (const char *)rgn->data + pgp.header_len;
+	rgn_size = rgn->size - pgp.header_len;
 
-	int rgn_pos = 0;
-	
 	/* chunks are indexed at 0 */
-	/*
-  	logmsg("parsing chunks<%u %u %u %u %u %u>\n", 
-		pgp.virt_region_type,
-		pgp.header_len, pgp.target, pgp.offset, 
-		pgp.chunk_size, pgp.sig_size);
-	*/
 
 	if(desired_chunk == -1)	{
 		/* dump each chunk */
 		logmsg("dumping each chunk\n");
-		rgn_size -= sizeof(struct pgp_region_hdr);
 		rgn_pos = 0;
 		chunkid = 0;
-		while(rgn_pos < rgn_size 
-				- pgp.sig_size) {
-			if(rgn_pos + pgp.chunk_size + pgp.sig_size > rgn_size)
-				data_read = rgn_size
-				- rgn_pos - pgp.sig_size;
+		/* Each chunk has at least one byte of data and its signature */
+		while(rgn_pos + sig_size < rgn_size) {
+			if(rgn_pos + chunk_size + sig_size > rgn_size)
+				data_read = rgn_size - rgn_pos - sig_size;
 			else
-				data_read = pgp.chunk_size;
+				data_read = chunk_size;
 			logmsg("\nDumping chunk <region = %d, chunkid = %d> "
-                                 "@ <byte_offset = %d, size = %d>\n\n", pgp.target,
+                                 "@ <byte_offset = %llu, size = %u>\n\n", pgp.target,
 				chunkid, rgn_pos, data_read);
-                	ret = read_data(fd, data_buf, data_read, 0);
-                	if(ret != data_read) {
-                        	logmsg("unable to read pgp data %d\n", ret);
-                        	goto cleanup;
-                	}
-
-                	/* dump sig */
-                	ret = read_data(fd, sig_buf, pgp.sig_size, 0);
-                	if(ret != pgp.sig_size) {
-                       		logmsg("unable to read pgp sig %d\n", ret);
-                       		goto cleanup;
-                	}
+			data = chunks + rgn_pos;
 
-                	ret = dump_data_sig_to_files(data_buf, data_read, sig_buf,
-                                       pgp.sig_size, pgp.target, chunkid);
+                	ret = process_chunk(data, data_read,
+					data + data_read, sig_size,
+					pgp.target, chunkid);
                		if(ret) {
                        		logmsg("unable to dump data and sig %d\n", ret);
+				ret = -1;
                        		goto cleanup;
                		}
         	       	chunkid++;
-			rgn_pos += data_read + pgp.sig_size;	
+			rgn_pos += data_read + sig_size;	
 		}
 		
 	} else if (desired_chunk >= 0) {
 
-		rgn_size -= sizeof(struct pgp_region_hdr);
 		/* dump if desired_chunk lies in this rgn */
-		//logmsg("dumping the desired chunk\n");
-		skip_bytes = desired_chunk * (pgp.chunk_size + pgp.sig_size); 
+		skip_bytes = (ULONGLONG)desired_chunk *
+				((ULONGLONG)chunk_size + sig_size);
 
 		/* chunk not in rgn */
-		if(skip_bytes > rgn_size) {
-			logmsg("chunk not found in this rgn %d %d\n", 
+		if(skip_bytes + sig_size >= rgn_size) {
+			logmsg("chunk not found in this rgn %llu %llu\n", 
 				skip_bytes, rgn_size);
-			chunkid = -1;
 			goto cleanup;
 		}
 
-		//logmsg("skip_bytes = %d\n", skip_bytes);
-
-		/* seek to the desired chunk */
-		lseek(fd, skip_bytes, SEEK_CUR);
-		cur_pos_in_rgn_file += skip_bytes;
-
-		//logmsg("writing %d\n", desired_chunk);
-		if(skip_bytes + pgp.chunk_size + pgp.sig_size > rgn_size) {
-			data_read = rgn_size  - skip_bytes - pgp.sig_size;
+		if(skip_bytes + chunk_size + sig_size > rgn_size) {
+			data_read = rgn_size  - skip_bytes - sig_size;
 		} else {
-			data_read = pgp.chunk_size;
+			data_read = chunk_size;
 		}
-                logmsg("\nDumping chunk <region = %d, chunkid = %d> @ <byte_offset = %d, "
-                         "size = %d>\n\n", pgp.target, 
+                logmsg("\nDumping chunk <region = %d, chunkid = %d> @ <byte_offset = %llu, "
+                         "size = %u>\n\n", pgp.target, 
 			desired_chunk, skip_bytes, data_read);
-		ret = read_data(fd, data_buf, data_read, 0);
-		if(ret != data_read) {
-			logmsg("unable to read pgp data %d\n", ret);
-			chunkid = -1;
-			goto cleanup;
-		} 
+		data = chunks + skip_bytes;
 
-                /* dump sig */
-                ret = read_data(fd, sig_buf, pgp.sig_size, 0);
-                if(ret != pgp.sig_size) {
-                        logmsg("unable to read pgp sig %d\n", ret);
-			chunkid = -1;
-			goto cleanup;
-                }
-
-		ret = dump_data_sig_to_files(data_buf, data_read, sig_buf,
-					pgp.sig_size, pgp.target, desired_chunk);
+		ret = process_chunk(data, data_read, data + data_read,
+					sig_size, pgp.target, desired_chunk);
 
 		if(ret) {
 			logmsg("unable to dump data and sig %d\n", ret);
-			chunkid = -1;
+			ret = -1;
 			goto cleanup;
 		}	
-		
-		chunkid = desired_chunk;
 	}
 
 cleanup:
-	return chunkid;
+	rgn_trace_end("parse_rgn_chunks", span, rgn->id);
+	return ret;
 
 }
 
 
-static int dump_data_sig_to_files(char *data, int data_size, char *sig, 
-				int sig_size, int rgnid, int chunkid)
+static int dump_data_sig_to_files(const char *data, int data_size,
+				const char *sig, int sig_size, int rgnid,
+				int chunkid)
 {
         char datafname[512];
         char sigfname[512];
-	char system_cmd[512];
         int datafd;
         int sigfd;
 	int ret;
@@ -585,13 +850,13 @@ static int dump_data_sig_to_files(char *data, int data_size, char *sig,
 		return -1;	
         }
 
-        ret = write_data(datafd, data, data_size, 0);
+        ret = rgn_write_full(datafd, data, data_size);
         if(ret != data_size) {
                 logmsg("unable to write to %s %d\n", datafname, ret);
         	return -1;
         }
 
-        ret = write_data(sigfd, sig, sig_size, 0);
+        ret = rgn_write_full(sigfd, sig, sig_size);
 	if(ret != sig_size) {
                 logmsg("unable to write to %s %d\n", sigfname, ret);
                 return -1;
@@ -600,100 +865,106 @@ static int dump_data_sig_to_files(char *data, int data_size, char *sig,
 	close(datafd);
         close(sigfd);
 
-        if(verify) {
-	        snprintf(system_cmd, sizeof(system_cmd), "gpg --verify %s",
-                                sigfname);
-
-                ret = system(system_cmd);
-                if(ret) {
-                	logmsg("unable to verify\n");
-			exit(1);
-                }
-        }
-
 	return 0;
 }
 
 
-int read_data(int fd, const char *buff, int size, int giveup)
+/*
+ * Queue a chunk for verification.  The data and signature stay where
+ * they are in the mapped region file.
+ */
+static int queue_verify(const char *data, int data_size,
+			const char *sig, int sig_size, int rgnid,
+			int chunkid)
 {
-        int bytes_left = size;
-        int bytes_read = 0;
-        int tot_bytes_read = 0;
-        int no_read = 0;
-
-        if(fd < 0 || buff == 0) {
-                return -1;
-        }
+	if(check_count == check_alloc) {
+		int n = check_alloc ? check_alloc * 2 : 64;
+		void *tmp;
 
-        while(bytes_left) {
-                bytes_read = read(fd, (void*)(buff + tot_bytes_read), bytes_left);
-                if(bytes_read <= 0) {
-                        no_read++;
-                        if(no_read % IO_READ_RETRY_COUNT == 0) {
-                                //logmsg("r%d.", tot_bytes_read);
-                                no_read = 0;
-                                if(giveup)
-                                        break;
-                        }
-                } else {
-                        bytes_left -= bytes_read;
-                        tot_bytes_read += bytes_read;
-                }
-        }
+		tmp = realloc(checks, n * sizeof(*checks));
+		if(!tmp)
+			return -1;
+		checks = tmp;
+		tmp = realloc(check_ids, n * sizeof(*check_ids));
+		if(!tmp)
+			return -1;
+		check_ids = tmp;
+		check_alloc = n;
+	}
 
-	cur_pos_in_rgn_file += tot_bytes_read;
-	//logmsg("filpos = %d\n", cur_pos_in_rgn_file);
+	checks[check_count].data = data;
+	checks[check_count].len = data_size;
+	checks[check_count].sig = (const BYTE *)sig;
+	checks[check_count].sig_len = sig_size;
+	check_ids[check_count].rgnid = rgnid;
+	check_ids[check_count].chunkid = chunkid;
+	check_count++;
 
-        return tot_bytes_read;
+	return 0;
 }
 
 
-
-int write_data(int fd, const char *buff, int size, int giveup)
+/*
+ * Chunks are written out when they are not being verified, or when -d
+ * asks for them as well.
+ */
+static int process_chunk(const char *data, int data_size,
+			const char *sig, int sig_size, int rgnid,
+			int chunkid)
 {
-        int bytes_left = size;
-        int bytes_written = 0;
-        int tot_bytes_written = 0;
-        int no_write = 0;
+	ULONGLONG span;
+	int ret;
 
-        if(fd < 0 || buff == 0) {
-                return -1;
-        }
+	if(!verify || detach_sig) {
+		rgn_stats_enter(RGN_PHASE_OUTPUT);
+		span = rgn_trace_begin();
+		ret = dump_data_sig_to_files(data, data_size, sig, sig_size,
+					rgnid, chunkid);
+		rgn_trace_end("dump_data_sig_to_files", span, chunkid);
+		rgn_stats_add(RGN_PHASE_OUTPUT, data_size + sig_size);
+		rgn_stats_leave();
+		if(ret)
+			return ret;
+	}
 
-        while(bytes_left) {
-                bytes_written = write(fd, buff + tot_bytes_written, bytes_left);
-                if(bytes_written <= 0) {
-                        no_write++;
-                        if(no_write % IO_WRITE_RETRY_COUNT == 0) {
-                                logmsg("w%d.", tot_bytes_written);
-                                no_write = 0;
-                                if(giveup)
-                                        break;
-                        }
-                } else {
-                        bytes_left -= bytes_written;
-                        tot_bytes_written += bytes_written;
-                }
-        }
+	if(verify)
+		return queue_verify(data, data_size, sig, sig_size, rgnid,
+				chunkid);
 
-        return tot_bytes_written;
+	return 0;
 }
 
 
-static void dump_bytes(char *data, int num_of_bytes)
+/*
+ * Verify every queued chunk and report on each.  Returns the number of
+ * chunks that failed, or 1 if there was no signed chunk to verify.
+ */
+static int verify_chunks(void)
 {
-        int pos = 0;
+	int i, ret, failed = 0;
 
-        if(num_of_bytes <= 0) {
-                return;
-        }
+	if(!check_count) {
+		logmsg("\nNo signed chunks found to verify\n");
+		return 1;
+	}
 
-        for(pos = 0; pos < num_of_bytes; pos++) {
-                logmsg("0x%x  ", *(data+pos));
-                if(pos == 15) {
-                        logmsg("\n");
-                }
-        }
-        logmsg("\n");
+	rgn_stats_enter(RGN_PHASE_VERIFY);
+	ret = pgp_verify_batch(&keyring, checks, check_count, verify_jobs);
+	rgn_stats_leave();
+	if(ret < 0)
+		return check_count ? check_count : 1;
+
+	logmsg("\nSignature report:\n");
+	for(i = 0; i < check_count; i++) {
+		logmsg("chunk <region = %d, chunkid = %d>: %s\n",
+			check_ids[i].rgnid, check_ids[i].chunkid,
+			pgp_status_string(checks[i].status));
+		if(checks[i].status != PGP_GOOD)
+			failed++;
+	}
+	logmsg("%d chunks verified, %d good, %d failed\n", check_count,
+		check_count - failed, failed);
+
+	return failed;
 }
+
@@ -0,0 +1,230 @@
+/*
+ * rgn-bench.c
+ *
+ * Run a command and report its throughput, system call count and peak
+ * resident set size.  Used by bench.sh; strace and time(1) are not
+ * needed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+struct run {
+	double seconds;
+	long max_rss;			/* KiB */
+	long long syscalls;		/* -1 if they could not be counted */
+	int status;
+};
+
+static const char *in_file;
+static const char *out_file;
+
+static void
+usage (const char *name)
+{
+	printf ("Usage: %s [OPTION]... -- COMMAND [ARG]...\n", name);
+	printf ("Run COMMAND and print one line of statistics:\n");
+	printf ("label, seconds, MB/s, system calls and peak RSS in KiB.\n");
+	printf ("\n");
+	printf ("  -l LABEL   Label for the output line\n");
+	printf ("  -b BYTES   Bytes processed, for the MB/s figure\n");
+	printf ("  -i FILE    Standard input of the command\n");
+	printf ("  -o FILE    Standard output of the command (default /dev/null)\n");
+	printf ("  -H         Print a header line and exit\n");
+	printf ("  -S         Do not count system calls\n");
+	printf ("  -h         Display this help message\n");
+	exit (0);
+}
+
+static void
+redirect (const char *path, int fd, int flags)
+{
+	int new_fd;
+
+	new_fd = open (path, flags, 0644);
+	if (new_fd < 0 || dup2 (new_fd, fd) < 0) {
+		fprintf (stderr, "%s: %s\n", path, strerror (errno));
+		_exit (127);
+	}
+	close (new_fd);
+}
+
+static pid_t
+spawn (char **argv, int trace)
+{
+	pid_t pid;
+
+	pid = fork ();
+	if (pid < 0) {
+		fprintf (stderr, "fork: %s\n", strerror (errno));
+		exit (1);
+	}
+	if (pid)
+		return pid;
+
+	if (in_file)
+		redirect (in_file, STDIN_FILENO, O_RDONLY);
+	redirect (out_file, STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC);
+	if (trace) {
+		if (ptrace (PTRACE_TRACEME, 0, NULL, NULL))
+			_exit (126);
+		raise (SIGSTOP);
+	}
+	execvp (argv[0], argv);
+	fprintf (stderr, "%s: %s\n", argv[0], strerror (errno));
+	_exit (127);
+}
+
+static double
+now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* An untraced run for the time and memory figures */
+static void
+timed_run (char **argv, struct run *run)
+{
+	struct rusage ru;
+	double start;
+	pid_t pid;
+
+	start = now ();
+	pid = spawn (argv, 0);
+	if (wait4 (pid, &run->status, 0, &ru) < 0) {
+		fprintf (stderr, "wait: %s\n", strerror (errno));
+		exit (1);
+	}
+	run->seconds = now () - start;
+	run->max_rss = ru.ru_maxrss;
+}
+
+/*
+ * A second run under ptrace, stopping at each system call entry and
+ * exit.  All threads are followed; tracing is too slow to time.
+ */
+static void
+counted_run (char **argv, struct run *run)
+{
+	long long stops = 0;
+	int status, live = 1;
+	pid_t pid, child;
+
+	run->syscalls = -1;
+	child = spawn (argv, 1);
+	if (waitpid (child, &status, 0) < 0 || !WIFSTOPPED (status)) {
+		waitpid (child, &status, 0);
+		return;
+	}
+	if (ptrace (PTRACE_SETOPTIONS, child, NULL,
+		    PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE |
+		    PTRACE_O_EXITKILL) ||
+	    ptrace (PTRACE_SYSCALL, child, NULL, NULL)) {
+		kill (child, SIGKILL);
+		waitpid (child, &status, 0);
+		return;
+	}
+
+	while (live) {
+		int sig = 0;
+
+		pid = waitpid (-1, &status, __WALL);
+		if (pid < 0)
+			break;
+		if (WIFEXITED (status) || WIFSIGNALED (status)) {
+			if (pid == child)
+				live = 0;
+			continue;
+		}
+		if (!WIFSTOPPED (status))
+			continue;
+
+		if (WSTOPSIG (status) == (SIGTRAP | 0x80))
+			stops++;
+		else if (WSTOPSIG (status) != SIGTRAP &&
+			 WSTOPSIG (status) != SIGSTOP)
+			sig = WSTOPSIG (status);
+		ptrace (PTRACE_SYSCALL, pid, NULL, (void *)(long)sig);
+	}
+
+	/* An entry and an exit stop per call; exit_group has no exit */
+	run->syscalls = (stops + 1) / 2;
+}
+
+int
+main (int argc, char **argv)
+{
+	const char *label = NULL;
+	unsigned long long bytes = 0;
+	struct run run;
+	int count = 1;
+	int opt;
+
+	out_file = "/dev/null";
+	while ((opt = getopt (argc, argv, "hl:b:i:o:HS")) != -1) {
+		switch (opt) {
+		case 'l':
+			label = optarg;
+			break;
+		case 'b':
+			bytes = strtoull (optarg, NULL, 0);
+			break;
+		case 'i':
+			in_file = optarg;
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		case 'H':
+			printf ("%-40s %9s %10s %10s %10s\n", "benchmark",
+				"seconds", "MB/s", "syscalls", "RSS KiB");
+			return 0;
+		case 'S':
+			count = 0;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	if (optind >= argc)
+		usage (argv[0]);
+	if (!label)
+		label = argv[optind];
+
+	memset (&run, 0, sizeof(run));
+	run.syscalls = -1;
+	timed_run (argv + optind, &run);
+	if (!WIFEXITED (run.status) || WEXITSTATUS (run.status)) {
+		fprintf (stderr, "%s: command failed\n", label);
+		return 1;
+	}
+	if (count)
+		counted_run (argv + optind, &run);
+
+	printf ("%-40s %9.3f ", label, run.seconds);
+	if (bytes && run.seconds > 0)
+		printf ("%10.1f ", bytes / run.seconds / 1e6);
+	else
+		printf ("%10s ", "-");
+	if (run.syscalls >= 0)
+		printf ("%10lld ", run.syscalls);
+	else
+		printf ("%10s ", "-");
+	printf ("%10ld\n", run.max_rss);
+
+	return 0;
+}
@@ -0,0 +1,695 @@
+/*
+ * rgn-cache.c
+ *
+ * librgn: persistent cache of region file summaries
+ *
+ * The cache is a single file of entries, each the key of a region file
+ * followed by its summary and flags.  Entries are only ever appended, by
+ * one write() under an exclusive flock(), and carry their length and a
+ * CRC32C, so a write torn by a crash is ignored; the last entry for a
+ * device and inode wins, and one whose key no longer matches the file is
+ * simply a miss.  Readers map the file as it was when they opened it and
+ * take no lock.  Once superseded entries make up most of the file, a
+ * writer closing the cache rewrites the live ones into a temporary file
+ * and renames it into place while still holding the lock.  Writers check
+ * after locking that their descriptor is still the file at the path and
+ * reopen it if not, and readers keep the old file until they close it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rgn.h"
+
+#define CACHE_MAGIC	"RGNCACH1"
+#define ENTRY_MAGIC	0x45746e52	/* "RntE" */
+
+/* Entry flags kept next to the RGN_CACHE_* ones */
+#define ENTRY_HASHED	0x80000000
+
+/* Stores are written out in blocks of this size */
+#define PENDING_MAX	(1024 * 1024)
+
+/* Files are not compacted below this size */
+#define COMPACT_MIN	(1024 * 1024)
+
+/*
+ * A file changed this recently could change again without its times
+ * moving on file systems with coarse timestamps.
+ */
+#define RACY_NS		2000000000ULL
+
+/* Size of the reads that hash a file's contents */
+#define HASH_BLOCK	(1024 * 1024)
+
+struct cache_entry {
+	UINT magic;
+	UINT len;		/* Bytes after crc */
+	UINT crc;		/* CRC32C of those bytes */
+	ULONGLONG dev;
+	ULONGLONG ino;
+	ULONGLONG size;
+	ULONGLONG mtime;
+	ULONGLONG ctime;
+	UINT hash;
+	UINT flags;
+	USHORT version;
+	USHORT data_version;
+	USHORT app_version;
+	USHORT builder_len;	/* Strings follow, without terminators */
+	USHORT build_date_len;
+	USHORT build_time_len;
+	UINT records;
+	UINT region_count;	/* Regions follow the strings */
+	UINT problems;
+	BYTE toc;
+	BYTE has_avr;
+} __attribute__ ((__packed__));
+
+struct cache_region {
+	BYTE type;
+	BYTE crc;
+	USHORT id;
+	UINT delay;
+	ULONGLONG size;
+	ULONGLONG offset;
+} __attribute__ ((__packed__));
+
+#define ENTRY_CRC_START	offsetof(struct cache_entry, dev)
+
+struct rgn_cache {
+	char *path;
+	int fd;
+	int writable;
+	int hash;		/* Keys hold a hash of the contents */
+	const BYTE *map;	/* The file as it was opened */
+	size_t map_len;
+	size_t *index;		/* Entry offsets by device and inode, 0 free */
+	size_t index_size;	/* A power of two */
+	size_t index_used;
+	size_t live;		/* Bytes of the entries in the index */
+	size_t end;		/* End of the last whole entry */
+	pthread_mutex_t lock;	/* For the pending stores */
+	BYTE *pending;
+	size_t pending_len;
+	size_t pending_alloc;
+};
+
+static size_t
+index_slot (const struct rgn_cache *cache, ULONGLONG dev, ULONGLONG ino)
+{
+	ULONGLONG h = (dev * 0x9e3779b97f4a7c15ULL) ^ ino;
+
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return h & (cache->index_size - 1);
+}
+
+static const struct cache_entry *
+entry_at (const BYTE *map, size_t offset)
+{
+	return (const struct cache_entry *)(map + offset);
+}
+
+static size_t
+entry_size (const struct cache_entry *e)
+{
+	return ENTRY_CRC_START + e->len;
+}
+
+/*
+ * Point the index at the entry at offset, replacing any earlier one for
+ * the same file.
+ */
+static int
+index_add (struct rgn_cache *cache, const BYTE *map, size_t offset)
+{
+	const struct cache_entry *e = entry_at (map, offset);
+	size_t i;
+
+	if (2 * (cache->index_used + 1) > cache->index_size) {
+		size_t *old = cache->index, old_size = cache->index_size, j;
+
+		cache->index_size = old_size ? 2 * old_size : 1024;
+		cache->index = calloc (cache->index_size, sizeof(size_t));
+		if (!cache->index) {
+			cache->index = old;
+			cache->index_size = old_size;
+			return -1;
+		}
+		for (j = 0; j < old_size; j++) {
+			const struct cache_entry *o;
+
+			if (!old[j])
+				continue;
+			o = entry_at (map, old[j]);
+			i = index_slot (cache, o->dev, o->ino);
+			while (cache->index[i])
+				i = (i + 1) & (cache->index_size - 1);
+			cache->index[i] = old[j];
+		}
+		free (old);
+	}
+
+	i = index_slot (cache, e->dev, e->ino);
+	while (cache->index[i]) {
+		const struct cache_entry *o = entry_at (map, cache->index[i]);
+
+		if (o->dev == e->dev && o->ino == e->ino) {
+			cache->live -= entry_size (o);
+			break;
+		}
+		i = (i + 1) & (cache->index_size - 1);
+	}
+	if (!cache->index[i])
+		cache->index_used++;
+	cache->index[i] = offset;
+	cache->live += entry_size (e);
+	return 0;
+}
+
+/*
+ * Index every whole entry of map.  A damaged or partly written entry ends
+ * the walk, since nothing after it can be trusted to be aligned.
+ */
+static int
+index_build (struct rgn_cache *cache, const BYTE *map, size_t len)
+{
+	size_t pos = sizeof(CACHE_MAGIC) - 1;
+
+	free (cache->index);
+	cache->index = NULL;
+	cache->index_size = cache->index_used = cache->live = 0;
+
+	while (len - pos >= sizeof(struct cache_entry)) {
+		const struct cache_entry *e = entry_at (map, pos);
+
+		if (e->magic != ENTRY_MAGIC ||
+		    e->len < sizeof(*e) - ENTRY_CRC_START ||
+		    e->len > len - pos - ENTRY_CRC_START ||
+		    rgn_crc32c (0, map + pos + ENTRY_CRC_START, e->len) !=
+								e->crc ||
+		    entry_size (e) != sizeof(*e) + e->builder_len +
+				      e->build_date_len + e->build_time_len +
+				      (size_t)e->region_count *
+				      sizeof(struct cache_region))
+			break;
+		if (index_add (cache, map, pos))
+			return -1;
+		pos += entry_size (e);
+	}
+	cache->end = pos;
+	return 0;
+}
+
+static int
+map_cache (struct rgn_cache *cache)
+{
+	struct stat st;
+	void *map;
+
+	if (fstat (cache->fd, &st))
+		return -1;
+	/* Empty, or a header still being written: no entries yet */
+	if ((size_t)st.st_size < sizeof(CACHE_MAGIC) - 1)
+		return 0;
+
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	if (memcmp (map, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1)) {
+		munmap (map, st.st_size);
+		errno = EBADMSG;
+		return -1;
+	}
+	cache->map = map;
+	cache->map_len = st.st_size;
+	return index_build (cache, cache->map, cache->map_len);
+}
+
+struct rgn_cache *
+rgn_cache_open (const char *path)
+{
+	struct rgn_cache *cache;
+	const char *env;
+
+	if (!path)
+		path = getenv ("RGN_CACHE");
+	if (!path || !*path) {
+		errno = 0;
+		return NULL;
+	}
+
+	cache = calloc (1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->path = strdup (path);
+	if (!cache->path)
+		goto fail;
+	env = getenv ("RGN_CACHE_HASH");
+	cache->hash = env && *env;
+	pthread_mutex_init (&cache->lock, NULL);
+
+	cache->fd = open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	cache->writable = cache->fd >= 0;
+	if (cache->fd < 0)
+		cache->fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (cache->fd < 0)
+		goto fail;
+	if (map_cache (cache))
+		goto fail;
+	return cache;
+
+fail:
+	rgn_cache_close (cache);
+	return NULL;
+}
+
+int
+rgn_cache_key (struct rgn_cache *cache, int fd, const struct stat *st,
+	       struct rgn_cache_key *key)
+{
+	struct stat fst;
+
+	if (!st) {
+		if (fstat (fd, &fst))
+			return -1;
+		st = &fst;
+	}
+
+	memset (key, 0, sizeof(*key));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+	key->size = st->st_size;
+	key->mtime = st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec;
+	key->ctime = st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+
+	if (cache->hash) {
+		BYTE *buf = malloc (HASH_BLOCK);
+		off_t pos = 0;
+		ssize_t n;
+
+		if (!buf)
+			return -1;
+		while ((n = pread (fd, buf, HASH_BLOCK, pos)) != 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0) {
+				free (buf);
+				return -1;
+			}
+			key->hash = rgn_crc32c (key->hash, buf, n);
+			pos += n;
+		}
+		free (buf);
+		key->has_hash = 1;
+	}
+	return 0;
+}
+
+static int
+key_matches (const struct cache_entry *e, const struct rgn_cache_key *key)
+{
+	return e->dev == key->dev && e->ino == key->ino &&
+	       e->size == key->size && e->mtime == key->mtime &&
+	       e->ctime == key->ctime &&
+	       !!(e->flags & ENTRY_HASHED) == key->has_hash &&
+	       (!key->has_hash || e->hash == key->hash);
+}
+
+static char *
+entry_string (const char **pos, USHORT len)
+{
+	char *s = strndup (*pos, len);
+
+	*pos += len;
+	return s;
+}
+
+int
+rgn_cache_lookup (struct rgn_cache *cache, const struct rgn_cache_key *key,
+		  struct rgn_summary *summary, unsigned int *flags)
+{
+	const struct cache_entry *e = NULL;
+	const struct cache_region *r;
+	const char *pos;
+	size_t i;
+	UINT n;
+
+	if (!cache->index_size)
+		return 0;
+	for (i = index_slot (cache, key->dev, key->ino); cache->index[i];
+	     i = (i + 1) & (cache->index_size - 1)) {
+		e = entry_at (cache->map, cache->index[i]);
+		if (e->dev == key->dev && e->ino == key->ino)
+			break;
+	}
+	if (!cache->index[i] || !key_matches (e, key))
+		return 0;
+
+	memset (summary, 0, sizeof(*summary));
+	summary->version = e->version;
+	summary->data_version = e->data_version;
+	summary->app_version = e->app_version;
+	summary->records = e->records;
+	summary->toc = e->toc;
+	summary->problems = e->problems;
+
+	pos = (const char *)(e + 1);
+	if (e->has_avr) {
+		summary->builder = entry_string (&pos, e->builder_len);
+		summary->build_date = entry_string (&pos, e->build_date_len);
+		summary->build_time = entry_string (&pos, e->build_time_len);
+		if (!summary->builder || !summary->build_date ||
+		    !summary->build_time)
+			goto fail;
+	}
+
+	summary->regions = malloc (e->region_count * sizeof(*summary->regions)
+									+ 1);
+	if (!summary->regions)
+		goto fail;
+	r = (const struct cache_region *)pos;
+	for (n = 0; n < e->region_count; n++, r++) {
+		summary->regions[n].type = r->type;
+		summary->regions[n].crc = r->crc;
+		summary->regions[n].id = r->id;
+		summary->regions[n].delay = r->delay;
+		summary->regions[n].size = r->size;
+		summary->regions[n].offset = r->offset;
+	}
+	summary->region_count = e->region_count;
+
+	if (flags)
+		*flags = e->flags & ~ENTRY_HASHED;
+	return 1;
+
+fail:
+	rgn_summary_free (summary);
+	return -1;
+}
+
+static size_t
+avr_string_len (const char *s)
+{
+	size_t len = s ? strlen (s) : 0;
+
+	return len > 0xffff ? 0xffff : len;
+}
+
+static int flush (struct rgn_cache *cache);
+
+int
+rgn_cache_store (struct rgn_cache *cache, int fd,
+		 const struct rgn_cache_key *key,
+		 const struct rgn_summary *summary, unsigned int flags)
+{
+	struct cache_entry e;
+	struct cache_region r;
+	struct timespec now;
+	struct stat st;
+	ULONGLONG now_ns;
+	size_t len;
+	BYTE *p;
+	UINT n;
+	int ret = 0;
+
+	if (!cache->writable)
+		return 0;
+
+	/* Changed since the key was taken, or too recently to tell */
+	clock_gettime (CLOCK_REALTIME, &now);
+	now_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	if (key->mtime + RACY_NS > now_ns || key->ctime + RACY_NS > now_ns)
+		return 0;
+	if (fstat (fd, &st))
+		return -1;
+	if (st.st_dev != key->dev || st.st_ino != key->ino ||
+	    st.st_size != key->size ||
+	    st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec !=
+								key->mtime ||
+	    st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec !=
+								key->ctime)
+		return 0;
+
+	memset (&e, 0, sizeof(e));
+	e.magic = ENTRY_MAGIC;
+	e.dev = key->dev;
+	e.ino = key->ino;
+	e.size = key->size;
+	e.mtime = key->mtime;
+	e.ctime = key->ctime;
+	e.hash = key->hash;
+	e.flags = flags | (key->has_hash ? ENTRY_HASHED : 0);
+	e.version = summary->version;
+	e.data_version = summary->data_version;
+	e.app_version = summary->app_version;
+	e.has_avr = summary->builder != NULL;
+	e.builder_len = avr_string_len (summary->builder);
+	e.build_date_len = avr_string_len (summary->build_date);
+	e.build_time_len = avr_string_len (summary->build_time);
+	e.records = summary->records;
+	e.region_count = summary->region_count;
+	e.problems = summary->problems;
+	e.toc = summary->toc;
+	len = sizeof(e) + e.builder_len + e.build_date_len +
+	      e.build_time_len + e.region_count * sizeof(r);
+	e.len = len - ENTRY_CRC_START;
+
+	pthread_mutex_lock (&cache->lock);
+	if (cache->pending_len + len > cache->pending_alloc) {
+		size_t alloc = cache->pending_alloc ? cache->pending_alloc : 65536;
+		BYTE *buf;
+
+		while (alloc < cache->pending_len + len)
+			alloc *= 2;
+		buf = realloc (cache->pending, alloc);
+		if (!buf) {
+			pthread_mutex_unlock (&cache->lock);
+			return -1;
+		}
+		cache->pending = buf;
+		cache->pending_alloc = alloc;
+	}
+
+	p = cache->pending + cache->pending_len;
+	memcpy (p, &e, sizeof(e));
+	p += sizeof(e);
+	memcpy (p, summary->builder, e.builder_len);
+	p += e.builder_len;
+	memcpy (p, summary->build_date, e.build_date_len);
+	p += e.build_date_len;
+	memcpy (p, summary->build_time, e.build_time_len);
+	p += e.build_time_len;
+	for (n = 0; n < e.region_count; n++) {
+		r.type = summary->regions[n].type;
+		r.crc = summary->regions[n].crc;
+		r.id = summary->regions[n].id;
+		r.delay = summary->regions[n].delay;
+		r.size = summary->regions[n].size;
+		r.offset = summary->regions[n].offset;
+		memcpy (p, &r, sizeof(r));
+		p += sizeof(r);
+	}
+	e.crc = rgn_crc32c (0, cache->pending + cache->pending_len +
+			    ENTRY_CRC_START, e.len);
+	memcpy (cache->pending + cache->pending_len +
+		offsetof(struct cache_entry, crc), &e.crc, sizeof(e.crc));
+	cache->pending_len += len;
+	if (cache->pending_len >= PENDING_MAX)
+		ret = flush (cache);
+	pthread_mutex_unlock (&cache->lock);
+
+	return ret;
+}
+
+/*
+ * Lock the cache file for writing, reopening it first if another process
+ * has renamed a compacted file over it.
+ */
+static int
+lock_cache (struct rgn_cache *cache)
+{
+	for (;;) {
+		struct stat st, path_st;
+		int fd;
+
+		if (flock (cache->fd, LOCK_EX))
+			return -1;
+		if (fstat (cache->fd, &st))
+			return -1;
+		if (stat (cache->path, &path_st) == 0 &&
+		    st.st_dev == path_st.st_dev && st.st_ino == path_st.st_ino)
+			return 0;
+
+		fd = open (cache->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return -1;
+		close (cache->fd);
+		cache->fd = fd;
+	}
+}
+
+/*
+ * Rewrite the live entries of the locked cache file into a new file and
+ * rename it into place.
+ */
+static int
+compact (struct rgn_cache *cache, const BYTE *map, size_t len)
+{
+	struct rgn_cache live;
+	char *tmp;
+	size_t i;
+	FILE *f;
+	int fd;
+
+	memset (&live, 0, sizeof(live));
+	if (index_build (&live, map, len))
+		return -1;
+	if (len < COMPACT_MIN || 2 * live.live > len) {
+		free (live.index);
+		return 0;
+	}
+
+	if (asprintf (&tmp, "%s.XXXXXX", cache->path) < 0) {
+		free (live.index);
+		return -1;
+	}
+	fd = mkostemp (tmp, O_CLOEXEC);
+	f = fd < 0 ? NULL : fdopen (fd, "w");
+	if (!f) {
+		if (fd >= 0)
+			close (fd);
+		goto fail;
+	}
+	fputs (CACHE_MAGIC, f);
+	for (i = 0; i < live.index_size; i++) {
+		const struct cache_entry *e;
+
+		if (!live.index[i])
+			continue;
+		e = entry_at (map, live.index[i]);
+		fwrite (e, entry_size (e), 1, f);
+	}
+	if (fchmod (fd, 0644) || fflush (f) || fsync (fd)) {
+		fclose (f);
+		goto fail;
+	}
+	if (fclose (f) || rename (tmp, cache->path))
+		goto fail;
+
+	free (tmp);
+	free (live.index);
+	return 0;
+
+fail:
+	unlink (tmp);
+	free (tmp);
+	free (live.index);
+	return -1;
+}
+
+/*
+ * Append the pending stores to the cache file and compact it if that is
+ * due.
+ */
+static int
+flush (struct rgn_cache *cache)
+{
+	struct rgn_cache current;
+	struct stat st;
+	void *map;
+	int ret = -1, err;
+
+	if (lock_cache (cache))
+		return -1;
+	if (fstat (cache->fd, &st))
+		goto out;
+
+	/*
+	 * Append after the last whole entry, so that a write torn by a
+	 * crash is overwritten rather than hiding everything after it.
+	 */
+	memset (&current, 0, sizeof(current));
+	if ((size_t)st.st_size < sizeof(CACHE_MAGIC) - 1) {
+		/* A new file, or one whose header was cut short */
+		if (pwrite (cache->fd, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1,
+			    0) != sizeof(CACHE_MAGIC) - 1)
+			goto out;
+		current.end = sizeof(CACHE_MAGIC) - 1;
+	}
+	else {
+		map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED,
+			    cache->fd, 0);
+		if (map == MAP_FAILED)
+			goto out;
+		if (memcmp (map, CACHE_MAGIC, sizeof(CACHE_MAGIC) - 1)) {
+			munmap (map, st.st_size);
+			errno = EBADMSG;
+			goto out;
+		}
+		err = index_build (&current, map, st.st_size);
+		munmap (map, st.st_size);
+		free (current.index);
+		if (err)
+			goto out;
+	}
+
+	if (pwrite (cache->fd, cache->pending, cache->pending_len,
+		    current.end) != (ssize_t)cache->pending_len)
+		goto out;
+	if (current.end + cache->pending_len < (size_t)st.st_size &&
+	    ftruncate (cache->fd, current.end + cache->pending_len))
+		goto out;
+	cache->pending_len = 0;
+
+	if (fstat (cache->fd, &st))
+		goto out;
+	if ((size_t)st.st_size < COMPACT_MIN) {
+		ret = 0;
+		goto out;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, cache->fd, 0);
+	if (map == MAP_FAILED)
+		goto out;
+	ret = compact (cache, map, st.st_size);
+	munmap (map, st.st_size);
+
+out:
+	flock (cache->fd, LOCK_UN);
+	return ret;
+}
+
+int
+rgn_cache_close (struct rgn_cache *cache)
+{
+	int ret = 0;
+
+	if (!cache)
+		return 0;
+	if (cache->pending_len)
+		ret = flush (cache);
+	if (cache->map)
+		munmap ((void *)cache->map, cache->map_len);
+	if (cache->fd >= 0)
+		close (cache->fd);
+	pthread_mutex_destroy (&cache->lock);
+	free (cache->pending);
+	free (cache->index);
+	free (cache->path);
+	free (cache);
+	return ret;
+}
@@ -0,0 +1,466 @@
+/*
+ * rgn-compress.c
+ *
+ * Compressed region payloads: a struct region_compressed, a table with the
+ * end offset of each block and the blocks themselves, each compressed on
+ * its own with zlib.  A block that does not shrink is stored as is, which
+ * shows as a stored length equal to the block length.
+ *
+ * Both directions run the blocks through a pool of threads.  Each thread
+ * takes the next block and codes it into a slot of a small ring; the
+ * calling thread writes the slots out in block order, so memory stays at a
+ * few blocks per thread whatever the payload size.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "rgn.h"
+
+/* Slots in the ring per thread */
+#define SLOTS_PER_THREAD	2
+
+struct slot {
+	BYTE *buf;		/* Coded block, when not used in place */
+	const BYTE *data;	/* Block to write: buf or the input */
+	size_t len;
+	int ready;
+};
+
+struct pipeline;
+
+/* Code block index into slot; returns 0 or -1 with errno set */
+typedef int (*block_fn) (struct pipeline *p, UINT index, struct slot *slot);
+
+struct pipeline {
+	block_fn work;
+	UINT count;		/* Blocks */
+	UINT window;		/* Slots in the ring */
+	struct slot *slots;
+	size_t slot_size;
+	UINT next;		/* Next block to code */
+	UINT written;		/* Blocks written so far */
+	int error;		/* errno of the first failure */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+
+	/* The payload being coded */
+	const BYTE *in;
+	size_t in_len;
+	UINT block_size;
+	int level;
+	const UINT *ends;	/* Block end offsets, when decompressing */
+	const BYTE *blocks;	/* First compressed block */
+	size_t blocks_len;
+};
+
+static void *
+pipeline_worker (void *arg)
+{
+	struct pipeline *p = arg;
+
+	rgn_trace_thread_name ("zlib");
+	rgn_stats_enter (RGN_PHASE_ENCODE);
+	pthread_mutex_lock (&p->lock);
+	while (!p->error && p->next < p->count) {
+		ULONGLONG span;
+		UINT i;
+		int ret;
+
+		if (p->next >= p->written + p->window) {
+			pthread_cond_wait (&p->cond, &p->lock);
+			continue;
+		}
+		i = p->next++;
+		pthread_mutex_unlock (&p->lock);
+
+		span = rgn_trace_begin ();
+		ret = p->work (p, i, &p->slots[i % p->window]);
+		rgn_trace_end ("block", span, i);
+
+		pthread_mutex_lock (&p->lock);
+		if (ret && !p->error)
+			p->error = errno ? errno : EIO;
+		p->slots[i % p->window].ready = 1;
+		pthread_cond_broadcast (&p->cond);
+	}
+	pthread_mutex_unlock (&p->lock);
+	rgn_stats_leave ();
+
+	return NULL;
+}
+
+/*
+ * Code every block with threads workers and pass the results in order to
+ * emit.  One thread codes and writes by itself.
+ */
+static int
+pipeline_run (struct pipeline *p, int threads,
+	      int (*emit) (struct pipeline *p, UINT index, struct slot *slot,
+			   void *arg),
+	      void *arg)
+{
+	pthread_t *tids = NULL;
+	int started = 0, i, ret = 0;
+	ULONGLONG span;
+	UINT n;
+
+	if (threads < 1)
+		threads = 1;
+	if ((UINT)threads > p->count)
+		threads = p->count ? p->count : 1;
+	p->window = threads * SLOTS_PER_THREAD;
+	p->next = p->written = 0;
+	p->error = 0;
+
+	p->slots = calloc (p->window, sizeof(*p->slots));
+	if (!p->slots)
+		return -1;
+	for (n = 0; n < p->window; n++) {
+		p->slots[n].buf = malloc (p->slot_size);
+		if (!p->slots[n].buf) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	if (threads == 1) {
+		for (n = 0; n < p->count; n++) {
+			rgn_stats_enter (RGN_PHASE_ENCODE);
+			span = rgn_trace_begin ();
+			ret = p->work (p, n, &p->slots[0]);
+			rgn_trace_end ("block", span, n);
+			rgn_stats_leave ();
+			if (ret || emit (p, n, &p->slots[0], arg)) {
+				ret = -1;
+				goto out;
+			}
+		}
+		goto out;
+	}
+
+	pthread_mutex_init (&p->lock, NULL);
+	pthread_cond_init (&p->cond, NULL);
+	tids = malloc (threads * sizeof(*tids));
+	if (!tids) {
+		ret = -1;
+		goto join;
+	}
+	for (started = 0; started < threads; started++) {
+		errno = pthread_create (&tids[started], NULL, pipeline_worker,
+					p);
+		if (errno) {
+			pthread_mutex_lock (&p->lock);
+			p->error = errno;
+			pthread_cond_broadcast (&p->cond);
+			pthread_mutex_unlock (&p->lock);
+			break;
+		}
+	}
+
+	for (n = 0; n < p->count; n++) {
+		struct slot *slot = &p->slots[n % p->window];
+		int failed;
+
+		/* Time spent here is the writer stalled on the workers */
+		span = rgn_trace_begin ();
+		pthread_mutex_lock (&p->lock);
+		while (!slot->ready && !p->error)
+			pthread_cond_wait (&p->cond, &p->lock);
+		pthread_mutex_unlock (&p->lock);
+		rgn_trace_end ("wait_block", span, n);
+		if (p->error)
+			break;
+
+		span = rgn_trace_begin ();
+		failed = emit (p, n, slot, arg);
+		rgn_trace_end ("emit", span, n);
+		if (failed) {
+			pthread_mutex_lock (&p->lock);
+			p->error = errno ? errno : EIO;
+			pthread_cond_broadcast (&p->cond);
+			pthread_mutex_unlock (&p->lock);
+			break;
+		}
+
+		pthread_mutex_lock (&p->lock);
+		slot->ready = 0;
+		p->written = n + 1;
+		pthread_cond_broadcast (&p->cond);
+		pthread_mutex_unlock (&p->lock);
+	}
+
+join:
+	for (i = 0; i < started; i++)
+		pthread_join (tids[i], NULL);
+	free (tids);
+	pthread_cond_destroy (&p->cond);
+	pthread_mutex_destroy (&p->lock);
+	if (p->error) {
+		errno = p->error;
+		ret = -1;
+	}
+
+out:
+	for (n = 0; n < p->window; n++)
+		free (p->slots[n].buf);
+	free (p->slots);
+	return ret;
+}
+
+static size_t
+block_length (const struct pipeline *p, UINT index)
+{
+	size_t start = (size_t)index * p->block_size;
+
+	return p->in_len - start < p->block_size ? p->in_len - start :
+						   p->block_size;
+}
+
+static int
+compress_block (struct pipeline *p, UINT index, struct slot *slot)
+{
+	const BYTE *in = p->in + (size_t)index * p->block_size;
+	size_t len = block_length (p, index);
+	uLongf out_len = p->slot_size;
+
+	if (compress2 (slot->buf, &out_len, in, len, p->level) != Z_OK ||
+	    out_len >= len) {
+		/* Store it */
+		slot->data = in;
+		slot->len = len;
+		return 0;
+	}
+	slot->data = slot->buf;
+	slot->len = out_len;
+	return 0;
+}
+
+struct compress_out {
+	int fd;
+	UINT *ends;
+	size_t total;
+};
+
+static int
+emit_compressed (struct pipeline *p, UINT index, struct slot *slot,
+		 void *arg)
+{
+	struct compress_out *out = arg;
+
+	if (out->total + slot->len > 0xffffffffu) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (rgn_write_full (out->fd, slot->data, slot->len) < 0)
+		return -1;
+	out->total += slot->len;
+	out->ends[index] = out->total;
+	return 0;
+}
+
+static UINT
+block_count (size_t size, UINT block_size)
+{
+	return (size + block_size - 1) / block_size;
+}
+
+ssize_t
+rgn_compress (const void *data, size_t len, int fd, UINT block_size,
+	      int level, int threads)
+{
+	struct region_compressed hdr;
+	struct compress_out out;
+	struct pipeline p;
+	size_t table_len;
+	off_t start;
+	int ret;
+
+	if (len > 0xffffffffu || block_size == 0) {
+		errno = len > 0xffffffffu ? EFBIG : EINVAL;
+		return -1;
+	}
+
+	start = lseek (fd, 0, SEEK_CUR);
+	if (start < 0)
+		return -1;
+
+	memset (&p, 0, sizeof(p));
+	p.work = compress_block;
+	p.count = block_count (len, block_size);
+	p.slot_size = compressBound (block_size);
+	p.in = data;
+	p.in_len = len;
+	p.block_size = block_size;
+	p.level = level;
+
+	hdr.size = len;
+	hdr.block_size = block_size;
+	hdr.method = REGION_COMPRESS_ZLIB;
+	table_len = p.count * sizeof(UINT);
+
+	memset (&out, 0, sizeof(out));
+	out.fd = fd;
+	out.ends = calloc (p.count + 1, sizeof(UINT));
+	if (!out.ends)
+		return -1;
+
+	/* The table is filled in once the block sizes are known */
+	if (rgn_write_full (fd, &hdr, sizeof(hdr)) < 0 ||
+	    rgn_write_full (fd, out.ends, table_len) < 0) {
+		free (out.ends);
+		return -1;
+	}
+
+	ret = pipeline_run (&p, threads, emit_compressed, &out);
+	if (ret == 0 && pwrite (fd, out.ends, table_len,
+				start + sizeof(hdr)) != (ssize_t)table_len)
+		ret = -1;
+	free (out.ends);
+	if (ret)
+		return -1;
+
+	return sizeof(hdr) + table_len + out.total;
+}
+
+/*
+ * Check the header and find the table and the blocks.
+ */
+static int
+decode_payload (const BYTE *payload, size_t len, struct region_compressed *hdr,
+		const UINT **ends, const BYTE **blocks, size_t *blocks_len)
+{
+	size_t table_len;
+	UINT count;
+
+	if (len < sizeof(*hdr))
+		goto bad;
+	memcpy (hdr, payload, sizeof(*hdr));
+	if (hdr->method != REGION_COMPRESS_ZLIB || hdr->block_size == 0)
+		goto bad;
+
+	count = block_count (hdr->size, hdr->block_size);
+	table_len = (size_t)count * sizeof(UINT);
+	if (len - sizeof(*hdr) < table_len)
+		goto bad;
+
+	*ends = (const UINT *)(payload + sizeof(*hdr));
+	*blocks = payload + sizeof(*hdr) + table_len;
+	*blocks_len = len - sizeof(*hdr) - table_len;
+	return 0;
+
+bad:
+	errno = EBADMSG;
+	return -1;
+}
+
+int
+rgn_compressed_header (const BYTE *payload, size_t len,
+		       struct region_compressed *hdr)
+{
+	const UINT *ends;
+	const BYTE *blocks;
+	size_t blocks_len;
+
+	return decode_payload (payload, len, hdr, &ends, &blocks, &blocks_len);
+}
+
+/* The table may be unaligned in the file */
+static UINT
+block_end (const UINT *ends, UINT index)
+{
+	UINT end;
+
+	memcpy (&end, ends + index, sizeof(end));
+	return end;
+}
+
+static int
+decompress_block (struct pipeline *p, UINT index, struct slot *slot)
+{
+	size_t len = block_length (p, index);
+	UINT start = index ? block_end (p->ends, index - 1) : 0;
+	UINT end = block_end (p->ends, index);
+	uLongf out_len = len;
+
+	if (end < start || end > p->blocks_len)
+		goto bad;
+
+	if (end - start == len) {
+		slot->data = p->blocks + start;
+		slot->len = len;
+		return 0;
+	}
+	if (uncompress (slot->buf, &out_len, p->blocks + start,
+			end - start) != Z_OK || out_len != len)
+		goto bad;
+	slot->data = slot->buf;
+	slot->len = len;
+	return 0;
+
+bad:
+	errno = EBADMSG;
+	return -1;
+}
+
+ssize_t
+rgn_decompress_block (const BYTE *payload, size_t len, UINT index,
+		      void *buf)
+{
+	struct region_compressed hdr;
+	struct pipeline p;
+	struct slot slot;
+
+	memset (&p, 0, sizeof(p));
+	if (decode_payload (payload, len, &hdr, &p.ends, &p.blocks,
+			    &p.blocks_len))
+		return -1;
+	p.in_len = hdr.size;
+	p.block_size = hdr.block_size;
+	if (index >= block_count (hdr.size, hdr.block_size)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	slot.buf = buf;
+	if (decompress_block (&p, index, &slot))
+		return -1;
+	if (slot.data != buf)
+		memcpy (buf, slot.data, slot.len);
+	return slot.len;
+}
+
+static int
+emit_decompressed (struct pipeline *p, UINT index, struct slot *slot,
+		   void *arg)
+{
+	int fd = *(int *)arg;
+
+	return rgn_write_full (fd, slot->data, slot->len) < 0 ? -1 : 0;
+}
+
+int
+rgn_decompress (const BYTE *payload, size_t len, int out_fd, int threads)
+{
+	struct region_compressed hdr;
+	struct pipeline p;
+
+	memset (&p, 0, sizeof(p));
+	if (decode_payload (payload, len, &hdr, &p.ends, &p.blocks,
+			    &p.blocks_len))
+		return -1;
+
+	p.work = decompress_block;
+	p.count = block_count (hdr.size, hdr.block_size);
+	p.slot_size = hdr.block_size;
+	p.in_len = hdr.size;
+	p.block_size = hdr.block_size;
+
+	return pipeline_run (&p, threads, emit_decompressed, &out_fd);
+}
@@ -0,0 +1,234 @@
+/*
+ * rgn-copy.c
+ *
+ * librgn: in-kernel data transfer between descriptors
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "rgn.h"
+
+/* Largest single request handed to the kernel */
+#define COPY_CHUNK	(1UL << 30)
+
+/* Fallback buffer, aligned so it also suits O_DIRECT descriptors */
+#define COPY_BUF_SIZE	(1024 * 1024)
+#define COPY_BUF_ALIGN	4096
+
+/*
+ * Offsets are either given explicitly or taken from the file position,
+ * which then has to be moved along with the copy.
+ */
+static off_t
+position (int fd, off_t *off)
+{
+	return off ? *off : lseek (fd, 0, SEEK_CUR);
+}
+
+static void
+advance (int fd, off_t *off, size_t count)
+{
+	if (off)
+		*off += count;
+	else
+		lseek (fd, count, SEEK_CUR);
+}
+
+/*
+ * Share the extents of src with dst (a reflink on btrfs or xfs).  Only
+ * works for block aligned ranges of two regular files on the same file
+ * system; returns 0 when nothing was cloned.
+ */
+static size_t
+clone_range (int src, off_t *src_off, int dst, off_t *dst_off, size_t count,
+	     const struct stat *src_st)
+{
+	struct file_clone_range range;
+	off_t src_pos, dst_pos;
+	size_t blk = src_st->st_blksize;
+	size_t len;
+
+	if (blk == 0 || count < blk)
+		return 0;
+
+	src_pos = position (src, src_off);
+	dst_pos = position (dst, dst_off);
+	if (src_pos < 0 || dst_pos < 0 || src_pos % blk || dst_pos % blk)
+		return 0;
+
+	/* The tail may only be unaligned if it ends at the end of src */
+	len = count;
+	if ((off_t)(src_pos + len) != src_st->st_size)
+		len -= len % blk;
+	if (len == 0)
+		return 0;
+
+	range.src_fd = src;
+	range.src_offset = src_pos;
+	range.src_length = len;
+	range.dest_offset = dst_pos;
+	if (ioctl (dst, FICLONERANGE, &range))
+		return 0;
+
+	advance (src, src_off, len);
+	advance (dst, dst_off, len);
+	return len;
+}
+
+static ssize_t
+copy_buffered (int src, off_t *src_off, int dst, off_t *dst_off, size_t count)
+{
+	size_t total = 0;
+	void *buf;
+
+	if (posix_memalign (&buf, COPY_BUF_ALIGN, COPY_BUF_SIZE))
+		return -1;
+
+	while (total < count) {
+		size_t req = count - total;
+		ssize_t bytes_read;
+		char *pos;
+
+		if (req > COPY_BUF_SIZE)
+			req = COPY_BUF_SIZE;
+
+		if (src_off)
+			bytes_read = pread (src, buf, req, *src_off);
+		else
+			bytes_read = read (src, buf, req);
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+			goto fail;
+		}
+		if (bytes_read == 0)
+			break;
+		if (src_off)
+			*src_off += bytes_read;
+
+		pos = buf;
+		while (bytes_read) {
+			ssize_t bytes_written;
+
+			if (dst_off)
+				bytes_written = pwrite (dst, pos, bytes_read,
+							*dst_off);
+			else
+				bytes_written = write (dst, pos, bytes_read);
+			if (bytes_written < 0) {
+				if (errno == EINTR)
+					continue;
+				goto fail;
+			}
+			if (dst_off)
+				*dst_off += bytes_written;
+			bytes_read -= bytes_written;
+			pos += bytes_written;
+			total += bytes_written;
+		}
+	}
+
+	free (buf);
+	return total;
+
+fail:
+	free (buf);
+	return -1;
+}
+
+/*
+ * Methods that keep the data inside the kernel.  Each returns the number
+ * of bytes moved, 0 at the end of src, or -1 with errno set.
+ */
+enum copy_method {
+	COPY_FILE_RANGE,
+	COPY_SPLICE,
+	COPY_SENDFILE,
+	COPY_BUFFERED,
+};
+
+static ssize_t
+copy_step (enum copy_method method, int src, off_t *src_off, int dst,
+	   off_t *dst_off, size_t req)
+{
+	switch (method) {
+	case COPY_FILE_RANGE:
+		return copy_file_range (src, src_off, dst, dst_off, req, 0);
+	case COPY_SPLICE:
+		return splice (src, src_off, dst, dst_off, req, SPLICE_F_MOVE);
+	case COPY_SENDFILE:
+		return sendfile (dst, src, src_off, req);
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+ssize_t
+rgn_copy (int src, off_t *src_off, int dst, off_t *dst_off, size_t count)
+{
+	struct stat src_st, dst_st;
+	enum copy_method method;
+	size_t total = 0;
+	ssize_t ret;
+
+	if (fstat (src, &src_st) || fstat (dst, &dst_st))
+		return -1;
+
+	if (S_ISREG (src_st.st_mode) && S_ISREG (dst_st.st_mode)) {
+		total = clone_range (src, src_off, dst, dst_off, count,
+				     &src_st);
+		method = COPY_FILE_RANGE;
+	}
+	else if (S_ISFIFO (src_st.st_mode) || S_ISFIFO (dst_st.st_mode))
+		method = COPY_SPLICE;
+	else if (S_ISREG (src_st.st_mode) && !dst_off)
+		method = COPY_SENDFILE;
+	else
+		method = COPY_BUFFERED;
+
+	while (total < count && method != COPY_BUFFERED) {
+		size_t req = count - total;
+
+		if (req > COPY_CHUNK)
+			req = COPY_CHUNK;
+
+		ret = copy_step (method, src, src_off, dst, dst_off, req);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			/*
+			 * The file systems or descriptors do not support
+			 * this method; finish the job in user space.
+			 */
+			if (errno == EXDEV || errno == EINVAL ||
+			    errno == ENOSYS || errno == EOPNOTSUPP ||
+			    errno == EBADF || errno == ESPIPE) {
+				method = COPY_BUFFERED;
+				break;
+			}
+			return -1;
+		}
+		if (ret == 0)
+			return total;
+		total += ret;
+	}
+
+	if (total < count) {
+		ret = copy_buffered (src, src_off, dst, dst_off, count - total);
+		if (ret < 0)
+			return -1;
+		total += ret;
+	}
+
+	return total;
+}
@@ -0,0 +1,261 @@
+/*
+ * rgn-crc.c
+ *
+ * CRC32C (Castagnoli) of region payloads.  x86 CPUs with SSE4.2 compute it
+ * with the crc32 instruction, running three independent streams so the
+ * instruction's latency is hidden, and join the streams with tables that
+ * shift a CRC over a fixed run of zero bytes.  Everything else uses
+ * slicing-by-8 tables.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "rgn.h"
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC
+#endif
+
+/* Reflected CRC32C polynomial */
+#define CRC32C_POLY	0x82f63b78
+
+/* Stream lengths for the hardware path; both must be powers of two */
+#define CRC_LONG	8192
+#define CRC_SHORT	256
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+static UINT crc_table[8][256];
+#ifdef HAVE_SSE42_CRC
+static UINT crc_long[4][256];
+static UINT crc_short[4][256];
+static int crc_hw;
+#endif
+
+/* Region files are little-endian, and so is every host they are built on */
+static inline uint64_t
+load64 (const BYTE *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, sizeof(v));
+	return v;
+}
+
+#ifdef HAVE_SSE42_CRC
+/* Multiply vec by a 32x32 matrix over GF(2) */
+static UINT
+gf2_matrix_times (const UINT *mat, UINT vec)
+{
+	UINT sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void
+gf2_matrix_square (UINT *square, const UINT *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times (mat, mat[n]);
+}
+
+/*
+ * Build in even the operator that feeds len zero bytes through the CRC.
+ * len must be a power of two.
+ */
+static void
+crc_zeros_op (UINT *even, size_t len)
+{
+	UINT odd[32], row = 1;
+	int n;
+
+	/* One zero bit, then two and four */
+	odd[0] = CRC32C_POLY;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square (even, odd);
+	gf2_matrix_square (odd, even);
+
+	/* Square up from one zero byte until len runs out */
+	do {
+		gf2_matrix_square (even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square (odd, even);
+		len >>= 1;
+	} while (len);
+
+	memcpy (even, odd, sizeof(odd));
+}
+
+/* Byte-wise tables for the operator that skips len zero bytes */
+static void
+crc_zeros (UINT zeros[4][256], size_t len)
+{
+	UINT op[32];
+	UINT n;
+
+	crc_zeros_op (op, len);
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times (op, n);
+		zeros[1][n] = gf2_matrix_times (op, n << 8);
+		zeros[2][n] = gf2_matrix_times (op, n << 16);
+		zeros[3][n] = gf2_matrix_times (op, n << 24);
+	}
+}
+
+static inline UINT
+crc_shift (UINT zeros[4][256], UINT crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+	       zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+/*
+ * Three crc32 streams over adjacent blocks, the first carrying the
+ * running CRC; the other two are shifted past the blocks that follow
+ * them and folded in.
+ */
+__attribute__ ((target ("sse4.2")))
+static UINT
+crc32c_hw (UINT crc, const BYTE *next, size_t len)
+{
+	uint64_t crc0 = crc ^ 0xffffffff, crc1, crc2;
+	const BYTE *end;
+
+	while (len && ((uintptr_t)next & 7)) {
+		crc0 = _mm_crc32_u8 (crc0, *next++);
+		len--;
+	}
+
+	while (len >= CRC_LONG * 3) {
+		crc1 = crc2 = 0;
+		end = next + CRC_LONG;
+		do {
+			crc0 = _mm_crc32_u64 (crc0, load64 (next));
+			crc1 = _mm_crc32_u64 (crc1, load64 (next + CRC_LONG));
+			crc2 = _mm_crc32_u64 (crc2, load64 (next + CRC_LONG * 2));
+			next += 8;
+		} while (next < end);
+		crc0 = crc_shift (crc_long, crc0) ^ crc1;
+		crc0 = crc_shift (crc_long, crc0) ^ crc2;
+		next += CRC_LONG * 2;
+		len -= CRC_LONG * 3;
+	}
+
+	while (len >= CRC_SHORT * 3) {
+		crc1 = crc2 = 0;
+		end = next + CRC_SHORT;
+		do {
+			crc0 = _mm_crc32_u64 (crc0, load64 (next));
+			crc1 = _mm_crc32_u64 (crc1, load64 (next + CRC_SHORT));
+			crc2 = _mm_crc32_u64 (crc2, load64 (next + CRC_SHORT * 2));
+			next += 8;
+		} while (next < end);
+		crc0 = crc_shift (crc_short, crc0) ^ crc1;
+		crc0 = crc_shift (crc_short, crc0) ^ crc2;
+		next += CRC_SHORT * 2;
+		len -= CRC_SHORT * 3;
+	}
+
+	while (len >= 8) {
+		crc0 = _mm_crc32_u64 (crc0, load64 (next));
+		next += 8;
+		len -= 8;
+	}
+	while (len) {
+		crc0 = _mm_crc32_u8 (crc0, *next++);
+		len--;
+	}
+
+	return (UINT)crc0 ^ 0xffffffff;
+}
+#endif
+
+static void
+crc_init (void)
+{
+	UINT n, k, crc;
+
+	for (n = 0; n < 256; n++) {
+		crc = n;
+		for (k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc_table[0][n] = crc;
+	}
+	for (n = 0; n < 256; n++) {
+		crc = crc_table[0][n];
+		for (k = 1; k < 8; k++) {
+			crc = crc_table[0][crc & 0xff] ^ (crc >> 8);
+			crc_table[k][n] = crc;
+		}
+	}
+
+#ifdef HAVE_SSE42_CRC
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("sse4.2")) {
+		crc_zeros (crc_long, CRC_LONG);
+		crc_zeros (crc_short, CRC_SHORT);
+		crc_hw = 1;
+	}
+#endif
+}
+
+/* Slicing-by-8: eight table lookups per 64-bit word */
+static UINT
+crc32c_sw (UINT crc, const BYTE *next, size_t len)
+{
+	uint64_t word;
+
+	crc ^= 0xffffffff;
+	while (len && ((uintptr_t)next & 7)) {
+		crc = crc_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		word = load64 (next) ^ crc;
+		crc = crc_table[7][word & 0xff] ^
+		      crc_table[6][(word >> 8) & 0xff] ^
+		      crc_table[5][(word >> 16) & 0xff] ^
+		      crc_table[4][(word >> 24) & 0xff] ^
+		      crc_table[3][(word >> 32) & 0xff] ^
+		      crc_table[2][(word >> 40) & 0xff] ^
+		      crc_table[1][(word >> 48) & 0xff] ^
+		      crc_table[0][word >> 56];
+		next += 8;
+		len -= 8;
+	}
+	while (len) {
+		crc = crc_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	return crc ^ 0xffffffff;
+}
+
+UINT
+rgn_crc32c (UINT crc, const void *buf, size_t len)
+{
+	pthread_once (&crc_once, crc_init);
+
+#ifdef HAVE_SSE42_CRC
+	if (crc_hw)
+		return crc32c_hw (crc, buf, len);
+#endif
+	return crc32c_sw (crc, buf, len);
+}
@@ -0,0 +1,350 @@
+/*
+ * rgn-delta.c
+ *
+ * Binary deltas between two versions of a region payload.  A delta is a
+ * struct region_delta followed by copy and insert operations; copies take
+ * a range of the old payload, inserts carry their bytes inline.
+ *
+ * The encoder slides a gear hash over both payloads: h = (h << 1) +
+ * gear[byte], so a 32-bit h depends on exactly the last 32 bytes and costs
+ * a shift and an add per byte.  Only windows whose hash passes a gate (one
+ * in 256 or fewer) are anchors, so the old payload's index stays small and
+ * the new payload only probes it at its own anchors; identical content has
+ * its anchors in the same places.  A verified hit is grown in both
+ * directions and becomes a copy; bytes between hits become inserts.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "rgn.h"
+
+/* Gear hash window, and most anchors indexed in the old payload */
+#define DELTA_WINDOW		32
+#define DELTA_MAX_ANCHORS	(1 << 22)
+
+/* Output is gathered and written in pieces of this size */
+#define DELTA_BUF_SIZE		(1024 * 1024)
+
+/* Copies this long are done by rgn_copy() rather than through the buffer */
+#define DELTA_KERNEL_COPY	(64 * 1024)
+
+/* Buffered output with a size limit */
+struct delta_out {
+	int fd;
+	BYTE *buf;
+	size_t len;
+	size_t total;
+	size_t limit;		/* 0 for none */
+	int full;		/* total went over limit */
+};
+
+static int
+out_flush (struct delta_out *out)
+{
+	if (out->len && rgn_write_full (out->fd, out->buf, out->len) < 0)
+		return -1;
+	out->len = 0;
+	return 0;
+}
+
+static int
+out_write (struct delta_out *out, const void *data, size_t len)
+{
+	out->total += len;
+	if (out->limit && out->total > out->limit) {
+		out->full = 1;
+		return 0;
+	}
+
+	if (out->len + len > DELTA_BUF_SIZE) {
+		if (out_flush (out))
+			return -1;
+		if (len > DELTA_BUF_SIZE)
+			return rgn_write_full (out->fd, data, len) < 0 ? -1 : 0;
+	}
+	memcpy (out->buf + out->len, data, len);
+	out->len += len;
+	return 0;
+}
+
+static int
+emit_op (struct delta_out *out, BYTE type, UINT offset, UINT len,
+	 const BYTE *data)
+{
+	struct region_delta_op op;
+
+	if (len == 0)
+		return 0;
+
+	op.op = type;
+	op.offset = offset;
+	op.len = len;
+	if (out_write (out, &op, sizeof(op)))
+		return -1;
+	if (data)
+		return out_write (out, data, len);
+	return 0;
+}
+
+/* Random values for each byte, fixed so deltas are reproducible */
+static void
+gear_init (UINT gear[256])
+{
+	unsigned long long x = 0x9e3779b97f4a7c15ULL;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		x += 0x9e3779b97f4a7c15ULL;
+		gear[i] = (x ^ (x >> 31)) * 0xbf58476d1ce4e5b9ULL >> 32;
+	}
+}
+
+/* The top bits of h depend on the whole window */
+static inline int
+is_anchor (UINT h, int gate)
+{
+	return (h >> gate) == 0;
+}
+
+static inline size_t
+hash_slot (UINT h, int shift)
+{
+	return (h * 0x9e3779b1u) >> shift;
+}
+
+/* Length of the common prefix of a and b, at most max */
+static size_t
+match_forward (const BYTE *a, const BYTE *b, size_t max)
+{
+	size_t n = 0;
+
+	while (n + 4096 <= max && !memcmp (a + n, b + n, 4096))
+		n += 4096;
+	while (n + 64 <= max && !memcmp (a + n, b + n, 64))
+		n += 64;
+	while (n < max && a[n] == b[n])
+		n++;
+	return n;
+}
+
+ssize_t
+rgn_delta_encode (const void *base_data, size_t base_len,
+		  const void *target_data, size_t target_len, int fd,
+		  size_t limit)
+{
+	const BYTE *base = base_data, *target = target_data;
+	struct region_delta hdr;
+	struct delta_out out;
+	size_t anchors, slots, i, p, e, lit;
+	UINT *table = NULL, h, gear[256];
+	int shift = 32, gate = 24;
+
+	if (base_len > 0xffffffffu || target_len > 0xffffffffu) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	memset (&out, 0, sizeof(out));
+	out.fd = fd;
+	out.limit = limit;
+	out.buf = malloc (DELTA_BUF_SIZE);
+	if (!out.buf)
+		return -1;
+
+	hdr.size = target_len;
+	hdr.base_size = base_len;
+	hdr.base_crc = rgn_crc32c (0, base, base_len);
+	hdr.crc = rgn_crc32c (0, target, target_len);
+	if (out_write (&out, &hdr, sizeof(hdr)))
+		goto fail;
+
+	/* Index the anchors of the old payload, thinning them if it is big */
+	while (gate > 20 && (base_len >> (32 - gate)) > DELTA_MAX_ANCHORS)
+		gate--;
+	anchors = (base_len >> (32 - gate)) + 1;
+	for (slots = 1024; slots < anchors * 2; slots <<= 1)
+		;
+	while ((1ul << (32 - shift)) < slots)
+		shift--;
+	table = calloc (slots, sizeof(UINT));
+	if (!table)
+		goto fail;
+	gear_init (gear);
+
+	/* i is the last byte of the window */
+	h = 0;
+	for (i = 0; i < base_len; i++) {
+		h = (h << 1) + gear[base[i]];
+		if (i + 1 >= DELTA_WINDOW && is_anchor (h, gate)) {
+			UINT *slot = &table[hash_slot (h, shift)];
+
+			/* The first occurrence wins */
+			if (!*slot)
+				*slot = i + 2 - DELTA_WINDOW;
+		}
+	}
+
+	/* e is the end of the window, which starts at p */
+	lit = 0;
+	h = 0;
+	for (e = 0; e < target_len && !out.full; ) {
+		UINT slot = 0;
+		size_t o, len;
+
+		h = (h << 1) + gear[target[e++]];
+		p = e - DELTA_WINDOW;
+		if (e < DELTA_WINDOW + lit || !is_anchor (h, gate))
+			continue;
+		slot = table[hash_slot (h, shift)];
+		if (!slot || memcmp (base + slot - 1, target + p, DELTA_WINDOW))
+			continue;
+
+		o = slot - 1;
+		while (p > lit && o > 0 && target[p - 1] == base[o - 1]) {
+			p--;
+			o--;
+		}
+		len = match_forward (base + o, target + p,
+				     base_len - o < target_len - p ?
+				     base_len - o : target_len - p);
+
+		if (emit_op (&out, REGION_DELTA_INSERT, 0, p - lit,
+			     target + lit) ||
+		    emit_op (&out, REGION_DELTA_COPY, o, len, NULL))
+			goto fail;
+		lit = e = p + len;
+		h = 0;
+
+		/* Give up early once the inserts alone are too big */
+		if (limit && out.total > limit)
+			out.full = 1;
+	}
+	if (emit_op (&out, REGION_DELTA_INSERT, 0, target_len - lit,
+		     target + lit))
+		goto fail;
+
+	free (table);
+	table = NULL;
+	if (out.full) {
+		free (out.buf);
+		return 0;
+	}
+	if (out_flush (&out))
+		goto fail;
+	free (out.buf);
+	return out.total;
+
+fail:
+	free (table);
+	free (out.buf);
+	return -1;
+}
+
+int
+rgn_delta_header (const BYTE *delta, size_t delta_len,
+		  struct region_delta *hdr)
+{
+	if (delta_len < sizeof(*hdr)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	memcpy (hdr, delta, sizeof(*hdr));
+	return 0;
+}
+
+/*
+ * Apply the operations in delta.  Short copies and inserts are gathered in
+ * a bounded buffer; long copies go from base_fd to out_fd in the kernel.
+ * The CRC of the result is accumulated from the mapped base as it goes.
+ */
+int
+rgn_delta_apply (int base_fd, off_t base_offset, const BYTE *base,
+		 size_t base_len, const BYTE *delta, size_t delta_len,
+		 int out_fd)
+{
+	struct region_delta hdr;
+	struct delta_out out;
+	size_t pos, done = 0;
+	UINT crc = 0;
+
+	if (rgn_delta_header (delta, delta_len, &hdr))
+		return -1;
+	if (hdr.base_size != base_len ||
+	    rgn_crc32c (0, base, base_len) != hdr.base_crc) {
+		errno = ESTALE;
+		return -1;
+	}
+
+	memset (&out, 0, sizeof(out));
+	out.fd = out_fd;
+	out.buf = malloc (DELTA_BUF_SIZE);
+	if (!out.buf)
+		return -1;
+
+	for (pos = sizeof(hdr); pos < delta_len; ) {
+		struct region_delta_op op;
+		const BYTE *data;
+
+		if (delta_len - pos < sizeof(op))
+			goto bad;
+		memcpy (&op, delta + pos, sizeof(op));
+		pos += sizeof(op);
+		if (op.len > hdr.size - done)
+			goto bad;
+
+		switch (op.op) {
+		case REGION_DELTA_INSERT:
+			if (op.len > delta_len - pos)
+				goto bad;
+			data = delta + pos;
+			pos += op.len;
+			if (out_write (&out, data, op.len))
+				goto fail;
+			break;
+		case REGION_DELTA_COPY:
+			if (op.offset > base_len || op.len > base_len - op.offset)
+				goto bad;
+			data = base + op.offset;
+			if (op.len < DELTA_KERNEL_COPY) {
+				if (out_write (&out, data, op.len))
+					goto fail;
+			}
+			else {
+				off_t src = base_offset + op.offset;
+				ssize_t copied;
+
+				if (out_flush (&out))
+					goto fail;
+				copied = rgn_copy (base_fd, &src, out_fd, NULL,
+						   op.len);
+				if (copied < 0)
+					goto fail;
+				if ((size_t)copied != op.len)
+					goto bad;
+			}
+			break;
+		default:
+			goto bad;
+		}
+		crc = rgn_crc32c (crc, data, op.len);
+		done += op.len;
+	}
+
+	if (done != hdr.size || crc != hdr.crc)
+		goto bad;
+	if (out_flush (&out))
+		goto fail;
+	free (out.buf);
+	return 0;
+
+bad:
+	errno = EBADMSG;
+fail:
+	free (out.buf);
+	return -1;
+}
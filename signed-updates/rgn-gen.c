@@ -0,0 +1,472 @@
+/*
+ * rgn-gen.c
+ *
+ * Generate synthetic region files and payloads for testing and
+ * benchmarking the region tools.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "rgn.h"
+#include "pgp.h"
+
+#define GEN_BUF_SIZE		(1024 * 1024)
+#define DEFAULT_CHUNK_SIZE	524288
+#define DEFAULT_SIG_SIZE	512
+
+struct options {
+	const char *output;
+	unsigned long long size;	/* Size of each region payload */
+	int count;			/* Number of regions */
+	int first_id;
+	int toc;
+	int signed_rgn;			/* Payloads are signed virtual regions */
+	int raw;			/* Write one payload without a region file */
+	int zero;			/* Zero data, written as holes if possible */
+	int large;			/* Version 200 records */
+	UINT chunk_size;
+	UINT sig_size;
+	unsigned long long seed;
+	const char *key_file;
+	const char *passphrase_file;
+};
+
+static struct pgp_key key;
+static int have_key;
+static unsigned long long rng_state;
+static int out_fd;
+static off_t out_pos;
+static int out_seekable;
+
+static void
+usage (const char *name)
+{
+	printf ("Usage: %s [OPTION]... -o FILE\n", name);
+	printf ("Generate a synthetic region file.\n");
+	printf ("\n");
+	printf ("  -o FILE          Output file (- for stdout)\n");
+	printf ("  -n COUNT         Number of regions (default 1)\n");
+	printf ("  -s SIZE          Payload size of each region; K, M and G\n");
+	printf ("                   suffixes are allowed (default 1M)\n");
+	printf ("  -i ID            ID of the first region (default 1)\n");
+	printf ("  -t, --toc        Add a region table of contents\n");
+	printf ("  -L, --large      Write version 200 records with 64-bit sizes;\n");
+	printf ("                   the default for payloads over 4 GiB\n");
+	printf ("  -S, --signed     Make each payload a PGP signed virtual\n");
+	printf ("                   region whose target is the region's index\n");
+	printf ("  -c SIZE          Chunk size of signed regions (default 512K)\n");
+	printf ("      --sig-size N Signature slot size (default 512)\n");
+	printf ("  -k, --key FILE   Sign chunks with this exported RSA key;\n");
+	printf ("                   without it the signature slots are zero\n");
+	printf ("      --pw_file F  Passphrase for the key\n");
+	printf ("  -r, --raw        Write a single payload, not a region file\n");
+	printf ("  -z, --zero       Zero data instead of pseudo-random bytes\n");
+	printf ("      --seed N     Seed for the data (default 1)\n");
+	printf ("  -h, --help       Display this help message\n");
+	exit (0);
+}
+
+static unsigned long long
+parse_size (const char *arg)
+{
+	unsigned long long val;
+	char *end;
+
+	errno = 0;
+	val = strtoull (arg, &end, 0);
+	if (errno || end == arg)
+		goto fail;
+	switch (*end) {
+	case 'G': case 'g':
+		val <<= 10;
+		/* Fall through */
+	case 'M': case 'm':
+		val <<= 10;
+		/* Fall through */
+	case 'K': case 'k':
+		val <<= 10;
+		end++;
+		break;
+	}
+	if (*end == 0)
+		return val;
+
+fail:
+	fprintf (stderr, "Invalid size: %s\n", arg);
+	exit (1);
+}
+
+static void
+parse_args (int argc, char **argv, struct options *opts)
+{
+	enum {
+		OPT_SIG_SIZE = 256,
+		OPT_PW_FILE,
+		OPT_SEED,
+	};
+	static const struct option available_options[] = {
+		{ "toc",	no_argument,		NULL, 't' },
+		{ "large",	no_argument,		NULL, 'L' },
+		{ "signed",	no_argument,		NULL, 'S' },
+		{ "key",	required_argument,	NULL, 'k' },
+		{ "raw",	no_argument,		NULL, 'r' },
+		{ "zero",	no_argument,		NULL, 'z' },
+		{ "sig-size",	required_argument,	NULL, OPT_SIG_SIZE },
+		{ "pw_file",	required_argument,	NULL, OPT_PW_FILE },
+		{ "seed",	required_argument,	NULL, OPT_SEED },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	int opt;
+
+	memset (opts, 0, sizeof(*opts));
+	opts->size = 1024 * 1024;
+	opts->count = 1;
+	opts->first_id = 1;
+	opts->chunk_size = DEFAULT_CHUNK_SIZE;
+	opts->sig_size = DEFAULT_SIG_SIZE;
+	opts->seed = 1;
+
+	while ((opt = getopt_long (argc, argv, "ho:n:s:i:tLSc:k:rz",
+				   available_options, NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			opts->output = optarg;
+			break;
+		case 'n':
+			opts->count = atoi (optarg);
+			break;
+		case 's':
+			opts->size = parse_size (optarg);
+			break;
+		case 'i':
+			opts->first_id = atoi (optarg);
+			break;
+		case 't':
+			opts->toc = 1;
+			break;
+		case 'L':
+			opts->large = 1;
+			break;
+		case 'S':
+			opts->signed_rgn = 1;
+			break;
+		case 'c':
+			opts->chunk_size = parse_size (optarg);
+			break;
+		case OPT_SIG_SIZE:
+			opts->sig_size = parse_size (optarg);
+			break;
+		case 'k':
+			opts->key_file = optarg;
+			break;
+		case OPT_PW_FILE:
+			opts->passphrase_file = optarg;
+			break;
+		case 'r':
+			opts->raw = 1;
+			break;
+		case 'z':
+			opts->zero = 1;
+			break;
+		case OPT_SEED:
+			opts->seed = strtoull (optarg, NULL, 0);
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+
+	if (!opts->output) {
+		fprintf (stderr, "Please specify an output file.  (-h for help)\n");
+		exit (1);
+	}
+	if (opts->count < 1 || opts->count > 0xffff || opts->first_id < 0 ||
+	    opts->first_id + opts->count - 1 > 0xffff) {
+		fprintf (stderr, "Invalid region count or ID\n");
+		exit (1);
+	}
+	if (opts->chunk_size == 0 || opts->sig_size < 16) {
+		fprintf (stderr, "Invalid chunk or signature size\n");
+		exit (1);
+	}
+	if (opts->raw)
+		opts->count = 1;
+}
+
+/* xorshift64*: fast, and the same bytes for the same seed */
+static void
+fill_random (BYTE *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		unsigned long long x = rng_state;
+
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		rng_state = x;
+		x *= 0x2545f4914f6cdd1dULL;
+		memcpy (buf + i, &x, 8);
+	}
+	for (; i < len; i++)
+		buf[i] = i;
+}
+
+static void
+emit (const void *buf, size_t len)
+{
+	if (rgn_write_full (out_fd, buf, len) < 0) {
+		fprintf (stderr, "Error writing: %s\n", strerror (errno));
+		exit (1);
+	}
+	out_pos += len;
+}
+
+/*
+ * Write len bytes of payload data.  Zero data becomes a hole in a
+ * regular output file, so many gigabytes cost nothing to generate.
+ */
+static void
+emit_data (BYTE *buf, unsigned long long len, const struct options *opts)
+{
+	if (opts->zero && out_seekable) {
+		out_pos += len;
+		if (lseek (out_fd, out_pos, SEEK_SET) < 0 ||
+		    ftruncate (out_fd, out_pos)) {
+			fprintf (stderr, "Error writing: %s\n", strerror (errno));
+			exit (1);
+		}
+		return;
+	}
+
+	while (len) {
+		size_t n = len > GEN_BUF_SIZE ? GEN_BUF_SIZE : len;
+
+		if (opts->zero)
+			memset (buf, 0, n);
+		else
+			fill_random (buf, n);
+		emit (buf, n);
+		len -= n;
+	}
+}
+
+/*
+ * The payload of a signed virtual region: a v2 header and the chunks,
+ * each followed by a signature slot.  The last chunk may be short.
+ */
+static unsigned long long
+signed_size (const struct options *opts)
+{
+	unsigned long long chunks;
+
+	chunks = (opts->size + opts->chunk_size - 1) / opts->chunk_size;
+	return sizeof(struct vr_header_v2) + opts->size +
+	       chunks * opts->sig_size;
+}
+
+static void
+emit_signed (UINT target, const struct options *opts)
+{
+	struct vr_header_v2 hdr;
+	unsigned long long left = opts->size;
+	BYTE *data, *sig;
+
+	hdr.virtual_region = PGP_SIGNED_VIRT_RGN;
+	hdr.header_len = sizeof(hdr);
+	hdr.target = target;
+	hdr.offset = 0;
+	hdr.chunk_size = opts->chunk_size;
+	hdr.sig_size = opts->sig_size;
+	emit (&hdr, sizeof(hdr));
+
+	data = malloc (opts->chunk_size);
+	sig = calloc (1, opts->sig_size > 4096 ? opts->sig_size : 4096);
+	if (!data || !sig) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	while (left) {
+		size_t len = left > opts->chunk_size ? opts->chunk_size : left;
+		size_t sig_len = 4096;
+
+		if (opts->zero)
+			memset (data, 0, len);
+		else
+			fill_random (data, len);
+		emit (data, len);
+
+		memset (sig, 0, opts->sig_size);
+		if (have_key) {
+			if (pgp_sign (&key, data, len, 0, sig, &sig_len) ||
+			    sig_len > opts->sig_size) {
+				fprintf (stderr, "Could not sign chunk\n");
+				exit (1);
+			}
+		}
+		emit (sig, opts->sig_size);
+		left -= len;
+	}
+
+	free (data);
+	free (sig);
+}
+
+static unsigned long long
+payload_size (const struct options *opts)
+{
+	return opts->signed_rgn ? signed_size (opts) : opts->size;
+}
+
+static void
+emit_payload (BYTE *buf, int index, const struct options *opts)
+{
+	if (opts->signed_rgn)
+		emit_signed (index, opts);
+	else
+		emit_data (buf, opts->size, opts);
+}
+
+static void
+emit_record (int large, ULONGLONG size, BYTE type, const void *body)
+{
+	BYTE rec[RGN_HEADERS_MAX];
+
+	emit (rec, rgn_encode_record_header (rec, large, size, type));
+	if (body)
+		emit (body, size);
+}
+
+static void
+emit_rgn (BYTE *buf, const struct options *opts)
+{
+	static const char avr_strings[] = "rgn-gen\0Jan 01 1970\0" "00:00:00";
+	unsigned long long size = payload_size (opts);
+	struct region_toc_entry *toc;
+	BYTE region[RGN_HEADERS_MAX];
+	struct vir vir;
+	BYTE avr[2 + sizeof(avr_strings)];
+	USHORT version = 100;
+	int large = opts->large;
+	size_t region_len;
+	off_t pos;
+	int i;
+
+	/* Records over 4 GiB need the version 200 format */
+	if (size > 0xffffffffULL - sizeof(struct region_header))
+		large = 1;
+	region_len = rgn_region_header_size (large);
+
+	vir.file_id = FILE_ID;
+	vir.version = large ? RGN_VERSION_LARGE : RGN_VERSION;
+	emit (&vir, sizeof(vir));
+	emit_record (large, sizeof(version), DATA_VERSION_REC_CHAR, &version);
+	memcpy (avr, &version, 2);
+	memcpy (avr + 2, avr_strings, sizeof(avr_strings));
+	emit_record (large, sizeof(avr), APP_VERSION_REC_CHAR, avr);
+
+	if (opts->toc) {
+		UINT toc_len = sizeof(UINT) + opts->count * sizeof(*toc);
+
+		toc = calloc (opts->count, sizeof(*toc));
+		if (!toc) {
+			fprintf (stderr, "Out of memory\n");
+			exit (1);
+		}
+		pos = out_pos + rgn_record_header_size (large) + toc_len;
+		for (i = 0; i < opts->count; i++) {
+			pos += rgn_record_header_size (large) + region_len;
+			toc[i].id = opts->first_id + i;
+			toc[i].delay = 0;
+			toc[i].size = size;
+			toc[i].offset = pos;
+			pos += size;
+		}
+		emit_record (large, toc_len, REGION_TOC_REC_CHAR, NULL);
+		emit (&opts->count, sizeof(UINT));
+		emit (toc, opts->count * sizeof(*toc));
+		free (toc);
+	}
+
+	for (i = 0; i < opts->count; i++) {
+		emit_record (large, region_len + size, REGION_REC_CHAR, NULL);
+		emit (region, rgn_encode_region_header (region, large,
+						opts->first_id + i, 0, size));
+		emit_payload (buf, i, opts);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	struct options opts;
+	struct stat st;
+	BYTE *buf;
+
+	parse_args (argc, argv, &opts);
+	rng_state = opts.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	if (opts.key_file) {
+		char pass[256] = "";
+
+		if (opts.passphrase_file) {
+			FILE *f = fopen (opts.passphrase_file, "r");
+
+			if (!f || !fgets (pass, sizeof(pass), f)) {
+				fprintf (stderr, "Could not read %s\n",
+					 opts.passphrase_file);
+				exit (1);
+			}
+			fclose (f);
+			pass[strcspn (pass, "\r\n")] = 0;
+		}
+		if (pgp_init () || pgp_key_load (&key, opts.key_file,
+					opts.passphrase_file ? pass : NULL))
+			exit (1);
+		have_key = 1;
+	}
+
+	if (!strcmp (opts.output, "-"))
+		out_fd = STDOUT_FILENO;
+	else
+		out_fd = open (opts.output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0) {
+		fprintf (stderr, "Could not open %s: %s\n", opts.output,
+			 strerror (errno));
+		exit (1);
+	}
+	out_seekable = fstat (out_fd, &st) == 0 && S_ISREG (st.st_mode);
+
+	buf = malloc (GEN_BUF_SIZE);
+	if (!buf) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	if (opts.raw)
+		emit_payload (buf, 0, &opts);
+	else
+		emit_rgn (buf, &opts);
+
+	free (buf);
+	if (have_key)
+		pgp_key_free (&key);
+	if (close (out_fd)) {
+		fprintf (stderr, "Error writing: %s\n", strerror (errno));
+		exit (1);
+	}
+
+	return 0;
+}
@@ -0,0 +1,693 @@
+/*
+ * rgn-io.c
+ *
+ * librgn: sequential readers with selectable I/O backends
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "rgn.h"
+
+/* Size of each read and of each read-ahead buffer */
+#define IO_BLOCK	(1024 * 1024)
+
+/* Reads kept in flight by the io_uring backend */
+#define IO_DEPTH	4
+
+/* O_DIRECT wants the buffer, offset and length aligned */
+#define IO_ALIGN	4096
+
+static const char *const backend_names[] = {
+	[RGN_IO_BUFFERED]	= "buffered",
+	[RGN_IO_MMAP]		= "mmap",
+	[RGN_IO_DIRECT]		= "direct",
+	[RGN_IO_URING]		= "uring",
+};
+
+static int default_backend = -1;
+
+int
+rgn_io_parse (const char *name, enum rgn_io_backend *backend)
+{
+	int i;
+
+	for (i = 0; i < RGN_IO_BACKENDS; i++) {
+		if (!strcmp (name, backend_names[i])) {
+			*backend = i;
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+const char *
+rgn_io_name (enum rgn_io_backend backend)
+{
+	if ((unsigned)backend >= RGN_IO_BACKENDS)
+		return "unknown";
+	return backend_names[backend];
+}
+
+void
+rgn_io_set_default (enum rgn_io_backend backend)
+{
+	default_backend = backend;
+}
+
+enum rgn_io_backend
+rgn_io_get_default (void)
+{
+	if (default_backend < 0) {
+		const char *env = getenv ("RGN_IO");
+		enum rgn_io_backend backend = RGN_IO_MMAP;
+
+		if (env && *env)
+			rgn_io_parse (env, &backend);
+		default_backend = backend;
+	}
+
+	return default_backend;
+}
+
+ssize_t
+rgn_write_full (int fd, const void *buf, size_t count)
+{
+	size_t total = 0;
+
+	while (total < count) {
+		ssize_t n = write (fd, (const BYTE *)buf + total, count - total);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		total += n;
+	}
+
+	return total;
+}
+
+/*
+ * Fill buf from fd, at offset off unless it is negative.  Short only at
+ * the end of the file.
+ */
+static ssize_t
+read_full (int fd, void *buf, size_t count, off_t off)
+{
+	size_t total = 0;
+
+	while (total < count) {
+		ssize_t n;
+
+		if (off >= 0)
+			n = pread (fd, (BYTE *)buf + total, count - total,
+				   off + total);
+		else
+			n = read (fd, (BYTE *)buf + total, count - total);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		total += n;
+	}
+
+	return total;
+}
+
+/*
+ * A minimal io_uring, set up with raw system calls so that no liburing
+ * is needed.
+ */
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+static int
+uring_setup (struct uring *u, unsigned entries)
+{
+	struct io_uring_params p;
+	BYTE *sq, *cq;
+
+	memset (&p, 0, sizeof(p));
+	u->fd = syscall (__NR_io_uring_setup, entries, &p);
+	if (u->fd < 0)
+		return -1;
+
+	u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_len = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_ring_len > u->sq_ring_len)
+			u->sq_ring_len = u->cq_ring_len;
+		u->cq_ring_len = u->sq_ring_len;
+	}
+
+	u->sq_ring = mmap (NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, u->fd,
+			   IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED)
+		goto fail_fd;
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ring = u->sq_ring;
+	else {
+		u->cq_ring = mmap (NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, u->fd,
+				   IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED)
+			goto fail_sq;
+	}
+
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap (NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail_cq;
+
+	sq = u->sq_ring;
+	cq = u->cq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return 0;
+
+fail_cq:
+	if (u->cq_ring != u->sq_ring)
+		munmap (u->cq_ring, u->cq_ring_len);
+fail_sq:
+	munmap (u->sq_ring, u->sq_ring_len);
+fail_fd:
+	close (u->fd);
+	return -1;
+}
+
+static void
+uring_exit (struct uring *u)
+{
+	munmap (u->sqes, u->sqes_len);
+	if (u->cq_ring != u->sq_ring)
+		munmap (u->cq_ring, u->cq_ring_len);
+	munmap (u->sq_ring, u->sq_ring_len);
+	close (u->fd);
+}
+
+/* Queue and submit a read of len bytes at off into buf */
+static int
+uring_read (struct uring *u, int fd, void *buf, size_t len, off_t off,
+	    unsigned long long tag)
+{
+	unsigned tail = *u->sq_tail;
+	unsigned index = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	memset (sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->user_data = tag;
+	u->sq_array[index] = index;
+	__atomic_store_n (u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	while (syscall (__NR_io_uring_enter, u->fd, 1, 0, 0, NULL, 0) < 0) {
+		if (errno != EINTR && errno != EAGAIN)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Return the tag and result of a completion.  If none is ready, wait
+ * until want of them are.
+ */
+static int
+uring_wait (struct uring *u, unsigned want, unsigned long long *tag, int *res)
+{
+	unsigned head = *u->cq_head;
+
+	while (head == __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE)) {
+		if (syscall (__NR_io_uring_enter, u->fd, 0, want,
+			     IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR)
+			return -1;
+	}
+
+	*tag = u->cqes[head & *u->cq_mask].user_data;
+	*res = u->cqes[head & *u->cq_mask].res;
+	__atomic_store_n (u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* A read-ahead buffer of the direct and io_uring backends */
+struct io_buf {
+	BYTE *data;
+	size_t len;		/* Bytes read into data */
+	off_t off;		/* File offset of data[0] */
+	int busy;		/* Read in flight */
+};
+
+struct rgn_reader {
+	int fd;
+	enum rgn_io_backend backend;
+	off_t pos;		/* File offset of the next byte returned */
+	off_t size;		/* Size of a regular file */
+
+	/* mmap */
+	const BYTE *map;
+	size_t map_len;
+
+	/* direct and uring */
+	struct io_buf bufs[IO_DEPTH];
+	int nbufs;
+	int head;		/* Buffer holding pos */
+	off_t next_off;		/* Offset of the next read to queue */
+	int saved_flags;
+	struct uring ring;
+};
+
+static void
+free_bufs (struct rgn_reader *r)
+{
+	int i;
+
+	for (i = 0; i < r->nbufs; i++)
+		free (r->bufs[i].data);
+	r->nbufs = 0;
+}
+
+static int
+alloc_bufs (struct rgn_reader *r, int count)
+{
+	for (r->nbufs = 0; r->nbufs < count; r->nbufs++) {
+		void *data;
+
+		if (posix_memalign (&data, IO_ALIGN, IO_BLOCK)) {
+			free_bufs (r);
+			errno = ENOMEM;
+			return -1;
+		}
+		r->bufs[r->nbufs].data = data;
+		r->bufs[r->nbufs].len = 0;
+		r->bufs[r->nbufs].off = -1;
+		r->bufs[r->nbufs].busy = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Start reading the next block into buf.  The io_uring backend only
+ * queues the read; the direct backend reads at once.
+ */
+static int
+queue_buf (struct rgn_reader *r, int index)
+{
+	struct io_buf *buf = &r->bufs[index];
+	size_t want;
+	ssize_t n;
+
+	buf->off = r->next_off;
+	buf->len = 0;
+	r->next_off += IO_BLOCK;
+
+	if (buf->off >= r->size)
+		return 0;
+
+	if (r->backend == RGN_IO_URING) {
+		buf->busy = 1;
+		return uring_read (&r->ring, r->fd, buf->data, IO_BLOCK,
+				   buf->off, index);
+	}
+
+	/* O_DIRECT: aligned lengths, and no retry at an unaligned offset */
+	want = r->size - buf->off;
+	if (want > IO_BLOCK)
+		want = IO_BLOCK;
+	while (buf->len < want) {
+		size_t len = (want - buf->len + IO_ALIGN - 1) &
+			     ~(size_t)(IO_ALIGN - 1);
+
+		n = pread (r->fd, buf->data + buf->len, len,
+			   buf->off + buf->len);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		buf->len += n;
+	}
+	return 0;
+}
+
+/* Wait until the read into buffer index has finished */
+static int
+wait_buf (struct rgn_reader *r, int index)
+{
+	while (r->bufs[index].busy) {
+		unsigned long long tag;
+		struct io_buf *buf;
+		int res;
+
+		if (uring_wait (&r->ring, 1, &tag, &res))
+			return -1;
+		buf = &r->bufs[tag];
+		buf->busy = 0;
+		if (res < 0) {
+			if (res != -EINTR && res != -EAGAIN) {
+				errno = -res;
+				return -1;
+			}
+			res = 0;
+		}
+		buf->len = res;
+
+		/* Finish a short or interrupted read synchronously */
+		if (res < IO_BLOCK && buf->off + res < r->size) {
+			ssize_t n = read_full (r->fd, buf->data + res,
+					       IO_BLOCK - res, buf->off + res);
+
+			if (n < 0)
+				return -1;
+			buf->len += n;
+		}
+	}
+
+	return 0;
+}
+
+static int
+start_ring (struct rgn_reader *r)
+{
+	int i;
+
+	/* Blocks start at an aligned offset; the head skips up to pos */
+	r->next_off = r->pos & ~(off_t)(IO_ALIGN - 1);
+	r->head = 0;
+	for (i = 0; i < r->nbufs; i++) {
+		if (queue_buf (r, i))
+			return -1;
+		/* The direct backend reads the others when needed */
+		if (r->backend != RGN_IO_URING)
+			break;
+	}
+
+	return 0;
+}
+
+struct rgn_reader *
+rgn_reader_open (int fd, enum rgn_io_backend backend)
+{
+	struct rgn_reader *r;
+	struct stat st;
+
+	if (fstat (fd, &st))
+		return NULL;
+
+	r = calloc (1, sizeof(*r));
+	if (!r)
+		return NULL;
+	r->fd = fd;
+	r->saved_flags = -1;
+	r->backend = backend;
+
+	/* Everything but the plain backend needs a regular file */
+	r->pos = lseek (fd, 0, SEEK_CUR);
+	if (!S_ISREG (st.st_mode) || r->pos < 0)
+		r->backend = RGN_IO_BUFFERED;
+	r->size = st.st_size;
+
+	switch (r->backend) {
+	case RGN_IO_MMAP:
+		r->map_len = r->size;
+		if (r->map_len == 0)
+			break;
+		r->map = mmap (NULL, r->map_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (r->map == MAP_FAILED) {
+			r->map = NULL;
+			r->backend = RGN_IO_BUFFERED;
+			break;
+		}
+		madvise ((void *)r->map, r->map_len, MADV_SEQUENTIAL);
+		break;
+
+	case RGN_IO_DIRECT:
+		r->saved_flags = fcntl (fd, F_GETFL);
+		if (r->saved_flags < 0 ||
+		    fcntl (fd, F_SETFL, r->saved_flags | O_DIRECT)) {
+			/* Not supported by this file system (tmpfs) */
+			r->saved_flags = -1;
+			r->backend = RGN_IO_BUFFERED;
+			break;
+		}
+		if (alloc_bufs (r, 1) || start_ring (r))
+			goto fail;
+		break;
+
+	case RGN_IO_URING:
+		if (uring_setup (&r->ring, IO_DEPTH)) {
+			r->backend = RGN_IO_BUFFERED;
+			break;
+		}
+		if (alloc_bufs (r, IO_DEPTH) || start_ring (r))
+			goto fail;
+		break;
+
+	default:
+		r->backend = RGN_IO_BUFFERED;
+		posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		break;
+	}
+
+	return r;
+
+fail:
+	rgn_reader_close (r);
+	return NULL;
+}
+
+enum rgn_io_backend
+rgn_reader_backend (const struct rgn_reader *r)
+{
+	return r->backend;
+}
+
+static ssize_t
+read_ring (struct rgn_reader *r, BYTE *dst, size_t count)
+{
+	size_t total = 0;
+
+	while (total < count) {
+		struct io_buf *buf = &r->bufs[r->head];
+		size_t skip, n;
+
+		if (wait_buf (r, r->head))
+			return -1;
+		if (buf->off >= r->size)
+			break;
+
+		skip = r->pos - buf->off;
+		if (skip < buf->len) {
+			n = buf->len - skip;
+			if (n > count - total)
+				n = count - total;
+			memcpy (dst + total, buf->data + skip, n);
+			total += n;
+			r->pos += n;
+			if (skip + n < buf->len)
+				continue;
+		}
+		if (buf->len < IO_BLOCK)
+			break;
+
+		/* Refill the used buffer further on and move to the next */
+		if (r->backend == RGN_IO_URING) {
+			if (queue_buf (r, r->head))
+				return -1;
+			r->head = (r->head + 1) % r->nbufs;
+		}
+		else if (queue_buf (r, r->head))
+			return -1;
+	}
+
+	return total;
+}
+
+ssize_t
+rgn_reader_read (struct rgn_reader *r, void *buf, size_t count)
+{
+	size_t n;
+
+	switch (r->backend) {
+	case RGN_IO_MMAP:
+		if (r->pos >= (off_t)r->map_len)
+			return 0;
+		n = r->map_len - r->pos;
+		if (n > count)
+			n = count;
+		memcpy (buf, r->map + r->pos, n);
+		r->pos += n;
+		return n;
+
+	case RGN_IO_DIRECT:
+	case RGN_IO_URING:
+		return read_ring (r, buf, count);
+
+	default:
+		return read_full (r->fd, buf, count, -1);
+	}
+}
+
+int
+rgn_reader_close (struct rgn_reader *r)
+{
+	int i;
+
+	if (r->backend == RGN_IO_URING) {
+		/* The kernel may still be writing into the buffers */
+		for (i = 0; i < r->nbufs; i++)
+			wait_buf (r, i);
+		uring_exit (&r->ring);
+	}
+	if (r->map)
+		munmap ((void *)r->map, r->map_len);
+	free_bufs (r);
+	if (r->saved_flags >= 0)
+		fcntl (r->fd, F_SETFL, r->saved_flags);
+
+	/* Leave the file position after the data handed out */
+	if (r->backend != RGN_IO_BUFFERED)
+		lseek (r->fd, r->pos, SEEK_SET);
+	free (r);
+
+	return 0;
+}
+
+/* statx() requests submitted to the ring at once */
+#define STATX_BATCH	256
+
+static void
+statx_one (struct rgn_statx *req, unsigned mask)
+{
+	req->error = statx (AT_FDCWD, req->path, 0, mask, &req->stx) ?
+		     errno : 0;
+}
+
+/*
+ * Batches of statx() requests go to an io_uring with one system call per
+ * batch, more only if a signal or a short submission cuts it short;
+ * kernels without io_uring or without its statx operation get one
+ * statx() call per path instead.
+ */
+int
+rgn_statx_batch (struct rgn_statx *reqs, size_t count, unsigned mask)
+{
+	struct uring ring;
+	size_t done = 0, i;
+
+	if (count < 2 || uring_setup (&ring, STATX_BATCH)) {
+		for (i = 0; i < count; i++)
+			statx_one (&reqs[i], mask);
+		return 0;
+	}
+
+	while (done < count) {
+		size_t batch = count - done < STATX_BATCH ? count - done :
+							    STATX_BATCH;
+		unsigned tail = *ring.sq_tail;
+		size_t submitted = 0, completed = 0;
+
+		for (i = 0; i < batch; i++) {
+			unsigned index = (tail + i) & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[index];
+			struct rgn_statx *req = &reqs[done + i];
+
+			memset (sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long)req->path;
+			sqe->len = mask;
+			sqe->off = (unsigned long)&req->stx;
+			sqe->user_data = done + i;
+			ring.sq_array[index] = index;
+		}
+		__atomic_store_n (ring.sq_tail, tail + batch, __ATOMIC_RELEASE);
+
+		/*
+		 * Submit and wait for the batch in one call.  The kernel may
+		 * take fewer SQEs than offered; offer it the rest again.
+		 */
+		while (submitted < batch) {
+			long ret = syscall (__NR_io_uring_enter, ring.fd,
+					    batch - submitted, batch,
+					    IORING_ENTER_GETEVENTS, NULL, 0);
+
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			submitted += ret;
+		}
+		if (submitted < batch)
+			/* Take back what the kernel never saw */
+			__atomic_store_n (ring.sq_tail, tail + submitted,
+					  __ATOMIC_RELEASE);
+
+		while (completed < submitted) {
+			unsigned long long tag;
+			int res;
+
+			/* Only after a signal or a short submission */
+			if (uring_wait (&ring, submitted - completed, &tag,
+					&res)) {
+				uring_exit (&ring);
+				return -1;
+			}
+			if (res == -EINVAL || res == -EOPNOTSUPP)
+				statx_one (&reqs[tag], mask);
+			else
+				reqs[tag].error = res < 0 ? -res : 0;
+			completed++;
+		}
+		if (submitted < batch) {
+			/* Submission failed; finish the slow way */
+			done += submitted;
+			break;
+		}
+		done += batch;
+	}
+	uring_exit (&ring);
+
+	for (i = done; i < count; i++)
+		statx_one (&reqs[i], mask);
+	return 0;
+}
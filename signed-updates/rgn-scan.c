@@ -0,0 +1,628 @@
+/*
+ * rgn-scan.c
+ *
+ * Inventory of directory trees of region files: one JSON or CSV row per
+ * file with its versions, builder, regions and validity, read from the
+ * record headers alone.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rgn.h"
+
+/* Rows are written out in blocks of this size */
+#define OUTPUT_BUFFER	(1024 * 1024)
+
+enum format {
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+struct options {
+	enum format format;
+	int all;		/* Every regular file, not only *.rgn */
+	int jobs;
+	enum rgn_stats_format stats;
+	const char *cache;
+};
+
+/* A file or directory still to be scanned */
+struct work {
+	char *path;
+	int dir;
+};
+
+struct row {
+	char *path;
+	char *text;
+};
+
+static struct options opts;
+static struct rgn_cache *cache;
+
+/* Work shared between the threads, and the rows they produce */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct work *queue;
+static size_t queue_len, queue_alloc;
+static int busy;		/* Threads scanning something right now */
+static struct row *rows;
+static size_t row_count, row_alloc;
+static int failed;		/* Some file was unreadable or invalid */
+
+static const char *const csv_header =
+	"path,size,version,data_version,app_version,builder,build_date,"
+	"build_time,toc,regions,region_ids,region_sizes,valid,problems\n";
+
+static void __attribute__ ((noreturn))
+usage (const char *name)
+{
+	printf ("Usage: %s [OPTION]... PATH...\n", name);
+	printf ("Print one row for each region file under the PATHs.\n");
+	printf ("\n");
+	printf ("  -f, --format FMT  json (the default) or csv\n");
+	printf ("  -a, --all         Scan every regular file, not only *.rgn\n");
+	printf ("  -j N              Scan with N threads (default: online CPUs)\n");
+	printf ("      --cache FILE  Keep summaries in FILE for the next scan\n");
+	printf ("                    (default: $RGN_CACHE)\n");
+	printf ("      --stats[=FMT] Print per-phase statistics to stderr on\n");
+	printf ("                    exit; FMT is text (default) or json\n");
+	printf ("  -h, --help        Display this help message\n");
+	printf ("\n");
+	printf ("Rows are sorted by path.  The exit status is 1 if any file\n");
+	printf ("could not be read or is not valid.\n");
+	exit (0);
+}
+
+static void *
+xmalloc (size_t size)
+{
+	void *ptr = malloc (size);
+
+	if (!ptr) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	return ptr;
+}
+
+static void *
+xrealloc (void *ptr, size_t size)
+{
+	ptr = realloc (ptr, size);
+	if (!ptr) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	return ptr;
+}
+
+static char *
+xstrdup (const char *s)
+{
+	char *copy = xmalloc (strlen (s) + 1);
+
+	return strcpy (copy, s);
+}
+
+static char *
+join_path (const char *dir, const char *name)
+{
+	size_t len = strlen (dir);
+	char *path = xmalloc (len + strlen (name) + 2);
+
+	if (len && dir[len - 1] == '/')
+		sprintf (path, "%s%s", dir, name);
+	else
+		sprintf (path, "%s/%s", dir, name);
+	return path;
+}
+
+static void
+push_work (char *path, int dir)
+{
+	pthread_mutex_lock (&lock);
+	if (queue_len == queue_alloc) {
+		queue_alloc = queue_alloc ? 2 * queue_alloc : 64;
+		queue = xrealloc (queue, queue_alloc * sizeof(*queue));
+	}
+	queue[queue_len].path = path;
+	queue[queue_len].dir = dir;
+	queue_len++;
+	pthread_cond_signal (&cond);
+	pthread_mutex_unlock (&lock);
+}
+
+static void
+add_row (char *path, char *text)
+{
+	pthread_mutex_lock (&lock);
+	if (row_count == row_alloc) {
+		row_alloc = row_alloc ? 2 * row_alloc : 256;
+		rows = xrealloc (rows, row_alloc * sizeof(*rows));
+	}
+	rows[row_count].path = path;
+	rows[row_count].text = text;
+	row_count++;
+	pthread_mutex_unlock (&lock);
+}
+
+/* Anything not printable ASCII is escaped, so rows are plain ASCII */
+static void
+json_string (FILE *f, const char *s)
+{
+	const unsigned char *p;
+
+	if (!s) {
+		fputs ("null", f);
+		return;
+	}
+	putc ('"', f);
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			fprintf (f, "\\%c", *p);
+		else if (*p < 0x20 || *p >= 0x7f)
+			fprintf (f, "\\u%04x", *p);
+		else
+			putc (*p, f);
+	}
+	putc ('"', f);
+}
+
+static void
+csv_string (FILE *f, const char *s)
+{
+	if (!s)
+		return;
+	if (!strpbrk (s, ",\"\r\n")) {
+		fputs (s, f);
+		return;
+	}
+	putc ('"', f);
+	for (; *s; s++) {
+		if (*s == '"')
+			putc ('"', f);
+		putc (*s, f);
+	}
+	putc ('"', f);
+}
+
+static void
+json_row (FILE *f, const char *path, off_t size,
+	  const struct rgn_summary *s)
+{
+	unsigned int bit;
+	UINT i;
+
+	fputs ("{\"path\":", f);
+	json_string (f, path);
+	fprintf (f, ",\"size\":%lld,\"version\":%u,\"data_version\":",
+		 (long long)size, s->version);
+	if (s->data_version)
+		fprintf (f, "%u", s->data_version);
+	else
+		fputs ("null", f);
+	fputs (",\"app_version\":", f);
+	if (s->builder)
+		fprintf (f, "%u", s->app_version);
+	else
+		fputs ("null", f);
+	fputs (",\"builder\":", f);
+	json_string (f, s->builder);
+	fputs (",\"build_date\":", f);
+	json_string (f, s->build_date);
+	fputs (",\"build_time\":", f);
+	json_string (f, s->build_time);
+	fprintf (f, ",\"toc\":%s,\"regions\":[", s->toc ? "true" : "false");
+	for (i = 0; i < s->region_count; i++) {
+		const struct rgn_summary_region *r = &s->regions[i];
+
+		fprintf (f, "%s{\"id\":%u,\"type\":\"%c\",\"delay\":%u,"
+			 "\"size\":%llu,\"crc\":%s}", i ? "," : "", r->id,
+			 r->type, r->delay, r->size, r->crc ? "true" : "false");
+	}
+	fprintf (f, "],\"valid\":%s,\"problems\":[",
+		 s->problems ? "false" : "true");
+	for (bit = 1; bit && bit <= s->problems; bit <<= 1) {
+		if (!(s->problems & bit))
+			continue;
+		if (bit != (s->problems & -s->problems))
+			putc (',', f);
+		json_string (f, rgn_problem_string (bit));
+	}
+	fputs ("]}\n", f);
+}
+
+static void
+csv_row (FILE *f, const char *path, off_t size, const struct rgn_summary *s)
+{
+	unsigned int bit;
+	UINT i;
+
+	csv_string (f, path);
+	fprintf (f, ",%lld,%u,", (long long)size, s->version);
+	if (s->data_version)
+		fprintf (f, "%u", s->data_version);
+	putc (',', f);
+	if (s->builder)
+		fprintf (f, "%u", s->app_version);
+	putc (',', f);
+	csv_string (f, s->builder);
+	putc (',', f);
+	csv_string (f, s->build_date);
+	putc (',', f);
+	csv_string (f, s->build_time);
+	fprintf (f, ",%d,%u,", s->toc, s->region_count);
+	for (i = 0; i < s->region_count; i++)
+		fprintf (f, "%s%u", i ? " " : "", s->regions[i].id);
+	putc (',', f);
+	for (i = 0; i < s->region_count; i++)
+		fprintf (f, "%s%llu", i ? " " : "", s->regions[i].size);
+	fprintf (f, ",%d,", !s->problems);
+	/* Problems are joined with "; ", which needs no quoting */
+	for (bit = 1; bit && bit <= s->problems; bit <<= 1) {
+		if (!(s->problems & bit))
+			continue;
+		if (bit != (s->problems & -s->problems))
+			fputs ("; ", f);
+		fputs (rgn_problem_string (bit), f);
+	}
+	putc ('\n', f);
+}
+
+static void
+error_row (FILE *f, const char *path, const char *error)
+{
+	if (opts.format == FORMAT_JSON) {
+		fputs ("{\"path\":", f);
+		json_string (f, path);
+		fputs (",\"error\":", f);
+		json_string (f, error);
+		fputs ("}\n", f);
+	}
+	else {
+		csv_string (f, path);
+		fputs (",,,,,,,,,,,,0,", f);
+		csv_string (f, error);
+		putc ('\n', f);
+	}
+}
+
+/*
+ * Summarize the file name in directory dir_fd, from the cache if it has
+ * the file as it is now.  A hit costs one stat() unless the cache keys
+ * files by their contents.
+ */
+static int
+summarize (int dir_fd, const char *name, struct stat *st,
+	   struct rgn_summary *summary)
+{
+	struct rgn_cache_key key;
+	int fd = -1, ret = -1, err;
+
+	if (cache) {
+		if (fstatat (dir_fd, name, st, 0))
+			return -1;
+		if (rgn_cache_key (cache, -1, st, &key)) {
+			fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC);
+			if (fd < 0 || rgn_cache_key (cache, fd, st, &key))
+				goto out;
+		}
+		if (rgn_cache_lookup (cache, &key, summary, NULL) == 1) {
+			ret = 0;
+			goto out;
+		}
+	}
+
+	if (fd < 0)
+		fd = openat (dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat (fd, st) ||
+	    rgn_summarize (fd, st->st_size, summary))
+		goto out;
+	ret = 0;
+	if (cache && !rgn_cache_key (cache, fd, st, &key))
+		rgn_cache_store (cache, fd, &key, summary, 0);
+
+out:
+	err = errno;
+	if (fd >= 0)
+		close (fd);
+	errno = err;
+	return ret;
+}
+
+/*
+ * Summarize the file name in directory dir_fd and add its row.
+ */
+static void
+scan_file (int dir_fd, const char *name, char *path)
+{
+	ULONGLONG span = rgn_trace_begin ();
+	struct rgn_summary summary;
+	struct stat st;
+	UINT regions = 0;
+	char *text;
+	size_t len;
+	FILE *f;
+
+	f = open_memstream (&text, &len);
+	if (!f) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+
+	rgn_stats_enter (RGN_PHASE_PARSE);
+	if (summarize (dir_fd, name, &st, &summary)) {
+		error_row (f, path, strerror (errno));
+		__atomic_store_n (&failed, 1, __ATOMIC_RELAXED);
+	}
+	else {
+		if (opts.format == FORMAT_JSON)
+			json_row (f, path, st.st_size, &summary);
+		else
+			csv_row (f, path, st.st_size, &summary);
+		if (summary.problems)
+			__atomic_store_n (&failed, 1, __ATOMIC_RELAXED);
+		regions = summary.region_count;
+		rgn_summary_free (&summary);
+	}
+	rgn_stats_leave ();
+
+	if (fclose (f)) {
+		fprintf (stderr, "Out of memory\n");
+		exit (1);
+	}
+	add_row (path, text);
+	rgn_trace_end ("scan_file", span, regions);
+}
+
+static int
+wanted (const char *name)
+{
+	size_t len = strlen (name);
+
+	return opts.all || (len > 4 && !strcmp (name + len - 4, ".rgn"));
+}
+
+/*
+ * Queue the subdirectories of path and scan the region files in it.
+ * Symbolic links are not followed.
+ */
+static void
+scan_dir (const char *path)
+{
+	ULONGLONG span = rgn_trace_begin ();
+	struct dirent *de;
+	int fd, files = 0;
+	DIR *dir;
+
+	fd = open (path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	dir = fd < 0 ? NULL : fdopendir (fd);
+	if (!dir) {
+		fprintf (stderr, "Could not open directory %s: %s\n", path,
+			 strerror (errno));
+		__atomic_store_n (&failed, 1, __ATOMIC_RELAXED);
+		if (fd >= 0)
+			close (fd);
+		return;
+	}
+
+	while ((de = readdir (dir))) {
+		unsigned char type = de->d_type;
+
+		if (!strcmp (de->d_name, ".") || !strcmp (de->d_name, ".."))
+			continue;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat (fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW))
+				continue;
+			if (S_ISDIR (st.st_mode))
+				type = DT_DIR;
+			else if (S_ISREG (st.st_mode))
+				type = DT_REG;
+		}
+
+		if (type == DT_DIR) {
+			push_work (join_path (path, de->d_name), 1);
+		}
+		else if (type == DT_REG && wanted (de->d_name)) {
+			scan_file (fd, de->d_name,
+				   join_path (path, de->d_name));
+			files++;
+		}
+	}
+	closedir (dir);
+	rgn_trace_end ("scan_dir", span, files);
+}
+
+static void *
+scan_worker (void *arg)
+{
+	struct work w;
+
+	if (arg)
+		rgn_trace_thread_name ("scan");
+
+	pthread_mutex_lock (&lock);
+	for (;;) {
+		while (!queue_len && busy)
+			pthread_cond_wait (&cond, &lock);
+		if (!queue_len)
+			break;
+		w = queue[--queue_len];
+		busy++;
+		pthread_mutex_unlock (&lock);
+
+		if (w.dir) {
+			scan_dir (w.path);
+			free (w.path);
+		}
+		else {
+			scan_file (AT_FDCWD, w.path, w.path);
+		}
+
+		pthread_mutex_lock (&lock);
+		if (--busy == 0 && !queue_len)
+			pthread_cond_broadcast (&cond);
+	}
+	pthread_mutex_unlock (&lock);
+
+	return NULL;
+}
+
+static int
+compare_rows (const void *a, const void *b)
+{
+	return strcmp (((const struct row *)a)->path,
+		       ((const struct row *)b)->path);
+}
+
+static void
+parse_args (int argc, char **argv)
+{
+	static const struct option available_options[] = {
+		{ "format",	required_argument,	NULL, 'f' },
+		{ "all",	no_argument,		NULL, 'a' },
+		{ "stats",	optional_argument,	NULL, 'S' },
+		{ "cache",	required_argument,	NULL, 'C' },
+		{ "help",	no_argument,		NULL, 'h' },
+		{ NULL, 0, NULL, 0 }
+	};
+	char *end;
+	int opt;
+
+	memset (&opts, 0, sizeof(opts));
+	opts.jobs = sysconf (_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt_long (argc, argv, "hf:aj:", available_options,
+				   NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp (optarg, "json"))
+				opts.format = FORMAT_JSON;
+			else if (!strcmp (optarg, "csv"))
+				opts.format = FORMAT_CSV;
+			else {
+				fprintf (stderr, "Unknown format: %s\n",
+					 optarg);
+				exit (1);
+			}
+			break;
+		case 'a':
+			opts.all = 1;
+			break;
+		case 'j':
+			opts.jobs = strtol (optarg, &end, 0);
+			if (*end || opts.jobs < 1) {
+				fprintf (stderr, "Invalid thread count: %s\n",
+					 optarg);
+				exit (1);
+			}
+			break;
+		case 'S':
+			if (rgn_stats_parse (optarg, &opts.stats)) {
+				fprintf (stderr, "Unknown statistics format: "
+					 "%s\n", optarg);
+				exit (1);
+			}
+			break;
+		case 'C':
+			opts.cache = optarg;
+			break;
+		case 'h':
+			usage (argv[0]);
+		default:
+			exit (1);
+		}
+	}
+	if (opts.jobs < 1)
+		opts.jobs = 1;
+
+	if (optind == argc) {
+		fprintf (stderr, "No paths given; see %s --help\n", argv[0]);
+		exit (1);
+	}
+}
+
+int
+main (int argc, char **argv)
+{
+	pthread_t *threads;
+	struct stat st;
+	size_t n;
+	int i, err;
+
+	parse_args (argc, argv);
+	rgn_stats_start ("rgn-scan", opts.stats);
+	rgn_trace_start ("rgn-scan");
+
+	cache = rgn_cache_open (opts.cache);
+	if (!cache && errno) {
+		fprintf (stderr, "Could not open cache %s: %s\n",
+			 opts.cache ? opts.cache : getenv ("RGN_CACHE"),
+			 strerror (errno));
+		exit (1);
+	}
+
+	/* Files named on the command line are scanned whatever their name */
+	for (i = argc - 1; i >= optind; i--) {
+		if (stat (argv[i], &st)) {
+			fprintf (stderr, "Could not stat %s: %s\n", argv[i],
+				 strerror (errno));
+			failed = 1;
+			continue;
+		}
+		push_work (xstrdup (argv[i]), S_ISDIR (st.st_mode));
+	}
+
+	/* This thread is one of the jobs */
+	threads = xmalloc (opts.jobs * sizeof(*threads));
+	for (i = 0; i < opts.jobs - 1; i++) {
+		err = pthread_create (&threads[i], NULL, scan_worker, &opts);
+		if (err) {
+			fprintf (stderr, "Could not start scan thread: %s\n",
+				 strerror (err));
+			exit (1);
+		}
+	}
+	scan_worker (NULL);
+	for (i = 0; i < opts.jobs - 1; i++)
+		pthread_join (threads[i], NULL);
+	free (threads);
+	free (queue);
+	if (rgn_cache_close (cache))
+		fprintf (stderr, "Could not write cache %s: %s\n",
+			 opts.cache ? opts.cache : getenv ("RGN_CACHE"),
+			 strerror (errno));
+
+	rgn_stats_enter (RGN_PHASE_OUTPUT);
+	qsort (rows, row_count, sizeof(*rows), compare_rows);
+	setvbuf (stdout, xmalloc (OUTPUT_BUFFER), _IOFBF, OUTPUT_BUFFER);
+	if (opts.format == FORMAT_CSV)
+		fputs (csv_header, stdout);
+	for (n = 0; n < row_count; n++) {
+		fputs (rows[n].text, stdout);
+		free (rows[n].text);
+		free (rows[n].path);
+	}
+	free (rows);
+	if (fflush (stdout)) {
+		fprintf (stderr, "Error writing: %s\n", strerror (errno));
+		exit (1);
+	}
+	rgn_stats_leave ();
+
+	return failed;
+}
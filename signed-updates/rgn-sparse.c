@@ -0,0 +1,447 @@
+/*
+ * rgn-sparse.c
+ *
+ * Sparse region payloads: runs of one fill byte, such as erased flash or
+ * zero padding, are kept as a struct region_fill each and only the bytes
+ * between them are stored.
+ *
+ * Runs are found by testing aligned blocks of half the shortest run for
+ * being one byte throughout and extending each hit both ways; any run of
+ * the shortest length or more holds such a block.  The test compares
+ * 16 or 32 bytes at a time with SSE2 or AVX2, so data without runs costs
+ * little more than a read.  Zero runs are expanded as holes in regular
+ * files not open for appending.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rgn.h"
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#define HAVE_SIMD_SPAN
+#endif
+
+/* Buffer of fill bytes for runs written out in full */
+#define FILL_BUF_SIZE	(64 * 1024)
+
+typedef size_t (*span_fn) (const BYTE *p, size_t len, BYTE byte);
+
+static pthread_once_t span_once = PTHREAD_ONCE_INIT;
+static span_fn fill_span;
+
+static inline uint64_t
+load64 (const BYTE *p)
+{
+	uint64_t v;
+
+	memcpy (&v, p, sizeof(v));
+	return v;
+}
+
+/* Length of the prefix of p that is all byte, a word at a time */
+static size_t
+fill_span_sw (const BYTE *p, size_t len, BYTE byte)
+{
+	uint64_t pattern = byte * 0x0101010101010101ull, diff;
+	size_t n = 0;
+
+	while (n + 8 <= len) {
+		diff = load64 (p + n) ^ pattern;
+		if (diff)
+			return n + __builtin_ctzll (diff) / 8;
+		n += 8;
+	}
+	while (n < len && p[n] == byte)
+		n++;
+	return n;
+}
+
+#ifdef HAVE_SIMD_SPAN
+static size_t
+fill_span_sse2 (const BYTE *p, size_t len, BYTE byte)
+{
+	__m128i pattern = _mm_set1_epi8 (byte);
+	size_t n = 0;
+	UINT mask;
+
+	while (n + 16 <= len) {
+		mask = _mm_movemask_epi8 (_mm_cmpeq_epi8 (
+			_mm_loadu_si128 ((const __m128i *)(p + n)), pattern));
+		if (mask != 0xffff)
+			return n + __builtin_ctz (~mask);
+		n += 16;
+	}
+	return n + fill_span_sw (p + n, len - n, byte);
+}
+
+/* Four vectors per test while they all match, one at a time after */
+__attribute__ ((target ("avx2")))
+static size_t
+fill_span_avx2 (const BYTE *p, size_t len, BYTE byte)
+{
+	__m256i pattern = _mm256_set1_epi8 (byte);
+	size_t n = 0;
+	UINT mask;
+
+	while (n + 128 <= len) {
+		const __m256i *v = (const __m256i *)(p + n);
+		__m256i all;
+
+		all = _mm256_and_si256 (
+			_mm256_and_si256 (
+				_mm256_cmpeq_epi8 (_mm256_loadu_si256 (v), pattern),
+				_mm256_cmpeq_epi8 (_mm256_loadu_si256 (v + 1),
+						   pattern)),
+			_mm256_and_si256 (
+				_mm256_cmpeq_epi8 (_mm256_loadu_si256 (v + 2),
+						   pattern),
+				_mm256_cmpeq_epi8 (_mm256_loadu_si256 (v + 3),
+						   pattern)));
+		if ((UINT)_mm256_movemask_epi8 (all) != 0xffffffff)
+			break;
+		n += 128;
+	}
+	while (n + 32 <= len) {
+		mask = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (
+			_mm256_loadu_si256 ((const __m256i *)(p + n)), pattern));
+		if (mask != 0xffffffff)
+			return n + __builtin_ctz (~mask);
+		n += 32;
+	}
+	return n + fill_span_sw (p + n, len - n, byte);
+}
+#endif
+
+static void
+span_init (void)
+{
+	fill_span = fill_span_sw;
+#ifdef HAVE_SIMD_SPAN
+	fill_span = fill_span_sse2;
+	__builtin_cpu_init ();
+	if (__builtin_cpu_supports ("avx2"))
+		fill_span = fill_span_avx2;
+#endif
+}
+
+size_t
+rgn_fill_span (const void *data, size_t len, BYTE byte)
+{
+	pthread_once (&span_once, span_init);
+	return fill_span (data, len, byte);
+}
+
+/*
+ * Find the runs of at least min_run bytes in data.  Returns their number
+ * and the bytes they cover in *filled, or -1 with errno set.
+ */
+static ssize_t
+find_runs (const BYTE *data, size_t len, size_t min_run,
+	   struct region_fill **runs, size_t *filled)
+{
+	size_t step = min_run / 2, pos = 0, count = 0, alloc = 0, start, n;
+	struct region_fill *r = NULL, *grown;
+
+	*filled = 0;
+	while (pos + step <= len) {
+		BYTE byte = data[pos];
+
+		if (fill_span (data + pos, step, byte) < step) {
+			pos += step;
+			continue;
+		}
+
+		/* Back to the end of the last run, then on as far as it goes */
+		start = pos;
+		while (start > 0 && data[start - 1] == byte &&
+		       (!count || start > r[count - 1].offset +
+					  r[count - 1].len))
+			start--;
+		n = pos + step - start;
+		n += fill_span (data + pos + step, len - pos - step, byte);
+
+		if (n >= min_run) {
+			if (count == alloc) {
+				alloc = alloc ? 2 * alloc : 64;
+				grown = realloc (r, alloc * sizeof(*r));
+				if (!grown) {
+					free (r);
+					return -1;
+				}
+				r = grown;
+			}
+			r[count].offset = start;
+			r[count].len = n;
+			r[count].byte = byte;
+			count++;
+			*filled += n;
+		}
+
+		/* Carry on at the next block boundary */
+		pos = (start + n + step - 1) / step * step;
+	}
+
+	*runs = r;
+	return count;
+}
+
+ssize_t
+rgn_sparse_encode (const void *data_in, size_t len, int fd, size_t min_run)
+{
+	const BYTE *data = data_in;
+	struct region_sparse hdr;
+	struct region_fill *runs = NULL;
+	size_t filled, size, pos, i;
+	ssize_t count;
+
+	if (len > 0xffffffffu) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (min_run < 2 * sizeof(struct region_fill))
+		min_run = 2 * sizeof(struct region_fill);
+
+	pthread_once (&span_once, span_init);
+	count = find_runs (data, len, min_run, &runs, &filled);
+	if (count < 0)
+		return -1;
+
+	size = sizeof(hdr) + count * sizeof(*runs) + len - filled;
+	if (!count || size >= len) {
+		free (runs);
+		return 0;
+	}
+
+	hdr.size = len;
+	hdr.count = count;
+	if (rgn_write_full (fd, &hdr, sizeof(hdr)) < 0 ||
+	    rgn_write_full (fd, runs, count * sizeof(*runs)) < 0)
+		goto fail;
+
+	/* The bytes between the runs */
+	pos = 0;
+	for (i = 0; i <= (size_t)count; i++) {
+		size_t end = i < (size_t)count ? runs[i].offset : len;
+
+		if (end > pos && rgn_write_full (fd, data + pos, end - pos) < 0)
+			goto fail;
+		if (i < (size_t)count)
+			pos = runs[i].offset + runs[i].len;
+	}
+
+	free (runs);
+	return size;
+
+fail:
+	free (runs);
+	return -1;
+}
+
+/*
+ * Check the header and the runs: in order, inside the region and leaving
+ * exactly the stored bytes for the rest.
+ */
+static int
+decode_payload (const BYTE *payload, size_t len, struct region_sparse *hdr,
+		const BYTE **runs, const BYTE **literal)
+{
+	struct region_fill run;
+	size_t end = 0, filled = 0, table_len;
+	UINT i;
+
+	if (len < sizeof(*hdr))
+		goto bad;
+	memcpy (hdr, payload, sizeof(*hdr));
+	table_len = (size_t)hdr->count * sizeof(run);
+	if (len - sizeof(*hdr) < table_len)
+		goto bad;
+
+	*runs = payload + sizeof(*hdr);
+	*literal = *runs + table_len;
+	for (i = 0; i < hdr->count; i++) {
+		memcpy (&run, *runs + i * sizeof(run), sizeof(run));
+		if (run.offset < end || run.offset > hdr->size ||
+		    run.len > hdr->size - run.offset)
+			goto bad;
+		end = (size_t)run.offset + run.len;
+		filled += run.len;
+	}
+	if (len - sizeof(*hdr) - table_len != hdr->size - filled)
+		goto bad;
+	return 0;
+
+bad:
+	errno = EBADMSG;
+	return -1;
+}
+
+int
+rgn_sparse_header (const BYTE *payload, size_t len,
+		   struct region_sparse *hdr)
+{
+	const BYTE *runs, *literal;
+
+	return decode_payload (payload, len, hdr, &runs, &literal);
+}
+
+/*
+ * Write len fill bytes to fd.  Zeros become a hole where holes is set,
+ * unless the file system cannot punch one or the seek past it does not
+ * land where it should.
+ */
+static int
+write_fill (int fd, BYTE byte, size_t len, int holes, BYTE *buf,
+	    int *buf_byte)
+{
+	if (byte == 0 && holes) {
+		off_t pos = lseek (fd, 0, SEEK_CUR);
+
+		if (pos >= 0 && !fallocate (fd, FALLOC_FL_PUNCH_HOLE |
+					    FALLOC_FL_KEEP_SIZE, pos, len) &&
+		    lseek (fd, len, SEEK_CUR) == pos + (off_t)len)
+			return 0;
+	}
+
+	if (*buf_byte != byte) {
+		memset (buf, byte, FILL_BUF_SIZE);
+		*buf_byte = byte;
+	}
+	while (len) {
+		size_t n = len < FILL_BUF_SIZE ? len : FILL_BUF_SIZE;
+
+		if (rgn_write_full (fd, buf, n) < 0)
+			return -1;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+rgn_sparse_expand (const BYTE *payload, size_t len, int out_fd)
+{
+	struct region_sparse hdr;
+	struct region_fill run;
+	const BYTE *runs, *literal;
+	BYTE *buf = NULL;
+	struct stat st;
+	size_t pos = 0;
+	off_t end;
+	int holes, flags, buf_byte = -1, ret = -1;
+	UINT i;
+
+	if (decode_payload (payload, len, &hdr, &runs, &literal))
+		return -1;
+
+	/*
+	 * Holes need a regular file that is written where it is positioned;
+	 * every write to an O_APPEND descriptor goes to the end whatever the
+	 * seeks between them, so the zeros are written out there.
+	 */
+	flags = fcntl (out_fd, F_GETFL);
+	holes = fstat (out_fd, &st) == 0 && S_ISREG (st.st_mode) &&
+		flags >= 0 && !(flags & O_APPEND);
+	buf = malloc (FILL_BUF_SIZE);
+	if (!buf)
+		return -1;
+
+	for (i = 0; i <= hdr.count; i++) {
+		if (i < hdr.count) {
+			memcpy (&run, runs + i * sizeof(run), sizeof(run));
+		}
+		else {
+			/* The stored bytes after the last run */
+			run.offset = hdr.size;
+			run.len = 0;
+			run.byte = 0;
+		}
+
+		if (run.offset > pos) {
+			if (rgn_write_full (out_fd, literal,
+					    run.offset - pos) < 0)
+				goto out;
+			literal += run.offset - pos;
+		}
+		if (run.len && write_fill (out_fd, run.byte, run.len, holes,
+					   buf, &buf_byte))
+			goto out;
+		pos = (size_t)run.offset + run.len;
+	}
+
+	/* A hole at the end does not make the file any longer */
+	if (holes) {
+		end = lseek (out_fd, 0, SEEK_CUR);
+		if (end < 0 || fstat (out_fd, &st) ||
+		    (st.st_size < end && ftruncate (out_fd, end)))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free (buf);
+	return ret;
+}
+
+ssize_t
+rgn_sparse_read (const BYTE *payload, size_t len, size_t offset, void *buf,
+		 size_t count)
+{
+	struct region_sparse hdr;
+	struct region_fill run;
+	const BYTE *runs, *literal;
+	BYTE *out = buf;
+	size_t pos = 0, done = 0;
+	UINT i;
+
+	if (decode_payload (payload, len, &hdr, &runs, &literal))
+		return -1;
+	if (offset >= hdr.size)
+		return 0;
+	if (count > hdr.size - offset)
+		count = hdr.size - offset;
+
+	/* pos is the region offset of the next stored byte at literal */
+	for (i = 0; i <= hdr.count && done < count; i++) {
+		size_t lit_end, from, to;
+
+		if (i < hdr.count) {
+			memcpy (&run, runs + i * sizeof(run), sizeof(run));
+		}
+		else {
+			/* The stored bytes after the last run */
+			run.offset = hdr.size;
+			run.len = 0;
+			run.byte = 0;
+		}
+
+		lit_end = run.offset;
+		from = offset + done > pos ? offset + done : pos;
+		to = offset + count < lit_end ? offset + count : lit_end;
+		if (from < to) {
+			memcpy (out + from - offset, literal + from - pos,
+				to - from);
+			done = to - offset;
+		}
+		literal += lit_end - pos;
+
+		from = offset + done > run.offset ? offset + done : run.offset;
+		to = offset + count < (size_t)run.offset + run.len ?
+		     offset + count : (size_t)run.offset + run.len;
+		if (from < to) {
+			memset (out + from - offset, run.byte, to - from);
+			done = to - offset;
+		}
+		pos = (size_t)run.offset + run.len;
+	}
+
+	return count;
+}
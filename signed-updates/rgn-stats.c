@@ -0,0 +1,362 @@
+/*
+ * rgn-stats.c
+ *
+ * librgn: per-phase statistics for the tools' --stats option
+ *
+ * Each thread keeps a small stack of the phases it is in.  Entering or
+ * leaving a phase samples the thread's CPU clock and its read and write
+ * system call counts (from /proc/thread-self/io) and charges the change
+ * to the phase that was running, so a nested phase is not also counted
+ * in the one around it, and threads working in the same phase add up.
+ * The wall time of a phase is the time at least one thread was in it, so
+ * a phase run on several threads at once shows more CPU than wall time.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "rgn.h"
+
+/* Deeper nesting is counted in the innermost phase that fits */
+#define PHASE_DEPTH	8
+
+struct phase_stats {
+	ULONGLONG bytes;
+	double wall;
+	double cpu;
+	long long reads;
+	long long writes;
+	long max_rss;		/* KiB */
+	int used;
+	int active;		/* Threads in the phase right now */
+	double since;		/* When the first of them entered it */
+};
+
+struct sample {
+	double wall;
+	double cpu;
+	long long reads;
+	long long writes;
+};
+
+struct thread_stats {
+	int depth;
+	enum rgn_phase stack[PHASE_DEPTH];
+	struct sample last;
+	int io_fd;		/* Plus one, so 0 is not opened yet */
+};
+
+static const char *const phase_names[RGN_PHASES] = {
+	[RGN_PHASE_PARSE]	= "parse",
+	[RGN_PHASE_COPY]	= "copy",
+	[RGN_PHASE_ENCODE]	= "encode",
+	[RGN_PHASE_SIGN]	= "sign",
+	[RGN_PHASE_VERIFY]	= "verify",
+	[RGN_PHASE_OUTPUT]	= "output",
+};
+
+static enum rgn_stats_format stats_format;
+static const char *stats_tool;
+static struct phase_stats phases[RGN_PHASES];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static __thread struct thread_stats thread_stats;
+
+/* The whole process, from rgn_stats_start() on */
+static struct sample process_start;
+static long long io_samples;	/* Reads of the io files since then */
+static int io_missing;
+
+static double
+clock_seconds (clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime (clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+max_rss (void)
+{
+	struct rusage ru;
+
+	if (getrusage (RUSAGE_SELF, &ru))
+		return 0;
+	return ru.ru_maxrss;
+}
+
+/*
+ * Read the syscr and syscw lines of an io file.  The read itself shows up
+ * in the next one, which the callers take off again.
+ */
+static int
+read_io (int fd, long long *reads, long long *writes)
+{
+	char buf[512];
+	const char *p;
+	ssize_t len;
+
+	len = pread (fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	__atomic_fetch_add (&io_samples, 1, __ATOMIC_RELAXED);
+
+	p = strstr (buf, "syscr: ");
+	if (!p)
+		return -1;
+	*reads = strtoll (p + 7, NULL, 10);
+	p = strstr (buf, "syscw: ");
+	if (!p)
+		return -1;
+	*writes = strtoll (p + 7, NULL, 10);
+	return 0;
+}
+
+static void
+close_io (void *arg)
+{
+	close ((int)(long)arg - 1);
+}
+
+static void
+thread_sample (struct thread_stats *t, struct sample *s)
+{
+	s->wall = clock_seconds (CLOCK_MONOTONIC);
+	s->cpu = clock_seconds (CLOCK_THREAD_CPUTIME_ID);
+	s->reads = s->writes = 0;
+
+	if (!t->io_fd) {
+		t->io_fd = open ("/proc/thread-self/io", O_RDONLY | O_CLOEXEC)
+									+ 1;
+		if (t->io_fd)
+			pthread_setspecific (stats_key, (void *)(long)t->io_fd);
+	}
+	if (!t->io_fd || read_io (t->io_fd - 1, &s->reads, &s->writes))
+		io_missing = 1;
+}
+
+/*
+ * Charge the thread's time since its last sample to phase from (if not
+ * negative) and move it to phase to (if not negative).
+ */
+static void
+switch_phase (int from, int to)
+{
+	struct thread_stats *t = &thread_stats;
+	struct phase_stats *p;
+	struct sample now;
+	long rss = 0;
+
+	thread_sample (t, &now);
+	if (from >= 0)
+		rss = max_rss ();
+
+	pthread_mutex_lock (&stats_lock);
+	if (from >= 0) {
+		p = &phases[from];
+		p->cpu += now.cpu - t->last.cpu;
+		p->reads += now.reads - t->last.reads - 1;
+		p->writes += now.writes - t->last.writes;
+		if (rss > p->max_rss)
+			p->max_rss = rss;
+		if (--p->active == 0)
+			p->wall += now.wall - p->since;
+	}
+	if (to >= 0) {
+		p = &phases[to];
+		p->used = 1;
+		if (p->active++ == 0)
+			p->since = now.wall;
+	}
+	pthread_mutex_unlock (&stats_lock);
+
+	t->last = now;
+}
+
+int
+rgn_stats_parse (const char *arg, enum rgn_stats_format *format)
+{
+	if (!arg || !strcmp (arg, "text"))
+		*format = RGN_STATS_TEXT;
+	else if (!strcmp (arg, "json"))
+		*format = RGN_STATS_JSON;
+	else {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+void
+rgn_stats_enter (enum rgn_phase phase)
+{
+	struct thread_stats *t = &thread_stats;
+
+	if (!stats_format)
+		return;
+	if (t->depth < PHASE_DEPTH) {
+		switch_phase (t->depth ? (int)t->stack[t->depth - 1] : -1,
+			      phase);
+		t->stack[t->depth] = phase;
+	}
+	t->depth++;
+}
+
+void
+rgn_stats_leave (void)
+{
+	struct thread_stats *t = &thread_stats;
+
+	if (!stats_format || !t->depth)
+		return;
+	t->depth--;
+	if (t->depth < PHASE_DEPTH)
+		switch_phase (t->stack[t->depth],
+			      t->depth ? (int)t->stack[t->depth - 1] : -1);
+}
+
+void
+rgn_stats_add (enum rgn_phase phase, ULONGLONG bytes)
+{
+	if (stats_format)
+		__atomic_fetch_add (&phases[phase].bytes, bytes,
+				    __ATOMIC_RELAXED);
+}
+
+static void
+print_count (FILE *f, long long count, int json)
+{
+	if (io_missing)
+		fprintf (f, json ? "null" : "%8s", "-");
+	else
+		fprintf (f, json ? "%lld" : "%8lld", count);
+}
+
+static void
+print_rate (FILE *f, ULONGLONG bytes, double seconds, int json)
+{
+	if (bytes && seconds > 0)
+		fprintf (f, json ? "%.1f" : "%10.1f", bytes / seconds / 1e6);
+	else
+		fprintf (f, json ? "null" : "%10s", "-");
+}
+
+static void
+report (void)
+{
+	struct thread_stats *t = &thread_stats;
+	struct phase_stats snap[RGN_PHASES], total;
+	int json = stats_format == RGN_STATS_JSON;
+	int top = t->depth < PHASE_DEPTH ? t->depth : PHASE_DEPTH;
+	double now;
+	FILE *f = stderr;
+	int fd, i, first = 1;
+
+	/* Close the books on whatever the exiting thread is doing */
+	if (top)
+		switch_phase (t->stack[top - 1], t->stack[top - 1]);
+
+	memset (&total, 0, sizeof(total));
+	now = clock_seconds (CLOCK_MONOTONIC);
+	total.wall = now - process_start.wall;
+	total.cpu = clock_seconds (CLOCK_PROCESS_CPUTIME_ID) -
+							process_start.cpu;
+	total.max_rss = max_rss ();
+	fd = open ("/proc/self/io", O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || read_io (fd, &total.reads, &total.writes))
+		io_missing = 1;
+	if (fd >= 0)
+		close (fd);
+	/* Less every read of an io file but the last */
+	total.reads -= process_start.reads + io_samples - 1;
+	total.writes -= process_start.writes;
+
+	pthread_mutex_lock (&stats_lock);
+	memcpy (snap, phases, sizeof(snap));
+	pthread_mutex_unlock (&stats_lock);
+	for (i = 0; i < RGN_PHASES; i++)
+		if (snap[i].active)
+			snap[i].wall += now - snap[i].since;
+
+	if (json)
+		fprintf (f, "{\"tool\":\"%s\",\"phases\":{", stats_tool);
+	else
+		fprintf (f, "%-8s %14s %9s %9s %10s %8s %8s %10s\n", "phase",
+			 "bytes", "wall s", "CPU s", "MB/s", "reads", "writes",
+			 "RSS KiB");
+
+	for (i = 0; i <= RGN_PHASES; i++) {
+		const struct phase_stats *p = i < RGN_PHASES ? &snap[i] :
+									&total;
+
+		if (i < RGN_PHASES && !p->used && !p->bytes)
+			continue;
+		if (json) {
+			if (i < RGN_PHASES)
+				fprintf (f, "%s\"%s\":{\"bytes\":%llu,"
+					 "\"mb_s\":", first ? "" : ",",
+					 phase_names[i], p->bytes);
+			else
+				fprintf (f, "},\"total\":{\"mb_s\":");
+			print_rate (f, p->bytes, p->wall, 1);
+			fprintf (f, ",\"wall_s\":%.6f,\"cpu_s\":%.6f,"
+				 "\"read_syscalls\":", p->wall, p->cpu);
+			print_count (f, p->reads, 1);
+			fprintf (f, ",\"write_syscalls\":");
+			print_count (f, p->writes, 1);
+			fprintf (f, ",\"peak_rss_kib\":%ld}", p->max_rss);
+		}
+		else {
+			fprintf (f, "%-8s ", i < RGN_PHASES ? phase_names[i] :
+								"total");
+			if (i < RGN_PHASES)
+				fprintf (f, "%14llu ", p->bytes);
+			else
+				fprintf (f, "%14s ", "-");
+			fprintf (f, "%9.3f %9.3f ", p->wall, p->cpu);
+			print_rate (f, p->bytes, p->wall, 0);
+			fprintf (f, " ");
+			print_count (f, p->reads, 0);
+			fprintf (f, " ");
+			print_count (f, p->writes, 0);
+			fprintf (f, " %10ld\n", p->max_rss);
+		}
+		first = 0;
+	}
+	if (json)
+		fprintf (f, "}\n");
+}
+
+void
+rgn_stats_start (const char *tool, enum rgn_stats_format format)
+{
+	int fd;
+
+	if (stats_format || !format)
+		return;
+	if (pthread_key_create (&stats_key, close_io))
+		return;
+
+	stats_tool = tool;
+	stats_format = format;
+	process_start.wall = clock_seconds (CLOCK_MONOTONIC);
+	process_start.cpu = clock_seconds (CLOCK_PROCESS_CPUTIME_ID);
+	fd = open ("/proc/self/io", O_RDONLY | O_CLOEXEC);
+	if (fd < 0 ||
+	    read_io (fd, &process_start.reads, &process_start.writes))
+		io_missing = 1;
+	if (fd >= 0)
+		close (fd);
+	atexit (report);
+}
@@ -0,0 +1,265 @@
+/*
+ * rgn-trace.c
+ *
+ * librgn: timeline tracing of the tools' hot loops
+ *
+ * Every thread records into a ring of its own, so recording takes no lock
+ * and touches no shared cache line: the owner fills the slot at head and
+ * then publishes it by advancing head.  A thread takes a ring the first
+ * time it records anything and hands it back when it exits, so the pools
+ * of short-lived workers the tools start per region reuse a few rings
+ * rather than each allocating one; events carry their thread ID for that
+ * reason.  At exit all rings are written out as Chrome trace event JSON
+ * (chrome://tracing, Perfetto).  A full ring overwrites its oldest
+ * events, so a long run keeps the last TRACE_EVENTS of each ring.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "rgn.h"
+
+/* Events kept per thread; a power of two */
+#define TRACE_EVENTS	(1 << 16)
+
+enum {
+	EVENT_SPAN,
+	EVENT_COUNTER,
+};
+
+struct trace_event {
+	ULONGLONG ts;		/* ns since rgn_trace_start() */
+	ULONGLONG dur;
+	const char *name;
+	long long arg;
+	pid_t tid;
+	int type;
+};
+
+struct trace_ring {
+	struct trace_ring *next;	/* All rings */
+	struct trace_ring *next_free;
+	ULONGLONG head;		/* Events ever recorded */
+	struct trace_event events[TRACE_EVENTS];
+};
+
+struct thread_name {
+	struct thread_name *next;
+	pid_t tid;
+	const char *name;
+};
+
+static int trace_on;
+static const char *trace_path;
+static const char *trace_tool;
+static ULONGLONG trace_epoch;
+static struct trace_ring *rings;
+static struct thread_name *names;
+static __thread struct trace_ring *thread_ring;
+static __thread pid_t thread_id;
+
+/* Rings of threads that have exited; only taken at thread start and end */
+static struct trace_ring *free_rings;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+
+static ULONGLONG
+now_ns (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+put_ring (void *arg)
+{
+	struct trace_ring *r = arg;
+
+	pthread_mutex_lock (&free_lock);
+	r->next_free = free_rings;
+	free_rings = r;
+	pthread_mutex_unlock (&free_lock);
+}
+
+static struct trace_ring *
+get_ring (void)
+{
+	struct trace_ring *r = thread_ring;
+
+	if (r)
+		return r;
+
+	pthread_mutex_lock (&free_lock);
+	r = free_rings;
+	if (r)
+		free_rings = r->next_free;
+	pthread_mutex_unlock (&free_lock);
+
+	if (!r) {
+		/* Not zeroed: only published slots are ever read */
+		r = malloc (sizeof(*r));
+		if (!r)
+			return NULL;
+		r->head = 0;
+		r->next = __atomic_load_n (&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n (&rings, &r->next, r, 1,
+						     __ATOMIC_RELEASE,
+						     __ATOMIC_RELAXED))
+			;
+	}
+	pthread_setspecific (ring_key, r);
+	thread_id = gettid ();
+	thread_ring = r;
+	return r;
+}
+
+static void
+record (int type, const char *name, ULONGLONG ts, ULONGLONG dur,
+	long long arg)
+{
+	struct trace_ring *r = get_ring ();
+	struct trace_event *ev;
+
+	if (!r)
+		return;
+	ev = &r->events[r->head & (TRACE_EVENTS - 1)];
+	ev->type = type;
+	ev->name = name;
+	ev->ts = ts;
+	ev->dur = dur;
+	ev->arg = arg;
+	ev->tid = thread_id;
+	__atomic_store_n (&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+ULONGLONG
+rgn_trace_begin (void)
+{
+	if (!trace_on)
+		return 0;
+	return now_ns ();
+}
+
+void
+rgn_trace_end (const char *name, ULONGLONG start, long long arg)
+{
+	ULONGLONG end;
+
+	if (!start)
+		return;
+	end = now_ns ();
+	record (EVENT_SPAN, name, start - trace_epoch, end - start, arg);
+}
+
+void
+rgn_trace_counter (const char *name, long long value)
+{
+	if (trace_on)
+		record (EVENT_COUNTER, name, now_ns () - trace_epoch, 0, value);
+}
+
+void
+rgn_trace_thread_name (const char *name)
+{
+	struct thread_name *n;
+
+	if (!trace_on || !(n = malloc (sizeof(*n))))
+		return;
+	n->tid = gettid ();
+	n->name = name;
+	n->next = __atomic_load_n (&names, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n (&names, &n->next, n, 1,
+					     __ATOMIC_RELEASE,
+					     __ATOMIC_RELAXED))
+		;
+}
+
+static void
+print_us (FILE *f, ULONGLONG ns)
+{
+	fprintf (f, "%llu.%03llu", ns / 1000, ns % 1000);
+}
+
+static void
+export (void)
+{
+	struct trace_ring *r;
+	struct thread_name *n;
+	ULONGLONG dropped = 0;
+	pid_t pid = getpid ();
+	FILE *f;
+
+	trace_on = 0;
+	f = fopen (trace_path, "w");
+	if (!f) {
+		fprintf (stderr, "Could not write trace %s: %s\n", trace_path,
+			 strerror (errno));
+		return;
+	}
+
+	fprintf (f, "{\"traceEvents\":[\n");
+	fprintf (f, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+		 "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, pid,
+		 trace_tool);
+	for (n = __atomic_load_n (&names, __ATOMIC_ACQUIRE); n; n = n->next)
+		fprintf (f, ",\n{\"ph\":\"M\",\"name\":\"thread_name\","
+			 "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			 pid, n->tid, n->name);
+
+	for (r = __atomic_load_n (&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		ULONGLONG head = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+		ULONGLONG i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+		dropped += i;
+		for (; i < head; i++) {
+			const struct trace_event *ev =
+					&r->events[i & (TRACE_EVENTS - 1)];
+
+			fprintf (f, ",\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,"
+				 "\"ts\":", ev->name, pid, ev->tid);
+			print_us (f, ev->ts);
+			if (ev->type == EVENT_SPAN) {
+				fprintf (f, ",\"ph\":\"X\",\"dur\":");
+				print_us (f, ev->dur);
+				fprintf (f, ",\"args\":{\"n\":%lld}}", ev->arg);
+			}
+			else {
+				fprintf (f, ",\"ph\":\"C\",\"args\":{\"%s\":%lld}}",
+					 ev->name, ev->arg);
+			}
+		}
+	}
+
+	fprintf (f, "\n],\"displayTimeUnit\":\"ns\",\"otherData\":"
+		 "{\"dropped_events\":%llu}}\n", dropped);
+	if (fclose (f))
+		fprintf (stderr, "Could not write trace %s: %s\n", trace_path,
+			 strerror (errno));
+}
+
+void
+rgn_trace_start (const char *tool)
+{
+	const char *path = getenv ("RGN_TRACE");
+
+	if (trace_on || !path || !*path)
+		return;
+	if (pthread_key_create (&ring_key, put_ring))
+		return;
+
+	trace_path = path;
+	trace_tool = tool;
+	trace_epoch = now_ns ();
+	trace_on = 1;
+	rgn_trace_thread_name ("main");
+	atexit (export);
+}
@@ -0,0 +1,885 @@
+/*
+ * rgn.c
+ *
+ * librgn: mmap based region file parser
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rgn.h"
+
+/* Spool in steps no larger than this */
+#define SPOOL_STEP (1UL << 30)
+
+/*
+ * Copy everything readable from src into a fresh unlinked temporary file
+ * and return its descriptor, or -1 on error.
+ */
+static int
+spool (int src)
+{
+	char path[] = "/tmp/rgnXXXXXX";
+	const char *tmpdir;
+	int fd;
+
+	tmpdir = getenv ("TMPDIR");
+	if (tmpdir && *tmpdir) {
+		char *tpl;
+
+		if (asprintf (&tpl, "%s/rgnXXXXXX", tmpdir) < 0)
+			return -1;
+		fd = mkstemp (tpl);
+		if (fd >= 0)
+			unlink (tpl);
+		free (tpl);
+	}
+	else {
+		fd = mkstemp (path);
+		if (fd >= 0)
+			unlink (path);
+	}
+	if (fd < 0)
+		return -1;
+
+	for (;;) {
+		ssize_t copied;
+
+		copied = rgn_copy (src, NULL, fd, NULL, SPOOL_STEP);
+		if (copied < 0) {
+			close (fd);
+			return -1;
+		}
+		if (copied < SPOOL_STEP)
+			break;
+	}
+
+	return fd;
+}
+
+/*
+ * Read the whole file into memory with the default I/O backend instead of
+ * mapping it.
+ */
+static int
+load (struct rgn_file *file)
+{
+	struct rgn_reader *r;
+	ssize_t n;
+
+	file->buf = malloc (file->size);
+	if (!file->buf)
+		return -1;
+
+	if (lseek (file->fd, 0, SEEK_SET) < 0)
+		goto fail;
+	r = rgn_reader_open (file->fd, rgn_io_get_default ());
+	if (!r)
+		goto fail;
+	n = rgn_reader_read (r, file->buf, file->size);
+	rgn_reader_close (r);
+	if (n < 0)
+		goto fail;
+	/* The file shrank under us; only what was read is there */
+	file->size = n;
+	file->map = file->buf;
+
+	return 0;
+
+fail:
+	{
+		int err = errno;
+
+		free (file->buf);
+		file->buf = NULL;
+		errno = err;
+	}
+	return -1;
+}
+
+int
+rgn_open (struct rgn_file *file, const char *path)
+{
+	int fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	return rgn_open_fd (file, fd);
+}
+
+int
+rgn_open_fd (struct rgn_file *file, int fd)
+{
+	struct stat st;
+	void *map;
+
+	memset (file, 0, sizeof(*file));
+	file->fd = -1;
+
+	if (fstat (fd, &st))
+		goto fail;
+
+	if (!S_ISREG (st.st_mode) && !S_ISBLK (st.st_mode)) {
+		int tmp = spool (fd);
+
+		if (tmp < 0)
+			goto fail;
+		close (fd);
+		fd = tmp;
+		if (fstat (fd, &st))
+			goto fail;
+	}
+
+	file->fd = fd;
+	if (S_ISBLK (st.st_mode)) {
+		off_t end = lseek (fd, 0, SEEK_END);
+
+		if (end < 0)
+			goto fail;
+		file->size = end;
+	}
+	else
+		file->size = st.st_size;
+
+	if (file->size == 0)
+		return 0;
+
+	if (rgn_io_get_default () != RGN_IO_MMAP) {
+		if (load (file))
+			goto fail;
+		return 0;
+	}
+
+	map = mmap (NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+	file->map = map;
+
+	return 0;
+
+fail:
+	{
+		int err = errno;
+
+		close (fd);
+		file->fd = -1;
+		errno = err;
+	}
+	return -1;
+}
+
+void
+rgn_close (struct rgn_file *file)
+{
+	if (file->buf)
+		free (file->buf);
+	else if (file->map)
+		munmap ((void *)file->map, file->size);
+	if (file->fd >= 0)
+		close (file->fd);
+	file->map = NULL;
+	file->buf = NULL;
+	file->size = 0;
+	file->fd = -1;
+}
+
+int
+rgn_advise (const struct rgn_file *file, int advice)
+{
+	if (!file->map || file->buf)
+		return 0;
+
+	return madvise ((void *)file->map, file->size, advice);
+}
+
+int
+rgn_read_vir (const struct rgn_file *file, struct vir *vir)
+{
+	if (file->size < sizeof(*vir)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	memcpy (vir, file->map, sizeof(*vir));
+	return 0;
+}
+
+size_t
+rgn_record_header_size (int large)
+{
+	return large ? sizeof(struct data_record_large) :
+		       sizeof(struct data_record);
+}
+
+size_t
+rgn_region_header_size (int large)
+{
+	return large ? sizeof(struct region_header_large) :
+		       sizeof(struct region_header);
+}
+
+size_t
+rgn_encode_record_header (void *buf, int large, ULONGLONG size, BYTE type)
+{
+	if (large) {
+		struct data_record_large dr = { size, type };
+
+		memcpy (buf, &dr, sizeof(dr));
+		return sizeof(dr);
+	}
+	else {
+		struct data_record dr = { size, type };
+
+		memcpy (buf, &dr, sizeof(dr));
+		return sizeof(dr);
+	}
+}
+
+size_t
+rgn_encode_region_header (void *buf, int large, USHORT id, UINT delay,
+			  ULONGLONG size)
+{
+	if (large) {
+		struct region_header_large hdr = { id, delay, size };
+
+		memcpy (buf, &hdr, sizeof(hdr));
+		return sizeof(hdr);
+	}
+	else {
+		struct region_header hdr = { id, delay, size };
+
+		memcpy (buf, &hdr, sizeof(hdr));
+		return sizeof(hdr);
+	}
+}
+
+/*
+ * Decode the record header at buf, of either format, into size and type.
+ * Returns the size of the header.
+ */
+static size_t
+decode_record_header (const BYTE *buf, int large, ULONGLONG *size,
+		      BYTE *type)
+{
+	if (large) {
+		struct data_record_large dr;
+
+		memcpy (&dr, buf, sizeof(dr));
+		*size = dr.size;
+		*type = dr.type;
+		return sizeof(dr);
+	}
+	else {
+		struct data_record dr;
+
+		memcpy (&dr, buf, sizeof(dr));
+		*size = dr.size;
+		*type = dr.type;
+		return sizeof(dr);
+	}
+}
+
+void
+rgn_iter_init (struct rgn_iter *it, const struct rgn_file *file)
+{
+	struct vir vir;
+
+	it->file = file;
+	it->pos = sizeof(struct vir);
+	it->large = rgn_read_vir (file, &vir) == 0 &&
+		    vir.version == RGN_VERSION_LARGE;
+}
+
+int
+rgn_iter_next (struct rgn_iter *it, struct rgn_record *rec)
+{
+	const struct rgn_file *file = it->file;
+	ULONGLONG size;
+	size_t left, hdr_len = rgn_record_header_size (it->large);
+	BYTE type;
+
+	if (it->pos >= file->size)
+		return 0;
+
+	left = file->size - it->pos;
+	if (left < hdr_len) {
+		errno = EBADMSG;
+		return -1;
+	}
+	decode_record_header (file->map + it->pos, it->large, &size, &type);
+	left -= hdr_len;
+
+	if (size > left) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	rec->type = type;
+	rec->large = it->large;
+	rec->size = size;
+	rec->offset = it->pos + hdr_len;
+	rec->data = file->map + rec->offset;
+
+	it->pos = rec->offset + size;
+
+	return 1;
+}
+
+int
+rgn_decode_advr (const struct rgn_record *rec, struct advr *advr)
+{
+	if (rec->size < sizeof(*advr)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	memcpy (advr, rec->data, sizeof(*advr));
+	return 0;
+}
+
+/*
+ * Point *str at the string starting at *pos and advance *pos past its
+ * terminator.  Returns 1 if the string runs to the end of the record
+ * without being terminated.
+ */
+static int
+decode_string (const struct rgn_record *rec, size_t *pos, const char **str,
+	       int *len)
+{
+	const char *start = (const char *)rec->data + *pos;
+	size_t max = rec->size - *pos;
+	size_t n;
+
+	n = strnlen (start, max);
+	*str = start;
+	*len = n;
+
+	if (n == max) {
+		*pos = rec->size;
+		return 1;
+	}
+	*pos += n + 1;
+	return 0;
+}
+
+int
+rgn_decode_avr (const struct rgn_record *rec, struct avr *avr)
+{
+	size_t pos;
+	int unterminated = 0;
+
+	if (rec->size < sizeof(avr->version)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	memcpy (&avr->version, rec->data, sizeof(avr->version));
+	pos = sizeof(avr->version);
+
+	unterminated |= decode_string (rec, &pos, &avr->builder,
+				       &avr->builder_len);
+	unterminated |= decode_string (rec, &pos, &avr->build_date,
+				       &avr->build_date_len);
+	unterminated |= decode_string (rec, &pos, &avr->build_time,
+				       &avr->build_time_len);
+
+	if (rec->data[rec->size - 1] != 0)
+		unterminated = 1;
+
+	return unterminated;
+}
+
+/*
+ * Decode a region header of either format.  Returns its size.
+ */
+static size_t
+decode_region_header (const BYTE *buf, int large, struct rgn_region *region)
+{
+	if (large) {
+		struct region_header_large hdr;
+
+		memcpy (&hdr, buf, sizeof(hdr));
+		region->id = hdr.id;
+		region->delay = hdr.delay;
+		region->size = hdr.size;
+		return sizeof(hdr);
+	}
+	else {
+		struct region_header hdr;
+
+		memcpy (&hdr, buf, sizeof(hdr));
+		region->id = hdr.id;
+		region->delay = hdr.delay;
+		region->size = hdr.size;
+		return sizeof(hdr);
+	}
+}
+
+int
+rgn_decode_region (const struct rgn_record *rec, struct rgn_region *region)
+{
+	size_t hdr_len = rgn_region_header_size (rec->large);
+
+	if (rec->size < hdr_len) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	decode_region_header (rec->data, rec->large, region);
+	if (region->size > rec->size - hdr_len) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	region->type = rec->type;
+	region->offset = rec->offset + hdr_len;
+	region->data = rec->data + hdr_len;
+
+	return 0;
+}
+
+int
+rgn_decode_crc (const struct rgn_record *rec, struct region_crc *crc)
+{
+	if (rec->size < sizeof(*crc)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	memcpy (crc, rec->data, sizeof(*crc));
+	return 0;
+}
+
+/*
+ * Read exactly count bytes at offset.  Running into the end of the file
+ * fails with EBADMSG.
+ */
+static int
+pread_full (int fd, void *buf, size_t count, off_t offset)
+{
+	while (count) {
+		ssize_t bytes_read;
+
+		bytes_read = pread (fd, buf, count, offset);
+		if (bytes_read < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (bytes_read == 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+		buf += bytes_read;
+		count -= bytes_read;
+		offset += bytes_read;
+	}
+
+	return 0;
+}
+
+static int
+toc_parse (const BYTE *body, ULONGLONG size, struct rgn_toc *toc)
+{
+	UINT count;
+
+	if (size < sizeof(count)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	memcpy (&count, body, sizeof(count));
+	if (count > (size - sizeof(count)) / sizeof(struct region_toc_entry)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	toc->count = count;
+	toc->entries = malloc (count * sizeof(struct region_toc_entry) + 1);
+	if (!toc->entries)
+		return -1;
+	memcpy (toc->entries, body + sizeof(count),
+		count * sizeof(struct region_toc_entry));
+
+	return 0;
+}
+
+int
+rgn_decode_toc (const struct rgn_record *rec, struct rgn_toc *toc)
+{
+	toc->large = rec->large;
+	return toc_parse (rec->data, rec->size, toc);
+}
+
+/* The TOC is written right after the version records */
+#define TOC_SEARCH_RECORDS 4
+
+int
+rgn_toc_read (int fd, struct rgn_toc *toc)
+{
+	off_t pos = sizeof(struct vir);
+	struct vir vir;
+	size_t hdr_len;
+	int i, large;
+
+	memset (toc, 0, sizeof(*toc));
+
+	if (pread_full (fd, &vir, sizeof(vir), 0))
+		return errno == EBADMSG ? 0 : -1;
+	if (vir.file_id != FILE_ID)
+		return 0;
+	large = vir.version == RGN_VERSION_LARGE;
+	hdr_len = rgn_record_header_size (large);
+
+	for (i = 0; i < TOC_SEARCH_RECORDS; i++) {
+		BYTE buf[sizeof(struct data_record_large)], type, *body;
+		ULONGLONG size;
+		int ret;
+
+		if (pread_full (fd, buf, hdr_len, pos))
+			return errno == EBADMSG ? 0 : -1;
+		decode_record_header (buf, large, &size, &type);
+
+		/* A TOC never follows the first region */
+		if (type == REGION_REC_CHAR)
+			return 0;
+
+		if (type == REGION_TOC_REC_CHAR) {
+			/* Far more than any count could need */
+			if (size > 0xffffffffULL) {
+				errno = EBADMSG;
+				return -1;
+			}
+			body = malloc (size + 1);
+			if (!body)
+				return -1;
+			ret = pread_full (fd, body, size, pos + hdr_len);
+			if (!ret)
+				ret = toc_parse (body, size, toc);
+			free (body);
+			toc->large = large;
+			return ret ? -1 : 1;
+		}
+
+		pos += hdr_len + size;
+	}
+
+	return 0;
+}
+
+void
+rgn_toc_free (struct rgn_toc *toc)
+{
+	free (toc->entries);
+	toc->entries = NULL;
+	toc->count = 0;
+}
+
+int
+rgn_toc_region (int fd, const struct rgn_toc *toc, UINT index,
+		struct rgn_region *region)
+{
+	const struct region_toc_entry *entry;
+	BYTE buf[RGN_HEADERS_MAX];
+	size_t rec_len = rgn_record_header_size (toc->large);
+	size_t len = rec_len + rgn_region_header_size (toc->large);
+	ULONGLONG size;
+
+	if (index >= toc->count) {
+		errno = ENOENT;
+		return -1;
+	}
+	entry = &toc->entries[index];
+
+	if (entry->offset < len + sizeof(struct vir)) {
+		errno = EBADMSG;
+		return -1;
+	}
+	if (pread_full (fd, buf, len, entry->offset - len))
+		return -1;
+
+	decode_record_header (buf, toc->large, &size, &region->type);
+	decode_region_header (buf + rec_len, toc->large, region);
+	if (region->id != entry->id || region->delay != entry->delay ||
+	    region->size != entry->size) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	region->offset = entry->offset;
+	region->data = NULL;
+
+	return 0;
+}
+
+/* Every record header and the body of every small record in one read */
+#define SUMMARY_WINDOW	256
+
+/* Longer AVRs are taken to be damaged rather than read */
+#define SUMMARY_AVR_MAX	(64 * 1024)
+
+/* The messages parse-region prints, by RGN_PROBLEM_* bit */
+static const char *const problem_strings[] = {
+	"VIR file ID is not correct",
+	"RGN file must contain an Application Data Version Record",
+	"More than one Application Data Version Record",
+	"First application data record must be ADVR",
+	"RGN file must contain an Application Version Record",
+	"Application Version Record strings are not terminated",
+	"Unknown data record type",
+	"Unexpected EOF",
+};
+
+const char *
+rgn_problem_string (unsigned int problems)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(problem_strings) / sizeof(*problem_strings);
+	     i++)
+		if (problems & (1U << i))
+			return problem_strings[i];
+	return "No problem";
+}
+
+void
+rgn_summary_free (struct rgn_summary *summary)
+{
+	free (summary->builder);
+	free (summary->build_date);
+	free (summary->build_time);
+	free (summary->regions);
+	memset (summary, 0, sizeof(*summary));
+}
+
+/*
+ * Add a record to the summary.  These return 1 for a record too short to
+ * decode and -1 if memory runs out.
+ */
+static int
+summary_avr (struct rgn_summary *summary, const struct rgn_record *rec)
+{
+	struct avr avr;
+	int ret;
+
+	ret = rgn_decode_avr (rec, &avr);
+	if (ret < 0)
+		return 1;
+	if (ret)
+		summary->problems |= RGN_PROBLEM_AVR_STRINGS;
+	if (summary->builder)
+		return 0;
+
+	summary->app_version = avr.version;
+	summary->builder = strndup (avr.builder, avr.builder_len);
+	summary->build_date = strndup (avr.build_date, avr.build_date_len);
+	summary->build_time = strndup (avr.build_time, avr.build_time_len);
+	if (!summary->builder || !summary->build_date || !summary->build_time)
+		return -1;
+	return 0;
+}
+
+static int
+summary_region (struct rgn_summary *summary, const struct rgn_record *rec)
+{
+	struct rgn_summary_region *r;
+	struct rgn_region region;
+	UINT n = summary->region_count;
+
+	if (rgn_decode_region (rec, &region))
+		return 1;
+
+	/* Grown in powers of two */
+	if ((n & (n - 1)) == 0) {
+		r = realloc (summary->regions, (n ? 2 * n : 1) * sizeof(*r));
+		if (!r)
+			return -1;
+		summary->regions = r;
+	}
+	r = &summary->regions[summary->region_count++];
+	r->type = rec->type;
+	r->crc = 0;
+	r->id = region.id;
+	r->delay = region.delay;
+	r->size = region.size;
+	r->offset = region.offset;
+	return 0;
+}
+
+/*
+ * Read a record body beyond the window.  Returns 1 if the file ends first.
+ */
+static int
+summary_read (int fd, void *buf, size_t count, off_t offset)
+{
+	if (!pread_full (fd, buf, count, offset))
+		return 0;
+	return errno == EBADMSG ? 1 : -1;
+}
+
+int
+rgn_summarize (int fd, off_t size, struct rgn_summary *summary)
+{
+	BYTE window[SUMMARY_WINDOW];
+	off_t pos = sizeof(struct vir);
+	int advr_count = 0, avr_count = 0, app_records = 0;
+	int first_is_advr = 0, last_is_region = 0;
+	struct vir vir;
+	size_t hdr_len;
+	int large, ret;
+
+	memset (summary, 0, sizeof(*summary));
+
+	if (size < pos)
+		goto eof;
+	ret = summary_read (fd, &vir, sizeof(vir), 0);
+	if (ret < 0)
+		goto fail;
+	if (ret)
+		goto eof;
+	summary->version = vir.version;
+	if (vir.file_id != FILE_ID)
+		summary->problems |= RGN_PROBLEM_FILE_ID;
+	large = vir.version == RGN_VERSION_LARGE;
+	hdr_len = rgn_record_header_size (large);
+
+	while (pos < size) {
+		size_t len = size - pos < (off_t)sizeof(window) ?
+						size - pos : sizeof(window);
+		struct rgn_record rec;
+		struct advr advr;
+		BYTE *body = NULL;
+
+		if (len < hdr_len)
+			goto eof;
+		ret = summary_read (fd, window, len, pos);
+		if (ret < 0)
+			goto fail;
+		if (ret)
+			goto eof;
+		decode_record_header (window, large, &rec.size, &rec.type);
+		if (rec.size > (ULONGLONG)(size - pos) - hdr_len)
+			goto eof;
+		rec.large = large;
+		rec.offset = pos + hdr_len;
+		rec.data = window + hdr_len;
+		pos = rec.offset + rec.size;
+		summary->records++;
+
+		switch (rec.type) {
+		case DATA_VERSION_REC_CHAR:
+			if (rgn_decode_advr (&rec, &advr))
+				goto eof;
+			if (!advr_count++)
+				summary->data_version = advr.version;
+			first_is_advr = ++app_records == 1;
+			break;
+		case APP_VERSION_REC_CHAR:
+			avr_count++;
+			app_records++;
+			/* Only an AVR can need more than the window holds */
+			if (rec.size > len - hdr_len) {
+				if (rec.size > SUMMARY_AVR_MAX) {
+					summary->problems |=
+						RGN_PROBLEM_AVR_STRINGS;
+					break;
+				}
+				body = malloc (rec.size);
+				if (!body)
+					goto fail;
+				ret = summary_read (fd, body, rec.size,
+						    rec.offset);
+				if (ret) {
+					free (body);
+					if (ret < 0)
+						goto fail;
+					goto eof;
+				}
+				rec.data = body;
+			}
+			ret = summary_avr (summary, &rec);
+			free (body);
+			if (ret < 0)
+				goto fail;
+			if (ret)
+				goto eof;
+			break;
+		case REGION_REC_CHAR:
+		case REGION_DELTA_REC_CHAR:
+		case REGION_COMPRESSED_REC_CHAR:
+		case REGION_SPARSE_REC_CHAR:
+			ret = summary_region (summary, &rec);
+			if (ret < 0)
+				goto fail;
+			if (ret)
+				goto eof;
+			app_records++;
+			break;
+		case REGION_TOC_REC_CHAR:
+			summary->toc = 1;
+			break;
+		case REGION_CRC_REC_CHAR:
+			if (last_is_region)
+				summary->regions[summary->region_count - 1].crc = 1;
+			break;
+		default:
+			/* parse-region stops here but still judges the rest */
+			summary->problems |= RGN_PROBLEM_RECORD_TYPE;
+			goto walked;
+		}
+
+		last_is_region = rec.type != DATA_VERSION_REC_CHAR &&
+				 rec.type != APP_VERSION_REC_CHAR &&
+				 rec.type != REGION_TOC_REC_CHAR &&
+				 rec.type != REGION_CRC_REC_CHAR;
+	}
+
+walked:
+	if (advr_count < 1)
+		summary->problems |= RGN_PROBLEM_NO_ADVR;
+	if (advr_count > 1)
+		summary->problems |= RGN_PROBLEM_ADVR_COUNT;
+	if (app_records > 0 && !first_is_advr)
+		summary->problems |= RGN_PROBLEM_ADVR_FIRST;
+	if (avr_count < 1)
+		summary->problems |= RGN_PROBLEM_NO_AVR;
+	return 0;
+
+eof:
+	/* parse-region gives up at the first record it cannot read */
+	summary->problems |= RGN_PROBLEM_EOF;
+	return 0;
+
+fail:
+	rgn_summary_free (summary);
+	return -1;
+}
+
+int
+rgn_summary_toc (const struct rgn_summary *summary, struct rgn_toc *toc)
+{
+	UINT i;
+
+	toc->large = summary->version == RGN_VERSION_LARGE;
+	toc->count = summary->region_count;
+	toc->entries = malloc (toc->count * sizeof(*toc->entries) + 1);
+	if (!toc->entries)
+		return -1;
+
+	for (i = 0; i < toc->count; i++) {
+		toc->entries[i].id = summary->regions[i].id;
+		toc->entries[i].delay = summary->regions[i].delay;
+		toc->entries[i].size = summary->regions[i].size;
+		toc->entries[i].offset = summary->regions[i].offset;
+	}
+	return 0;
+}
@@ -0,0 +1,587 @@
+/*
+ * rgn.h
+ *
+ * Region file format definitions and the librgn record parser.
+ *
+ * A region file is mapped into memory once and walked with a record
+ * iterator.  Records are handed back as views into the mapping, so no
+ * record is ever copied or allocated while walking a file.
+ */
+
+#ifndef RGN_H
+#define RGN_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <linux/stat.h>
+
+/* Region file header information */
+#define FILE_ID			0x7247704B
+#define DATA_VERSION_REC_CHAR	'D'
+#define APP_VERSION_REC_CHAR	'A'
+#define REGION_REC_CHAR		'R'
+#define REGION_TOC_REC_CHAR	'T'
+#define REGION_CRC_REC_CHAR	'C'
+#define REGION_DELTA_REC_CHAR	'P'
+#define REGION_COMPRESSED_REC_CHAR	'Z'
+#define REGION_SPARSE_REC_CHAR	'S'
+
+/*
+ * Low level versions, in the VIR.  A version 200 file has the same records
+ * as a version 100 one, but every record starts with a struct
+ * data_record_large and every region, delta, compressed and sparse record
+ * with a struct region_header_large, so that records and regions can be
+ * larger than 4 GiB.  The payload formats of delta, compressed and sparse
+ * regions are the same in both.
+ */
+#define RGN_VERSION		100
+#define RGN_VERSION_LARGE	200
+
+/* Virtual region type of a PGP signed update */
+#define PGP_SIGNED_VIRT_RGN	512
+
+/* Types as defined by "RGNPKG Document File Specification" */
+typedef unsigned char BYTE;
+typedef signed short SHORT;
+typedef unsigned short USHORT;
+typedef signed int INT;
+typedef unsigned int UINT;
+typedef unsigned long long ULONGLONG;
+typedef char * STRING;
+typedef BYTE * BSTRING;
+typedef unsigned char BOOL;
+typedef double DOUBLE;
+
+/* Version identification record */
+struct vir {
+	UINT file_id;
+	USHORT version;
+} __attribute__ ((__packed__));
+
+/* Data record */
+struct data_record {
+	UINT size;
+	BYTE type;
+} __attribute__ ((__packed__));
+
+/* Application data version record */
+struct advr {
+	USHORT version;
+} __attribute__ ((__packed__));
+
+/* Format of region data in region header */
+struct region_header {
+	USHORT id;
+	UINT delay;
+	UINT size;
+} __attribute__ ((__packed__));
+
+/* The same in a version 200 file */
+struct data_record_large {
+	ULONGLONG size;
+	BYTE type;
+} __attribute__ ((__packed__));
+
+struct region_header_large {
+	USHORT id;
+	UINT delay;
+	ULONGLONG size;
+} __attribute__ ((__packed__));
+
+/*
+ * Region table of contents.  The optional TOC record follows the
+ * application version record and holds a count followed by one entry per
+ * region record, in file order.  The offset is the absolute file offset
+ * of the region payload.
+ */
+struct region_toc_entry {
+	USHORT id;
+	UINT delay;
+	ULONGLONG size;
+	ULONGLONG offset;
+} __attribute__ ((__packed__));
+
+/*
+ * Region checksum.  The optional CRC record directly follows the region
+ * record it covers and holds the CRC32C of that region's payload.
+ */
+struct region_crc {
+	USHORT id;
+	UINT crc;
+} __attribute__ ((__packed__));
+
+/*
+ * Delta region.  A delta record has the same body as a region record, but
+ * its payload rebuilds the region from the region with the same ID in an
+ * earlier region file: a struct region_delta followed by operations, each
+ * a struct region_delta_op.  A copy takes len bytes at offset in the old
+ * payload; an insert is followed by its len bytes.
+ */
+#define REGION_DELTA_COPY	'C'
+#define REGION_DELTA_INSERT	'I'
+
+struct region_delta {
+	UINT size;		/* Size of the rebuilt payload */
+	UINT base_size;		/* Size of the old payload */
+	UINT base_crc;		/* CRC32C of the old payload */
+	UINT crc;		/* CRC32C of the rebuilt payload */
+} __attribute__ ((__packed__));
+
+struct region_delta_op {
+	BYTE op;
+	UINT offset;
+	UINT len;
+} __attribute__ ((__packed__));
+
+/*
+ * Compressed region.  A compressed record has the same body as a region
+ * record; its payload is a struct region_compressed, a table of UINT end
+ * offsets of each block relative to the end of the table, and the blocks.
+ * Every block but the last holds block_size bytes of the region and is
+ * compressed on its own, so blocks can be coded in parallel and any block
+ * can be read without the ones before it.  A block whose stored length is
+ * its full length is stored uncompressed.
+ */
+#define REGION_COMPRESS_ZLIB	1
+
+struct region_compressed {
+	UINT size;		/* Size of the uncompressed payload */
+	UINT block_size;
+	BYTE method;
+} __attribute__ ((__packed__));
+
+/*
+ * Sparse region.  A sparse record has the same body as a region record;
+ * its payload is a struct region_sparse, count struct region_fill runs in
+ * increasing offset order and then the bytes of the region outside the
+ * runs, in order.  A run stands for len copies of byte at offset in the
+ * region.
+ */
+struct region_sparse {
+	UINT size;		/* Size of the expanded payload */
+	UINT count;		/* Fill runs */
+} __attribute__ ((__packed__));
+
+struct region_fill {
+	UINT offset;
+	UINT len;
+	BYTE byte;
+} __attribute__ ((__packed__));
+
+/* Header of a PGP signed virtual region (version 2 layout) */
+struct vr_header_v2 {
+	UINT virtual_region;	/* Type of virtual region */
+	UINT header_len;	/* Length of this header */
+	UINT target;		/* Product-specific flash area */
+	UINT offset;		/* Offset within this flash target */
+	UINT chunk_size;	/* Size of each signed data chunk */
+	UINT sig_size;		/* Size each signature is padded to */
+} __attribute__ ((__packed__));
+
+/*
+ * Application version record.  The strings point into the mapped file and
+ * are not guaranteed to be terminated; print them with "%.*s" and the
+ * matching length.
+ */
+struct avr {
+	USHORT version;
+	const char *builder;
+	int builder_len;
+	const char *build_date;
+	int build_date_len;
+	const char *build_time;
+	int build_time_len;
+};
+
+/* An open, mapped region file */
+struct rgn_file {
+	int fd;
+	const BYTE *map;
+	size_t size;
+	void *buf;		/* Set when the file was read in, not mapped */
+};
+
+/* A record as seen through the mapping */
+struct rgn_record {
+	BYTE type;
+	BYTE large;		/* From a version 200 file */
+	ULONGLONG size;		/* Size of the record body */
+	off_t offset;		/* File offset of the record body */
+	const BYTE *data;	/* Record body */
+};
+
+/* A decoded region record */
+struct rgn_region {
+	BYTE type;		/* Region, delta, compressed or sparse record */
+	USHORT id;
+	UINT delay;
+	ULONGLONG size;		/* Size of the payload */
+	off_t offset;		/* File offset of the payload */
+	const BYTE *data;	/* Payload */
+};
+
+/* A region table of contents loaded into memory */
+struct rgn_toc {
+	int large;		/* From a version 200 file */
+	UINT count;
+	struct region_toc_entry *entries;
+};
+
+/* Record iterator */
+struct rgn_iter {
+	const struct rgn_file *file;
+	size_t pos;
+	int large;		/* Version 200 record headers */
+};
+
+/*
+ * Opening and closing.  rgn_open_fd() takes ownership of fd.  Input that
+ * cannot be mapped (pipes, terminals) is spooled into an unlinked
+ * temporary file first.  The file is mapped unless the default I/O
+ * backend (see below) is another one, in which case it is read into
+ * memory with that backend.  All functions return 0 on success and -1 with
+ * errno set on failure unless noted otherwise.
+ */
+int rgn_open (struct rgn_file *file, const char *path);
+int rgn_open_fd (struct rgn_file *file, int fd);
+void rgn_close (struct rgn_file *file);
+
+/*
+ * Pass an madvise() hint for the whole mapping.  Walking only the record
+ * headers of a large file wants MADV_RANDOM so that readahead does not
+ * pull in payload pages.
+ */
+int rgn_advise (const struct rgn_file *file, int advice);
+
+/* Decode the version identification record at the start of the file */
+int rgn_read_vir (const struct rgn_file *file, struct vir *vir);
+
+/*
+ * Walk the data records following the VIR.  rgn_iter_next() returns 1 and
+ * fills rec for each record, 0 at the end of the file and -1 with errno
+ * set to EBADMSG if a record runs past the end of the file.  The record
+ * header format follows the version in the VIR.
+ */
+void rgn_iter_init (struct rgn_iter *it, const struct rgn_file *file);
+int rgn_iter_next (struct rgn_iter *it, struct rgn_record *rec);
+
+/*
+ * Record decoders.  rgn_decode_avr() returns 1 instead of 0 if the
+ * strings are not properly terminated inside the record.
+ */
+int rgn_decode_advr (const struct rgn_record *rec, struct advr *advr);
+int rgn_decode_avr (const struct rgn_record *rec, struct avr *avr);
+int rgn_decode_region (const struct rgn_record *rec,
+		       struct rgn_region *region);
+
+/*
+ * Record headers for writers.  rgn_record_header_size() and
+ * rgn_region_header_size() are the sizes of the headers in a version 100
+ * (large 0) or 200 (large 1) file; the encoders store them in buf, which
+ * has room for RGN_HEADERS_MAX bytes, and return their size.
+ */
+#define RGN_HEADERS_MAX	(sizeof(struct data_record_large) + \
+			 sizeof(struct region_header_large))
+
+size_t rgn_record_header_size (int large);
+size_t rgn_region_header_size (int large);
+size_t rgn_encode_record_header (void *buf, int large, ULONGLONG size,
+				 BYTE type);
+size_t rgn_encode_region_header (void *buf, int large, USHORT id,
+				 UINT delay, ULONGLONG size);
+
+/*
+ * Region table of contents.  rgn_toc_read() locates the TOC record with a
+ * handful of pread() calls on fd, without mapping or reading anything past
+ * the TOC.  It returns 1 and fills toc if the file has a TOC, 0 if it has
+ * none.  rgn_toc_region() looks up the region at index (0 based) and checks
+ * the entry against the region header stored in the file; the returned
+ * region has no data pointer.
+ */
+int rgn_toc_read (int fd, struct rgn_toc *toc);
+void rgn_toc_free (struct rgn_toc *toc);
+int rgn_toc_region (int fd, const struct rgn_toc *toc, UINT index,
+		    struct rgn_region *region);
+int rgn_decode_toc (const struct rgn_record *rec, struct rgn_toc *toc);
+
+/*
+ * Header summaries.  rgn_summarize() walks the records of the region file
+ * open on fd, size bytes long, with one small pread() per record and no
+ * mapping; region payloads are never read.  It fills summary with the
+ * version records, the region table and the problems parse-region would
+ * report, and returns 0 for any file it could read, valid or not.
+ * rgn_summary_free() releases the strings and the region table, and
+ * rgn_problem_string() describes the lowest RGN_PROBLEM_* bit set in
+ * problems.
+ */
+enum {
+	RGN_PROBLEM_FILE_ID	= 1 << 0,	/* VIR file ID is wrong */
+	RGN_PROBLEM_NO_ADVR	= 1 << 1,
+	RGN_PROBLEM_ADVR_COUNT	= 1 << 2,	/* More than one ADVR */
+	RGN_PROBLEM_ADVR_FIRST	= 1 << 3,	/* ADVR is not the first */
+	RGN_PROBLEM_NO_AVR	= 1 << 4,
+	RGN_PROBLEM_AVR_STRINGS	= 1 << 5,	/* Unterminated AVR strings */
+	RGN_PROBLEM_RECORD_TYPE	= 1 << 6,	/* Unknown record; walk stops */
+	RGN_PROBLEM_EOF		= 1 << 7,	/* Truncated; walk stops */
+};
+
+struct rgn_summary_region {
+	BYTE type;		/* Region, delta, compressed or sparse record */
+	BYTE crc;		/* Followed by a CRC record */
+	USHORT id;
+	UINT delay;
+	ULONGLONG size;		/* Size of the stored payload */
+	ULONGLONG offset;	/* File offset of the payload */
+};
+
+struct rgn_summary {
+	USHORT version;		/* VIR version */
+	USHORT data_version;	/* ADVR version, 0 without one */
+	USHORT app_version;	/* First AVR, 0 and NULL strings without one */
+	char *builder;
+	char *build_date;
+	char *build_time;
+	UINT records;		/* Data records walked */
+	UINT region_count;
+	int toc;		/* Has a region table of contents */
+	unsigned int problems;	/* RGN_PROBLEM_* bits, 0 for a valid file */
+	struct rgn_summary_region *regions;
+};
+
+int rgn_summarize (int fd, off_t size, struct rgn_summary *summary);
+void rgn_summary_free (struct rgn_summary *summary);
+const char *rgn_problem_string (unsigned int problems);
+
+/*
+ * Persistent summary cache.  rgn_cache_open() opens the cache file path,
+ * or the one named by the RGN_CACHE environment variable if path is NULL,
+ * creating it if need be and opening it read-only if it cannot be
+ * written.  It returns NULL with errno 0 when no cache is configured.
+ * Files are identified by a key that rgn_cache_key() fills from st (or
+ * from fstat() of fd if st is NULL); when RGN_CACHE_HASH is set it also
+ * holds a CRC32C of the contents, read through fd, so fd may be -1 when
+ * st is given and the call then fails with EBADF only if the cache hashes.
+ * rgn_cache_lookup() returns 1 and the stored summary and RGN_CACHE_*
+ * flags if the cache has the file under that exact key, 0 if not.
+ * rgn_cache_store() adds or replaces the entry unless fd no longer
+ * matches key or the file was changed too recently for its timestamps to
+ * be trusted; stores are written out by rgn_cache_close().  Lookups and stores may come from
+ * several threads, and several processes may share one cache file.
+ */
+#define RGN_CACHE_CHECKED	0x1	/* CRC records checked and good */
+
+struct rgn_cache;
+struct stat;
+
+struct rgn_cache_key {
+	ULONGLONG dev;
+	ULONGLONG ino;
+	ULONGLONG size;
+	ULONGLONG mtime;	/* ns */
+	ULONGLONG ctime;	/* ns */
+	UINT hash;		/* CRC32C of the contents */
+	int has_hash;
+};
+
+struct rgn_cache *rgn_cache_open (const char *path);
+int rgn_cache_key (struct rgn_cache *cache, int fd, const struct stat *st,
+		   struct rgn_cache_key *key);
+int rgn_cache_lookup (struct rgn_cache *cache, const struct rgn_cache_key *key,
+		      struct rgn_summary *summary, unsigned int *flags);
+int rgn_cache_store (struct rgn_cache *cache, int fd,
+		     const struct rgn_cache_key *key,
+		     const struct rgn_summary *summary, unsigned int flags);
+int rgn_cache_close (struct rgn_cache *cache);
+
+/*
+ * A table of contents made from a summary's regions, for files that have
+ * none of their own.  Free it with rgn_toc_free().
+ */
+int rgn_summary_toc (const struct rgn_summary *summary, struct rgn_toc *toc);
+
+/*
+ * CRC32C (Castagnoli) of len bytes of buf, continuing from crc, which is 0
+ * for the first call and the previous result after that.  Uses the SSE4.2
+ * crc32 instruction when the CPU has it.  rgn_decode_crc() decodes a CRC
+ * record.
+ */
+UINT rgn_crc32c (UINT crc, const void *buf, size_t len);
+int rgn_decode_crc (const struct rgn_record *rec, struct region_crc *crc);
+
+/*
+ * Region deltas.  rgn_delta_encode() writes the delta that turns base into
+ * target to fd and returns its size, or 0 without writing everything if it
+ * would be larger than limit (0 for no limit).  rgn_delta_apply() writes
+ * the rebuilt payload to out_fd at its file position, with memory use
+ * bounded by a 1 MiB buffer; long copies are made from base_fd, where the
+ * old payload starts at base_offset, without passing through user space.
+ * It fails with ESTALE if base is not the payload the delta was made
+ * against and with EBADMSG if the delta is malformed or the result does
+ * not match its CRC.
+ */
+ssize_t rgn_delta_encode (const void *base, size_t base_len,
+			  const void *target, size_t target_len, int fd,
+			  size_t limit);
+int rgn_delta_header (const BYTE *delta, size_t delta_len,
+		      struct region_delta *hdr);
+int rgn_delta_apply (int base_fd, off_t base_offset, const BYTE *base,
+		     size_t base_len, const BYTE *delta, size_t delta_len,
+		     int out_fd);
+
+/*
+ * Compressed regions.  rgn_compress() writes the compressed form of data
+ * to fd at its file position and returns its size; fd must be seekable,
+ * as the block table is filled in last.  level is a zlib level.
+ * rgn_decompress() writes the uncompressed payload to out_fd in order.
+ * Both code blocks on threads threads at once, holding two blocks per
+ * thread in memory.  rgn_decompress_block() decompresses block index
+ * alone into buf, which has room for block_size bytes, and returns its
+ * length.  Malformed payloads fail with EBADMSG.
+ */
+#define RGN_COMPRESS_BLOCK	(1024 * 1024)
+
+ssize_t rgn_compress (const void *data, size_t len, int fd, UINT block_size,
+		      int level, int threads);
+int rgn_compressed_header (const BYTE *payload, size_t len,
+			   struct region_compressed *hdr);
+int rgn_decompress (const BYTE *payload, size_t len, int out_fd,
+		    int threads);
+ssize_t rgn_decompress_block (const BYTE *payload, size_t len, UINT index,
+			      void *buf);
+
+/*
+ * Sparse regions.  rgn_sparse_encode() writes data to fd at its file
+ * position with every run of min_run or more equal bytes replaced by a
+ * struct region_fill, and returns the size written, or 0 without writing
+ * anything if that would not be smaller than data.  rgn_sparse_expand()
+ * writes the whole payload to out_fd at its file position; zero runs in a
+ * regular file become holes.  rgn_sparse_read() copies count bytes from
+ * offset in the expanded payload to buf and returns how many there were.
+ * Malformed payloads fail with EBADMSG.  rgn_fill_span() is the length of
+ * the prefix of data that is all byte.
+ */
+#define RGN_FILL_MIN	512
+
+ssize_t rgn_sparse_encode (const void *data, size_t len, int fd,
+			   size_t min_run);
+int rgn_sparse_header (const BYTE *payload, size_t len,
+		       struct region_sparse *hdr);
+int rgn_sparse_expand (const BYTE *payload, size_t len, int out_fd);
+ssize_t rgn_sparse_read (const BYTE *payload, size_t len, size_t offset,
+			 void *buf, size_t count);
+size_t rgn_fill_span (const void *data, size_t len, BYTE byte);
+
+/*
+ * Copy count bytes from src to dst without passing them through user
+ * space where the kernel allows it: a reflink or copy_file_range()
+ * between regular files, splice() when either end is a pipe and
+ * sendfile() from a regular file to anything else.  A large aligned
+ * buffer is only used when none of those work.  A NULL offset means the
+ * file position is used and advanced, as with copy_file_range().  Returns
+ * the number of bytes copied, which is short only at the end of src, or
+ * -1 with errno set.
+ */
+ssize_t rgn_copy (int src, off_t *src_off, int dst, off_t *dst_off,
+		  size_t count);
+
+/*
+ * I/O backends for reading a file from start to end: plain read(), a
+ * mapping, O_DIRECT with large aligned reads, and io_uring with several
+ * large reads in flight.  Backends that need a regular file, or that the
+ * kernel or file system does not support, fall back to plain reads.
+ *
+ * The default is mmap unless the RGN_IO environment variable names
+ * another backend; tools can override it with rgn_io_set_default() so a
+ * switch on the command line can compare backends.
+ */
+enum rgn_io_backend {
+	RGN_IO_BUFFERED,
+	RGN_IO_MMAP,
+	RGN_IO_DIRECT,
+	RGN_IO_URING,
+	RGN_IO_BACKENDS,
+};
+
+int rgn_io_parse (const char *name, enum rgn_io_backend *backend);
+const char *rgn_io_name (enum rgn_io_backend backend);
+void rgn_io_set_default (enum rgn_io_backend backend);
+enum rgn_io_backend rgn_io_get_default (void);
+
+/*
+ * A sequential reader starting at the file position of fd.
+ * rgn_reader_read() returns count bytes, fewer only at the end of the
+ * file, 0 at the end, or -1 with errno set; EINTR is handled inside.
+ * rgn_reader_close() leaves the file position after the data returned
+ * and does not close fd.
+ */
+struct rgn_reader;
+
+struct rgn_reader *rgn_reader_open (int fd, enum rgn_io_backend backend);
+ssize_t rgn_reader_read (struct rgn_reader *r, void *buf, size_t count);
+enum rgn_io_backend rgn_reader_backend (const struct rgn_reader *r);
+int rgn_reader_close (struct rgn_reader *r);
+
+/*
+ * statx() many paths at once, through io_uring where the kernel has it.
+ * Each request gets its own result in stx, or an errno value in error.
+ * Returns 0, or -1 with errno set if the requests could not be run.
+ */
+struct rgn_statx {
+	const char *path;
+	struct statx stx;
+	int error;
+};
+
+int rgn_statx_batch (struct rgn_statx *reqs, size_t count, unsigned mask);
+
+/*
+ * Per-phase statistics for the tools' --stats option.  rgn_stats_start()
+ * turns them on and prints them to stderr in the given format when the
+ * process exits; rgn_stats_parse() takes the argument of --stats=FORMAT
+ * (NULL for plain --stats).  A thread counts its wall and CPU time and
+ * its read and write system calls to the phase it last entered with
+ * rgn_stats_enter() until the matching rgn_stats_leave(); phases nest.
+ * Bytes are added to a phase from any thread.  All of them do nothing
+ * until rgn_stats_start() is called.
+ */
+enum rgn_phase {
+	RGN_PHASE_PARSE,	/* Reading and checking record headers */
+	RGN_PHASE_COPY,		/* Moving region payloads */
+	RGN_PHASE_ENCODE,	/* Delta, compression and sparse coding */
+	RGN_PHASE_SIGN,
+	RGN_PHASE_VERIFY,	/* Signatures and CRCs */
+	RGN_PHASE_OUTPUT,	/* Writing headers, listings and results */
+	RGN_PHASES,
+};
+
+enum rgn_stats_format {
+	RGN_STATS_OFF,
+	RGN_STATS_TEXT,
+	RGN_STATS_JSON,
+};
+
+int rgn_stats_parse (const char *arg, enum rgn_stats_format *format);
+void rgn_stats_start (const char *tool, enum rgn_stats_format format);
+void rgn_stats_enter (enum rgn_phase phase);
+void rgn_stats_leave (void);
+void rgn_stats_add (enum rgn_phase phase, ULONGLONG bytes);
+
+/*
+ * Timeline tracing.  rgn_trace_start() turns it on when the RGN_TRACE
+ * environment variable names a file, which gets the recorded events as
+ * Chrome trace event JSON when the process exits.  A span is the time
+ * from rgn_trace_begin() to rgn_trace_end(), with a number to show with
+ * it; a counter records a value, such as a queue depth, over time.  Names
+ * must be string constants.  Each thread records into a lock-free ring
+ * of its own, and all of them cost a single test when tracing is off.
+ */
+void rgn_trace_start (const char *tool);
+ULONGLONG rgn_trace_begin (void);
+void rgn_trace_end (const char *name, ULONGLONG start, long long arg);
+void rgn_trace_counter (const char *name, long long value);
+void rgn_trace_thread_name (const char *name);
+
+/* Write all of buf, retrying after EINTR and short writes */
+ssize_t rgn_write_full (int fd, const void *buf, size_t count);
+
+#endif /* RGN_H */
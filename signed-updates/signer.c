@@ -0,0 +1,282 @@
+/*
+ * signer.c
+ *
+ * Detached signature backends: in-process OpenPGP and an external gpg
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "signer.h"
+#include "pgp.h"
+
+/*
+ * Read the passphrase from the first line of path, the same way
+ * gpg --passphrase-file does.
+ */
+static char *
+read_passphrase (const char *path)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *f;
+
+	f = fopen (path, "r");
+	if (!f) {
+		fprintf (stderr, "Could not open %s: %s\n", path,
+			 strerror (errno));
+		return NULL;
+	}
+	len = getline (&line, &size, f);
+	fclose (f);
+	if (len < 0) {
+		free (line);
+		return strdup ("");
+	}
+	while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+		line[--len] = '\0';
+
+	return line;
+}
+
+/* In-process signing with a key exported by gpg --export-secret-keys */
+
+static int
+pgp_open (struct signer *s, const struct signer_config *cfg)
+{
+	struct pgp_key *key;
+	char *passphrase = NULL;
+	int ret;
+
+	if (!cfg->key_file) {
+		fprintf (stderr, "The pgp signer needs a key file\n");
+		return -1;
+	}
+	if (pgp_init ())
+		return -1;
+	if (cfg->passphrase_file) {
+		passphrase = read_passphrase (cfg->passphrase_file);
+		if (!passphrase)
+			return -1;
+	}
+
+	key = malloc (sizeof(*key));
+	if (!key) {
+		fprintf (stderr, "Out of memory\n");
+		free (passphrase);
+		return -1;
+	}
+	ret = pgp_key_load (key, cfg->key_file, passphrase);
+	if (passphrase) {
+		memset (passphrase, 0, strlen (passphrase));
+		free (passphrase);
+	}
+	if (ret) {
+		free (key);
+		return -1;
+	}
+
+	s->priv = key;
+	return 0;
+}
+
+static int
+pgp_sign_chunk (struct signer *s, const void *data, size_t len, UINT created,
+		BYTE *sig, size_t *sig_len)
+{
+	return pgp_sign (s->priv, data, len, created, sig, sig_len);
+}
+
+static void
+pgp_close (struct signer *s)
+{
+	pgp_key_free (s->priv);
+	free (s->priv);
+}
+
+/* One gpg process per chunk; works with any key gpg can use */
+
+struct gpg_signer {
+	char *argv[16];
+	char time[32];
+};
+
+static int
+gpg_open (struct signer *s, const struct signer_config *cfg)
+{
+	struct gpg_signer *gpg;
+	int argc = 0;
+
+	if (!cfg->user_id || !cfg->passphrase_file) {
+		fprintf (stderr, "The gpg signer needs a user id and a "
+				 "passphrase file\n");
+		return -1;
+	}
+
+	gpg = calloc (1, sizeof(*gpg));
+	if (!gpg) {
+		fprintf (stderr, "Out of memory\n");
+		return -1;
+	}
+	gpg->argv[argc++] = "gpg";
+	if (cfg->homedir) {
+		gpg->argv[argc++] = "--homedir";
+		gpg->argv[argc++] = (char *)cfg->homedir;
+	}
+	gpg->argv[argc++] = "--batch";
+	gpg->argv[argc++] = "-q";
+	gpg->argv[argc++] = "--pinentry-mode";
+	gpg->argv[argc++] = "loopback";
+	gpg->argv[argc++] = "--passphrase-file";
+	gpg->argv[argc++] = (char *)cfg->passphrase_file;
+	/* Sign with the run's creation time so chunks are reproducible */
+	gpg->argv[argc++] = "--faked-system-time";
+	gpg->argv[argc++] = gpg->time;
+	gpg->argv[argc++] = "-b";
+	gpg->argv[argc++] = "-u";
+	gpg->argv[argc++] = (char *)cfg->user_id;
+	gpg->argv[argc++] = "-o";
+	gpg->argv[argc++] = "-";
+	gpg->argv[argc] = NULL;
+
+	/* A gpg that exits early must not take us down with it */
+	signal (SIGPIPE, SIG_IGN);
+
+	s->priv = gpg;
+	return 0;
+}
+
+static int
+gpg_sign_chunk (struct signer *s, const void *data, size_t len, UINT created,
+		BYTE *sig, size_t *sig_len)
+{
+	struct gpg_signer *gpg = s->priv;
+	char *argv[16];
+	char time[32];
+	int in[2], out[2];
+	size_t total = 0;
+	int status, i;
+	pid_t pid;
+
+	/* Each call gets its own argv so threads do not share the time */
+	for (i = 0; gpg->argv[i]; i++)
+		argv[i] = gpg->argv[i] == gpg->time ? time : gpg->argv[i];
+	argv[i] = NULL;
+	snprintf (time, sizeof(time), "%u!", created);
+
+	if (pipe2 (in, O_CLOEXEC))
+		return -1;
+	if (pipe2 (out, O_CLOEXEC)) {
+		close (in[0]);
+		close (in[1]);
+		return -1;
+	}
+
+	pid = fork ();
+	if (pid == 0) {
+		int null = open ("/dev/null", O_WRONLY);
+
+		dup2 (in[0], STDIN_FILENO);
+		dup2 (out[1], STDOUT_FILENO);
+		if (null >= 0)
+			dup2 (null, STDERR_FILENO);
+		execvp (argv[0], argv);
+		_exit (127);
+	}
+	close (in[0]);
+	close (out[1]);
+	if (pid < 0) {
+		close (in[1]);
+		close (out[0]);
+		return -1;
+	}
+
+	/* gpg reads all of its input before it writes the signature */
+	while (len) {
+		ssize_t n = write (in[1], data, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		data = (const BYTE *)data + n;
+		len -= n;
+	}
+	close (in[1]);
+
+	for (;;) {
+		ssize_t n = read (out[0], sig + total, *sig_len - total);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (n == 0 || (total += n) == *sig_len)
+			break;
+	}
+	close (out[0]);
+
+	while (waitpid (pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	if (len || !WIFEXITED (status) || WEXITSTATUS (status)) {
+		fprintf (stderr, "gpg failed to sign\n");
+		return -1;
+	}
+
+	*sig_len = total;
+	return 0;
+}
+
+static void
+gpg_close (struct signer *s)
+{
+	free (s->priv);
+}
+
+static const struct signer_ops signers[] = {
+	{ "pgp", pgp_open, pgp_sign_chunk, pgp_close },
+	{ "gpg", gpg_open, gpg_sign_chunk, gpg_close },
+};
+
+int
+signer_open (struct signer *s, const char *name,
+	     const struct signer_config *cfg)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(signers) / sizeof(signers[0]); i++) {
+		if (strcmp (signers[i].name, name))
+			continue;
+		s->ops = &signers[i];
+		s->priv = NULL;
+		return s->ops->open (s, cfg);
+	}
+
+	fprintf (stderr, "Unknown signer: %s\n", name);
+	return -1;
+}
+
+int
+signer_sign (struct signer *s, const void *data, size_t len, UINT created,
+	     BYTE *sig, size_t *sig_len)
+{
+	return s->ops->sign (s, data, len, created, sig, sig_len);
+}
+
+void
+signer_close (struct signer *s)
+{
+	s->ops->close (s);
+}
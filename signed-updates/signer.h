@@ -0,0 +1,55 @@
+/*
+ * signer.h
+ *
+ * Pluggable detached signature backends for build-signed-update
+ */
+
+#ifndef SIGNER_H
+#define SIGNER_H
+
+#include <stddef.h>
+
+#include "rgn.h"
+
+/* Largest signature any backend may return */
+#define SIGNER_MAX_SIG	4096
+
+struct signer_config {
+	const char *key_file;		/* Exported key block (pgp) */
+	const char *user_id;		/* Key to sign with (gpg) */
+	const char *passphrase_file;
+	const char *homedir;		/* GnuPG home directory (gpg) */
+};
+
+struct signer;
+
+struct signer_ops {
+	const char *name;
+	int (*open) (struct signer *s, const struct signer_config *cfg);
+	/*
+	 * Sign len bytes of data into sig, which holds *sig_len bytes.
+	 * created is the signature time, fixed for a whole run.  Must be
+	 * safe to call from several threads at once.
+	 */
+	int (*sign) (struct signer *s, const void *data, size_t len,
+		     UINT created, BYTE *sig, size_t *sig_len);
+	void (*close) (struct signer *s);
+};
+
+struct signer {
+	const struct signer_ops *ops;
+	void *priv;
+};
+
+/*
+ * Open the backend called name ("pgp" signs in-process with an exported
+ * RSA key, "gpg" runs gpg for every chunk).  Returns 0 or -1 after
+ * printing the reason to stderr.
+ */
+int signer_open (struct signer *s, const char *name,
+		 const struct signer_config *cfg);
+int signer_sign (struct signer *s, const void *data, size_t len,
+		 UINT created, BYTE *sig, size_t *sig_len);
+void signer_close (struct signer *s);
+
+#endif /* SIGNER_H */